@@ -130,6 +130,9 @@ void thread::free_tcb()
 
 void thread_main_c(thread* t)
 {
+    // we are still on the stack's top page, populated by whoever allocated
+    // it, so this is in time
+    init_lazy_stack(t->get_stack_info());
     arch::irq_enable();
 #ifdef CONF_preempt
     preempt_enable();
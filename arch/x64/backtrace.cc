@@ -31,5 +31,25 @@ int backtrace_safe(void** pc, int nr)
     return i;
 }
 
+int backtrace_safe(void** pc, int nr, void* start_pc, void* start_fp)
+{
+    frame* rbp = static_cast<frame*>(start_fp);
+    frame* next;
+
+    if (nr == 0) {
+        return 0;
+    }
+    pc[0] = start_pc;
+    int i = 1;
+    while (i < nr
+            && safe_load(&rbp->next, next)
+            && safe_load(&rbp->pc, pc[i])
+            && pc[i]) {
+        rbp = next;
+        ++i;
+    }
+    return i;
+}
+
 
 
@@ -24,6 +24,9 @@ void page_fault(exception_frame *ef)
     }
     // The following code may sleep. So let's verify the fault did not happen
     // when preemption was disabled, or interrupts were disabled.
+    if (!sched::preemptable() || !(ef->rflags & processor::rflags_if)) {
+        sched::check_lazy_stack_fault(addr);
+    }
     assert(sched::preemptable());
     assert(ef->rflags & processor::rflags_if);
 
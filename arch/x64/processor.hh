@@ -245,6 +245,11 @@ inline void sti_hlt() {
     asm volatile ("sti; hlt" : : : "memory");
 }
 
+// spin-wait loop hint
+inline void pause() {
+    asm volatile ("pause" : : : "memory");
+}
+
 inline u8 inb(u16 port)
 {
     u8 r;
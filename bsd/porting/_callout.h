@@ -40,10 +40,13 @@
 
 #include <osv/mutex.h>
 #include <osv/clock.hh>
+#include <bsd/sys/sys/queue.h>
 
 struct callout {
-	/* OSv waiter thread for drain (drain) */
-	void *waiter_thread;
+	/* Link in a timer wheel slot, valid while CALLOUT_PENDING */
+	LIST_ENTRY(callout) c_links;
+	/* The per-cpu timer wheel this callout was last armed on */
+	void *c_wheel;
 	/* State of this entry */
 	int c_flags;
 	uint64_t c_ticks;
@@ -6,11 +6,13 @@
  */
 
 #include <mutex>
-#include <set>
+#include <vector>
+#include <algorithm>
 #include "osv/trace.hh"
 #include <osv/debug.hh>
 #include <osv/sched.hh>
 #include <osv/clock.hh>
+#include <osv/waitqueue.hh>
 using namespace osv::clock::literals;
 
 #include <bsd/porting/rwlock.h>
@@ -22,274 +24,440 @@ TRACEPOINT(trace_callout_init, "C=%p", void *);
 TRACEPOINT(trace_callout_reset, "C=%p to_ticks=%d fn=%p arg=%p", void *, uint64_t, void *, void *);
 TRACEPOINT(trace_callout_stop_wait, "C=%p", void *);
 TRACEPOINT(trace_callout_stop, "C=%p flags=%d, is_drain=%d", void *, int, int);
-TRACEPOINT(trace_callout_thread_waiting, "C=%p", void *);
+TRACEPOINT(trace_callout_thread_waiting, "tick=%d", uint64_t);
 TRACEPOINT(trace_callout_thread_retry, "C=%p", void *);
 TRACEPOINT(trace_callout_thread_dispatching, "C=%p fn=%p", void *, void *);
-TRACEPOINT(trace_callout_thread_waking, "C=%p thread=%p", void *, void *);
-
-int _callout_stop_safe_locked(struct callout *c, int safe);
+TRACEPOINT(trace_callout_thread_waking, "C=%p", void *);
 
 namespace callouts {
 
-    struct callout_compare {
-        bool operator() (callout *a, callout *b) const {
-            if (a->c_to_ns == b->c_to_ns) {
-                return (a < b);
-            }
-
-            return (a->c_to_ns < b->c_to_ns);
-        }
+    // Callouts are kept in a timing wheel per cpu, and are dispatched by
+    // that cpu's callout thread. Arming, re-arming and stopping a callout
+    // are O(1), and only contend with other users of the same wheel.
+    //
+    // The wheel is hierarchical: level 0 has a slot for each of the next
+    // 256 ticks, and each slot of level n > 0 spans all the slots of level
+    // n - 1. When the wheel reaches the start of a slot of level n > 0, its
+    // callouts are cascaded into the lower levels. Callouts further away
+    // than the top level spans wait in its last slot, and get there again
+    // on each cascade until they are close enough.
+    constexpr unsigned level0_bits = 8;
+    constexpr unsigned level_bits = 6;
+    constexpr unsigned nr_levels = 4;
+    constexpr unsigned level0_size = 1 << level0_bits;
+    constexpr unsigned level_size = 1 << level_bits;
+    constexpr u64 max_delta = u64(1) << (level0_bits + (nr_levels - 1) * level_bits);
+    constexpr u64 never = ~u64(0);
+
+    LIST_HEAD(callout_list, callout);
+
+    struct wheel {
+        mutex mtx;
+        // The next tick to dispatch; all earlier ones have been.
+        u64 now;
+        callout_list level0[level0_size];
+        callout_list levels[nr_levels - 1][level_size];
+        // Slots which may be non-empty. Removing a callout doesn't clear
+        // the bit of its slot, next_event() does when it finds it empty.
+        u64 level0_map[level0_size / 64];
+        u64 levels_map[nr_levels - 1];
+
+        sched::thread *dispatcher;
+        // The tick the dispatcher sleeps until, 0 if it's awake
+        u64 sleep_until;
+        bool have_work;
+
+        // The callout being dispatched, if any. While the dispatcher waits
+        // for the callout's lock, stopping it cancels the dispatch; once
+        // the handler is called, callout_drain() waits for it to return.
+        struct callout *running;
+        bool acquiring;
+        bool cancelled;
+        bool draining;
+        waitqueue running_done;
     };
 
-    // We manage callouts in a single ordered set
-    std::set<callout *, callout_compare> _callouts;
-
-    // Both global data and callout structure are protected using this lock
-    mutex _callout_mutex;
-    void lock(void) { _callout_mutex.lock(); }
-    void unlock(void) { _callout_mutex.unlock(); }
-
-    // The callout dispatcher thread
-    sched::thread *_callout_dispatcher = nullptr;
-    bool _have_work = false;
+    std::vector<wheel*> _wheels;
 
-    void add_callout(callout *c)
+    u64 current_tick()
     {
-        _callouts.insert(c);
+        return ns2ticks(std::chrono::duration_cast<std::chrono::nanoseconds>
+                (osv::clock::uptime::now().time_since_epoch()).count());
     }
 
-    void remove_callout(callout *c)
+    osv::clock::uptime::time_point tick_time(u64 tick)
     {
-        _callouts.erase(c);
+        return osv::clock::uptime::time_point(
+                std::chrono::nanoseconds(ticks2ns(tick)));
     }
 
-    callout *get_one(void)
+    unsigned level_shift(unsigned level)
     {
-        if (_callouts.empty()) {
-            return (nullptr);
-        }
-        return (*_callouts.begin());
+        return level0_bits + (level - 1) * level_bits;
     }
 
-    // FIXME: optimize this function
-    bool have_callout(callout *c)
+    void insert(wheel *w, struct callout *c)
     {
-        for (auto i: _callouts) {
-            if (i == c) {
-                return (true);
+        u64 expire = std::max(c->c_time, w->now);
+        u64 delta = expire - w->now;
+        callout_list *slot;
+
+        if (delta < level0_size) {
+            unsigned idx = expire & (level0_size - 1);
+            slot = &w->level0[idx];
+            w->level0_map[idx / 64] |= u64(1) << (idx % 64);
+        } else {
+            if (delta >= max_delta) {
+                expire = w->now + max_delta - 1;
+                delta = max_delta - 1;
+            }
+            unsigned level = 1;
+            while (delta >> (level_shift(level) + level_bits)) {
+                level++;
             }
+            unsigned idx = (expire >> level_shift(level)) & (level_size - 1);
+            slot = &w->levels[level - 1][idx];
+            w->levels_map[level - 1] |= u64(1) << idx;
         }
 
-        return (false);
+        LIST_INSERT_HEAD(slot, c, c_links);
+        c->c_flags |= CALLOUT_PENDING;
     }
 
-    void mark_have_work(void)
+    // Removes a pending callout. Returns whether it was pending.
+    bool remove(struct callout *c)
     {
-        _have_work = true;
+        if (!(c->c_flags & CALLOUT_PENDING)) {
+            return false;
+        }
+        LIST_REMOVE(c, c_links);
+        c->c_flags &= ~CALLOUT_PENDING;
+        return true;
     }
 
-    // wakes the dispatcher
-    void wake_dispatcher(void)
+    // Distance from 'start' to the next possibly non-empty slot, cyclically,
+    // or 'size' if there are none.
+    unsigned next_slot(const u64 *map, unsigned size, unsigned start)
     {
-        _callout_dispatcher->wake();
+        for (unsigned k = 0; k < size; ) {
+            unsigned idx = (start + k) % size;
+            u64 word = map[idx / 64] >> (idx % 64);
+            if (word) {
+                k += __builtin_ctzll(word);
+                return std::min(k, size);
+            }
+            k += 64 - idx % 64;
+        }
+        return size;
     }
-}
 
-static sched::thread* callout_get_waiter(struct callout *c)
-{
-    return reinterpret_cast<sched::thread*>(c->waiter_thread);
-}
+    // The first tick at which there are callouts to dispatch or cascade
+    u64 next_event(wheel *w)
+    {
+        u64 next = never;
+
+        unsigned start = w->now & (level0_size - 1);
+        unsigned k;
+        while ((k = next_slot(w->level0_map, level0_size, start)) < level0_size) {
+            unsigned idx = (start + k) % level0_size;
+            if (!LIST_EMPTY(&w->level0[idx])) {
+                next = w->now + k;
+                break;
+            }
+            w->level0_map[idx / 64] &= ~(u64(1) << (idx % 64));
+        }
 
-static void callout_set_waiter(struct callout *c, sched::thread* t)
-{
-    if (t != NULL)
-        assert(c->waiter_thread == NULL);
+        for (unsigned level = 1; level < nr_levels; level++) {
+            unsigned shift = level_shift(level);
+            u64 *map = &w->levels_map[level - 1];
+            start = (w->now >> shift) & (level_size - 1);
+            // If we're past the start of the current slot, it comes last.
+            unsigned first = (w->now & ((u64(1) << shift) - 1)) ? 1 : 0;
+            while ((k = next_slot(map, level_size, start + first)) < level_size) {
+                k += first;
+                unsigned idx = (start + k) % level_size;
+                if (!LIST_EMPTY(&w->levels[level - 1][idx])) {
+                    next = std::min(next, ((w->now >> shift) + k) << shift);
+                    break;
+                }
+                *map &= ~(u64(1) << idx);
+            }
+        }
 
-    c->waiter_thread = reinterpret_cast<void*>(t);
-}
+        return next;
+    }
 
-static void _callout_thread(void)
-{
-    callouts::lock();
+    // Move the callouts of a slot of level > 0 to the lower levels
+    void cascade(wheel *w, callout_list *slot)
+    {
+        callout_list moving = LIST_HEAD_INITIALIZER(moving);
+        LIST_SWAP(slot, &moving, callout, c_links);
 
-    while (true) {
+        struct callout *c;
+        while ((c = LIST_FIRST(&moving)) != nullptr) {
+            LIST_REMOVE(c, c_links);
+            insert(w, c);
+        }
+    }
 
-        // Wait for work
-        sched::thread::wait_until(callouts::_callout_mutex, [] {
-            return (callouts::get_one() != nullptr);
-        });
+    void dispatch(wheel *w, struct callout *c)
+    {
+        auto fn = c->c_fn;
+        auto arg = c->c_arg;
+        struct mtx* c_mtx = c->c_mtx;
+        struct rwlock* c_rwlock = c->c_rwlock;
+        bool return_unlocked = ((c->c_flags & CALLOUT_RETURNUNLOCKED) == 0);
 
-        // get the first callout with the earliest time
-        callout *c = callouts::get_one();
+        w->running = c;
+        w->cancelled = false;
+        w->draining = false;
+
+        if (c_mtx || c_rwlock) {
+            // The callout's lock is taken before ours by callout_reset()
+            // and callout_stop() callers, so we can't hold ours here.
+            w->acquiring = true;
+            DROP_LOCK(w->mtx) {
+                if (c_rwlock)
+                    rw_wlock(c_rwlock);
+                if (c_mtx)
+                    mtx_lock(c_mtx);
+            }
+            w->acquiring = false;
+
+            if (w->cancelled) {
+                if (c_rwlock)
+                    rw_wunlock(c_rwlock);
+                if (c_mtx)
+                    mtx_unlock(c_mtx);
+                trace_callout_thread_retry(c);
+                return_unlocked = false;
+                fn = nullptr;
+            }
+        }
 
-        assert(c->c_flags & (CALLOUT_ACTIVE | CALLOUT_PENDING));
+        if (fn) {
+            DROP_LOCK(w->mtx) {
+                // Callout handler. After it returns, the callout may have
+                // been rescheduled or freed, so we don't touch it again.
+                trace_callout_thread_dispatching(c, (void*)fn);
+                fn(arg);
+
+                if (return_unlocked) {
+                    if (c_rwlock)
+                        rw_wunlock(c_rwlock);
+                    if (c_mtx)
+                        mtx_unlock(c_mtx);
+                }
+            }
+        }
 
-        //////////////////////
-        // Wait for timeout //
-        //////////////////////
+        w->running = nullptr;
+        if (w->draining) {
+            trace_callout_thread_waking(c);
+            w->running_done.wake_all(w->mtx);
+        }
+    }
 
-        auto cur = osv::clock::uptime::now();
-        bool expired = true;
-        if (cur < c->c_to_ns-1_ms) {
-            sched::timer t(*sched::thread::current());
-            t.set(c->c_to_ns);
+    void run_tick(wheel *w, u64 tick)
+    {
+        w->now = tick;
 
-            trace_callout_thread_waiting(c);
-            sched::thread::wait_until(callouts::_callout_mutex, [&] {
-                return ( (t.expired()) || (callouts::_have_work));
-            });
+        for (unsigned level = nr_levels - 1; level > 0; level--) {
+            unsigned shift = level_shift(level);
+            if (tick & ((u64(1) << shift) - 1)) {
+                continue;
+            }
+            cascade(w, &w->levels[level - 1][(tick >> shift) & (level_size - 1)]);
+        }
 
-            callouts::_have_work = false;
-            expired = t.expired();
+        // Callouts re-armed for this tick or earlier by the handlers go to
+        // the next tick.
+        callout_list expired = LIST_HEAD_INITIALIZER(expired);
+        LIST_SWAP(&w->level0[tick & (level0_size - 1)], &expired, callout, c_links);
+        w->now = tick + 1;
+
+        // Handlers may stop callouts which are still on the expired list,
+        // so take them off one at a time.
+        struct callout *c;
+        while ((c = LIST_FIRST(&expired)) != nullptr) {
+            remove(c);
+            dispatch(w, c);
         }
+    }
 
-        if (!expired  || (!callouts::have_callout(c))) {
-            trace_callout_thread_retry(c);
-            continue;
+    void dispatcher_loop(wheel *w)
+    {
+        WITH_LOCK(w->mtx) {
+            while (true) {
+                u64 next = next_event(w);
+                if (next <= current_tick()) {
+                    run_tick(w, next);
+                    continue;
+                }
+
+                w->sleep_until = next;
+                w->have_work = false;
+                if (next == never) {
+                    sched::thread::wait_until(w->mtx, [&] { return w->have_work; });
+                } else {
+                    sched::timer t(*sched::thread::current());
+                    t.set(tick_time(next));
+                    trace_callout_thread_waiting(next);
+                    sched::thread::wait_until(w->mtx, [&] {
+                        return t.expired() || w->have_work;
+                    });
+                }
+                w->sleep_until = 0;
+            }
         }
+    }
 
-        ///////////////
-        // Dispatch! //
-        ///////////////
+    wheel *get_wheel(struct callout *c)
+    {
+        return static_cast<wheel*>(c->c_wheel);
+    }
 
-        auto fn = c->c_fn;
-        auto arg = c->c_arg;
-        struct mtx* c_mtx = c->c_mtx;
-        struct rwlock* c_rwlock = c->c_rwlock;
-        bool return_unlocked = ((c->c_flags & CALLOUT_RETURNUNLOCKED) == 0);
+    // Lock the wheel the callout is on. Returns nullptr if it has never
+    // been armed.
+    wheel *lock_callout(struct callout *c)
+    {
+        while (true) {
+            wheel *w = get_wheel(c);
+            if (!w) {
+                return nullptr;
+            }
+            w->mtx.lock();
+            if (get_wheel(c) == w) {
+                return w;
+            }
+            w->mtx.unlock();
+        }
+    }
 
-        if (c_rwlock)
-            rw_wlock(c_rwlock);
-        if (c_mtx)
-            mtx_lock(c_mtx);
+    // Returns whether the callout was stopped before its handler was called
+    int stop_locked(wheel *w, struct callout *c, int is_drain)
+    {
+        int result = 0;
 
-        c->c_flags &= ~CALLOUT_PENDING;
+        trace_callout_stop(c, c->c_flags, is_drain);
 
-        callouts::unlock();
-
-        // Callout handler
-        trace_callout_thread_dispatching(c, (void*)fn);
-        fn(arg);
-
-        callouts::lock();
-
-        sched::thread* waiter = nullptr;
-
-        //
-        // note: after the handler have been invoked the callout structure
-        // can look much differently, the handler may reschedule the callout
-        // or even freed it.
-        //
-        // if the callout is in the set it means that it hasn't been freed
-        // by the user
-        //
-        // reset || drain || !stop
-        if (callouts::have_callout(c)) {
-
-            waiter = callout_get_waiter(c);
-            callout_set_waiter(c, NULL);
-            // if the callout hadn't been reschedule, remove it
-            if ( ((c->c_flags & CALLOUT_PENDING) == 0) || (waiter) ) {
-                c->c_flags |= CALLOUT_COMPLETED;
-                callouts::remove_callout(c);
-            }
+        if (remove(c)) {
+            result = 1;
+        } else if (w->running == c && w->acquiring && !w->cancelled) {
+            w->cancelled = true;
+            result = 1;
         }
 
-        // FIXME: should we do this in case the caller called callout_stop?
-        if (return_unlocked) {
-            if (c_rwlock)
-                rw_wunlock(c_rwlock);
-            if (c_mtx)
-                mtx_unlock(c_mtx);
-        }
+        // Clear flags
+        c->c_flags &= ~(CALLOUT_ACTIVE | CALLOUT_PENDING);
 
-        // if we have a waiter then the callout structure must be valid
-        if (waiter) {
-            trace_callout_thread_waking(c, waiter);
-            waiter->wake();
-        }
+        return result;
     }
 }
 
 int callout_reset_on(struct callout *c, u64 to_ticks, void (*fn)(void *),
     void *arg, int ignore_cpu)
 {
+    using namespace callouts;
+
     auto cur = osv::clock::uptime::now();
-    int cur_ticks = ns2ticks(
-            std::chrono::duration_cast<std::chrono::nanoseconds>
-                (cur.time_since_epoch()).count());
     int result = 0;
-    bool queued_first = false;
-
-    callouts::lock();
+    bool rearm = true;
+    bool wake = false;
 
     trace_callout_reset(c, to_ticks, (void*)fn, arg);
 
-    result = _callout_stop_safe_locked(c, 0);
-
-    // Reset the callout
-    c->c_ticks = to_ticks;
-    c->c_time = cur_ticks + to_ticks;           // for freebsd compatibility
-    c->c_to_ns = cur + ticks2ns(to_ticks) * 1_ns;      // this is what we use
-    c->c_fn = fn;
-    c->c_arg = arg;
-    c->c_flags |= (CALLOUT_PENDING | CALLOUT_ACTIVE);
+    // Arm the callout on this cpu's wheel, so it runs here. We need the
+    // lock of the wheel it is on now, too.
+    wheel *target = _wheels[sched::cpu::current()->id];
+    wheel *w;
+    while (true) {
+        w = get_wheel(c);
+        if (!w || w == target) {
+            target->mtx.lock();
+        } else {
+            std::less<wheel*> before;
+            (before(w, target) ? w : target)->mtx.lock();
+            (before(w, target) ? target : w)->mtx.lock();
+        }
+        if (get_wheel(c) == w) {
+            break;
+        }
+        if (w && w != target) {
+            w->mtx.unlock();
+        }
+        target->mtx.unlock();
+    }
+    wheel *dest = target;
+
+    if (w && w->running == c && w->draining) {
+        // callout_drain() is waiting for this handler to return, don't let
+        // it re-arm itself.
+        rearm = false;
+    } else if (w) {
+        // A running callout stays on its wheel, so callout_drain() finds
+        // it there.
+        if (w->running == c) {
+            dest = w;
+        }
+        result = stop_locked(w, c, 0);
+    }
 
-    callouts::add_callout(c);
-    if (c == callouts::get_one()) {
-        callouts::mark_have_work();
-        queued_first = true;
+    if (rearm) {
+        // Reset the callout
+        c->c_ticks = to_ticks;
+        c->c_to_ns = cur + ticks2ns(to_ticks) * 1_ns;      // this is what we use
+        // for freebsd compatibility, in ticks, rounded up so we never
+        // dispatch before c_to_ns.
+        c->c_time = ns2ticks(std::chrono::duration_cast<std::chrono::nanoseconds>
+                (c->c_to_ns.time_since_epoch()).count() + TSECOND / hz - 1);
+        c->c_fn = fn;
+        c->c_arg = arg;
+        c->c_flags |= CALLOUT_ACTIVE;
+        c->c_wheel = dest;
+
+        insert(dest, c);
+        if (c->c_time < dest->sleep_until) {
+            dest->have_work = true;
+            wake = true;
+        }
     }
 
-    callouts::unlock();
+    if (w && w != target) {
+        w->mtx.unlock();
+    }
+    target->mtx.unlock();
 
-    if (queued_first)
-        callouts::wake_dispatcher();
+    if (wake)
+        dest->dispatcher->wake();
 
     return result;
 }
 
 // callout_stop() and callout_drain()
-int _callout_stop_safe_locked(struct callout *c, int is_drain)
+int _callout_stop_safe(struct callout *c, int is_drain)
 {
-    int result = 0;
-
-    trace_callout_stop(c, c->c_flags, is_drain);
+    using namespace callouts;
 
-    if ((is_drain) &&
-        (sched::thread::current() != callouts::_callout_dispatcher) &&
-            (callout_pending(c) ||
-             (callout_active(c) && !callout_completed(c))) ) {
+    wheel *w = lock_callout(c);
+    if (!w) {
+        c->c_flags &= ~(CALLOUT_ACTIVE | CALLOUT_PENDING);
+        return 0;
+    }
 
-        // Wait for callout
-        callout_set_waiter(c, sched::thread::current());
-        callouts::mark_have_work();
-        callouts::wake_dispatcher();
+    int result = stop_locked(w, c, is_drain);
 
+    // Wait for the handler to return, unless we're called from it
+    if (is_drain && w->running == c &&
+        sched::thread::current() != w->dispatcher) {
         trace_callout_stop_wait(c);
-
-        sched::thread::wait_until(callouts::_callout_mutex, [&] {
-            return (c->c_flags & CALLOUT_COMPLETED);
-        });
-
-        result = 1;
+        w->draining = true;
+        while (w->running == c) {
+            w->running_done.wait(w->mtx);
+        }
     }
 
-    callouts::remove_callout(c);
-
-    // Clear flags
-    c->c_flags &= ~(CALLOUT_ACTIVE | CALLOUT_PENDING | CALLOUT_COMPLETED);
-
-    return (result);
-}
-
-int _callout_stop_safe(struct callout *c, int is_drain)
-{
-    int result = 0;
-
-    callouts::lock();
-    result = _callout_stop_safe_locked(c, is_drain);
-    callouts::unlock();
+    w->mtx.unlock();
 
     return (result);
 }
@@ -322,9 +490,18 @@ void callout_init_mtx(struct callout *c, struct mtx *mtx, int flags)
 
 void init_callouts(void)
 {
-    // Start the callout thread
-    callouts::_callout_dispatcher = new sched::thread(_callout_thread,
-            sched::thread::attr().name("callout"));
-    callouts::_callout_dispatcher->start();
+    using namespace callouts;
+
+    // Start a callout thread on each cpu
+    u64 now = current_tick();
+    for (auto cpu : sched::cpus) {
+        auto w = new wheel();
+        w->now = now;
+        w->dispatcher = new sched::thread([w] { dispatcher_loop(w); },
+                sched::thread::attr().pin(cpu).name("callout"));
+        _wheels.push_back(w);
+    }
+    for (auto w : _wheels) {
+        w->dispatcher->start();
+    }
 }
-
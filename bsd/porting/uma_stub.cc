@@ -11,22 +11,135 @@
 #include <bsd/porting/netport.h>
 #include <bsd/porting/uma_stub.h>
 #include <osv/preempt-lock.hh>
+#include <osv/mempool.hh>
+#include <osv/mutex.h>
+#include <osv/sched.hh>
+#include <algorithm>
+#include <vector>
+
+// The shrinker takes zones_lock from the reclaimer thread, so nothing may
+// allocate memory while holding it: an allocation waiting for reclaim would
+// wait for us.
+static mutex zones_lock;
+static std::vector<uma_zone*> zones;
+
+// Return an item, initialized by uz_init, to malloc()
+static void zone_release_item(uma_zone_t zone, void* item)
+{
+    if (zone->uz_fini) {
+        zone->uz_fini(item, zone->uz_size);
+    }
 
-void* uma_zone::cache::alloc()
+    auto effective_size = zone->uz_size;
+    if (zone->uz_flags & UMA_ZONE_REFCNT) {
+        effective_size += UMA_ITEM_HDR_LEN;
+    }
+
+    if (effective_size == PAGE_SIZE) {
+       memory::free_page(item);
+    } else {
+       free(item);
+    }
+}
+
+// Release the items in a list of magazines, and the magazines themselves.
+// Returns the number of bytes freed.
+static size_t zone_release_magazines(uma_zone_t zone, uma_zone::magazine* m)
 {
-    if (len && CONF_debug_memory) {
-        return a[--len];
+    size_t freed = 0;
+    while (m) {
+        auto next = m->next;
+        for (unsigned i = 0; i < m->len; i++) {
+            zone_release_item(zone, m->a[i]);
+        }
+        freed += m->len * zone->uz_size + sizeof(*m);
+        delete m;
+        m = next;
     }
-    return nullptr;
+    return freed;
 }
 
-bool uma_zone::cache::free(void* obj)
+// Called without preemption disabled, so we can free the magazine if the
+// depot has enough empty ones already
+static void zone_put_empty(uma_zone_t zone, uma_zone::magazine* m)
 {
-    if (len < max_size && CONF_debug_memory) {
-        a[len++] = obj;
-        return true;
+    m->len = 0;
+    WITH_LOCK(zone->depot_lock) {
+        if (zone->depot_nempty < uma_zone::depot_max) {
+            m->next = zone->depot_empty;
+            zone->depot_empty = m;
+            zone->depot_nempty++;
+            return;
+        }
     }
-    return false;
+    delete m;
+}
+
+// Called with preemption disabled
+void* uma_zone::cache::alloc(uma_zone* zone)
+{
+    if (!loaded || !loaded->len) {
+        if (prev && prev->len) {
+            std::swap(loaded, prev);
+        } else {
+            // Exchange our empty magazine for a full one from the depot
+            WITH_LOCK(zone->depot_lock) {
+                auto m = zone->depot_full;
+                if (!m) {
+                    misses++;
+                    return nullptr;
+                }
+                zone->depot_full = m->next;
+                zone->depot_nfull--;
+                m->next = nullptr;
+                if (prev) {
+                    prev->next = zone->depot_empty;
+                    zone->depot_empty = prev;
+                    zone->depot_nempty++;
+                }
+                prev = loaded;
+                loaded = m;
+            }
+        }
+    }
+    hits++;
+    return loaded->a[--loaded->len];
+}
+
+// Called with preemption disabled. Returns false if the depot has no empty
+// magazine for us; the caller may add one and retry. If the depot has too
+// many full magazines, one is returned in drain for the caller to release.
+bool uma_zone::cache::free(uma_zone* zone, void* obj, magazine*& drain)
+{
+    if (!loaded || loaded->len == magazine::max_size) {
+        if (prev && prev->len < magazine::max_size) {
+            std::swap(loaded, prev);
+        } else {
+            // Exchange our full magazine for an empty one from the depot
+            WITH_LOCK(zone->depot_lock) {
+                auto m = zone->depot_empty;
+                if (!m) {
+                    return false;
+                }
+                zone->depot_empty = m->next;
+                zone->depot_nempty--;
+                m->next = nullptr;
+                if (prev) {
+                    if (zone->depot_nfull < depot_max) {
+                        prev->next = zone->depot_full;
+                        zone->depot_full = prev;
+                        zone->depot_nfull++;
+                    } else {
+                        drain = prev;
+                    }
+                }
+                prev = loaded;
+                loaded = m;
+            }
+        }
+    }
+    loaded->a[loaded->len++] = obj;
+    return true;
 }
 
 void * uma_zalloc_arg(uma_zone_t zone, void *udata, int flags)
@@ -34,7 +147,7 @@ void * uma_zalloc_arg(uma_zone_t zone, void *udata, int flags)
     void * ptr;
 
     WITH_LOCK(preempt_lock) {
-        ptr = (*zone->percpu_cache)->alloc();
+        ptr = (*zone->percpu_cache)->alloc(zone);
     }
 
     if (!ptr) {
@@ -68,7 +181,7 @@ void * uma_zalloc_arg(uma_zone_t zone, void *udata, int flags)
     // Call ctor
     if (zone->uz_ctor != NULL) {
         if (zone->uz_ctor(ptr, zone->uz_size, udata, flags) != 0) {
-            free(ptr);
+            zone_release_item(zone, ptr);
             return (NULL);
         }
     }
@@ -99,24 +212,26 @@ void uma_zfree_arg(uma_zone_t zone, void *item, void *udata)
         zone->uz_dtor(item, zone->uz_size, udata);
     }
 
-    WITH_LOCK(preempt_lock) {
-        if ((*zone->percpu_cache)->free(item)) {
-            return;
+    uma_zone::magazine* drain = nullptr;
+    bool cached;
+    for (bool retry = false; ; retry = true) {
+        WITH_LOCK(preempt_lock) {
+            cached = (*zone->percpu_cache)->free(zone, item, drain);
+        }
+        if (cached || retry) {
+            break;
         }
+        zone_put_empty(zone, new uma_zone::magazine);
     }
 
-    if (zone->uz_fini) {
-        zone->uz_fini(item, zone->uz_size);
+    if (drain) {
+        for (unsigned i = 0; i < drain->len; i++) {
+            zone_release_item(zone, drain->a[i]);
+        }
+        zone_put_empty(zone, drain);
     }
-
-    auto effective_size = zone->uz_size;
-    if (zone->uz_flags)
-        effective_size += UMA_ITEM_HDR_LEN;
-
-    if (effective_size == PAGE_SIZE) {
-       memory::free_page(item);
-    } else {
-       free(item);
+    if (!cached) {
+        zone_release_item(zone, item);
     }
 }
 
@@ -125,9 +240,23 @@ void uma_zfree(uma_zone_t zone, void *item)
     uma_zfree_arg(zone, item, NULL);
 }
 
+// Release the magazines in the zone's depot. The per-cpu magazines are
+// left alone, as they may only be touched by their own cpu.
+static size_t zone_drain_depot(uma_zone_t zone)
+{
+    uma_zone::magazine *full, *empty;
+    WITH_LOCK(zone->depot_lock) {
+        full = zone->depot_full;
+        empty = zone->depot_empty;
+        zone->depot_full = zone->depot_empty = nullptr;
+        zone->depot_nfull = zone->depot_nempty = 0;
+    }
+    return zone_release_magazines(zone, full) + zone_release_magazines(zone, empty);
+}
+
 void zone_drain_wait(uma_zone_t zone, int waitok)
 {
-    /* Do nothing here */
+    zone_drain_depot(zone);
 }
 
 void zone_drain(uma_zone_t zone)
@@ -140,6 +269,104 @@ int uma_zone_set_max(uma_zone_t zone, int nitems)
     return (nitems);
 }
 
+class uma_shrinker : public memory::shrinker {
+public:
+    uma_shrinker() : shrinker("uma") {}
+    virtual size_t request_memory(size_t n);
+    virtual size_t release_memory(size_t n) { return 0; }
+};
+
+size_t uma_shrinker::request_memory(size_t n)
+{
+    // Whoever holds zones_lock may be waiting for us to free memory
+    if (!mutex_trylock(&zones_lock)) {
+        return 0;
+    }
+    size_t freed = 0;
+    for (auto zone : zones) {
+        if (freed >= n) {
+            break;
+        }
+        freed += zone_drain_depot(zone);
+    }
+    mutex_unlock(&zones_lock);
+    return freed;
+}
+
+static void zone_register(uma_zone_t zone)
+{
+    static uma_shrinker* shrinker = new uma_shrinker;
+    (void)shrinker;
+    while (true) {
+        size_t capacity;
+        WITH_LOCK(zones_lock) {
+            if (zones.size() < zones.capacity()) {
+                zones.push_back(zone);
+                return;
+            }
+            capacity = zones.capacity();
+        }
+        // Grow the vector outside the lock; the old array is freed when
+        // bigger goes out of scope, also outside the lock.
+        std::vector<uma_zone*> bigger;
+        bigger.reserve(std::max(capacity * 2, size_t(64)));
+        WITH_LOCK(zones_lock) {
+            if (zones.capacity() == capacity) {
+                bigger.assign(zones.begin(), zones.end());
+                bigger.push_back(zone);
+                zones.swap(bigger);
+                return;
+            }
+        }
+    }
+}
+
+std::string uma_procfs_stats()
+{
+    constexpr size_t line_size = 200;
+    std::string ret = "zone                     size    hits      misses    depot\n";
+    auto header = ret.size();
+    size_t nzones;
+    WITH_LOCK(zones_lock) {
+        nzones = zones.size();
+    }
+    // Make room for the lines first: appending them below, under
+    // zones_lock, must not allocate.
+    while (true) {
+        ret.reserve(header + (nzones + 1) * line_size);
+        WITH_LOCK(zones_lock) {
+            nzones = zones.size();
+            if (ret.capacity() >= header + nzones * line_size) {
+                break;
+            }
+        }
+    }
+    WITH_LOCK(zones_lock) {
+        for (auto zone : zones) {
+            if (ret.size() + line_size > ret.capacity()) {
+                // zones were created since we made room
+                break;
+            }
+            u_int64_t hits = 0, misses = 0, cached;
+            for (auto c : sched::cpus) {
+                auto cache = zone->percpu_cache.for_cpu(c)->get();
+                hits += cache->hits;
+                misses += cache->misses;
+            }
+            // Items in full magazines; the per-cpu ones are not counted, as
+            // they could be exchanged under our feet
+            WITH_LOCK(zone->depot_lock) {
+                cached = zone->depot_nfull * uma_zone::magazine::max_size;
+            }
+            char line[line_size];
+            snprintf(line, sizeof(line), "%-24s %-7u %-9lu %-9lu %lu\n",
+                    zone->uz_name, zone->uz_size, hits, misses, cached);
+            ret += line;
+        }
+    }
+    return ret;
+}
+
 uma_zone_t uma_zcreate(const char *name, size_t size, uma_ctor ctor,
             uma_dtor dtor, uma_init uminit, uma_fini fini,
             int align, u_int32_t flags)
@@ -160,6 +387,8 @@ uma_zone_t uma_zcreate(const char *name, size_t size, uma_ctor ctor,
     args.keg = NULL;
     */
 
+    zone_register(z);
+
     return (z);
 }
 
@@ -177,6 +406,8 @@ uma_zone_t uma_zsecond_create(char *name, uma_ctor ctor, uma_dtor dtor,
     z->master = master;
     z->uz_flags = master->uz_flags;
 
+    zone_register(z);
+
     return (z);
 }
 
@@ -204,5 +435,17 @@ u_int32_t *uma_find_refcnt(uma_zone_t zone, void *item)
 
 void uma_zdestroy(uma_zone_t zone)
 {
+    WITH_LOCK(zones_lock) {
+        zones.erase(std::find(zones.begin(), zones.end(), zone));
+    }
+    // Nobody uses the zone any more, so the per-cpu magazines are safe
+    // to release too
+    for (auto c : sched::cpus) {
+        auto cache = zone->percpu_cache.for_cpu(c)->get();
+        zone_release_magazines(zone, cache->loaded);
+        zone_release_magazines(zone, cache->prev);
+        cache->loaded = cache->prev = nullptr;
+    }
+    zone_drain_depot(zone);
     delete zone;
 }
@@ -159,20 +159,43 @@ struct uma_zone;
 #ifdef __cplusplus
 
 #include <osv/percpu.hh>
+#include <osv/spinlock.h>
+#include <string>
 
 struct uma_zone {
     const char  *uz_name;   /* Text name of the zone */
 
-    struct cache {
-        static constexpr size_t max_size = 1000;
-        size_t len = 0;
+    /*
+     * Freed items are cached, still initialized by uz_init, in magazines:
+     * each cpu has two, and the zone keeps a depot of full and empty ones
+     * for cpus to exchange theirs with. Items only go back to malloc()
+     * (through uz_fini) when the depot is full or the zone is drained.
+     */
+    struct magazine {
+        static constexpr unsigned max_size = 64;
+        magazine* next = nullptr;
+        unsigned len = 0;
         void* a[max_size];
-        void* alloc();
-        bool free(void* obj);
+    };
+
+    struct cache {
+        magazine* loaded = nullptr;
+        magazine* prev = nullptr;
+        u_int64_t hits = 0;
+        u_int64_t misses = 0;
+        void* alloc(uma_zone* zone);
+        bool free(uma_zone* zone, void* obj, magazine*& drain);
     };
 
     dynamic_percpu_indirect<cache> percpu_cache;
 
+    static constexpr unsigned depot_max = 64;
+    spinlock_t depot_lock;
+    magazine* depot_full = nullptr;
+    unsigned depot_nfull = 0;
+    magazine* depot_empty = nullptr;
+    unsigned depot_nempty = 0;
+
     uma_ctor    uz_ctor;    /* Constructor for each allocation */
     uma_dtor    uz_dtor;    /* Destructor */
     uma_init    uz_init;    /* Initializer for each item */
@@ -186,6 +209,9 @@ struct uma_zone {
 
 };
 
+/* Per-zone cache statistics, for /proc/uma */
+std::string uma_procfs_stats();
+
 #endif
 
 typedef struct uma_zone * uma_zone_t;
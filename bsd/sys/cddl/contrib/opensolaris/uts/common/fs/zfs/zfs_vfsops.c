@@ -1422,7 +1422,10 @@ zfs_mount(struct mount *mp, char *dev, int flags, void *data)
 	}
 
 	kprintf("zfs: mounting %s from device %s\n", osname, dev);
-	return zfs_domount(mp, osname);
+	error = zfs_domount(mp, osname);
+	if (!error)
+		mp->m_flags |= MNT_DCACHE;
+	return error;
 }
 
 static int
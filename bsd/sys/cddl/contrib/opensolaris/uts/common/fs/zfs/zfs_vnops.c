@@ -4901,4 +4901,5 @@ struct vnops zfs_vnops = {
 	zfs_inactive,			/* inactive */
 	zfs_truncate,			/* truncate */
 	zfs_link,			/* link */
+	NULL,				/* getpage */
 };
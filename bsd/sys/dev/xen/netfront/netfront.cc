@@ -993,6 +993,7 @@ xn_rxeof(struct netfront_info *np)
     struct mbuf *m;
     struct mbuf_head rxq, errq;
     int err, pages_flipped = 0, work_to_do;
+    classifier::wake_batch wakes;
 
     do {
         XN_RX_LOCK_ASSERT(np);
@@ -1078,6 +1079,10 @@ xn_rxeof(struct netfront_info *np)
              * Do we really need to drop the rx lock?
              */
             XN_RX_UNLOCK(np);
+            if (ifp->if_classifier.post_packet(m, wakes)) {
+                XN_RX_LOCK(np);
+                continue;
+            }
 #if __FreeBSD_version >= 700000
             /* Use LRO if possible */
             if ((ifp->if_capenable & IFCAP_LRO) == 0 ||
@@ -1093,6 +1098,7 @@ xn_rxeof(struct netfront_info *np)
 #endif
             XN_RX_LOCK(np);
         }
+        ifp->if_classifier.flush(wakes);
 
         np->rx.rsp_cons = i;
 
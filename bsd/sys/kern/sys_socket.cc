@@ -258,6 +258,26 @@ socket_file::poll_uninstall(pollreq& pr)
     SOCK_UNLOCK(so);
 }
 
+void
+socket_file::epoll_add(epoll_ptr ep)
+{
+    SOCK_LOCK(so);
+    if (so->so_nc) {
+        so->so_nc->add_epoll(ep);
+    }
+    SOCK_UNLOCK(so);
+}
+
+void
+socket_file::epoll_del(epoll_ptr ep)
+{
+    SOCK_LOCK(so);
+    if (so->so_nc) {
+        so->so_nc->del_epoll(ep);
+    }
+    SOCK_UNLOCK(so);
+}
+
 int
 socket_file::stat(struct stat *ub)
 {
@@ -293,8 +313,22 @@ socket_file::close()
 {
     int error = 0;
 
-    if (so)
+    if (so) {
+        // The epoll registrations outlive close() (they are removed when the
+        // file is destroyed), but the net channel may outlive the file.
+        SOCK_LOCK(so);
+        if (so->so_nc) {
+            WITH_LOCK(f_lock) {
+                if (f_epolls) {
+                    for (auto&& ep : *f_epolls) {
+                        so->so_nc->del_epoll(ep);
+                    }
+                }
+            }
+        }
+        SOCK_UNLOCK(so);
         error = soclose(so);
+    }
     return (error);
 }
 
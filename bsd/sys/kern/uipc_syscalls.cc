@@ -56,6 +56,9 @@
 
 #include <memory>
 #include <fs/fs.hh>
+#include <osv/pagecache.hh>
+#include <osv/vnode.h>
+#include <osv/dentry.h>
 
 using namespace std;
 
@@ -1029,592 +1032,147 @@ sockargs(struct mbuf **mp, caddr_t buf, int buflen, int type)
 	return (error);
 }
 
-/* FIXME: OSv - Implement sendfile */
-#if 0
-
-#include <sys/condvar.h>
-
-struct sendfile_sync {
-	struct mtx	mtx;
-	struct cv	cv;
-	unsigned 	count;
-};
-
 /*
- * Detach mapped page and release resources back to the system.
+ * sendfile(2), Linux flavor: send count bytes of in_fd, starting at *offset
+ * (or at the file offset, if offset is NULL), to the socket out_fd.
+ *
+ * The data is not copied: the page cache pages holding it are attached to
+ * the mbufs as external storage, and stay referenced until the mbufs are
+ * freed, i.e., until the peer acknowledged the data.
  */
-void
-sf_buf_mext(void *addr, void *args)
+static void
+sendfile_ext_free(void *page, void *arg2)
 {
-	vm_page_t m;
-	struct sendfile_sync *sfs;
-
-	m = sf_buf_page(args);
-	sf_buf_free(args);
-	vm_page_lock(m);
-	vm_page_unwire(m, 0);
-	/*
-	 * Check for the object going away on us. This can
-	 * happen since we don't hold a reference to it.
-	 * If so, we're responsible for freeing the page.
-	 */
-	if (m->wire_count == 0 && m->object == NULL)
-		vm_page_free(m);
-	vm_page_unlock(m);
-	if (addr == NULL)
-		return;
-	sfs = addr;
-	mtx_lock(&sfs->mtx);
-	KASSERT(sfs->count> 0, ("Sendfile sync botchup count == 0"));
-	if (--sfs->count == 0)
-		cv_signal(&sfs->cv);
-	mtx_unlock(&sfs->mtx);
+	pagecache::release(page);
 }
 
-/*
- * sendfile(2)
- *
- * int sendfile(int fd, int s, off_t offset, size_t nbytes,
- *	 struct sf_hdtr *hdtr, off_t *sbytes, int flags)
- *
- * Send a file specified by 'fd' and starting at 'offset' to a socket
- * specified by 's'. Send only 'nbytes' of the file or until EOF if nbytes ==
- * 0.  Optionally add a header and/or trailer to the socket output.  If
- * specified, write the total number of bytes sent into *sbytes.
- */
-int
-sys_sendfile(struct thread *td, struct sendfile_args *uap)
+/* Get the page of the file at off, reading it in if it isn't cached */
+static void *
+sendfile_page(struct file *fp, struct vnode *vp, off_t off)
 {
-
-	return (do_sendfile(td, uap, 0));
+	bool must_fill;
+	void *page = pagecache::get(vp, off, must_fill);
+
+	if (page && must_fill) {
+		struct iovec iov = { page, PAGE_SIZE };
+		struct uio uio = { &iov, 1, off, PAGE_SIZE, UIO_READ };
+		int error = fp->read(&uio, FOF_OFFSET);
+		memset((char *)page + PAGE_SIZE - uio.uio_resid, 0, uio.uio_resid);
+		pagecache::filled(page);
+		if (error) {
+			pagecache::invalidate(vp, off, off + PAGE_SIZE);
+			pagecache::release(page);
+			return (NULL);
+		}
+	}
+	return (page);
 }
 
+/* Build a chain of mbufs pointing at len bytes of the file at off */
 static int
-do_sendfile(struct thread *td, struct sendfile_args *uap, int compat)
+sendfile_mbufs(struct file *fp, struct vnode *vp, off_t off, size_t len,
+    struct mbuf **mp)
 {
-	struct sf_hdtr hdtr;
-	struct uio *hdr_uio, *trl_uio;
-	int error;
-
-	hdr_uio = trl_uio = NULL;
-
-	if (uap->hdtr != NULL) {
-		error = copyin(uap->hdtr, &hdtr, sizeof(hdtr));
-		if (error)
-			goto out;
-		if (hdtr.headers != NULL) {
-			error = copyinuio(hdtr.headers, hdtr.hdr_cnt, &hdr_uio);
-			if (error)
-				goto out;
+	struct mbuf *top = NULL, **tail = &top;
+	size_t done = 0;
+
+	while (done < len) {
+		size_t pgoff = (off + done) % PAGE_SIZE;
+		size_t n = MIN(len - done, PAGE_SIZE - pgoff);
+		void *page = sendfile_page(fp, vp, off + done - pgoff);
+		if (page == NULL) {
+			m_freem(top);
+			return (EIO);
 		}
-		if (hdtr.trailers != NULL) {
-			error = copyinuio(hdtr.trailers, hdtr.trl_cnt, &trl_uio);
-			if (error)
-				goto out;
-
+		struct mbuf *m = top ? m_get(M_WAITOK, MT_DATA) :
+		    m_gethdr(M_WAITOK, MT_DATA);
+		m_extadd(m, (caddr_t)page + pgoff, n, sendfile_ext_free, page,
+		    NULL, 0, EXT_SFBUF);
+		if ((m->m_hdr.mh_flags & M_EXT) == 0) {
+			pagecache::release(page);
+			m_free(m);
+			m_freem(top);
+			return (ENOMEM);
 		}
+		m->m_hdr.mh_len = n;
+		*tail = m;
+		tail = &m->m_hdr.mh_next;
+		done += n;
 	}
-
-	error = kern_sendfile(td, uap, hdr_uio, trl_uio, compat);
-out:
-	if (hdr_uio)
-		free(hdr_uio, M_IOV);
-	if (trl_uio)
-		free(trl_uio, M_IOV);
-	return (error);
-}
-
-#ifdef COMPAT_FREEBSD4
-int
-freebsd4_sendfile(struct thread *td, struct freebsd4_sendfile_args *uap)
-{
-	struct sendfile_args args;
-
-	args.fd = uap->fd;
-	args.s = uap->s;
-	args.offset = uap->offset;
-	args.nbytes = uap->nbytes;
-	args.hdtr = uap->hdtr;
-	args.sbytes = uap->sbytes;
-	args.flags = uap->flags;
-
-	return (do_sendfile(td, &args, 1));
+	top->M_dat.MH.MH_pkthdr.len = len;
+	*mp = top;
+	return (0);
 }
-#endif /* COMPAT_FREEBSD4 */
 
 int
-kern_sendfile(struct thread *td, struct sendfile_args *uap,
-    struct uio *hdr_uio, struct uio *trl_uio, int compat)
+kern_sendfile(int out_fd, int in_fd, off_t *offset, size_t count,
+    ssize_t *bytes)
 {
-	struct file *sock_fp;
+	struct file *in_fp, *sock_fp;
+	struct socket *so;
 	struct vnode *vp;
-	struct vm_object *obj = NULL;
-	struct socket *so = NULL;
-	struct mbuf *m = NULL;
-	struct sf_buf *sf;
-	struct vm_page *pg;
-	off_t off, xfsize, fsbytes = 0, sbytes = 0, rem = 0;
-	int error, hdrlen = 0, mnw = 0;
-	int vfslocked;
-	struct sendfile_sync *sfs = NULL;
+	struct mbuf *top;
+	off_t off, size;
+	size_t len;
+	int error;
 
-	/*
-	 * The file descriptor must be a regular file and have a
-	 * backing VM object.
-	 * File offset must be positive.  If it goes beyond EOF
-	 * we send only the header/trailer and no payload data.
-	 */
-	AUDIT_ARG_FD(uap->fd);
-	if ((error = fgetvp_read(td, uap->fd, CAP_READ, &vp)) != 0)
-		goto out;
-	vfslocked = VFS_LOCK_GIANT(vp->v_mount);
-	vn_lock(vp, LK_SHARED | LK_RETRY);
-	if (vp->v_type == VREG) {
-		obj = vp->v_object;
-		if (obj != NULL) {
-			/*
-			 * Temporarily increase the backing VM
-			 * object's reference count so that a forced
-			 * reclamation of its vnode does not
-			 * immediately destroy it.
-			 */
-			VM_OBJECT_LOCK(obj);
-			if ((obj->flags & OBJ_DEAD) == 0) {
-				vm_object_reference_locked(obj);
-				VM_OBJECT_UNLOCK(obj);
-			} else {
-				VM_OBJECT_UNLOCK(obj);
-				obj = NULL;
-			}
-		}
-	}
-	VOP_UNLOCK(vp, 0);
-	VFS_UNLOCK_GIANT(vfslocked);
-	if (obj == NULL) {
-		error = EINVAL;
-		goto out;
-	}
-	if (uap->offset < 0) {
-		error = EINVAL;
-		goto out;
-	}
+	*bytes = 0;
+	error = getsock_cap(out_fd, &sock_fp, NULL);
+	if (error)
+		return (error);
+	so = (struct socket *)file_data(sock_fp);
 
-	/*
-	 * The socket must be a stream socket and connected.
-	 * Remember if it a blocking or non-blocking socket.
-	 */
-	if ((error = getsock_cap(td->td_proc->p_fd, uap->s, CAP_WRITE,
-	    &sock_fp, NULL)) != 0)
-		goto out;
-	so = sock_fp->f_data;
-	if (so->so_type != SOCK_STREAM) {
-		error = EINVAL;
-		goto out;
-	}
-	if ((so->so_state & SS_ISCONNECTED) == 0) {
-		error = ENOTCONN;
+	error = fget(in_fd, &in_fp);
+	if (error)
 		goto out;
+	if ((in_fp->f_flags & FREAD) == 0) {
+		error = EBADF;
+		goto out_in;
 	}
-	/*
-	 * Do not wait on memory allocations but return ENOMEM for
-	 * caller to retry later.
-	 * XXX: Experimental.
-	 */
-	if (uap->flags & SF_MNOWAIT)
-		mnw = 1;
-
-	if (uap->flags & SF_SYNC) {
-		sfs = malloc(sizeof *sfs, M_TEMP, M_WAITOK | M_ZERO);
-		mtx_init(&sfs->mtx, "sendfile", NULL, MTX_DEF);
-		cv_init(&sfs->cv, "sendfile");
+	if (in_fp->f_dentry == NULL ||
+	    in_fp->f_dentry->d_vnode->v_type != VREG) {
+		error = EINVAL;
+		goto out_in;
 	}
-
-#ifdef MAC
-	error = mac_socket_check_send(td->td_ucred, so);
-	if (error)
-		goto out;
-#endif
-
-	/* If headers are specified copy them into mbufs. */
-	if (hdr_uio != NULL) {
-		hdr_uio->uio_td = td;
-		hdr_uio->uio_rw = UIO_WRITE;
-		if (hdr_uio->uio_resid > 0) {
-			/*
-			 * In FBSD < 5.0 the nbytes to send also included
-			 * the header.  If compat is specified subtract the
-			 * header size from nbytes.
-			 */
-			if (compat) {
-				if (uap->nbytes > hdr_uio->uio_resid)
-					uap->nbytes -= hdr_uio->uio_resid;
-				else
-					uap->nbytes = 0;
-			}
-			m = m_uiotombuf(hdr_uio, (mnw ? M_NOWAIT : M_WAITOK),
-			    0, 0, 0);
-			if (m == NULL) {
-				error = mnw ? EAGAIN : ENOBUFS;
-				goto out;
-			}
-			hdrlen = m_length(m, NULL);
-		}
+	vp = in_fp->f_dentry->d_vnode;
+	size = ::size(fileref(in_fp));
+	/* f_offset is protected by the vnode lock, as in read() and lseek() */
+	if (offset) {
+		off = *offset;
+	} else {
+		vn_lock(vp);
+		off = in_fp->f_offset;
+		vn_unlock(vp);
 	}
 
-	/*
-	 * Protect against multiple writers to the socket.
-	 *
-	 * XXXRW: Historically this has assumed non-interruptibility, so now
-	 * we implement that, but possibly shouldn't.
-	 */
-	(void)sblock(&so->so_snd, SBL_WAIT | SBL_NOINTR);
-
-	/*
-	 * Loop through the pages of the file, starting with the requested
-	 * offset. Get a file page (do I/O if necessary), map the file page
-	 * into an sf_buf, attach an mbuf header to the sf_buf, and queue
-	 * it on the socket.
-	 * This is done in two loops.  The inner loop turns as many pages
-	 * as it can, up to available socket buffer space, without blocking
-	 * into mbufs to have it bulk delivered into the socket send buffer.
-	 * The outer loop checks the state and available space of the socket
-	 * and takes care of the overall progress.
-	 */
-	for (off = uap->offset, rem = uap->nbytes; ; ) {
-		struct mbuf *mtail = NULL;
-		int loopbytes = 0;
-		int space = 0;
-		int done = 0;
-
-		/*
-		 * Check the socket state for ongoing connection,
-		 * no errors and space in socket buffer.
-		 * If space is low allow for the remainder of the
-		 * file to be processed if it fits the socket buffer.
-		 * Otherwise block in waiting for sufficient space
-		 * to proceed, or if the socket is nonblocking, return
-		 * to userland with EAGAIN while reporting how far
-		 * we've come.
-		 * We wait until the socket buffer has significant free
-		 * space to do bulk sends.  This makes good use of file
-		 * system read ahead and allows packet segmentation
-		 * offloading hardware to take over lots of work.  If
-		 * we were not careful here we would send off only one
-		 * sfbuf at a time.
-		 */
-		SOCKBUF_LOCK(&so->so_snd);
-		if (so->so_snd.sb_lowat < so->so_snd.sb_hiwat / 2)
-			so->so_snd.sb_lowat = so->so_snd.sb_hiwat / 2;
-retry_space:
-		if (so->so_snd.sb_state & SBS_CANTSENDMORE) {
-			error = EPIPE;
-			SOCKBUF_UNLOCK(&so->so_snd);
-			goto done;
-		} else if (so->so_error) {
-			error = so->so_error;
-			so->so_error = 0;
-			SOCKBUF_UNLOCK(&so->so_snd);
-			goto done;
-		}
-		space = sbspace(&so->so_snd);
-		if (space < rem &&
-		    (space <= 0 ||
-		     space < so->so_snd.sb_lowat)) {
-			if (so->so_state & SS_NBIO) {
-				SOCKBUF_UNLOCK(&so->so_snd);
-				error = EAGAIN;
-				goto done;
-			}
-			/*
-			 * sbwait drops the lock while sleeping.
-			 * When we loop back to retry_space the
-			 * state may have changed and we retest
-			 * for it.
-			 */
-			error = sbwait(&so->so_snd);
-			/*
-			 * An error from sbwait usually indicates that we've
-			 * been interrupted by a signal. If we've sent anything
-			 * then return bytes sent, otherwise return the error.
-			 */
-			if (error) {
-				SOCKBUF_UNLOCK(&so->so_snd);
-				goto done;
-			}
-			goto retry_space;
-		}
-		SOCKBUF_UNLOCK(&so->so_snd);
-
-		/*
-		 * Reduce space in the socket buffer by the size of
-		 * the header mbuf chain.
-		 * hdrlen is set to 0 after the first loop.
-		 */
-		space -= hdrlen;
-
-		/*
-		 * Loop and construct maximum sized mbuf chain to be bulk
-		 * dumped into socket buffer.
-		 */
-		while (space > loopbytes) {
-			vm_pindex_t pindex;
-			vm_offset_t pgoff;
-			struct mbuf *m0;
-
-			VM_OBJECT_LOCK(obj);
-			/*
-			 * Calculate the amount to transfer.
-			 * Not to exceed a page, the EOF,
-			 * or the passed in nbytes.
-			 */
-			pgoff = (vm_offset_t)(off & PAGE_MASK);
-			xfsize = omin(PAGE_SIZE - pgoff,
-			    obj->un_pager.vnp.vnp_size - uap->offset -
-			    fsbytes - loopbytes);
-			if (uap->nbytes)
-				rem = (uap->nbytes - fsbytes - loopbytes);
-			else
-				rem = obj->un_pager.vnp.vnp_size -
-				    uap->offset - fsbytes - loopbytes;
-			xfsize = omin(rem, xfsize);
-			xfsize = omin(space - loopbytes, xfsize);
-			if (xfsize <= 0) {
-				VM_OBJECT_UNLOCK(obj);
-				done = 1;		/* all data sent */
-				break;
-			}
-
-			/*
-			 * Attempt to look up the page.  Allocate
-			 * if not found or wait and loop if busy.
-			 */
-			pindex = OFF_TO_IDX(off);
-			pg = vm_page_grab(obj, pindex, VM_ALLOC_NOBUSY |
-			    VM_ALLOC_NORMAL | VM_ALLOC_WIRED | VM_ALLOC_RETRY);
-
-			/*
-			 * Check if page is valid for what we need,
-			 * otherwise initiate I/O.
-			 * If we already turned some pages into mbufs,
-			 * send them off before we come here again and
-			 * block.
-			 */
-			if (pg->valid && vm_page_is_valid(pg, pgoff, xfsize))
-				VM_OBJECT_UNLOCK(obj);
-			else if (m != NULL)
-				error = EAGAIN;	/* send what we already got */
-			else if (uap->flags & SF_NODISKIO)
-				error = EBUSY;
-			else {
-				int bsize;
-				ssize_t resid;
-
-				/*
-				 * Ensure that our page is still around
-				 * when the I/O completes.
-				 */
-				vm_page_io_start(pg);
-				VM_OBJECT_UNLOCK(obj);
-
-				/*
-				 * Get the page from backing store.
-				 */
-				vfslocked = VFS_LOCK_GIANT(vp->v_mount);
-				error = vn_lock(vp, LK_SHARED);
-				if (error != 0)
-					goto after_read;
-				bsize = vp->v_mount->mnt_stat.f_iosize;
-
-				/*
-				 * XXXMAC: Because we don't have fp->f_cred
-				 * here, we pass in NOCRED.  This is probably
-				 * wrong, but is consistent with our original
-				 * implementation.
-				 */
-				error = vn_rdwr(UIO_READ, vp, NULL, MAXBSIZE,
-				    trunc_page(off), UIO_NOCOPY, IO_NODELOCKED |
-				    IO_VMIO | ((MAXBSIZE / bsize) << IO_SEQSHIFT),
-				    td->td_ucred, NOCRED, &resid, td);
-				VOP_UNLOCK(vp, 0);
-			after_read:
-				VFS_UNLOCK_GIANT(vfslocked);
-				VM_OBJECT_LOCK(obj);
-				vm_page_io_finish(pg);
-				if (!error)
-					VM_OBJECT_UNLOCK(obj);
-				mbstat.sf_iocnt++;
-			}
-			if (error) {
-				vm_page_lock(pg);
-				vm_page_unwire(pg, 0);
-				/*
-				 * See if anyone else might know about
-				 * this page.  If not and it is not valid,
-				 * then free it.
-				 */
-				if (pg->wire_count == 0 && pg->valid == 0 &&
-				    pg->busy == 0 && !(pg->oflags & VPO_BUSY))
-					vm_page_free(pg);
-				vm_page_unlock(pg);
-				VM_OBJECT_UNLOCK(obj);
-				if (error == EAGAIN)
-					error = 0;	/* not a real error */
-				break;
-			}
-
-			/*
-			 * Get a sendfile buf.  When allocating the
-			 * first buffer for mbuf chain, we usually
-			 * wait as long as necessary, but this wait
-			 * can be interrupted.  For consequent
-			 * buffers, do not sleep, since several
-			 * threads might exhaust the buffers and then
-			 * deadlock.
-			 */
-			sf = sf_buf_alloc(pg, (mnw || m != NULL) ? SFB_NOWAIT :
-			    SFB_CATCH);
-			if (sf == NULL) {
-				mbstat.sf_allocfail++;
-				vm_page_lock(pg);
-				vm_page_unwire(pg, 0);
-				KASSERT(pg->object != NULL,
-				    ("kern_sendfile: object disappeared"));
-				vm_page_unlock(pg);
-				if (m == NULL)
-					error = (mnw ? EAGAIN : EINTR);
-				break;
-			}
-
-			/*
-			 * Get an mbuf and set it up as having
-			 * external storage.
-			 */
-			m0 = m_get((mnw ? M_NOWAIT : M_WAITOK), MT_DATA);
-			if (m0 == NULL) {
-				error = (mnw ? EAGAIN : ENOBUFS);
-				sf_buf_mext((void *)sf_buf_kva(sf), sf);
-				break;
-			}
-			MEXTADD(m0, sf_buf_kva(sf), PAGE_SIZE, sf_buf_mext,
-			    sfs, sf, M_RDONLY, EXT_SFBUF);
-			m0->m_hdr.mh_data = (char *)sf_buf_kva(sf) + pgoff;
-			m0->m_hdr.mh_len = xfsize;
-
-			/* Append to mbuf chain. */
-			if (mtail != NULL)
-				mtail->m_hdr.mh_next = m0;
-			else if (m != NULL)
-				m_last(m)->m_hdr.mh_next = m0;
-			else
-				m = m0;
-			mtail = m0;
-
-			/* Keep track of bits processed. */
-			loopbytes += xfsize;
-			off += xfsize;
-
-			if (sfs != NULL) {
-				mtx_lock(&sfs->mtx);
-				sfs->count++;
-				mtx_unlock(&sfs->mtx);
-			}
-		}
-
-		/* Add the buffer chain to the socket buffer. */
-		if (m != NULL) {
-			int mlen, err;
-
-			mlen = m_length(m, NULL);
-			SOCKBUF_LOCK(&so->so_snd);
-			if (so->so_snd.sb_state & SBS_CANTSENDMORE) {
-				error = EPIPE;
-				SOCKBUF_UNLOCK(&so->so_snd);
-				goto done;
-			}
-			SOCKBUF_UNLOCK(&so->so_snd);
-			CURVNET_SET(so->so_vnet);
-			/* Avoid error aliasing. */
-			err = (*so->so_proto->pr_usrreqs->pru_send)
-				    (so, 0, m, NULL, NULL, td);
-			CURVNET_RESTORE();
-			if (err == 0) {
-				/*
-				 * We need two counters to get the
-				 * file offset and nbytes to send
-				 * right:
-				 * - sbytes contains the total amount
-				 *   of bytes sent, including headers.
-				 * - fsbytes contains the total amount
-				 *   of bytes sent from the file.
-				 */
-				sbytes += mlen;
-				fsbytes += mlen;
-				if (hdrlen) {
-					fsbytes -= hdrlen;
-					hdrlen = 0;
-				}
-			} else if (error == 0)
-				error = err;
-			m = NULL;	/* pru_send always consumes */
-		}
-
-		/* Quit outer loop on error or when we're done. */
-		if (done) 
+	while (count && off < size) {
+		/* sosend() wants a chain it can queue all at once */
+		len = MIN(count, (size_t)(size - off));
+		len = MIN(len, so->so_snd.sb_hiwat);
+		error = sendfile_mbufs(in_fp, vp, off, len, &top);
+		if (error)
 			break;
+		error = sosend(so, NULL, NULL, top, NULL, 0, NULL);
 		if (error)
-			goto done;
+			break;
+		off += len;
+		count -= len;
+		*bytes += len;
 	}
+	if (*bytes)
+		error = 0;
 
-	/*
-	 * Send trailers. Wimp out and use writev(2).
-	 */
-	if (trl_uio != NULL) {
-		sbunlock(&so->so_snd);
-		error = kern_writev(td, uap->s, trl_uio);
-		if (error == 0)
-			sbytes += td->td_retval[0];
-		goto out;
+	if (offset) {
+		*offset = off;
+	} else {
+		vn_lock(vp);
+		in_fp->f_offset = off;
+		vn_unlock(vp);
 	}
-
-done:
-	sbunlock(&so->so_snd);
+out_in:
+	fdrop(in_fp);
 out:
-	/*
-	 * If there was no error we have to clear td->td_retval[0]
-	 * because it may have been set by writev.
-	 */
-	if (error == 0) {
-		td->td_retval[0] = 0;
-	}
-	if (uap->sbytes != NULL) {
-		copyout(&sbytes, uap->sbytes, sizeof(off_t));
-	}
-	if (obj != NULL)
-		vm_object_deallocate(obj);
-	if (vp != NULL) {
-		vfslocked = VFS_LOCK_GIANT(vp->v_mount);
-		vrele(vp);
-		VFS_UNLOCK_GIANT(vfslocked);
-	}
-	if (so)
-		fdrop(sock_fp, td);
-	if (m)
-		m_freem(m);
-
-	if (sfs != NULL) {
-		mtx_lock(&sfs->mtx);
-		if (sfs->count != 0)
-			cv_wait(&sfs->cv, &sfs->mtx);
-		KASSERT(sfs->count == 0, ("sendfile sync still busy"));
-		cv_destroy(&sfs->cv);
-		mtx_destroy(&sfs->mtx);
-		free(sfs, M_TEMP);
-	}
-
-	if (error == ERESTART)
-		error = EINTR;
-
+	fdrop(sock_fp);
 	return (error);
 }
-#endif
 
@@ -2,6 +2,9 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <assert.h>
+#include <unistd.h>
+#include <vector>
+#include <algorithm>
 
 #include <bsd/uipc_syscalls.h>
 #include <osv/debug.h>
@@ -245,6 +248,60 @@ ssize_t sendmsg(int fd, const struct msghdr *msg, int flags)
 	return bytes;
 }
 
+// sendfile() to something which is not a socket: copy through a buffer
+static ssize_t sendfile_copy(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+	std::vector<char> buf(std::min(count, size_t(64 << 10)));
+	ssize_t total = 0;
+
+	while (count) {
+		auto len = std::min(count, buf.size());
+		auto n = offset ? pread(in_fd, buf.data(), len, *offset) :
+			read(in_fd, buf.data(), len);
+		if (n <= 0) {
+			return total ? total : n;
+		}
+		auto w = write(out_fd, buf.data(), n);
+		if (w < n && !offset) {
+			// give back what we didn't write
+			lseek(in_fd, std::max(w, ssize_t(0)) - n, SEEK_CUR);
+		}
+		if (w <= 0) {
+			return total ? total : w;
+		}
+		if (offset) {
+			*offset += w;
+		}
+		total += w;
+		count -= w;
+		if (w < n) {
+			break;
+		}
+	}
+	return total;
+}
+
+extern "C"
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+	ssize_t bytes;
+	int error;
+
+	sock_d("sendfile(out_fd=%d, in_fd=%d, ..., count=%zu)", out_fd, in_fd, count)
+
+	error = kern_sendfile(out_fd, in_fd, offset, count, &bytes);
+	if (error == ENOTSOCK) {
+		return sendfile_copy(out_fd, in_fd, offset, count);
+	}
+	if (error) {
+		sock_d("sendfile() failed, errno=%d", error);
+		errno = error;
+		return -1;
+	}
+
+	return bytes;
+}
+
 extern "C"
 int getsockopt(int fd, int level, int optname, void *__restrict optval,
 		socklen_t *__restrict optlen)
@@ -3689,6 +3689,11 @@ tcp_setup_net_channel(tcpcb* tp, struct ifnet* intf)
 			TAILQ_FOREACH(pl, &so->fp->f_poll_list, _link) {
 				so->so_nc->add_poller(*pl->_req);
 			}
+			if (so->fp->f_epolls) {
+				for (auto&& ep : *so->fp->f_epolls) {
+					so->so_nc->add_epoll(ep);
+				}
+			}
 		}
 	}
 }
@@ -3713,15 +3718,22 @@ tcp_free_net_channel(tcpcb* tp)
 	tcp_teardown_net_channel(tp);
 	auto so = tp->t_inpcb->inp_socket;
 	if (so && so->fp) {
-		TAILQ_FOREACH(pl, &so->fp->f_poll_list, _link) {
-			so->so_nc->del_poller(*pl->_req);
+		WITH_LOCK(so->fp->f_lock) {
+			TAILQ_FOREACH(pl, &so->fp->f_poll_list, _link) {
+				so->so_nc->del_poller(*pl->_req);
+			}
+			if (so->fp->f_epolls) {
+				for (auto&& ep : *so->fp->f_epolls) {
+					so->so_nc->del_epoll(ep);
+				}
+			}
 		}
 		so->so_nc = nullptr;
 	}
 	if (tp->nc_intf) {
 		tp->nc_intf->del_net_channel(tcp_connection_id(tp));
 	}
-	osv::rcu_dispose(tp->nc);
+	tp->nc->dispose();
 	tp->nc = nullptr;
 }
 
@@ -27,6 +27,8 @@ int kern_setsockopt(int s, int level, int name, void *val, socklen_t valsize);
 int kern_getsockopt(int s, int level, int name, void *val, socklen_t *valsize);
 int kern_socketpair(int domain, int type, int protocol, int *rsv);
 int kern_getsockname(int fd, struct bsd_sockaddr **sa, socklen_t *alen);
+int kern_sendfile(int out_fd, int in_fd, off_t *offset, size_t count,
+    ssize_t *bytes);
 
 /* FreeBSD Interface */
 int sys_socket(int domain, int type, int protocol, int *out_fd);
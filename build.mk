@@ -198,6 +198,8 @@ tests += tests/tst-preempt.so
 tests += tests/tst-tracepoint.so
 tests += tests/tst-hub.so
 tests += tests/misc-leak.so
+tests += tests/misc-malloc-frag.so
+tests += tests/misc-uma.so
 tests += tests/misc-mmap-anon-perf.so
 tests += tests/tst-mmap-file.so
 tests += tests/tst-mmap.so
@@ -208,12 +210,19 @@ tests += tests/tst-condvar.so
 tests += tests/tst-queue-mpsc.so
 tests += tests/tst-af-local.so
 tests += tests/tst-pipe.so
+tests += tests/misc-pipe.so
+tests += tests/misc-sendfile.so
+tests += tests/misc-ramfs.so
+tests += tests/misc-console.so
 tests += tests/tst-yield.so
 tests += tests/misc-ctxsw.so
 tests += tests/tst-readdir.so
 tests += tests/tst-remove.so
 tests += tests/misc-wake.so
 tests += tests/tst-epoll.so
+tests += tests/misc-epoll.so
+tests += tests/misc-rcu-hashtable.so
+tests += tests/tst-rcu-hashtable.so
 tests += tests/misc-lfring.so
 tests += tests/tst-fsx.so
 tests += tests/tst-sleep.so
@@ -225,6 +234,7 @@ tests += tests/misc-loadbalance.so
 tests += tests/misc-scheduler.so
 tests += tests/tst-dns-resolver.so
 tests += tests/tst-fs-link.so
+tests += tests/tst-dcache.so
 tests += tests/tst-kill.so
 tests += tests/tst-truncate.so
 tests += $(boost-tests)
@@ -238,6 +248,7 @@ tests += tests/tst-threadcomplete.so
 tests += tests/tst-timerfd.so
 tests += tests/tst-memmove.so
 tests += tests/tst-pthread-clock.so
+tests += tests/misc-clock.so
 tests += tests/misc-procfs.so
 tests += tests/tst-chdir.so
 tests += tests/tst-hello.so
@@ -572,10 +583,11 @@ drivers += drivers/virtio-net.o
 drivers += drivers/virtio-blk.o
 drivers += drivers/virtio-scsi.o
 drivers += drivers/virtio-rng.o
+drivers += drivers/virtio-serial.o
 drivers += drivers/clock.o drivers/kvmclock.o drivers/xenclock.o
 drivers += drivers/clockevent.o
 drivers += drivers/acpi.o
-drivers += drivers/hpet.o
+drivers += drivers/hpet.o drivers/tscclock.o
 drivers += drivers/xenfront.o drivers/xenfront-xenbus.o drivers/xenfront-blk.o
 drivers += drivers/pvpanic.o
 drivers += drivers/random.o
@@ -611,6 +623,7 @@ objects += core/debug.o
 objects += core/rcu.o
 objects += drivers/pci.o
 objects += core/mempool.o
+objects += core/pagecache.o
 objects += core/alloctracker.o
 objects += core/printf.o
 objects += arch/x64/elf-dl.o
@@ -620,6 +633,7 @@ objects += core/sched.o
 objects += core/mmio.o
 objects += core/kprintf.o
 objects += core/trace.o
+objects += core/sampler.o
 objects += core/callstack.o
 objects += core/poll.o
 objects += core/select.o
@@ -7,10 +7,12 @@
 
 // Implement the Linux epoll(7) functions in OSV
 
-// NOTE: This is an inefficient implementation, in which epoll_wait() calls
-// poll(), thereby negating all the performance benefits of using epoll and
-// not poll. This is only a temporary implementation, for getting the
-// functionality of epoll which Java needs - but not its performance.
+// Every registered file has an epoll_registration, and the file keeps an
+// epoll_ptr to it in f_epolls. When the file's state changes, poll_wake()
+// (or, for sockets with a net channel, the channel's wake()) calls
+// epoll_wake(), which puts the registration on the epoll's ready list.
+// epoll_wait() only looks at the files on the ready list, so its cost does
+// not depend on the number of idle registered files.
 
 #include <sys/epoll.h>
 #include <sys/poll.h>
@@ -20,22 +22,28 @@
 
 #include <osv/file.h>
 #include <osv/poll.h>
+#include <osv/spinlock.h>
+#include <osv/rcu.hh>
 #include <fs/fs.hh>
 
 #include <osv/debug.hh>
 #include <unordered_map>
 #include <boost/range/algorithm/find.hpp>
+#include <boost/intrusive/list.hpp>
 
 #include <osv/trace.hh>
 TRACEPOINT(trace_epoll_create, "returned fd=%d", int);
 TRACEPOINT(trace_epoll_ctl, "epfd=%d, fd=%d, op=%s", int, int, const char*);
 TRACEPOINT(trace_epoll_wait, "epfd=%d, maxevents=%d, timeout=%d", int, int, int);
 TRACEPOINT(trace_epoll_ready, "file=%p, event=0x%x", file*, int);
+TRACEPOINT(trace_epoll_wake, "epoll=%p, file=%p", epoll_file*, file*);
 
-// We implement epoll using poll(), and therefore need to convert epoll's
-// event bits to and poll(). These are mostly the same, so the conversion
-// is trivial, but we verify this here with static_asserts. We additionally
-// support the epoll-only EPOLLET, but not EPOLLONESHOT.
+namespace bi = boost::intrusive;
+
+// We implement epoll using each file's poll() method, and therefore need to
+// convert epoll's event bits to and from poll(). These are mostly the same,
+// so the conversion is trivial, but we verify this here with static_asserts.
+// We additionally support the epoll-only EPOLLET and EPOLLONESHOT flags.
 static_assert(POLLIN == EPOLLIN, "POLLIN!=EPOLLIN");
 static_assert(POLLOUT == EPOLLOUT, "POLLOUT!=EPOLLOUT");
 static_assert(POLLRDHUP == EPOLLRDHUP, "POLLRDHUP!=EPOLLRDHUP");
@@ -44,11 +52,15 @@ static_assert(POLLERR == EPOLLERR, "POLLERR!=EPOLLERR");
 static_assert(POLLHUP == EPOLLHUP, "POLLHUP!=EPOLLHUP");
 constexpr int SUPPORTED_EVENTS =
         EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLPRI | EPOLLERR | EPOLLHUP |
-        EPOLLET;
+        EPOLLET | EPOLLONESHOT;
+constexpr int EPOLL_FLAGS = EPOLLET | EPOLLONESHOT;
+// EPOLLET is passed on to poll(): socket poll() only re-arms its wakeup
+// after reporting an event if it is set (see sopoll_generic()), and it is
+// the wakeup which puts an edge-triggered file back on the ready list.
 inline uint32_t events_epoll_to_poll(uint32_t e)
 {
     assert (!(e & ~SUPPORTED_EVENTS));
-    return e;
+    return e & ~EPOLLONESHOT;
 }
 inline uint32_t events_poll_to_epoll(uint32_t e)
 {
@@ -56,98 +68,267 @@ inline uint32_t events_poll_to_epoll(uint32_t e)
     return e;
 }
 
-struct registered_epoll : epoll_event {
-    int last_poll_wake_count; // For implementing EPOLLET
-    registered_epoll(epoll_event e, int c) :
-        epoll_event(e), last_poll_wake_count(c) {}
+struct epoll_activity;
+
+struct epoll_registration {
+    epoll_registration(file* fp, epoll_event e, epoll_activity* act)
+        : fp(fp), event(e), act(act) {}
+    file* fp;
+    // protected by epoll_file::_lock
+    epoll_event event;
+    epoll_activity* act;
+    // The following are protected by epoll_activity::lock.
+    // ready_link is linked while the file is waiting to be looked at by
+    // epoll_wait(); removed is set once the registration is on its way to
+    // be freed, and wakers that still hold an epoll_ptr must ignore it.
+    bi::list_member_hook<bi::link_mode<bi::auto_unlink>> ready_link;
+    bool removed = false;
+};
+
+// The part of an epoll which wakers touch. Wakers from an rcu read-side
+// section (net channels) may still reach it through a registration after
+// the epoll_file is closed and deleted, so it is freed separately, after a
+// grace period, like the registrations themselves.
+struct epoll_activity {
+    using ready_list = bi::list<epoll_registration,
+            bi::member_hook<epoll_registration,
+                    bi::list_member_hook<bi::link_mode<bi::auto_unlink>>,
+                    &epoll_registration::ready_link>,
+            bi::constant_time_size<false>>;
+    struct waiter {
+        sched::thread* t;
+        waiter* next;
+    };
+    explicit epoll_activity(epoll_file* epoll) : epoll(epoll) {}
+    // for tracing only; may be stale once the epoll is closed
+    epoll_file* epoll;
+    // Wakers may run with preemption disabled, so the ready list and the
+    // list of waiting threads are protected by a spinlock rather than
+    // epoll_file::_lock.
+    spinlock_t lock;
+    ready_list ready;
+    waiter* waiters = nullptr;
 };
 
 class epoll_file final : public special_file {
-    std::unordered_map<file*, registered_epoll> map;
+    using ready_list = epoll_activity::ready_list;
+    using waiter = epoll_activity::waiter;
+    // _lock protects the map, and serializes epoll_ctl() against wait().
+    mutex _lock;
+    std::unordered_map<file*, epoll_registration*> map;
+    epoll_activity* _act;
 public:
-    epoll_file() : special_file(0, DTYPE_UNSPEC) {}
+    epoll_file() : special_file(0, DTYPE_UNSPEC), _act(new epoll_activity(this)) {}
+    // close() has marked every registration removed, so wakers which still
+    // find _act ignore it; it just needs to outlive them.
+    virtual ~epoll_file() {
+        osv::rcu_dispose(_act);
+    }
     virtual int close() override {
-        for (auto& e : map) {
-            auto fp = e.first;
-            remove_me(fp);
+        WITH_LOCK(_lock) {
+            for (auto& e : map) {
+                remove_me(e.first, e.second);
+                dispose(e.second);
+            }
+            map.clear();
         }
         return 0;
     }
     int add(file* fp, struct epoll_event *event)
     {
-        if (map.count(fp)) {
-            return EEXIST;
-        }
-        WITH_LOCK(fp->f_lock) {
-            // I used poll_wake_count-1, to ensure EPOLLET returns once when
-            // registering an epoll after data is already available.
-            map.emplace(std::move(fp),
-                    registered_epoll(*event, fp->poll_wake_count - 1));
-            if (!fp->f_epolls) {
-                fp->f_epolls.reset(new std::vector<file*>);
+        WITH_LOCK(_lock) {
+            if (map.count(fp)) {
+                return EEXIST;
+            }
+            auto reg = new epoll_registration(fp, *event, _act);
+            map.emplace(fp, reg);
+            epoll_ptr ep{this, reg};
+            WITH_LOCK(fp->f_lock) {
+                if (!fp->f_epolls) {
+                    fp->f_epolls.reset(new std::vector<epoll_ptr>);
+                }
+                fp->f_epolls->push_back(ep);
             }
-            fp->f_epolls->push_back(this);
+            fp->epoll_add(ep);
+            // Let the next wait() check whether the file is already ready.
+            // This also reports data which arrived before registering with
+            // EPOLLET, just once.
+            wake(reg);
         }
         return 0;
     }
     int mod(file* fp, struct epoll_event *event)
     {
-        try {
-            WITH_LOCK(fp->f_lock) {
-                map.at(fp) = registered_epoll(*event, fp->poll_wake_count - 1);
+        WITH_LOCK(_lock) {
+            auto i = map.find(fp);
+            if (i == map.end()) {
+                return ENOENT;
             }
-            return 0;
-        } catch (std::out_of_range &e) {
-            return ENOENT;
+            i->second->event = *event;
+            // Re-evaluate with the new events, which also re-arms a
+            // registration disabled by EPOLLONESHOT.
+            wake(i->second);
         }
+        return 0;
     }
     int del(file* fp)
     {
-        if (map.erase(fp)) {
-            remove_me(fp);
-            return 0;
-        } else {
-            return ENOENT;
+        WITH_LOCK(_lock) {
+            auto i = map.find(fp);
+            if (i == map.end()) {
+                return ENOENT;
+            }
+            remove_me(fp, i->second);
+            dispose(i->second);
+            map.erase(i);
         }
+        return 0;
     }
     int wait(struct epoll_event *events, int maxevents, int timeout_ms)
     {
-        std::vector<poll_file> pollfds;
-        pollfds.reserve(map.size());
-        for (auto &i : map) {
-            int eevents = i.second.events;
-            auto events = events_epoll_to_poll(eevents);
-            pollfds.emplace_back(i.first, events, 0,
-                    i.second.last_poll_wake_count);
+        sched::timer tmr(*sched::thread::current());
+        if (timeout_ms > 0) {
+            using namespace osv::clock::literals;
+            tmr.set(timeout_ms * 1_ms);
         }
-        int r = do_poll(pollfds, timeout_ms);
-        if (r > 0) {
-            r = std::min(r, maxevents);
-            int remain = r;
-            for (size_t i = 0; i < pollfds.size() && remain;  i++) {
-                if (pollfds[i].revents) {
-                    --remain;
-                    assert(pollfds[i].fp);
-                    events[remain].data = map.at(pollfds[i].fp.get()).data;
-                    events[remain].events =
-                            events_poll_to_epoll(pollfds[i].revents);
-                    trace_epoll_ready(pollfds[i].fp.get(), pollfds[i].revents);
-                    if (pollfds[i].events & EPOLLET) {
-                        map.at(pollfds[i].fp.get()).last_poll_wake_count =
-                                pollfds[i].last_poll_wake_count;
-                    }
-                }
+        waiter w{sched::thread::current(), nullptr};
+        int nr = 0;
+        WITH_LOCK(_lock) {
+            add_waiter(w);
+            while (!(nr = process_ready(events, maxevents)) &&
+                    timeout_ms != 0 && !tmr.expired()) {
+                sched::thread::wait_until(_lock, [&] {
+                    return has_ready() || tmr.expired();
+                });
+            }
+            remove_waiter(w);
+        }
+        return nr;
+    }
+    // Called by wakers; see epoll_wake(). Only touches the registration
+    // and its epoll_activity, since the epoll_file may already be gone.
+    static void wake(epoll_registration* reg)
+    {
+        auto act = reg->act;
+        WITH_LOCK(act->lock) {
+            if (reg->removed || reg->ready_link.is_linked()) {
+                return;
+            }
+            trace_epoll_wake(act->epoll, reg->fp);
+            act->ready.push_back(*reg);
+            for (auto w = act->waiters; w; w = w->next) {
+                w->t->wake();
             }
         }
-        return r;
     }
 private:
-    void remove_me(file* fp) {
+    // Called with _lock held. Polls the files on the ready list, fills
+    // events, and returns the number of ready files found. Level-triggered
+    // files which were found ready stay on the list, so the next wait()
+    // reports them again if they are still ready.
+    int process_ready(struct epoll_event *events, int maxevents)
+    {
+        ready_list batch;
+        WITH_LOCK(_act->lock) {
+            batch.swap(_act->ready);
+        }
+        int nr = 0;
+        while (nr < maxevents) {
+            file* key;
+            int requested;
+            WITH_LOCK(_act->lock) {
+                if (batch.empty()) {
+                    break;
+                }
+                auto& reg = batch.front();
+                batch.pop_front();
+                key = reg.fp;
+                requested = events_epoll_to_poll(reg.event.events);
+            }
+            // A zero mask is a registration disabled by EPOLLONESHOT.
+            // The file is being closed if we can't get a reference to it;
+            // it will remove itself through epoll_file_closed().
+            if (!(requested & ~EPOLLET) || !fhold_if_positive(key)) {
+                continue;
+            }
+            // Once the registration is off the ready lists, any wakeup from
+            // here on puts it back, so we can't miss an event which races
+            // with the poll() below.
+            int revents;
+            DROP_LOCK(_lock) {
+                revents = key->poll(requested);
+                fdrop(key);
+            }
+            // The registration may have been modified or removed while we
+            // dropped the lock
+            auto i = map.find(key);
+            if (!revents || i == map.end()) {
+                continue;
+            }
+            auto reg = i->second;
+            // POSIX requires POLLOUT to be never set simultaneously with
+            // POLLHUP.
+            if (revents & POLLHUP) {
+                revents &= ~POLLOUT;
+            }
+            events[nr].data = reg->event.data;
+            events[nr].events = events_poll_to_epoll(revents);
+            ++nr;
+            trace_epoll_ready(key, revents);
+            if (reg->event.events & EPOLLONESHOT) {
+                reg->event.events &= EPOLL_FLAGS;
+            } else if (!(reg->event.events & EPOLLET)) {
+                wake(reg);
+            }
+        }
+        // Whatever we didn't get to because of maxevents is still ready.
+        WITH_LOCK(_act->lock) {
+            _act->ready.splice(_act->ready.begin(), batch);
+        }
+        return nr;
+    }
+    bool has_ready()
+    {
+        WITH_LOCK(_act->lock) {
+            return !_act->ready.empty();
+        }
+    }
+    void add_waiter(waiter& w)
+    {
+        WITH_LOCK(_act->lock) {
+            w.next = _act->waiters;
+            _act->waiters = &w;
+        }
+    }
+    void remove_waiter(waiter& w)
+    {
+        WITH_LOCK(_act->lock) {
+            auto p = &_act->waiters;
+            while (*p != &w) {
+                p = &(*p)->next;
+            }
+            *p = w.next;
+        }
+    }
+    // Called with _lock held; stops fp from waking this epoll.
+    void remove_me(file* fp, epoll_registration* reg) {
+        epoll_ptr ep{this, reg};
         WITH_LOCK(fp->f_lock) {
-            auto i = boost::range::find(*fp->f_epolls, this);
+            auto i = boost::range::find(*fp->f_epolls, ep);
             assert(i != fp->f_epolls->end());
             fp->f_epolls->erase(i);
         }
+        fp->epoll_del(ep);
+    }
+    // Wakers from an rcu read-side section (net channels) may still hold
+    // an epoll_ptr to reg, so it is only freed after a grace period; see
+    // also epoll_activity.
+    void dispose(epoll_registration* reg) {
+        WITH_LOCK(_act->lock) {
+            reg->removed = true;
+            reg->ready_link.unlink();
+        }
+        osv::rcu_dispose(reg);
     }
 };
 
@@ -195,6 +376,10 @@ int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
 
     int error = 0;
     fileref fp = fileref_from_fd(fd);
+    if (!fp) {
+        errno = EBADF;
+        return -1;
+    }
 
     switch (op) {
     case EPOLL_CTL_ADD:
@@ -236,9 +421,13 @@ int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout_
     return epo->wait(events, maxevents, timeout_ms);
 }
 
-void epoll_file_closed(file* epoll_fd, file* client)
+void epoll_file_closed(epoll_ptr ep, file* client)
+{
+    fileref epoll_ref(ep.epoll);
+    ep.epoll->del(client);
+}
+
+void epoll_wake(const epoll_ptr& ep)
 {
-    fileref epoll_ptr(epoll_fd);
-    auto epoll_obj = dynamic_cast<epoll_file*>(epoll_ptr.get());
-    epoll_obj->del(client);
+    epoll_file::wake(ep.reg);
 }
@@ -9,6 +9,7 @@
 #include <osv/trace.hh>
 #include <osv/sched.hh>
 #include <osv/wait_record.hh>
+#include "processor.hh"
 
 namespace lockfree {
 
@@ -19,6 +20,49 @@ TRACEPOINT(trace_mutex_try_lock, "%p, success=%d", mutex *, bool);
 TRACEPOINT(trace_mutex_unlock, "%p", mutex *);
 TRACEPOINT(trace_mutex_send_lock, "%p, wr=%p", mutex *, wait_record *);
 TRACEPOINT(trace_mutex_receive_lock, "%p", mutex *);
+TRACEPOINT(trace_mutex_lock_spin, "%p, spins=%u", mutex *, unsigned);
+TRACEPOINT(trace_mutex_lock_spin_fail, "%p, spins=%u", mutex *, unsigned);
+
+// How many rounds spin() waits for the lock before giving up and sleeping,
+// about a few microseconds, which is what going to sleep and being woken
+// up costs anyway.
+static constexpr unsigned spin_budget = 1000;
+
+// A lock held by a thread running on another cpu is usually released
+// within a short critical section, sooner than we could go to sleep and be
+// woken up. So before queuing ourselves, spin on the lock while its owner
+// runs. We give up early if others are queued, as the lock then goes to
+// them and not to us, or if the owner stopped running. Spinning doesn't
+// touch count, so a concurrent unlock() sees no waiter to hand off to.
+bool mutex::spin(sched::thread *current)
+{
+    if (sched::cpus.size() == 1) {
+        return false;
+    }
+    unsigned i;
+    for (i = 0; i < spin_budget; i++) {
+        int c = count.load(std::memory_order_relaxed);
+        if (c == 0) {
+            if (count.compare_exchange_weak(c, 1, std::memory_order_acquire)) {
+                owner.store(current, std::memory_order_relaxed);
+                depth = 1;
+                trace_mutex_lock_spin(this, i);
+                return true;
+            }
+        } else if (c > 1) {
+            break;
+        } else if (i % 16 == 0) {
+            // owner is null while a concurrent lock() is just taking it
+            auto o = owner.load(std::memory_order_relaxed);
+            if (o && !sched::is_running(o)) {
+                break;
+            }
+        }
+        processor::pause();
+    }
+    trace_mutex_lock_spin_fail(this, i);
+    return false;
+}
 
 void mutex::lock()
 {
@@ -26,7 +70,8 @@ void mutex::lock()
 
     sched::thread *current = sched::thread::current();
 
-    if (count.fetch_add(1, std::memory_order_acquire) == 0) {
+    int zero = 0;
+    if (count.compare_exchange_strong(zero, 1, std::memory_order_acquire)) {
         // Uncontended case (no other thread is holding the lock, and no
         // concurrent lock() attempts). We got the lock.
         // Setting count=1 already got us the lock; we set owner and depth
@@ -40,11 +85,21 @@ void mutex::lock()
     // a recursive mutex so it's possible the lock holder is us - in which
     // case we need to increment depth instead of waiting.
     if (owner.load(std::memory_order_relaxed) == current) {
-        count.fetch_add(-1, std::memory_order_relaxed);
         ++depth;
         return;
     }
 
+    if (spin(current)) {
+        return;
+    }
+
+    if (count.fetch_add(1, std::memory_order_acquire) == 0) {
+        // The lock was released since we last looked
+        owner.store(current, std::memory_order_relaxed);
+        depth = 1;
+        return;
+    }
+
     // If we're here still here the lock is owned by a different thread.
     // Put this thread in a waiting queue, so it will eventually be woken
     // when another thread releases the lock.
@@ -399,8 +399,24 @@ struct addr_cmp {
     }
 };
 
+struct size_cmp {
+    bool operator()(const page_range& fpr1, const page_range& fpr2) const {
+        return fpr1.size < fpr2.size || (fpr1.size == fpr2.size && &fpr1 < &fpr2);
+    }
+    // for lower_bound(size)
+    bool operator()(const page_range& fpr, size_t size) const {
+        return fpr.size < size;
+    }
+    bool operator()(size_t size, const page_range& fpr) const {
+        return size < fpr.size;
+    }
+};
+
 namespace bi = boost::intrusive;
 
+// Free memory is kept in two indexes of the same page ranges: by address,
+// to coalesce adjacent ranges when freeing, and by size, to find the best
+// fitting range for an allocation in O(log n).
 mutex free_page_ranges_lock;
 bi::set<page_range,
         bi::compare<addr_cmp>,
@@ -408,6 +424,40 @@ bi::set<page_range,
                        bi::set_member_hook<>,
                        &page_range::member_hook>
        > free_page_ranges __attribute__((init_priority((int)init_prio::fpranges)));
+bi::set<page_range,
+        bi::compare<size_cmp>,
+        bi::member_hook<page_range,
+                       bi::set_member_hook<>,
+                       &page_range::size_hook>
+       > free_page_ranges_by_size __attribute__((init_priority((int)init_prio::fpranges)));
+
+static void erase_page_range(page_range* range)
+{
+    free_page_ranges.erase(free_page_ranges.iterator_to(*range));
+    free_page_ranges_by_size.erase(free_page_ranges_by_size.iterator_to(*range));
+}
+
+// Shrink a free page range from its end, removing it if nothing is left
+static void resize_page_range(page_range* range, size_t size)
+{
+    if (!size) {
+        erase_page_range(range);
+        return;
+    }
+    free_page_ranges_by_size.erase(free_page_ranges_by_size.iterator_to(*range));
+    range->size = size;
+    free_page_ranges_by_size.insert(*range);
+}
+
+// The smallest free page range of at least size bytes
+static page_range* find_page_range(size_t size)
+{
+    auto i = free_page_ranges_by_size.lower_bound(size, size_cmp());
+    if (i == free_page_ranges_by_size.end()) {
+        return nullptr;
+    }
+    return &*i;
+}
 
 // Our notion of free memory is "whatever is in the page ranges". Therefore it
 // starts at 0, and increases as we add page ranges.
@@ -542,24 +592,22 @@ static void* malloc_large(size_t size)
         WITH_LOCK(free_page_ranges_lock) {
             reclaimer_thread.wait_for_minimum_memory();
 
-            for (auto i = free_page_ranges.begin(); i != free_page_ranges.end(); ++i) {
-                auto header = &*i;
+            auto header = find_page_range(size);
+            if (header) {
                 page_range* ret_header;
-                if (header->size >= size) {
-                    if (header->size == size) {
-                        free_page_ranges.erase(i);
-                        ret_header = header;
-                    } else {
-                        void *v = header;
-                        header->size -= size;
-                        ret_header = new (v + header->size) page_range(size);
-                    }
-                    on_alloc(size);
-                    void* obj = ret_header;
-                    obj += page_size;
-                    trace_memory_malloc_large(obj, size);
-                    return obj;
+                if (header->size == size) {
+                    erase_page_range(header);
+                    ret_header = header;
+                } else {
+                    void *v = header;
+                    resize_page_range(header, header->size - size);
+                    ret_header = new (v + header->size) page_range(size);
                 }
+                on_alloc(size);
+                void* obj = ret_header;
+                obj += page_size;
+                trace_memory_malloc_large(obj, size);
+                return obj;
             }
             reclaimer_thread.wait_for_memory(size);
         }
@@ -705,20 +753,6 @@ void reclaimer::_do_reclaim()
     }
 }
 
-static page_range* merge(page_range* a, page_range* b)
-{
-    void* va = a;
-    void* vb = b;
-
-    if (va + a->size == vb) {
-        a->size += b->size;
-        free_page_ranges.erase(*b);
-        return a;
-    } else {
-        return b;
-    }
-}
-
 // Return a page range back to free_page_ranges. Note how the size of the
 // page range is range->size, but its start is at range itself.
 static void free_page_range_locked(page_range *range)
@@ -727,12 +761,25 @@ static void free_page_range_locked(page_range *range)
 
     on_free(range->size);
 
+    // Coalesce with the neighbours, and only then index by the final size
     if (i != free_page_ranges.begin()) {
-        i = free_page_ranges.iterator_to(*merge(&*boost::prior(i), &*i));
+        auto prev = &*std::prev(i);
+        if (static_cast<void*>(prev) + prev->size == static_cast<void*>(range)) {
+            free_page_ranges_by_size.erase(free_page_ranges_by_size.iterator_to(*prev));
+            prev->size += range->size;
+            free_page_ranges.erase(i);
+            range = prev;
+            i = free_page_ranges.iterator_to(*range);
+        }
     }
-    if (boost::next(i) != free_page_ranges.end()) {
-        merge(&*i, &*boost::next(i));
+    if (std::next(i) != free_page_ranges.end()) {
+        auto next = &*std::next(i);
+        if (static_cast<void*>(range) + range->size == static_cast<void*>(next)) {
+            erase_page_range(next);
+            range->size += next->size;
+        }
     }
+    free_page_ranges_by_size.insert(*range);
 }
 
 // Return a page range back to free_page_ranges. Note how the size of the
@@ -790,17 +837,16 @@ static void refill_page_buffer()
             auto limit = (pbuf.max + 1) / 2;
 
             while (pbuf.nr < limit) {
-                auto it = free_page_ranges.begin();
-                if (it == free_page_ranges.end())
+                // Take pages from the smallest ranges, keeping the large
+                // ones for large allocations.
+                auto it = free_page_ranges_by_size.begin();
+                if (it == free_page_ranges_by_size.end())
                     break;
                 auto p = &*it;
                 auto size = std::min(p->size, (limit - pbuf.nr) * page_size);
-                p->size -= size;
                 total_size += size;
+                resize_page_range(p, p->size - size);
                 void* pages = static_cast<void*>(p) + p->size;
-                if (!p->size) {
-                    free_page_ranges.erase(*p);
-                }
                 while (size) {
                     pbuf.free[pbuf.nr++] = pages;
                     pages += page_size;
@@ -860,13 +906,10 @@ static void* early_alloc_page()
             abort("alloc_page(): out of memory\n");
         }
 
-        auto p = &*free_page_ranges.begin();
-        p->size -= page_size;
+        auto p = &*free_page_ranges_by_size.begin();
+        resize_page_range(p, p->size - page_size);
         on_alloc(page_size);
         void* page = static_cast<void*>(p) + p->size;
-        if (!p->size) {
-            free_page_ranges.erase(*p);
-        }
         return page;
     }
 }
@@ -924,55 +967,77 @@ void free_page(void* v)
 void* alloc_huge_page(size_t N)
 {
     WITH_LOCK(free_page_ranges_lock) {
-        for (auto i = free_page_ranges.begin(); i != free_page_ranges.end(); ++i) {
-            page_range *range = &*i;
-            if (range->size < N)
-                continue;
-            intptr_t v = (intptr_t) range;
+        // A page range of 2N - page_size bytes always contains an aligned
+        // block of N bytes; a smaller one may or may not, depending on its
+        // alignment. Look at a few of the smaller ranges first, which fit
+        // more tightly, then take the smallest range that surely fits.
+        constexpr unsigned max_tries = 16;
+        const size_t surely_fits = 2 * N - page_size;
+        page_range* range = nullptr;
+        intptr_t ret = 0;
+        unsigned tries = 0;
+        for (auto i = free_page_ranges_by_size.lower_bound(N, size_cmp());
+                i != free_page_ranges_by_size.end() && i->size < surely_fits
+                        && tries < max_tries;
+                ++i, ++tries) {
+            intptr_t v = (intptr_t) &*i;
             // Find the the beginning of the last aligned area in the given
             // page range. This will be our return value:
-            intptr_t ret = (v+range->size-N) & ~(N-1);
-            if (ret<v)
-                continue;
-            // endsize is the number of bytes in the page range *after* the
-            // N bytes we will return. calculate it before changing header->size
-            int endsize = v+range->size-ret-N;
-            // Make the original page range smaller, pointing to the part before
-            // our ret (if there's nothing before, remove this page range)
-            size_t alloc_size;
-            if (ret==v) {
-                alloc_size = range->size;
-                free_page_ranges.erase(*range);
-            } else {
-                // Note that this is is done conditionally because we are
-                // operating page ranges. That is what is left on our page
-                // ranges, so that is what we bill. It doesn't matter that we
-                // are currently allocating "N" bytes.  The difference will be
-                // later on wiped by the on_free() call that exists within
-                // free_page_range in the conditional right below us.
-                alloc_size = range->size - (ret - v);
-                range->size = ret-v;
+            ret = (v+i->size-N) & ~(N-1);
+            if (ret >= v) {
+                range = &*i;
+                break;
             }
-            on_alloc(alloc_size);
-
-            // Create a new page range for the endsize part (if there is one)
-            if (endsize > 0) {
-                void *e = (void *)(ret+N);
-                free_page_range(e, endsize);
+        }
+        if (!range) {
+            range = find_page_range(surely_fits);
+            if (range) {
+                intptr_t v = (intptr_t) range;
+                ret = (v+range->size-N) & ~(N-1);
             }
-            // Return the middle 2MB part
-            return (void*) ret;
-            // TODO: consider using tracker.remember() for each one of the small
-            // pages allocated. However, this would be inefficient, and since we
-            // only use alloc_huge_page in one place, maybe not worth it.
         }
-        // Definitely a sign we are somewhat short on memory. It doesn't *mean* we
-        // are, because that might be just fragmentation. But we wake up the reclaimer
-        // just to be sure, and if this is not real pressure, it will just go back to
-        // sleep
-        reclaimer_thread.wake();
-        trace_memory_huge_failure(free_page_ranges.size());
-        return nullptr;
+        if (!range) {
+            // Definitely a sign we are somewhat short on memory. It doesn't *mean* we
+            // are, because that might be just fragmentation. But we wake up the reclaimer
+            // just to be sure, and if this is not real pressure, it will just go back to
+            // sleep
+            reclaimer_thread.wake();
+            trace_memory_huge_failure(free_page_ranges.size());
+            return nullptr;
+        }
+
+        intptr_t v = (intptr_t) range;
+        // endsize is the number of bytes in the page range *after* the
+        // N bytes we will return. calculate it before changing header->size
+        size_t endsize = v+range->size-ret-N;
+        // Make the original page range smaller, pointing to the part before
+        // our ret (if there's nothing before, remove this page range)
+        size_t alloc_size;
+        if (ret==v) {
+            alloc_size = range->size;
+            erase_page_range(range);
+        } else {
+            // Note that this is is done conditionally because we are
+            // operating page ranges. That is what is left on our page
+            // ranges, so that is what we bill. It doesn't matter that we
+            // are currently allocating "N" bytes.  The difference will be
+            // later on wiped by the on_free() call that exists within
+            // free_page_range in the conditional right below us.
+            alloc_size = range->size - (ret - v);
+            resize_page_range(range, ret-v);
+        }
+        on_alloc(alloc_size);
+
+        // Create a new page range for the endsize part (if there is one)
+        if (endsize > 0) {
+            void *e = (void *)(ret+N);
+            free_page_range_locked(new (e) page_range(endsize));
+        }
+        // Return the middle 2MB part
+        return (void*) ret;
+        // TODO: consider using tracker.remember() for each one of the small
+        // pages allocated. However, this would be inefficient, and since we
+        // only use alloc_huge_page in one place, maybe not worth it.
     }
 }
 
@@ -25,6 +25,7 @@
 #include "arch-mmu.hh"
 #include <stack>
 #include "java/jvm_balloon.hh"
+#include <osv/pagecache.hh>
 
 extern void* elf_start;
 extern size_t elf_size;
@@ -176,6 +177,8 @@ struct map_page_ops {
     virtual void free(void *addr, uintptr_t offset) = 0;
     virtual void free(void *addr, size_t size, uintptr_t offset) = 0;
     virtual void finalize() = 0;
+    // A page shared with other mappings, which must not be made writable
+    virtual bool is_shared(void *addr) { return false; }
     virtual ~map_page_ops() {}
 };
 
@@ -473,7 +476,12 @@ public:
         if (!ptep.read().empty()) {
             return;
         }
-        phys page = virt_to_phys(_pops->alloc(offset));
+        void *vpage = _pops->alloc(offset);
+        if (!vpage) {
+            // out of memory: leave the page unmapped, see file_vma::fault()
+            return;
+        }
+        phys page = virt_to_phys(vpage);
         if (!ptep.compare_exchange(make_empty_pte(), dirty(make_normal_pte(page, perm)))) {
             _pops->free(phys_to_virt(page), offset);
         } else {
@@ -574,10 +582,18 @@ class protection : public vma_operation<allocate_intermediate_opt::no, skip_empt
 private:
     unsigned int perm;
     bool do_flush;
+    map_page_ops* _pops;
 public:
-    protection(unsigned int perm) : perm(perm), do_flush(false) { }
+    protection(unsigned int perm, map_page_ops* pops = nullptr)
+        : perm(perm), do_flush(false), _pops(pops) { }
     void small_page(hw_ptep ptep, uintptr_t offset) {
-        do_flush |= change_perm(ptep, perm);
+        auto p = perm;
+        if ((p & perm_write) && _pops &&
+                _pops->is_shared(phys_to_virt(ptep.read().addr(false)))) {
+            // will be copied on the first write
+            p &= ~perm_write;
+        }
+        do_flush |= change_perm(ptep, p);
     }
     bool huge_page(hw_ptep ptep, uintptr_t offset) {
         do_flush |= change_perm(ptep, perm);
@@ -756,7 +772,7 @@ static error protect(void *addr, size_t size, unsigned int perm)
         i->split(start);
         if (contains(start, end, *i)) {
             i->protect(perm);
-            i->operate_range(protection(perm));
+            i->operate_range(protection(perm, i->page_ops()));
         }
     }
     return no_error();
@@ -919,6 +935,144 @@ public:
     }
 };
 
+// Private mappings of regular files map the pages of the page cache, so all
+// of them share a single copy of the pages they don't write to. The pages are
+// mapped read-only, and copied on the first write by cow_page.
+class map_file_page_cached : public map_page_ops {
+private:
+    file *_file;
+    struct vnode *_vp;
+    f_offset _foffset;
+    // pages just added to the cache, to be read in by finalize()
+    std::vector<std::pair<void*, f_offset>> _fill;
+    // the cache had no memory for a page
+    bool _out_of_memory = false;
+public:
+    map_file_page_cached(file *file, f_offset foffset) :
+        _file(file), _vp(file->f_dentry->d_vnode), _foffset(foffset) {}
+    virtual void* alloc(uintptr_t offset) override {
+        bool must_fill;
+        auto page = pagecache::get(_vp, _foffset + offset, must_fill);
+        if (!page) {
+            _out_of_memory = true;
+            return nullptr;
+        }
+        if (must_fill) {
+            _fill.emplace_back(page, _foffset + offset);
+        }
+        return page;
+    }
+    virtual void* alloc(size_t size, uintptr_t offset) override {
+        // the cache only has small pages, populate() falls back to them
+        return nullptr;
+    }
+    virtual void free(void *addr, uintptr_t offset) override {
+        if (!pagecache::release(addr)) {
+            memory::free_page(addr);
+        }
+    }
+    virtual void free(void *addr, size_t size, uintptr_t offset) override {
+        memory::free_huge_page(addr, size);
+    }
+    virtual bool is_shared(void *addr) override {
+        return pagecache::is_cached(addr);
+    }
+    // Whether we ran out of memory since the last call. Faults are
+    // serialized by vma_list_mutex, so this is about the current fault.
+    bool out_of_memory() {
+        bool ret = _out_of_memory;
+        _out_of_memory = false;
+        return ret;
+    }
+    void set_out_of_memory() {
+        _out_of_memory = true;
+    }
+    virtual void finalize() override {
+        // one read for each run of consecutive pages
+        for (size_t i = 0, j; i < _fill.size(); i = j) {
+            std::vector<iovec> iov;
+            for (j = i; j < _fill.size() &&
+                    _fill[j].second == _fill[i].second + (j - i) * page_size; ++j) {
+                iov.push_back(iovec{_fill[j].first, page_size});
+            }
+            ssize_t len = iov.size() * page_size;
+            uio data{iov.data(), int(iov.size()), off_t(_fill[i].second), len, UIO_READ};
+            auto error = _file->read(&data, FOF_OFFSET);
+            /* zero buffer tail on a short read */
+            size_t done = len - data.uio_resid;
+            for (auto& v : iov) {
+                auto skip = std::min(done, page_size);
+                memset(static_cast<char*>(v.iov_base) + skip, 0, page_size - skip);
+                done -= skip;
+                pagecache::filled(v.iov_base);
+            }
+            if (error) {
+                // don't keep the zeroes cached
+                pagecache::invalidate(_vp, _fill[i].second, _fill[i].second + len);
+            }
+        }
+        _fill.clear();
+    }
+};
+
+/*
+ * Handle a write fault on a private file mapping: replace the page shared
+ * with the page cache (reading it in first, if it wasn't mapped yet) with a
+ * private, writable copy.
+ */
+class cow_page : public vma_operation<allocate_intermediate_opt::yes, skip_empty_opt::no> {
+private:
+    map_file_page_cached* _pops;
+    unsigned int _perm;
+    bool _do_flush = false;
+    void* _shared = nullptr;
+    uintptr_t _offset = 0;
+public:
+    cow_page(map_file_page_cached* pops, unsigned int perm) : _pops(pops), _perm(perm) {}
+    void small_page(hw_ptep ptep, uintptr_t offset) {
+        pt_element pte = ptep.read();
+        void* shared;
+        if (pte.empty()) {
+            shared = _pops->alloc(offset);
+            _pops->finalize();
+            if (!shared) {
+                return;
+            }
+        } else {
+            shared = phys_to_virt(pte.addr(false));
+            if (!_pops->is_shared(shared)) {
+                return;
+            }
+            _do_flush = true;
+        }
+        void* page = memory::alloc_page();
+        if (!page) {
+            // leave the shared page mapped read-only, the write faults again
+            if (pte.empty()) {
+                _pops->free(shared, offset);
+            }
+            _pops->set_out_of_memory();
+            return;
+        }
+        memcpy(page, shared, page_size);
+        pte = make_normal_pte(virt_to_phys(page), _perm);
+        pte.set_dirty(true);
+        ptep.write(pte);
+        // dropped once no cpu can still be using it
+        _shared = shared;
+        _offset = offset;
+    }
+    bool huge_page(hw_ptep ptep, uintptr_t offset) {
+        return false;
+    }
+    bool tlb_flush_needed(void) { return _do_flush; }
+    void finalize() {
+        if (_shared) {
+            _pops->free(_shared, _offset);
+        }
+    }
+};
+
 uintptr_t allocate(vma *v, uintptr_t start, size_t size, bool search)
 {
     if (search) {
@@ -991,7 +1145,7 @@ void* map_file(void* addr, size_t size, unsigned flags, unsigned perm,
         v = (void*) allocate(vma, start, asize, search);
         if (flags & mmap_populate) {
             map = vma->page_ops();
-            vma->operate_range(populate<>(map, perm, vma->map_dirty()), v, asize);
+            vma->operate_range(populate<>(map, vma->populate_perm(), vma->map_dirty()), v, asize);
         }
     }
     // call finalize outside of the lock so the file read will not happen under it
@@ -1186,7 +1340,7 @@ void vma::fault(uintptr_t addr, exception_frame *ef)
     }
 
     map_page_ops *map = page_ops();
-    auto total = operate_range(populate<account_opt::yes>(map, _perm, map_dirty()), (void*)addr, size);
+    auto total = operate_range(populate<account_opt::yes>(map, populate_perm(), map_dirty()), (void*)addr, size);
     map->finalize();
 
     if (_flags & mmap_jvm_heap) {
@@ -1199,6 +1353,11 @@ map_page_ops* vma::page_ops()
     return _page_ops;
 }
 
+unsigned vma::populate_perm()
+{
+    return _perm;
+}
+
 static map_anon_page_noinit page_ops_noinit;
 static map_anon_page page_ops_init;
 static map_page_ops *page_ops_noinitp = &page_ops_noinit, *page_ops_initp = &page_ops_init;
@@ -1318,6 +1477,7 @@ file_vma::file_vma(addr_range range, unsigned perm, fileref file, f_offset offse
     , _file(file)
     , _offset(offset)
     , _shared(shared)
+    , _cached(!shared && file->f_dentry && file->f_dentry->d_vnode->v_type == VREG)
 {
     int err = validate_perm(perm);
 
@@ -1325,7 +1485,11 @@ file_vma::file_vma(addr_range range, unsigned perm, fileref file, f_offset offse
         throw make_error(err);
     }
 
-    _page_ops = new map_file_page(_file.get(), ::size(_file), _offset, size());
+    if (_cached) {
+        _page_ops = new map_file_page_cached(_file.get(), _offset);
+    } else {
+        _page_ops = new map_file_page(_file.get(), ::size(_file), _offset, size());
+    }
 }
 
 file_vma::~file_vma()
@@ -1333,6 +1497,33 @@ file_vma::~file_vma()
     delete _page_ops;
 }
 
+void file_vma::fault(uintptr_t addr, exception_frame *ef)
+{
+    if (!_cached) {
+        vma::fault(addr, ef);
+        return;
+    }
+    auto pops = static_cast<map_file_page_cached*>(_page_ops);
+    // forget failures of an earlier populate
+    pops->out_of_memory();
+    if (ef->error_code & page_fault_write) {
+        operate_range(cow_page(pops, _perm), (void*)addr, page_size);
+    } else {
+        vma::fault(addr, ef);
+    }
+    // The page cache had no memory for the page: fail the access, rather
+    // than fault on it forever
+    if (pops->out_of_memory()) {
+        osv::handle_bus_error(addr, ef);
+    }
+}
+
+unsigned file_vma::populate_perm()
+{
+    // catch the first write to a page of the page cache, see cow_page
+    return _cached ? _perm & ~perm_write : _perm;
+}
+
 void file_vma::split(uintptr_t edge)
 {
     if (edge <= _range.start() || edge >= _range.end()) {
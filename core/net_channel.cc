@@ -6,6 +6,7 @@
  */
 
 #include <osv/net_channel.hh>
+#include <osv/file.h>
 #include <osv/poll.h>
 #include <bsd/sys/sys/mbuf.h>
 #include <bsd/sys/net/ethernet.h>
@@ -15,6 +16,10 @@
 #include <bsd/sys/net/ethernet.h>
 
 #include <osv/debug.hh>
+#include <algorithm>
+#include <osv/trace.hh>
+
+TRACEPOINT(trace_classifier_flush, "packets=%u wakes=%u", unsigned, unsigned);
 
 std::ostream& operator<<(std::ostream& os, in_addr ia)
 {
@@ -39,11 +44,17 @@ void net_channel::process_queue()
 void net_channel::wake_pollers()
 {
     WITH_LOCK(osv::rcu_read_lock) {
-        auto& pl = *_pollers.read();
-        for (pollreq* pr : pl) {
-            // net_channel is self synchronizing
-            pr->_awake.store(true, std::memory_order_relaxed);
-            pr->_poll_thread->wake();
+        if (auto pl = _pollers.read()) {
+            for (pollreq* pr : *pl) {
+                // net_channel is self synchronizing
+                pr->_awake.store(true, std::memory_order_relaxed);
+                pr->_poll_thread->wake();
+            }
+        }
+        if (auto el = _epollers.read()) {
+            for (auto&& ep : *el) {
+                epoll_wake(ep);
+            }
         }
     }
 }
@@ -76,39 +87,58 @@ void net_channel::del_poller(pollreq& pr)
     }
 }
 
+void net_channel::add_epoll(const epoll_ptr& ep)
+{
+    WITH_LOCK(_pollers_mutex) {
+        auto old = _epollers.read_by_owner();
+        std::unique_ptr<std::vector<epoll_ptr>> neww{new std::vector<epoll_ptr>};
+        if (old) {
+            *neww = *old;
+        }
+        neww->push_back(ep);
+        _epollers.assign(neww.release());
+        osv::rcu_dispose(old);
+    }
+}
+
+void net_channel::del_epoll(const epoll_ptr& ep)
+{
+    WITH_LOCK(_pollers_mutex) {
+        auto old = _epollers.read_by_owner();
+        std::unique_ptr<std::vector<epoll_ptr>> neww{new std::vector<epoll_ptr>};
+        if (old) {
+            *neww = *old;
+        }
+        neww->erase(std::remove(neww->begin(), neww->end(), ep), neww->end());
+        _epollers.assign(neww.release());
+        osv::rcu_dispose(old);
+    }
+}
+
 classifier::classifier()
-    : _ipv4_tcp_channels(new ipv4_tcp_channels)
 {
 }
 
 void classifier::add(ipv4_tcp_conn_id id, net_channel* channel)
 {
     WITH_LOCK(_mtx) {
-        auto old = _ipv4_tcp_channels.read_by_owner();
-        std::unique_ptr<ipv4_tcp_channels> neww{new ipv4_tcp_channels(*old)};
-        neww->emplace(id, channel);
-        _ipv4_tcp_channels.assign(neww.release());
-        osv::rcu_dispose(old);
+        _ipv4_tcp_channels.insert(id, channel);
     }
 }
 
 void classifier::remove(ipv4_tcp_conn_id id)
 {
     WITH_LOCK(_mtx) {
-        auto old = _ipv4_tcp_channels.read_by_owner();
-        std::unique_ptr<ipv4_tcp_channels> neww{new ipv4_tcp_channels(*old)};
-        neww->erase(id);
-        _ipv4_tcp_channels.assign(neww.release());
-        osv::rcu_dispose(old);
+        _ipv4_tcp_channels.erase(id);
     }
 }
 
 bool classifier::post_packet(mbuf* m)
 {
     WITH_LOCK(osv::rcu_read_lock) {
-        if (auto nc = classify_ipv4_tcp(m)) {
+        ipv4_tcp_conn_id id;
+        if (auto nc = classify_ipv4_tcp(m, id)) {
             nc->push(m);
-            // FIXME: find a way to batch wakes
             nc->wake();
             return true;
         }
@@ -116,8 +146,53 @@ bool classifier::post_packet(mbuf* m)
     return false;
 }
 
+bool classifier::post_packet(mbuf* m, wake_batch& wakes)
+{
+    WITH_LOCK(osv::rcu_read_lock) {
+        ipv4_tcp_conn_id id;
+        if (auto nc = classify_ipv4_tcp(m, id)) {
+            nc->push(m);
+            ++wakes._packets;
+            auto end = wakes._channels.begin() + wakes._nr;
+            if (std::find(wakes._channels.begin(), end, nc) != end) {
+                return true;
+            }
+            if (wakes._nr < wakes.max_channels) {
+                // found under rcu, so not freed yet
+                nc->hold();
+                wakes._channels[wakes._nr++] = nc;
+            } else {
+                // too many flows in this burst; don't defer this one
+                nc->wake();
+                ++wakes._wakes;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void classifier::flush(wake_batch& wakes)
+{
+    if (!wakes._packets) {
+        return;
+    }
+    for (unsigned i = 0; i < wakes._nr; i++) {
+        // The channel may have been removed since its packets were pushed,
+        // but its consumer may still be draining it.
+        auto nc = wakes._channels[i];
+        nc->wake();
+        nc->release();
+        ++wakes._wakes;
+    }
+    trace_classifier_flush(wakes._packets, wakes._wakes);
+    wakes._nr = 0;
+    wakes._packets = 0;
+    wakes._wakes = 0;
+}
+
 // must be called with rcu lock held
-net_channel* classifier::classify_ipv4_tcp(mbuf* m)
+net_channel* classifier::classify_ipv4_tcp(mbuf* m, ipv4_tcp_conn_id& id)
 {
     caddr_t h = m->m_hdr.mh_data;
     if (unsigned(m->m_hdr.mh_len) < ETHER_HDR_LEN + sizeof(ip)) {
@@ -148,11 +223,10 @@ net_channel* classifier::classify_ipv4_tcp(mbuf* m)
     }
     auto src_port = ntohs(tcp_hdr->th_sport);
     auto dst_port = ntohs(tcp_hdr->th_dport);
-    auto id = ipv4_tcp_conn_id{src_addr, dst_addr, src_port, dst_port};
-    auto ht = _ipv4_tcp_channels.read();
-    auto i = ht->find(id);
-    if (i == ht->end()) {
+    id = ipv4_tcp_conn_id{src_addr, dst_addr, src_port, dst_port};
+    auto nc = _ipv4_tcp_channels.find(id);
+    if (!nc) {
         return nullptr;
     }
-    return i->second;
+    return *nc;
 }
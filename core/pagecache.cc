@@ -0,0 +1,349 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#include <osv/pagecache.hh>
+#include <osv/mempool.hh>
+#include <osv/mutex.h>
+#include <osv/condvar.h>
+#include <osv/align.hh>
+#include <osv/types.h>
+#include <osv/vnode.h>
+#include <boost/intrusive/set.hpp>
+#include <boost/intrusive/list.hpp>
+#include <memory>
+#include <utility>
+#include <stdio.h>
+
+namespace bi = boost::intrusive;
+
+using memory::page_size;
+
+namespace pagecache {
+
+struct cached_page {
+    cached_page(struct vnode* vp, off_t offset, void* page)
+        : vp(vp), offset(offset), page(page) {}
+    struct vnode* vp;
+    off_t offset;
+    void* page;
+    // mappings of the page, and callers of get() not done with it yet
+    unsigned refs = 0;
+    // can be found by get()
+    bool hashed = false;
+    bool uptodate = false;
+    // the page belongs to the file system (see get_borrowed()), and is not
+    // ours to free
+    bool borrowed = false;
+    bi::set_member_hook<> index_hook;
+    bi::set_member_hook<> page_hook;
+    bi::list_member_hook<> lru_hook;
+};
+
+typedef std::pair<struct vnode*, off_t> index_key;
+
+struct index_compare {
+    static index_key key(const cached_page& cp) {
+        return index_key(cp.vp, cp.offset);
+    }
+    bool operator()(const cached_page& a, const cached_page& b) const {
+        return key(a) < key(b);
+    }
+    bool operator()(const cached_page& a, const index_key& b) const {
+        return key(a) < b;
+    }
+    bool operator()(const index_key& a, const cached_page& b) const {
+        return a < key(b);
+    }
+};
+
+struct page_compare {
+    bool operator()(const cached_page& a, const cached_page& b) const {
+        return a.page < b.page;
+    }
+    bool operator()(const cached_page& a, const void* b) const {
+        return a.page < b;
+    }
+    bool operator()(const void* a, const cached_page& b) const {
+        return a < b.page;
+    }
+};
+
+typedef bi::list<cached_page,
+                 bi::member_hook<cached_page, bi::list_member_hook<>,
+                                 &cached_page::lru_hook>> page_list;
+
+// Nothing is allocated with the lock held, so that the allocator may call
+// our shrinker.
+static mutex lock;
+static condvar fill_done;
+// hashed pages, by vnode and offset
+static bi::set<cached_page,
+               bi::member_hook<cached_page, bi::set_member_hook<>,
+                               &cached_page::index_hook>,
+               bi::compare<index_compare>> index;
+// all pages, hashed or not, by address
+static bi::set<cached_page,
+               bi::member_hook<cached_page, bi::set_member_hook<>,
+                               &cached_page::page_hook>,
+               bi::compare<page_compare>> pages;
+// hashed pages which are not mapped, least recently used first
+static page_list lru;
+static u64 hits, misses, evictions, lent;
+
+static void free_pages(page_list& victims)
+{
+    while (!victims.empty()) {
+        auto& cp = victims.front();
+        victims.pop_front();
+        if (!cp.borrowed) {
+            memory::free_page(cp.page);
+        }
+        delete &cp;
+    }
+}
+
+// Returns true if the page is now unused, and has to be freed
+static bool unhash(cached_page& cp)
+{
+    index.erase(index.iterator_to(cp));
+    cp.hashed = false;
+    __atomic_sub_fetch(&cp.vp->v_npages, 1, __ATOMIC_SEQ_CST);
+    if (cp.lru_hook.is_linked()) {
+        lru.erase(lru.iterator_to(cp));
+    }
+    if (cp.refs) {
+        return false;
+    }
+    pages.erase(pages.iterator_to(cp));
+    return true;
+}
+
+class pagecache_shrinker : public memory::shrinker {
+public:
+    pagecache_shrinker() : shrinker("pagecache") {}
+    virtual size_t request_memory(size_t n);
+    virtual size_t release_memory(size_t n) { return 0; }
+};
+
+size_t pagecache_shrinker::request_memory(size_t n)
+{
+    page_list victims;
+    size_t freed = 0;
+    WITH_LOCK(lock) {
+        while (freed < n && !lru.empty()) {
+            auto& cp = lru.front();
+            unhash(cp);
+            victims.push_back(cp);
+            if (!cp.borrowed) {
+                freed += page_size;
+            }
+            ++evictions;
+        }
+    }
+    free_pages(victims);
+    return freed;
+}
+
+// Takes a reference to a page found in the index, with the lock held
+static void* hit(cached_page& cp)
+{
+    if (cp.refs++ == 0 && cp.lru_hook.is_linked()) {
+        lru.erase(lru.iterator_to(cp));
+    }
+    ++hits;
+    return cp.page;
+}
+
+// File systems which keep whole pages (ramfs) lend them to the cache as
+// they are, instead of having them copied into a page of our own. The
+// vnode lock keeps the file system from dropping the page until it is
+// indexed; from then on, the file system calls adopt() before freeing it.
+//
+// release() and adopt() know a page only by its address, so a page is lent
+// at most once: if it is already here under another vnode (one the file
+// system dropped while the page was still mapped, say), the new mapping
+// shares that entry.
+static void* get_borrowed(struct vnode* vp, off_t offset)
+{
+    std::unique_ptr<cached_page> fresh(new cached_page(vp, offset, nullptr));
+    void* page = nullptr;
+    vn_lock(vp);
+    if (VOP_GETPAGE(vp, offset, &fresh->page) == 0) {
+        WITH_LOCK(lock) {
+            auto i = index.find(index_key(vp, offset), index_compare());
+            auto lent_page = pages.find(fresh->page, page_compare());
+            if (i == index.end() && lent_page != pages.end()) {
+                assert(lent_page->borrowed);
+                page = hit(*lent_page);
+            } else if (i == index.end()) {
+                auto cp = fresh.release();
+                cp->hashed = true;
+                cp->uptodate = true;
+                cp->borrowed = true;
+                cp->refs = 1;
+                index.insert(*cp);
+                pages.insert(*cp);
+                __atomic_add_fetch(&vp->v_npages, 1, __ATOMIC_SEQ_CST);
+                ++lent;
+                page = cp->page;
+            } else if (i->uptodate) {
+                page = hit(*i);
+            }
+            // else someone is reading it in, let get() wait for them
+        }
+    }
+    vn_unlock(vp);
+    return page;
+}
+
+void* get(struct vnode* vp, off_t offset, bool& must_fill)
+{
+    must_fill = false;
+    if (vp->v_op->vop_getpage) {
+        if (auto page = get_borrowed(vp, offset)) {
+            return page;
+        }
+    }
+    std::unique_ptr<cached_page> fresh;
+    while (true) {
+        WITH_LOCK(lock) {
+            auto i = index.find(index_key(vp, offset), index_compare());
+            if (i != index.end() && !i->uptodate) {
+                // someone else is reading it in
+                fill_done.wait(&lock);
+                continue;
+            }
+            if (i != index.end()) {
+                must_fill = false;
+                if (fresh) {
+                    memory::free_page(fresh->page);
+                }
+                return hit(*i);
+            }
+            if (fresh) {
+                auto cp = fresh.release();
+                cp->hashed = true;
+                cp->refs = 1;
+                index.insert(*cp);
+                pages.insert(*cp);
+                __atomic_add_fetch(&vp->v_npages, 1, __ATOMIC_SEQ_CST);
+                ++misses;
+                must_fill = true;
+                return cp->page;
+            }
+        }
+        static pagecache_shrinker* shrinker = new pagecache_shrinker;
+        (void)shrinker;
+        auto page = memory::alloc_page();
+        if (!page) {
+            return nullptr;
+        }
+        fresh.reset(new cached_page(vp, offset, page));
+    }
+}
+
+void filled(void* page)
+{
+    WITH_LOCK(lock) {
+        auto i = pages.find(page, page_compare());
+        assert(i != pages.end());
+        i->uptodate = true;
+        if (!i->refs && i->hashed) {
+            lru.push_back(*i);
+        }
+        fill_done.wake_all();
+    }
+}
+
+bool release(void* page)
+{
+    page_list victims;
+    WITH_LOCK(lock) {
+        auto i = pages.find(page, page_compare());
+        if (i == pages.end()) {
+            return false;
+        }
+        assert(i->refs);
+        if (--i->refs == 0) {
+            if (!i->hashed) {
+                auto& cp = *i;
+                pages.erase(i);
+                victims.push_back(cp);
+            } else if (i->uptodate) {
+                lru.push_back(*i);
+            }
+        }
+    }
+    free_pages(victims);
+    return true;
+}
+
+bool is_cached(void* page)
+{
+    WITH_LOCK(lock) {
+        return pages.find(page, page_compare()) != pages.end();
+    }
+}
+
+bool adopt(void* page)
+{
+    WITH_LOCK(lock) {
+        auto i = pages.find(page, page_compare());
+        if (i == pages.end()) {
+            return false;
+        }
+        auto& cp = *i;
+        assert(cp.borrowed);
+        if (cp.hashed) {
+            unhash(cp);
+        }
+        if (!cp.refs) {
+            // unhash() took it out of pages
+            delete &cp;
+            return false;
+        }
+        // still mapped, we free it when it's unmapped
+        cp.borrowed = false;
+        return true;
+    }
+}
+
+void invalidate(struct vnode* vp, off_t offset, off_t end)
+{
+    // Saves taking the lock on every write to a file which is not mapped.
+    // A page added concurrently is being read after the file changed.
+    if (!__atomic_load_n(&vp->v_npages, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+    page_list victims;
+    WITH_LOCK(lock) {
+        auto i = index.lower_bound(index_key(vp, align_down(offset, off_t(page_size))),
+                                   index_compare());
+        while (i != index.end() && i->vp == vp && i->offset < end) {
+            auto& cp = *i++;
+            if (unhash(cp)) {
+                victims.push_back(cp);
+            }
+        }
+    }
+    free_pages(victims);
+}
+
+std::string procfs_stats()
+{
+    char buf[256];
+    WITH_LOCK(lock) {
+        snprintf(buf, sizeof(buf),
+                "pages %zu\nhashed %zu\nunused %zu\nhits %lu\nmisses %lu\n"
+                "evictions %lu\nlent %lu\n",
+                pages.size(), index.size(), lru.size(), hits, misses,
+                evictions, lent);
+    }
+    return buf;
+}
+
+}
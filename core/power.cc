@@ -9,6 +9,7 @@
 #include <osv/debug.hh>
 #include <smp.hh>
 #include <processor.hh>
+#include <drivers/console.hh>
 
 extern "C" {
 #include "acpi.h"
@@ -30,6 +31,7 @@ void halt(void)
 
 void poweroff(void)
 {
+    console::flush();
     ACPI_STATUS status = AcpiEnterSleepStatePrep(ACPI_STATE_S5);
     if (ACPI_FAILURE(status)) {
         debug("AcpiEnterSleepStatePrep failed: %s\n", AcpiFormatException(status));
@@ -48,6 +50,7 @@ void poweroff(void)
 // some reson fails.
 void reboot(void)
 {
+    console::flush();
     // It would be nice if AcpiReset() worked, but it doesn't seem to work
     // (on qemu & kvm), so let's resort to brute force...
     processor::outb(1, 0x92);
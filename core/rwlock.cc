@@ -9,8 +9,16 @@
 #include <osv/sched.hh>
 #include <osv/rwlock.h>
 
+// Readers don't take _mtx unless a writer is around: a reader increments
+// its shard's count, then checks _writer; a writer sets _writer (under
+// _mtx), then sums the counts. Both are sequentially consistent, so either
+// the reader sees the writer and backs off to wait on _mtx, or the writer
+// sees the reader and waits for it to leave. A reader leaving while a
+// writer is around takes _mtx to wake it.
+
 rwlock::rwlock()
-    : _readers(0),
+    : _readers(),
+      _writer(false),
       _read_waiters(0),
       _write_waiters(0),
       _wowner(nullptr),
@@ -20,131 +28,193 @@ rwlock::rwlock()
 rwlock::~rwlock()
 {
     assert(_wowner == nullptr);
-    assert(_readers == 0);
+    assert(readers() == 0);
     assert(_read_waiters == 0);
     assert(_write_waiters == 0);
 }
 
-void rwlock::rlock()
+int* rwlock::reader_count()
 {
-    std::lock_guard<mutex> guard(_mtx);
-    reader_wait_lockable();
-
-    _readers++;
+    return &_readers[sched::cpu::current()->id % RWLOCK_READER_SHARDS].count;
 }
 
-bool rwlock::try_rlock()
+int rwlock::readers()
 {
-    std::lock_guard<mutex> guard(_mtx);
-    if (!read_lockable()) {
-        return false;
+    int n = 0;
+    for (auto& r : _readers) {
+        n += __atomic_load_n(&r.count, __ATOMIC_SEQ_CST);
     }
-
-    _readers++;
-    return true;
+    return n;
 }
 
-void rwlock::runlock()
+// Called with _mtx held, whenever _wowner or _write_waiters change
+void rwlock::update_writer()
 {
-    bool need_wake = false;
+    __atomic_store_n(&_writer, _wowner || _write_waiters, __ATOMIC_SEQ_CST);
+}
 
-    WITH_LOCK(_mtx) {
-        assert(_wowner == nullptr);
-        assert(_readers > 0);
+bool rwlock::reader_enter(int* count)
+{
+    __atomic_add_fetch(count, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&_writer, __ATOMIC_SEQ_CST)) {
+        return true;
+    }
+    reader_exit(count);
+    return false;
+}
 
-        // If we are the last reader and we have a write waiter,
-        // then wake up one writer
-        if ((--_readers == 0) && (_write_waiters)) {
-            need_wake = true;
+void rwlock::reader_exit(int* count)
+{
+    __atomic_sub_fetch(count, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&_writer, __ATOMIC_SEQ_CST)) {
+        // A writer may be waiting for us to leave. It checks the count
+        // with _mtx held, so it either sees our decrement or gets woken.
+        WITH_LOCK(_mtx) {
+            if (_write_waiters) {
+                _cond_writers.wake_one();
+            }
         }
     }
+}
 
-    // wake() only after releasing the mutex
-    if (need_wake) {
-        _cond_writers.wake_one();
+void rwlock::rlock()
+{
+    if (reader_enter(reader_count())) {
+        return;
     }
+
+    std::lock_guard<mutex> guard(_mtx);
+    reader_wait_lockable();
+
+    // Writers check the count with _mtx held, so we can't be missed
+    __atomic_add_fetch(reader_count(), 1, __ATOMIC_SEQ_CST);
+}
+
+bool rwlock::try_rlock()
+{
+    return reader_enter(reader_count());
+}
+
+void rwlock::runlock()
+{
+    assert(_wowner == nullptr);
+    reader_exit(reader_count());
 }
 
 bool rwlock::try_upgrade()
 {
-    std::lock_guard<mutex> guard(_mtx);
+    bool need_wake = false;
 
-    // if we don't have any write waiters and we are the only reader
-    if ((_readers == 1) && (!_write_waiters)) {
-        assert(_wowner == nullptr);
-        _readers = 0;
-        _wowner = sched::thread::current();
-        return true;
+    WITH_LOCK(_mtx) {
+        // if we don't have any write waiters and we are the only reader
+        if (_wowner || _write_waiters) {
+            return false;
+        }
+        // Keep new readers out while counting the current ones
+        __atomic_store_n(&_writer, true, __ATOMIC_SEQ_CST);
+        if (readers() == 1) {
+            __atomic_sub_fetch(reader_count(), 1, __ATOMIC_SEQ_CST);
+            _wowner = sched::thread::current();
+            return true;
+        }
+        update_writer();
+        need_wake = _read_waiters;
     }
 
+    if (need_wake) {
+        _cond_readers.wake_all();
+    }
     return false;
 }
 
 void rwlock::wlock()
 {
     std::lock_guard<mutex> guard(_mtx);
-    writer_wait_lockable();
 
     // recursive write lock
     if (_wowner == sched::thread::current()) {
         _wrecurse++;
+        return;
     }
 
+    writer_wait_lockable();
     _wowner = sched::thread::current();
 }
 
 bool rwlock::try_wlock()
 {
-    std::lock_guard<mutex> guard(_mtx);
-    if (!write_lockable()) {
-        return false;
-    }
+    bool need_wake = false;
 
-    // recursive write lock
-    if (_wowner == sched::thread::current()) {
-        _wrecurse++;
+    WITH_LOCK(_mtx) {
+        // recursive write lock
+        if (_wowner == sched::thread::current()) {
+            _wrecurse++;
+            return true;
+        }
+        if (_wowner) {
+            return false;
+        }
+
+        __atomic_store_n(&_writer, true, __ATOMIC_SEQ_CST);
+        if (write_lockable()) {
+            _wowner = sched::thread::current();
+            return true;
+        }
+        update_writer();
+        need_wake = read_lockable() && _read_waiters;
     }
 
-    _wowner = sched::thread::current();
-    return true;
+    if (need_wake) {
+        _cond_readers.wake_all();
+    }
+    return false;
 }
 
 void rwlock::wunlock()
 {
+    bool wake_writer = false, wake_readers = false;
+
     WITH_LOCK(_mtx) {
         assert(_wowner == sched::thread::current());
 
         if (_wrecurse > 0) {
             _wrecurse--;
-        } else {
-            _wowner = nullptr;
+            return;
         }
+
+        _wowner = nullptr;
+        update_writer();
+        wake_writer = _write_waiters;
+        wake_readers = !_write_waiters && _read_waiters;
     }
 
     // wake() only after releasing the mutex
-    if (_write_waiters) {
+    if (wake_writer) {
         _cond_writers.wake_one();
-    } else if (_read_waiters) {
+    } else if (wake_readers) {
         _cond_readers.wake_all();
     }
 }
 
 void rwlock::downgrade()
 {
+    bool need_wake = false;
+
     WITH_LOCK(_mtx) {
         assert(_wowner == sched::thread::current());
 
-        // I'm aware this implementation is ugly but it does the trick for the
-        // time being.
-        while (_wrecurse) this->wunlock();
-        this->wunlock();
+        // Become a reader before letting go of the write lock, so that
+        // writers already waiting keep waiting for us, and we never block.
+        _wrecurse = 0;
+        _wowner = nullptr;
+        __atomic_add_fetch(reader_count(), 1, __ATOMIC_SEQ_CST);
+        update_writer();
+        need_wake = !_write_waiters && _read_waiters;
     }
 
-    // FIXME: Writers that already wait get precedence, so this function can
-    // block, there's only one user in sys/netinet/if_ether.c
-    // and we need to make sure that it's ok to block here.
-
-    this->rlock();
+    if (need_wake) {
+        _cond_readers.wake_all();
+    }
 }
 
 bool rwlock::wowned()
@@ -159,21 +229,18 @@ bool rwlock::read_lockable()
 
 bool rwlock::write_lockable()
 {
-    return ((_wowner == sched::thread::current()) ||
-            ((!_readers) && (!_wowner)));
+    return ((!_wowner) && (!readers()));
 }
 
 void rwlock::writer_wait_lockable()
 {
-    while (true) {
-        if (write_lockable()) {
-            return;
-        }
-
-        _write_waiters++;
+    // Announce ourselves first, so that new readers wait behind us
+    _write_waiters++;
+    update_writer();
+    while (!write_lockable()) {
         _cond_writers.wait(&_mtx, nullptr);
-        _write_waiters--;
     }
+    _write_waiters--;
 }
 
 void rwlock::reader_wait_lockable()
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#include <osv/sampler.hh>
+#include <osv/sched.hh>
+#include <osv/trace.hh>
+#include <osv/mutex.h>
+#include <osv/execinfo.hh>
+#include "exceptions.hh"
+#include <memory>
+#include <algorithm>
+
+TRACEPOINT(trace_sampler_tick, "");
+
+namespace prof {
+
+class cpu_sampler : public sched::timer_base::client {
+public:
+    cpu_sampler() : _timer(*this) {}
+    // start() and stop() must run on the sampler's cpu
+    void start(std::chrono::nanoseconds period);
+    void stop();
+    virtual void timer_fired() override;
+private:
+    sched::timer_base _timer;
+    std::chrono::nanoseconds _period;
+    bool _active = false;
+};
+
+static mutex control_lock;
+static cpu_sampler* samplers[sched::max_cpus];
+
+void cpu_sampler::start(std::chrono::nanoseconds period)
+{
+    _timer.cancel();
+    _period = period;
+    _active = true;
+    _timer.set(period);
+}
+
+void cpu_sampler::stop()
+{
+    _active = false;
+    _timer.cancel();
+}
+
+// Runs in the timer interrupt, so the interrupted context's registers are
+// in the interrupt frame
+void cpu_sampler::timer_fired()
+{
+    if (!_active) {
+        return;
+    }
+    auto ef = current_interrupt_frame;
+    if (ef) {
+        void* bt[tracepoint_base::backtrace_len];
+        int n = backtrace_safe(bt, tracepoint_base::backtrace_len,
+                reinterpret_cast<void*>(ef->rip), reinterpret_cast<void*>(ef->rbp));
+        trace_sampler_tick.log_sample(bt, n);
+    }
+    _timer.set(_period);
+}
+
+static void on_each_cpu(std::function<void (cpu_sampler&)> f)
+{
+    for (auto c : sched::cpus) {
+        std::unique_ptr<sched::thread> t(new sched::thread([&] {
+            f(*samplers[c->id]);
+        }, sched::thread::attr().pin(c).name("sampler")));
+        t->start();
+        t->join();
+    }
+}
+
+bool start_sampler(config cfg)
+{
+    if (cfg.period <= std::chrono::nanoseconds::zero()) {
+        return false;
+    }
+    cfg.period = std::max(cfg.period, min_period);
+    WITH_LOCK(control_lock) {
+        enable_tracepoint("sampler_tick");
+        for (auto c : sched::cpus) {
+            if (!samplers[c->id]) {
+                samplers[c->id] = new cpu_sampler;
+            }
+        }
+        on_each_cpu([&] (cpu_sampler& s) { s.start(cfg.period); });
+    }
+    return true;
+}
+
+void stop_sampler()
+{
+    WITH_LOCK(control_lock) {
+        if (!samplers[0]) {
+            return;
+        }
+        on_each_cpu([] (cpu_sampler& s) { s.stop(); });
+    }
+}
+
+}
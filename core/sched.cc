@@ -12,6 +12,7 @@
 #include <osv/debug.hh>
 #include <osv/irqlock.hh>
 #include <osv/align.hh>
+#include <osv/mmu.hh>
 #include <osv/interrupt.hh>
 #include "smp.hh"
 #include "osv/trace.hh"
@@ -51,6 +52,12 @@ cpu __thread * current_cpu;
 
 unsigned __thread preempt_counter = 1;
 bool __thread need_reschedule = false;
+// the current thread's stack is populated lazily
+bool __thread lazy_stack = false;
+// On such a stack: the lowest address known to be populated, and the lowest
+// we may touch (the top of the guard pages)
+char __thread *lazy_stack_floor;
+char __thread *lazy_stack_limit;
 
 elf::tls_data tls;
 
@@ -254,6 +261,7 @@ void cpu::reschedule_from_interrupt(bool preempt)
     assert(n->_detached_state->st.load() == thread::status::queued);
     trace_sched_switch(n, p->_runtime.get_local(), n->_runtime.get_local());
     n->_detached_state->st.store(thread::status::running);
+    running_thread.store(n, std::memory_order_relaxed);
     n->_runtime.hysteresis_run_start();
 
     assert(n!=p);
@@ -520,12 +528,12 @@ float thread::priority() const
 }
 
 thread::stack_info::stack_info()
-    : begin(nullptr), size(0), deleter(nullptr)
+    : begin(nullptr), size(0), deleter(nullptr), lazy(false), guard(0)
 {
 }
 
 thread::stack_info::stack_info(void* _begin, size_t _size)
-    : begin(_begin), size(_size), deleter(nullptr)
+    : begin(_begin), size(_size), deleter(nullptr), lazy(false), guard(0)
 {
     auto end = align_down(begin + size, 16);
     size = static_cast<char*>(end) - static_cast<char*>(begin);
@@ -951,9 +959,54 @@ void thread_handle::wake()
 
 void preempt_disable()
 {
+    ensure_stack_reserve();
     ++preempt_counter;
 }
 
+// A thread on a lazily populated stack may not take a page fault on it
+// once preemption or interrupts are disabled. So before disabling them, we
+// fault in lazy_stack_reserve bytes below the stack pointer, while we still
+// can. That is the most stack a critical section may use, including the
+// scheduler and the tracepoint slow path which may run inside it (interrupt
+// handlers have a stack of their own). The pages stay populated, so once
+// the stack has been that deep this is a single comparison.
+void ensure_stack_reserve()
+{
+    if (!lazy_stack) {
+        return;
+    }
+    auto sp = static_cast<char*>(__builtin_frame_address(0));
+    if (preempt_counter || !arch::irq_enabled()) {
+        // nested: we must be within what the outermost call faulted in
+        assert(sp >= lazy_stack_floor);
+        return;
+    }
+    auto want = std::max(sp - lazy_stack_reserve, lazy_stack_limit);
+    while (lazy_stack_floor > want) {
+        lazy_stack_floor -= mmu::page_size;
+        *static_cast<volatile char*>(lazy_stack_floor);
+    }
+}
+
+void init_lazy_stack(const thread::stack_info& si)
+{
+    lazy_stack = si.lazy;
+    auto top = static_cast<char*>(si.begin) + si.size;
+    // the top page is populated by whoever allocated the stack
+    lazy_stack_floor = align_down(top - 1, mmu::page_size);
+    lazy_stack_limit = static_cast<char*>(si.begin) + si.guard;
+}
+
+void check_lazy_stack_fault(uintptr_t addr)
+{
+    auto p = reinterpret_cast<char*>(addr);
+    if (lazy_stack && p >= lazy_stack_limit && p < lazy_stack_floor) {
+        abort("page fault on a lazily populated stack with preemption or "
+              "interrupts disabled: a critical section used more than %d "
+              "bytes of stack\n", int(lazy_stack_reserve));
+    }
+}
+
 void preempt_enable()
 {
     --preempt_counter;
@@ -972,6 +1025,16 @@ unsigned int get_preempt_counter()
     return preempt_counter;
 }
 
+bool is_running(const thread* t)
+{
+    for (auto c : cpus) {
+        if (c->running_thread.load(std::memory_order_relaxed) == t) {
+            return true;
+        }
+    }
+    return false;
+}
+
 void preempt()
 {
     if (preemptable()) {
@@ -45,10 +45,27 @@ struct tracepoint_patch_sites_type {
 tracepoint_patch_sites_type tracepoint_patch_sites;
 
 constexpr size_t trace_page_size = 4096;  // need not match arch page size
-constexpr unsigned max_trace = trace_page_size * 1024;
-
-char *trace_log __attribute__((may_alias));
-std::atomic<size_t> trace_record_last;
+// size of each cpu's ring
+constexpr unsigned max_trace = trace_page_size * 256;
+
+// Each cpu logs into a ring of its own, so that tracing on many cpus does
+// not bounce a shared cache line between them, and distort what is being
+// measured. A ring is only written by its cpu, with interrupts disabled, so
+// this needs no atomic operations. Records are merged by time when the
+// trace is extracted (scripts/loader.py).
+struct trace_buf {
+    char *log __attribute__((may_alias));
+    // bytes reserved since the ring was allocated, including page padding
+    size_t last;
+    // records written since the ring was allocated; those which can no
+    // longer be found in the ring were overwritten
+    u64 records;
+    // records lost because the ring wasn't allocated yet
+    u64 dropped;
+} CACHELINE_ALIGNED;
+
+trace_buf trace_bufs[sched::max_cpus];
+std::atomic<u64> trace_records_no_cpu;
 bool trace_enabled;
 
 typeof(tracepoint_base::tp_list) tracepoint_base::tp_list __attribute__((init_priority((int)init_prio::tracepoint_base)));
@@ -62,9 +79,13 @@ void enable_trace()
 
 void enable_tracepoint(std::string wildcard)
 {
-    if (!trace_log) {
-        trace_log = (char *) aligned_alloc(sizeof(long), max_trace);
-        bzero(trace_log, max_trace);
+    for (auto c : sched::cpus) {
+        auto& tb = trace_bufs[c->id];
+        if (!tb.log) {
+            auto log = (char *) aligned_alloc(sizeof(long), max_trace);
+            bzero(log, max_trace);
+            tb.log = log;
+        }
     }
     wildcard = boost::algorithm::replace_all_copy(wildcard, std::string("*"), std::string(".*"));
     wildcard = boost::algorithm::replace_all_copy(wildcard, std::string("?"), std::string("."));
@@ -235,24 +256,60 @@ void tracepoint_base::do_log_backtrace(trace_record* tr, u8*& buffer)
     buffer += backtrace_len * sizeof(void*);
 }
 
-trace_record* allocate_trace_record(size_t size)
+void tracepoint_base::log_sample(void** bt, int nr)
+{
+    if (!logging) {
+        return;
+    }
+    auto thread = sched::thread::current();
+    if (!thread) {
+        trace_record_no_cpu();
+        return;
+    }
+    auto cpu = thread->tcpu()->id;
+    auto tr = allocate_trace_record(backtrace_len * sizeof(void*), cpu);
+    if (!tr) {
+        return;
+    }
+    tr->tp = this;
+    tr->thread = thread;
+    tr->thread_name = thread->name_raw();
+    tr->time = clock::get()->time();
+    tr->cpu = cpu;
+    tr->backtrace = true;
+    auto p = reinterpret_cast<void**>(tr->buffer);
+    nr = std::min(nr, int(backtrace_len));
+    std::copy(bt, bt + nr, p);
+    std::fill(p + nr, p + backtrace_len, nullptr);
+}
+
+trace_record* allocate_trace_record(size_t size, unsigned cpu)
 {
+    auto& tb = trace_bufs[cpu];
+    if (!tb.log) {
+        ++tb.dropped;
+        return nullptr;
+    }
     size += sizeof(trace_record);
     size = align_up(size, sizeof(long));
-    size_t p = trace_record_last.load(std::memory_order_relaxed);
-    size_t pn;
-    do {
-        pn = p + size;
-        if (align_down(p, trace_page_size) != align_down(pn, trace_page_size)) {
-            // crossed page boundary
-            pn = align_up(p, trace_page_size) + size;
-        }
-    } while (!trace_record_last.compare_exchange_weak(p, pn, std::memory_order_relaxed));
-    char* pp = &trace_log[p % max_trace];
+    size_t p = tb.last;
+    size_t pn = p + size;
+    if (align_down(p, trace_page_size) != align_down(pn, trace_page_size)) {
+        // crossed page boundary
+        pn = align_up(p, trace_page_size) + size;
+    }
+    char* pp = &tb.log[p % max_trace];
     // clear the first word, do indicate an padding at the end of the page
     reinterpret_cast<trace_record*>(pp)->tp = nullptr;
+    tb.last = pn;
+    ++tb.records;
     pn -= size;
-    return reinterpret_cast<trace_record*>(&trace_log[pn % max_trace]);
+    return reinterpret_cast<trace_record*>(&tb.log[pn % max_trace]);
+}
+
+void trace_record_no_cpu()
+{
+    trace_records_no_cpu.fetch_add(1, std::memory_order_relaxed);
 }
 
 static __thread unsigned func_trace_nesting;
@@ -262,6 +319,7 @@ extern "C" void __cyg_profile_func_enter(void *this_fn, void *call_site)
     if (!trace_enabled) {
         return;
     }
+    sched::ensure_stack_reserve();
     arch::irq_flag_notrace irq;
     irq.save();
     arch::irq_disable_notrace();
@@ -277,6 +335,7 @@ extern "C" void __cyg_profile_func_exit(void *this_fn, void *call_site)
     if (!trace_enabled || !arch::tls_available()) {
         return;
     }
+    sched::ensure_stack_reserve();
     arch::irq_flag_notrace irq;
     irq.save();
     arch::irq_disable_notrace();
@@ -9,9 +9,13 @@
 #include <osv/prex.h>
 #include <osv/device.h>
 #include <osv/sched.hh>
+#include <osv/preempt-lock.hh>
+#include <osv/condvar.h>
+#include "processor.hh"
 #include <queue>
 #include <deque>
 #include <vector>
+#include <atomic>
 #include <sys/ioctl.h>
 
 #include "isa-serial.hh"
@@ -27,19 +31,264 @@ namespace console {
 // should eventually become a list of console device that we chose the best from
 debug_console console;
 
+// Output is asynchronous: write() copies the text into a ring of the current
+// cpu, without taking any lock, and the console-writer thread drains the
+// rings into the device in batches, so a thread printing a lot only delays
+// itself. Records carry a global sequence number, and are written out in
+// that order, even if a thread moved between cpus. Writes which can't wait
+// (from interrupts or the scheduler), before the writer thread runs, and
+// write_ll() for panics, go to the device directly.
+namespace {
+
+struct record_header {
+    u64 seq;
+    u64 len;
+};
+
+std::atomic<u64> next_seq;
+
+class output_ring {
+public:
+    static constexpr size_t size = 16384;
+    static constexpr size_t max_record = 1024;
+    // Producer side, on the ring's cpu with preemption disabled
+    bool has_room(size_t len) const;
+    bool push(const char* msg, size_t len);
+    // Consumer side: the header of the oldest record, and removing it
+    bool front(record_header& h) const;
+    void pop(const record_header& h, char* buf);
+    bool empty() const;
+private:
+    void copy_in(size_t pos, const void* src, size_t n);
+    void copy_out(size_t pos, void* dst, size_t n) const;
+    // free running offsets into _buf
+    std::atomic<size_t> _head {0};
+    std::atomic<size_t> _tail {0};
+    char _buf[size];
+};
+
+void output_ring::copy_in(size_t pos, const void* src, size_t n)
+{
+    auto off = pos % size;
+    auto first = std::min(n, size - off);
+    memcpy(_buf + off, src, first);
+    memcpy(_buf, static_cast<const char*>(src) + first, n - first);
+}
+
+void output_ring::copy_out(size_t pos, void* dst, size_t n) const
+{
+    auto off = pos % size;
+    auto first = std::min(n, size - off);
+    memcpy(dst, _buf + off, first);
+    memcpy(static_cast<char*>(dst) + first, _buf, n - first);
+}
+
+bool output_ring::has_room(size_t len) const
+{
+    auto used = _tail.load(std::memory_order_relaxed) -
+            _head.load(std::memory_order_acquire);
+    return size - used >= sizeof(record_header) + len;
+}
+
+bool output_ring::push(const char* msg, size_t len)
+{
+    if (!has_room(len)) {
+        return false;
+    }
+    auto tail = _tail.load(std::memory_order_relaxed);
+    record_header h{next_seq.fetch_add(1, std::memory_order_relaxed), len};
+    copy_in(tail, &h, sizeof(h));
+    copy_in(tail + sizeof(h), msg, len);
+    _tail.store(tail + sizeof(h) + len, std::memory_order_release);
+    return true;
+}
+
+bool output_ring::front(record_header& h) const
+{
+    auto head = _head.load(std::memory_order_relaxed);
+    if (head == _tail.load(std::memory_order_acquire)) {
+        return false;
+    }
+    copy_out(head, &h, sizeof(h));
+    return true;
+}
+
+void output_ring::pop(const record_header& h, char* buf)
+{
+    auto head = _head.load(std::memory_order_relaxed);
+    copy_out(head + sizeof(h), buf, h.len);
+    _head.store(head + sizeof(h) + h.len, std::memory_order_release);
+}
+
+bool output_ring::empty() const
+{
+    return _head.load(std::memory_order_relaxed) ==
+            _tail.load(std::memory_order_acquire);
+}
+
+// by cpu id
+std::vector<output_ring*> rings;
+std::atomic<sched::thread*> writer_thread;
+std::atomic<bool> draining;
+// The rings have a single consumer. Normally it is the writer thread, which
+// holds consumer just around each pop; once there is a panic, write_ll()
+// takes it for good, for the cpu which panicked (its id + 1).
+constexpr int no_consumer = 0;
+constexpr int writer_consumer = -1;
+std::atomic<int> consumer {no_consumer};
+// wakes writers waiting for room in a ring, and flush()
+mutex drained_mutex;
+condvar drained;
+
+constexpr size_t batch_size = 4096;
+char batch[batch_size];
+char batch_ll[batch_size];
+
+bool pending()
+{
+    for (auto r : rings) {
+        if (!r->empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Writes out the records of all the rings, oldest first, batch by batch.
+// Only the current consumer (see above) may call it, as me.
+template <typename Write>
+void drain(char* buf, Write device_write, int me)
+{
+    size_t n = 0;
+    while (true) {
+        if (me == writer_consumer) {
+            int c = no_consumer;
+            if (!consumer.compare_exchange_strong(c, me, std::memory_order_acquire)) {
+                break;
+            }
+        }
+        output_ring* oldest = nullptr;
+        record_header h, oldest_h;
+        for (auto r : rings) {
+            if (r->front(h) && (!oldest || h.seq < oldest_h.seq)) {
+                oldest = r;
+                oldest_h = h;
+            }
+        }
+        bool popped = oldest && n + oldest_h.len <= batch_size;
+        if (popped) {
+            oldest->pop(oldest_h, buf + n);
+            n += oldest_h.len;
+        }
+        if (me == writer_consumer) {
+            consumer.store(no_consumer, std::memory_order_release);
+        }
+        if (!oldest) {
+            break;
+        }
+        if (!popped) {
+            // the batch is full
+            device_write(buf, n);
+            n = 0;
+        }
+    }
+    if (n) {
+        device_write(buf, n);
+    }
+}
+
+void writer_main()
+{
+    while (true) {
+        // after a panic, the rings are write_ll()'s
+        sched::thread::wait_until([] {
+            return pending() && consumer.load(std::memory_order_relaxed) <= 0;
+        });
+        draining.store(true, std::memory_order_relaxed);
+        drain(batch, [] (const char* buf, size_t n) { console.write(buf, n); },
+                writer_consumer);
+        draining.store(false, std::memory_order_relaxed);
+        WITH_LOCK(drained_mutex) {
+            drained.wake_all();
+        }
+    }
+}
+
+}
+
 void write(const char *msg, size_t len)
 {
-    if (len)
-        console.write(msg, len);
+    auto writer = writer_thread.load(std::memory_order_acquire);
+    if (!writer || !sched::preemptable() || !arch::irq_enabled()) {
+        if (len)
+            console.write(msg, len);
+        return;
+    }
+    while (len) {
+        auto n = std::min(len, output_ring::max_record);
+        unsigned cpu;
+        bool pushed;
+        WITH_LOCK(preempt_lock) {
+            cpu = sched::cpu::current()->id;
+            pushed = rings[cpu]->push(msg, n);
+        }
+        if (!pushed) {
+            // the ring is full: wait for the writer, as one would for a
+            // slow device
+            WITH_LOCK(drained_mutex) {
+                writer->wake();
+                drained.wait_until(drained_mutex, [&] { return rings[cpu]->has_room(n); });
+            }
+            continue;
+        }
+        msg += n;
+        len -= n;
+    }
+    writer->wake();
 }
 
-// lockless version
+// Makes this cpu the rings' consumer, for good. The writer thread only holds
+// them for the length of a pop; if it doesn't let go, it was interrupted by
+// this panic, or another cpu panicked too, and we leave the rings alone.
+static bool take_rings_for_panic()
+{
+    int me = sched::cpu::current()->id + 1;
+    for (int i = 0; i < 100000; i++) {
+        int c = no_consumer;
+        if (consumer.compare_exchange_weak(c, me, std::memory_order_acquire) ||
+                c == me) {
+            return true;
+        }
+        processor::pause();
+    }
+    return false;
+}
+
+// lockless version, whatever is still queued goes out first, if we can
 void write_ll(const char *msg, size_t len)
 {
+    if (writer_thread.load(std::memory_order_relaxed) && take_rings_for_panic()) {
+        drain(batch_ll, [] (const char* buf, size_t n) { console.write_ll(buf, n); },
+                sched::cpu::current()->id + 1);
+    }
     if (len)
         console.write_ll(msg, len);
 }
 
+void flush()
+{
+    auto writer = writer_thread.load(std::memory_order_acquire);
+    if (!writer || !sched::preemptable() || !arch::irq_enabled()) {
+        return;
+    }
+    WITH_LOCK(drained_mutex) {
+        writer->wake();
+        drained.wait_until(drained_mutex, [] {
+            return !pending() && !draining.load(std::memory_order_relaxed);
+        });
+    }
+}
+
 mutex console_mutex;
 // characters available to be returned on read() from the console
 std::queue<char> console_queue;
@@ -119,7 +368,7 @@ void console_poll()
             // user can edit it with backspace, etc.).
             if (c == '\n') {
                 if (tio.c_lflag && ECHO)
-                    console.write(&c, 1);
+                    write(&c, 1);
                 line_buffer.push_back('\n');
                 while (!line_buffer.empty()) {
                     console_queue.push(line_buffer.front());
@@ -139,15 +388,15 @@ void console_poll()
                     static const char eraser[] = {'\b',' ','\b','\b',' ','\b'};
                     if (tio.c_lflag && ECHOE) {
                         if (isctrl(e)) { // Erase the two characters ^X
-                            console.write(eraser, 6);
+                            write(eraser, 6);
                         } else {
-                            console.write(eraser, 3);
+                            write(eraser, 3);
                         }
                     } else {
                         if (isctrl(e)) {
-                            console.write(eraser+2, 2);
+                            write(eraser+2, 2);
                         } else {
-                            console.write(eraser, 1);
+                            write(eraser, 1);
                         }
                     }
                     continue; // already echoed
@@ -168,9 +417,9 @@ void console_poll()
                 char out[2];
                 out[0] = '^';
                 out[1] = c^'@';
-                console.write(out, 2);
+                write(out, 2);
             } else {
-                console.write(&c, 1);
+                write(&c, 1);
             }
         }
     }
@@ -209,10 +458,8 @@ console_write(struct uio *uio, int ioflag)
         struct iovec *iov = uio->uio_iov;
 
         if (iov->iov_len) {
-            WITH_LOCK(console_mutex) {
-                console::write(reinterpret_cast<const char *>(iov->iov_base),
-                               iov->iov_len);
-            }
+            console::write(reinterpret_cast<const char *>(iov->iov_base),
+                           iov->iov_len);
         }
 
         uio->uio_iov++;
@@ -280,9 +527,11 @@ struct driver console_driver = {
     .devops	= &console_devops,
 };
 
+static sched::thread* console_poll_thread;
+
 void console_init(bool use_vga)
 {
-    auto console_poll_thread = new sched::thread(console_poll,
+    console_poll_thread = new sched::thread(console_poll,
             sched::thread::attr().name("console"));
     Console* console;
 
@@ -293,6 +542,30 @@ void console_init(bool use_vga)
     console_poll_thread->start();
     console::console.set_impl(console);
     device_create(&console_driver, "console", D_CHR);
+
+    for (auto c : sched::cpus) {
+        assert(c->id == rings.size());
+        rings.push_back(new output_ring);
+    }
+    auto writer = new sched::thread(writer_main,
+            sched::thread::attr().name("console-writer"));
+    writer->start();
+    writer_thread.store(writer, std::memory_order_release);
+}
+
+void set_device(Console* dev)
+{
+    console.set_impl(dev);
+}
+
+sched::thread* input_thread()
+{
+    return console_poll_thread;
+}
+
+const termios* get_termios()
+{
+    return &tio;
 }
 
 class console_file : public special_file {
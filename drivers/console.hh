@@ -18,11 +18,26 @@ public:
     virtual char readch() = 0;
 };
 
+struct termios;
+namespace sched {
+class thread;
+}
+
 namespace console {
 
+// Queued, and written to the device by a background thread
 void write(const char *msg, size_t len);
+// Synchronous and lockless, for panics
 void write_ll(const char *msg, size_t len);
+// Waits until what was written so far reached the device
+void flush();
 void console_init(bool use_vga);
+// Switches to a better device found later, like virtio-serial. The device
+// wakes input_thread() when it has input, and processes output according
+// to get_termios().
+void set_device(Console* dev);
+sched::thread* input_thread();
+const termios* get_termios();
 int open(void);
 
 }
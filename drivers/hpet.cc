@@ -13,6 +13,7 @@ extern "C" {
 #include <osv/prio.hh>
 #include "processor.hh"
 #include "clock.hh"
+#include "tscclock.hh"
 #include <osv/mmu.hh>
 #include <osv/mmio.hh>
 #include "arch.hh"
@@ -185,6 +186,11 @@ void __attribute__((constructor(init_prio::hpet))) hpet_init()
         auto h = get_parent_from_member(hpet_header, &ACPI_TABLE_HPET::Header);
         auto hpet_address = h->Address;
 
-        clock::register_clock(new hpetclock(hpet_address.Address));
+        c = new hpetclock(hpet_address.Address);
+        // Reading the HPET exits to the host, reading the TSC does not
+        if (tscclock::probe()) {
+            c = new tscclock(c);
+        }
+        clock::register_clock(c);
     }, {});
 }
@@ -32,6 +32,7 @@ private:
     static bool _smp_init;
     static s64 _boot_systemtime;
     static bool _new_kvmclock_msrs;
+    static bool _stable_tsc;
     pvclock_wall_clock* _wall;
     static percpu<pvclock_vcpu_time_info> _sys;
     sched::cpu::notifier cpu_notifier;
@@ -40,6 +41,7 @@ private:
 bool kvmclock::_smp_init = false;
 s64 kvmclock::_boot_systemtime = 0;
 bool kvmclock::_new_kvmclock_msrs = true;
+bool kvmclock::_stable_tsc = false;
 PERCPU(pvclock_vcpu_time_info, kvmclock::_sys);
 
 kvmclock::kvmclock()
@@ -64,6 +66,8 @@ void kvmclock::setup_cpu()
 
 bool kvmclock::probe()
 {
+    _stable_tsc = processor::features().invariant_tsc &&
+                  processor::features().kvm_clocksource_stable;
     if (processor::features().kvm_clocksource2) {
         return true;
     }
@@ -116,6 +120,16 @@ u64 kvmclock::wall_clock_boot()
 
 u64 kvmclock::system_time()
 {
+    // With an invariant TSC, and the host keeping the clocks of all cpus in
+    // sync, any cpu's record gives the same time: we needn't stay on this
+    // cpu while reading it, and the read is just the TSC and the record's
+    // scale and offset, under its version seqlock.
+    if (_stable_tsc) {
+        auto sys = &*_sys;
+        if (sys->flags & PVCLOCK_TSC_STABLE_BIT) {
+            return pvclock::system_time(sys);
+        }
+    }
     sched::preempt_disable();
     auto sys = &*_sys;  // avoid recaclulating address each access
     auto r = pvclock::system_time(sys);
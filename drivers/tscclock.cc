@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#include "tscclock.hh"
+#include "processor.hh"
+#include "cpuid.hh"
+#include <string.h>
+
+// How long we compare the TSC with the reference clock at boot. Each end
+// is known to within a read of the reference clock, a microsecond or so.
+static constexpr s64 calibration_ns = 10000000;
+
+tscclock::tscclock(clock* ref)
+    : _ref(ref)
+{
+    memset(&_sys, 0, sizeof(_sys));
+    calibrate();
+}
+
+bool tscclock::probe()
+{
+    return processor::features().invariant_tsc;
+}
+
+// Reads the reference clock, and the TSC at the middle of that read
+static s64 sample(clock* ref, u64& tsc)
+{
+    auto before = processor::rdtsc();
+    auto ns = ref->uptime();
+    auto after = processor::rdtsc();
+    tsc = before + (after - before) / 2;
+    return ns;
+}
+
+// Sets mul and shift so that ns = ((ticks << shift) * mul) >> 32, with
+// mul as large (precise) as fits in 32 bits. A negative shift is a right
+// shift.
+static void set_scale(pvclock_vcpu_time_info& sys, u64 ns, u64 ticks)
+{
+    typedef unsigned __int128 u128;
+    auto mul = [=] (int shift) {
+        return shift >= 0 ? (u128(ns) << 32) / (u128(ticks) << shift)
+                          : (u128(ns) << (32 - shift)) / ticks;
+    };
+    int shift = 0;
+    while (mul(shift) >> 32) {
+        ++shift;
+    }
+    while (shift > -31 && !(mul(shift - 1) >> 32)) {
+        --shift;
+    }
+    sys.tsc_to_system_mul = mul(shift);
+    sys.tsc_shift = shift;
+}
+
+void tscclock::calibrate()
+{
+    u64 tsc0, tsc1;
+    auto ns0 = sample(_ref, tsc0);
+    s64 ns1;
+    do {
+        ns1 = sample(_ref, tsc1);
+    } while (ns1 - ns0 < calibration_ns);
+    set_scale(_sys, ns1 - ns0, tsc1 - tsc0);
+    _sys.tsc_timestamp = tsc1;
+    _sys.system_time = ns1;
+    _sys.flags = PVCLOCK_TSC_STABLE_BIT;
+}
+
+s64 tscclock::uptime()
+{
+    return pvclock::system_time(&_sys);
+}
+
+s64 tscclock::time()
+{
+    return _ref->boot_time() + uptime();
+}
+
+s64 tscclock::boot_time()
+{
+    return _ref->boot_time();
+}
+
+u64 tscclock::processor_to_nano(u64 ticks)
+{
+    return pvclock::processor_to_nano(&_sys, ticks);
+}
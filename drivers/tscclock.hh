@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef TSCCLOCK_HH_
+#define TSCCLOCK_HH_
+
+#include "clock.hh"
+#include <osv/pvclock-abi.hh>
+
+// A clock reading the invariant TSC, for hosts whose other clock is slow to
+// read (the HPET, each read of which exits to the host). The TSC's rate is
+// calibrated against that reference clock at boot, and kept with the offset
+// in a record in the pvclock format, read under its version seqlock just as
+// kvmclock's are. The TSCs of all cpus are assumed to be in sync, as they
+// are on the hypervisors advertising an invariant TSC.
+class tscclock : public clock {
+public:
+    // Takes over ref, which should only be used through us from now on
+    explicit tscclock(clock* ref);
+    virtual s64 time() override __attribute__((no_instrument_function));
+    virtual s64 uptime() override __attribute__((no_instrument_function));
+    virtual s64 boot_time() override __attribute__((no_instrument_function));
+    virtual u64 processor_to_nano(u64 ticks) override __attribute__((no_instrument_function));
+    static bool probe();
+private:
+    void calibrate();
+private:
+    clock* _ref;
+    pvclock_vcpu_time_info _sys;
+};
+
+#endif /* TSCCLOCK_HH_ */
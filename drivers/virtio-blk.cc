@@ -36,10 +36,12 @@ TRACEPOINT(trace_virtio_blk_read_config_blk_size, "blk_size=%u", u32);
 TRACEPOINT(trace_virtio_blk_read_config_topology, "physical_block_exp=%u, alignment_offset=%u, min_io_size=%u, opt_io_size=%u", u32, u32, u32, u32);
 TRACEPOINT(trace_virtio_blk_read_config_wce, "wce=%u", u32);
 TRACEPOINT(trace_virtio_blk_read_config_ro, "readonly=true");
+TRACEPOINT(trace_virtio_blk_read_config_num_queues, "num_queues=%u", u32);
 TRACEPOINT(trace_virtio_blk_make_request_seg_max, "request of size %d needs more segment than the max %d", size_t, u32);
 TRACEPOINT(trace_virtio_blk_make_request_readonly, "write on readonly device");
-TRACEPOINT(trace_virtio_blk_wake, "");
+TRACEPOINT(trace_virtio_blk_wake, "queue=%u", unsigned);
 TRACEPOINT(trace_virtio_blk_strategy, "bio=%p", struct bio*);
+TRACEPOINT(trace_virtio_blk_make_request, "bio=%p, queue=%u", struct bio*, unsigned);
 TRACEPOINT(trace_virtio_blk_req_ok, "bio=%p, sector=%lu, len=%lu, type=%x", struct bio*, u64, size_t, u32);
 TRACEPOINT(trace_virtio_blk_req_unsupp, "bio=%p, sector=%lu, len=%lu, type=%x", struct bio*, u64, size_t, u32);
 TRACEPOINT(trace_virtio_blk_req_err, "bio=%p, sector=%lu, len=%lu, type=%x", struct bio*, u64, size_t, u32);
@@ -101,10 +103,11 @@ struct driver blk_driver = {
 bool blk::ack_irq()
 {
     auto isr = virtio_conf_readb(VIRTIO_PCI_ISR);
-    auto queue = get_virt_queue(0);
 
     if (isr) {
-        queue->disable_interrupts();
+        for (unsigned idx = 0; idx < _nqueues; idx++) {
+            _rq[idx]->vqueue->interrupt();
+        }
         return true;
     } else {
         return false;
@@ -115,28 +118,47 @@ bool blk::ack_irq()
 blk::blk(pci::device& pci_dev)
     : virtio_driver(pci_dev), _ro(false)
 {
-printf("blk::blk\n");
     _driver_name = "virtio-blk";
     _id = _instance++;
     virtio_i("VIRTIO BLK INSTANCE %d", _id);
 
-//    setup_features();
-//    read_config();
+    probe_virt_queues();
+
+    // With VIRTIO_BLK_F_MQ, use up to one queue per cpu. The requests of
+    // queue N are completed on cpu N, by a thread which the queue's
+    // interrupt wakes.
+    unsigned max_queues = _mq ? std::max<unsigned>(_config.num_queues, 1) : 1;
+    _nqueues = std::min<unsigned>({max_queues, _num_queues, unsigned(sched::cpus.size())});
+    virtio_i("virtio-blk: using %d of %d queues", _nqueues, max_queues);
+
+    for (unsigned idx = 0; idx < _nqueues; idx++) {
+        _rq[idx] = new rq(get_virt_queue(idx), [this, idx] { this->req_done(idx); },
+                          sched::cpus[idx]);
+        for (unsigned i = 0; i < std::min<unsigned>(_rq[idx]->vqueue->size(), rq::max_free_reqs); i++) {
+            _rq[idx]->put_req(new blk_req(nullptr));
+        }
+        _rq[idx]->done_task.start();
+        // Enable indirect descriptor: a request is a header, up to seg_max
+        // data segments (see make_request()) and a status byte
+        _rq[idx]->vqueue->set_use_indirect(true, _config.seg_max + 2);
+    }
 
-    //register the single irq callback for the block
-    sched::thread* t = new sched::thread([this] { this->req_done(); },
-            sched::thread::attr().name("virtio-blk"));
-    t->start();
-    auto queue = get_virt_queue(0);
     if (pci_dev.is_msix()) {
-        _msi.easy_register({ { 0, [=] { queue->disable_interrupts(); }, t } });
+        std::vector<msix_binding> bindings;
+        for (unsigned idx = 0; idx < _nqueues; idx++) {
+            vring* vq = _rq[idx]->vqueue;
+            bindings.push_back({ idx, [=] { vq->interrupt(); }, &_rq[idx]->done_task });
+        }
+        _msi.easy_register(bindings);
     } else {
-        _gsi.set_ack_and_handler(pci_dev.get_interrupt_line(), [=] { return this->ack_irq(); }, [=] { t->wake(); });
+        // A single interrupt line for all the queues
+        _gsi.set_ack_and_handler(pci_dev.get_interrupt_line(), [=] { return this->ack_irq(); }, [=] {
+            for (unsigned idx = 0; idx < _nqueues; idx++) {
+                _rq[idx]->done_task.wake();
+            }
+        });
     }
 
-    // Enable indirect descriptor
-    queue->set_use_indirect(true);
-
     add_dev_status(VIRTIO_CONFIG_S_DRIVER_OK);
 
     struct blk_priv* prv;
@@ -187,17 +209,21 @@ printf("blk::read_config\n");
         set_readonly();
         trace_virtio_blk_read_config_ro();
     }
+    _mq = get_guest_feature_bit(VIRTIO_BLK_F_MQ);
+    if (_mq) {
+        trace_virtio_blk_read_config_num_queues(_config.num_queues);
+    }
 }
 
-void blk::req_done()
+void blk::req_done(unsigned idx)
 {
-    auto* queue = get_virt_queue(0);
+    auto* queue = _rq[idx]->vqueue;
     blk_req* req;
 
     while (1) {
 
         virtio_driver::wait_for_queue(queue, &vring::used_ring_not_empty);
-        trace_virtio_blk_wake();
+        trace_virtio_blk_wake(idx);
 
         u32 len;
         while((req = static_cast<blk_req*>(queue->get_buf_elem(&len))) != nullptr) {
@@ -218,7 +244,7 @@ void blk::req_done()
                }
             }
 
-            delete req;
+            _rq[idx]->put_req(req);
             queue->get_buf_finalize();
         }
 
@@ -236,43 +262,51 @@ static const int sector_size = 512;
 
 int blk::make_request(struct bio* bio)
 {
-    // The lock is here for parallel requests protection
-    WITH_LOCK(_lock) {
-
-        if (!bio) return EIO;
+    if (!bio) return EIO;
 
-        if (bio->bio_bcount/mmu::page_size + 1 > _config.seg_max) {
-            trace_virtio_blk_make_request_seg_max(bio->bio_bcount, _config.seg_max);
-            return EIO;
-        }
+    if (bio->bio_bcount/mmu::page_size + 1 > _config.seg_max) {
+        trace_virtio_blk_make_request_seg_max(bio->bio_bcount, _config.seg_max);
+        return EIO;
+    }
 
-        auto* queue = get_virt_queue(0);
-        blk_request_type type;
-
-        switch (bio->bio_cmd) {
-        case BIO_READ:
-            type = VIRTIO_BLK_T_IN;
-            break;
-        case BIO_WRITE:
-            if (is_readonly()) {
-                trace_virtio_blk_make_request_readonly();
-                biodone(bio, false);
-                return EROFS;
-            }
-            type = VIRTIO_BLK_T_OUT;
-            break;
-        case BIO_FLUSH:
-            type = VIRTIO_BLK_T_FLUSH;
-            break;
-        default:
-            return ENOTBLK;
+    blk_request_type type;
+
+    switch (bio->bio_cmd) {
+    case BIO_READ:
+        type = VIRTIO_BLK_T_IN;
+        break;
+    case BIO_WRITE:
+        if (is_readonly()) {
+            trace_virtio_blk_make_request_readonly();
+            biodone(bio, false);
+            return EROFS;
         }
+        type = VIRTIO_BLK_T_OUT;
+        break;
+    case BIO_FLUSH:
+        type = VIRTIO_BLK_T_FLUSH;
+        break;
+    default:
+        return ENOTBLK;
+    }
 
-        auto* req = new blk_req(bio);
+    // Only the submitters using the same queue, normally running on the
+    // same cpu, serialize on its lock. The last one of them kicks the
+    // host for all.
+    unsigned idx = pick_rq();
+    auto* q = _rq[idx];
+    trace_virtio_blk_make_request(bio, idx);
+    q->vqueue->batch_begin();
+    WITH_LOCK(q->lock) {
+        auto* queue = q->vqueue;
+
+        auto* req = q->get_req();
+        req->bio = bio;
         blk_outhdr* hdr = &req->hdr;
         hdr->type = type;
         hdr->ioprio = 0;
         hdr->sector = bio->bio_offset / sector_size;
+        req->res.status = 0;
 
         queue->init_sg();
         queue->add_out_sg(hdr, sizeof(struct blk_outhdr));
@@ -296,12 +330,11 @@ int blk::make_request(struct bio* bio)
             offset = 0;
         }
 
-        req->res.status = 0;
         queue->add_in_sg(&req->res, sizeof (struct blk_res));
 
         queue->add_buf_wait(req);
 
-        queue->kick();
+        queue->batch_end();
 
         return 0;
     }
@@ -316,6 +349,7 @@ u32 blk::get_driver_features()
                  | ( 1 << VIRTIO_BLK_F_RO)
                  | ( 1 << VIRTIO_BLK_F_BLK_SIZE)
                  | ( 1 << VIRTIO_BLK_F_CONFIG_WCE)
+                 | ( 1 << VIRTIO_BLK_F_MQ)
                  | ( 1 << VIRTIO_BLK_F_WCE));
 }
 
@@ -10,6 +10,7 @@
 #include "drivers/virtio.hh"
 #include "drivers/pci-device.hh"
 #include <osv/bio.h>
+#include <lockfree/ring.hh>
 
 namespace virtio {
 
@@ -28,6 +29,7 @@ public:
         VIRTIO_BLK_F_WCE        = 9,  /* Writeback mode enabled after reset */
         VIRTIO_BLK_F_TOPOLOGY   = 10, /* Topology information is available */
         VIRTIO_BLK_F_CONFIG_WCE = 11, /* Writeback mode available in config */
+        VIRTIO_BLK_F_MQ         = 12, /* Support more than one vq */
     };
 
     enum {
@@ -95,6 +97,10 @@ public:
 
             /* writeback mode (if VIRTIO_BLK_F_CONFIG_WCE) */
             u8 wce;
+            u8 unused;
+
+            /* number of vqs, only available when VIRTIO_BLK_F_MQ is set */
+            u16 num_queues;
     } __attribute__((packed));
 
     /* This is the first element of the read scatter-gather list. */
@@ -128,7 +134,7 @@ public:
 
     int make_request(struct bio*);
 
-    void req_done();
+    void req_done(unsigned idx);
     int64_t size();
 
     void set_readonly() {_ro = true;}
@@ -148,6 +154,36 @@ private:
         struct bio* bio;
     };
 
+    // A request queue, used by the cpus for which idx == cpu % _nqueues.
+    // Its requests complete on the first of these cpus.
+    struct rq {
+        rq(vring* vq, std::function<void ()> done_func, sched::cpu* c)
+            : vqueue(vq), done_task(done_func, sched::thread::attr().pin(c).name("virtio-blk")) {};
+        vring* vqueue;
+        sched::thread done_task;
+        // protects vqueue against concurrent submitters, which are only
+        // threads running on the same cpus, so it is rarely contended
+        mutex lock;
+        // Requests recycled by done_task (the single producer) for the
+        // submitters (a single consumer, under lock), so that neither
+        // allocates memory in the common case.
+        static constexpr unsigned max_free_reqs = 1024;
+        ring_spsc<blk_req*, max_free_reqs> free_reqs;
+        blk_req* get_req() {
+            blk_req* req;
+            return free_reqs.pop(req) ? req : new blk_req(nullptr);
+        }
+        void put_req(blk_req* req) {
+            if (!free_reqs.push(req)) {
+                delete req;
+            }
+        }
+    };
+
+    unsigned pick_rq() {
+        return sched::cpu::current()->id % _nqueues;
+    }
+
     std::string _driver_name;
     blk_config _config;
 
@@ -155,8 +191,9 @@ private:
     static int _instance;
     int _id;
     bool _ro;
-    // This mutex protects parallel make_request invocations
-    mutex _lock;
+    bool _mq = false;
+    unsigned _nqueues;
+    rq* _rq[max_virtqueues_nr];
     gsi_level_interrupt _gsi;
 };
 
@@ -23,6 +23,7 @@
 #include <osv/debug.h>
 
 #include <osv/sched.hh>
+#include <osv/clock.hh>
 #include "osv/trace.hh"
 
 
@@ -40,7 +41,7 @@
 #include <bsd/sys/netinet/tcp.h>
 
 TRACEPOINT(trace_virtio_net_rx_packet, "if=%d, len=%d", int, int);
-TRACEPOINT(trace_virtio_net_rx_wake, "");
+TRACEPOINT(trace_virtio_net_rx_wake, "if=%d, queue=%d", int, unsigned);
 TRACEPOINT(trace_virtio_net_fill_rx_ring, "if=%d", int);
 TRACEPOINT(trace_virtio_net_fill_rx_ring_added, "if=%d, added=%d", int, int);
 TRACEPOINT(trace_virtio_net_tx_packet, "if=%d, len=%d", int, int);
@@ -56,6 +57,8 @@ using namespace memory;
 namespace virtio {
 
 int net::_instance = 0;
+std::vector<unsigned> net::xps;
+std::vector<unsigned> net::rxq_cpus;
 
 #define net_tag "virtio-net"
 #define net_d(...)   tprintf_d(net_tag, __VA_ARGS__)
@@ -123,20 +126,25 @@ static int if_transmit(struct ifnet* ifp, struct mbuf* m_head)
 
     net_d("%s_start", __FUNCTION__);
 
-    /* Process packets */
-    vnet->_tx_ring_lock.lock();
+    unsigned idx = vnet->pick_txq(m_head);
+
+    /*
+     * Process packets. Transmitters queued behind each other on the lock
+     * leave kicking the host to the last one.
+     */
+    vring* vq = vnet->tx_vqueue(idx);
+    vq->batch_begin();
+    vnet->tx_lock(idx).lock();
 
     net_d("*** processing packet! ***");
 
-    unsigned idx = vnet->pick_txq(m_head);
     int error = vnet->tx_locked(idx, m_head);
 
-    if (!error)
-        vnet->kick(2 * idx + 1);
-    else
+    if (error)
         printf("if_transmit error %d\n", error);
+    vq->batch_end();
 
-    vnet->_tx_ring_lock.unlock();
+    vnet->tx_lock(idx).unlock();
 
     return error;
 }
@@ -164,8 +172,8 @@ static void if_getinfo(struct ifnet* ifp, struct if_data* out_data)
 
 void net::fill_stats(struct if_data* out_data) const
 {
-    // We currently support _num_queues / 2 pairs of Tx/Rx queues
-    for (unsigned idx = 0; idx < _num_queues / 2; idx++) {
+    // if_data has no per-queue counters, so report the sum over all queues
+    for (unsigned idx = 0; idx < _queue_pairs; idx++) {
         fill_qstats(_rxq[idx], out_data);
         fill_qstats(_txq[idx], out_data);
     }
@@ -183,18 +191,19 @@ void net::fill_qstats(const struct rxq* rxq,
 void net::fill_qstats(const struct txq* txq,
                              struct if_data* out_data) const
 {
-    assert(!out_data->ifi_oerrors && !out_data->ifi_obytes && !out_data->ifi_opackets);
     out_data->ifi_opackets += txq->stats.tx_packets;
     out_data->ifi_obytes   += txq->stats.tx_bytes;
     out_data->ifi_oerrors  += txq->stats.tx_err + txq->stats.tx_drops;
 }
 
-bool net::ack_irq(unsigned idx)
+bool net::ack_irq()
 {
     auto isr = virtio_conf_readb(VIRTIO_PCI_ISR);
 
     if (isr) {
-        _rxq[idx]->vqueue->disable_interrupts();
+        for (unsigned idx = 0; idx < _queue_pairs; idx++) {
+            _rxq[idx]->vqueue->interrupt();
+        }
         return true;
     } else {
         return false;
@@ -207,20 +216,32 @@ net::net(pci::device& dev)
 {
     unsigned idx;
 
-printf("net::net num_queues %d\n", _num_queues);
-    for (idx = 0; idx < _num_queues / 2; idx++) {
-        _rxq[idx] = new rxq(get_virt_queue(2 * idx), [this] { this->receiver(); }, sched::cpus[idx]);
-        _txq[idx] = new txq(get_virt_queue(2 * idx + 1));
-printf("net::net idx %d\n", idx);
-    }
-printf("net::net1 idx %d\n", idx);
-
     _driver_name = "virtio-net";
     virtio_i("VIRTIO NET INSTANCE");
     _id = _instance++;
 
-//    setup_features();
-//    read_config();
+    probe_virt_queues();
+
+    // The device has max_virtqueue_pairs rx/tx queue pairs followed by the
+    // control queue, or, without VIRTIO_NET_F_MQ, a single pair.
+    unsigned max_pairs = _mq ? _config.max_virtqueue_pairs : 1;
+    if (_ctrl_vq_cap) {
+        _ctrl_vq = get_virt_queue(2 * max_pairs);
+    }
+    if (_mq && !_ctrl_vq) {
+        net_w("Control queue %d was not set up, using a single queue pair", 2 * max_pairs);
+        max_pairs = 1;
+    }
+    _queue_pairs = std::min<unsigned>(max_pairs,
+            rxq_cpus.empty() ? sched::cpus.size() : rxq_cpus.size());
+    net_i("Using %d of %d queue pairs", _queue_pairs, max_pairs);
+
+    for (idx = 0; idx < _queue_pairs; idx++) {
+        unsigned cpu = rxq_cpus.empty() ? idx : rxq_cpus[idx];
+        _rxq[idx] = new rxq(get_virt_queue(2 * idx), [this, idx] { this->receiver(idx); },
+                            sched::cpus[cpu % sched::cpus.size()]);
+        _txq[idx] = new txq(get_virt_queue(2 * idx + 1));
+    }
 
     _hdr_size = _mergeable_bufs ? sizeof(net_hdr_mrg_rxbuf) : sizeof(net_hdr);
 
@@ -244,8 +265,7 @@ printf("net::net1 idx %d\n", idx);
     _ifn->if_getinfo = if_getinfo;
 
     int ifn_qsize = 0;
-printf("net::net num_queues1 %d\n", _num_queues);
-    for (idx = 0; idx < _num_queues / 2; idx++)
+    for (idx = 0; idx < _queue_pairs; idx++)
         ifn_qsize += _txq[idx]->vqueue->size();
 
     IFQ_SET_MAXLEN(&_ifn->if_snd, ifn_qsize);
@@ -268,27 +288,40 @@ printf("net::net num_queues1 %d\n", _num_queues);
 
     _ifn->if_capenable = _ifn->if_capabilities | IFCAP_HWSTATS;
 
-    //Start the polling thread before attaching it to the Rx interrupt
-printf("net::net num_queues2 %d\n", _num_queues);
-    for (idx = 0; idx < _num_queues / 2; idx++)
+    //Start the polling threads before attaching them to the Rx interrupts
+    for (idx = 0; idx < _queue_pairs; idx++)
         _rxq[idx]->poll_task.start();
 
     ether_ifattach(_ifn, _config.mac);
 
-    for (idx = 0; idx < _num_queues / 2; idx++) {
-        if (dev.is_msix()) {
-            _msi.easy_register({
-                { 2 * idx, [&] { _rxq[idx]->vqueue->disable_interrupts(); }, &_rxq[idx]->poll_task },
-                { 2 * idx + 1, [&] { _txq[idx]->vqueue->disable_interrupts(); }, nullptr }
-            });
-        } else {
-            _gsi.set_ack_and_handler(dev.get_interrupt_line(), [=] { return this->ack_irq(idx); }, [=] { _rxq[idx]->poll_task.wake(); });
+    if (dev.is_msix()) {
+        std::vector<msix_binding> bindings;
+        for (idx = 0; idx < _queue_pairs; idx++) {
+            vring* rx_vq = _rxq[idx]->vqueue;
+            vring* tx_vq = _txq[idx]->vqueue;
+            bindings.push_back({ 2 * idx, [=] { rx_vq->interrupt(); }, &_rxq[idx]->poll_task });
+            bindings.push_back({ 2 * idx + 1, [=] { tx_vq->interrupt(); }, nullptr });
         }
+        _msi.easy_register(bindings);
+    } else {
+        // A single interrupt line for all the queues
+        _gsi.set_ack_and_handler(dev.get_interrupt_line(), [=] { return this->ack_irq(); }, [=] {
+            for (unsigned i = 0; i < _queue_pairs; i++) {
+                _rxq[i]->poll_task.wake();
+            }
+        });
+    }
 
+    for (idx = 0; idx < _queue_pairs; idx++)
         fill_rx_ring(idx);
-    }
 
     add_dev_status(VIRTIO_CONFIG_S_DRIVER_OK);
+
+    // Until told otherwise, the device only uses the first queue pair
+    if (_queue_pairs > 1 && !set_queue_pairs(_queue_pairs)) {
+        net_w("Failed to enable %d queue pairs, using a single one", _queue_pairs);
+        _queue_pairs = 1;
+    }
 }
 
 net::~net()
@@ -308,7 +341,6 @@ net::~net()
 
 void net::read_config()
 {
-printf("net::read_config\n");
     virtio_driver::read_config();
 
     //read all of the net config  in one shot
@@ -332,15 +364,63 @@ printf("net::read_config\n");
     _guest_tso4 = get_guest_feature_bit(VIRTIO_NET_F_GUEST_TSO4);
     _host_tso4 = get_guest_feature_bit(VIRTIO_NET_F_HOST_TSO4);
     _guest_ufo = get_guest_feature_bit(VIRTIO_NET_F_GUEST_UFO);
-    if (get_guest_feature_bit(VIRTIO_NET_F_MQ))
-       printf("VIRTIO_NET_F_MQ is enabled\n");
-    
+    _ctrl_vq_cap = get_guest_feature_bit(VIRTIO_NET_F_CTRL_VQ);
+    _mq = _ctrl_vq_cap && get_guest_feature_bit(VIRTIO_NET_F_MQ);
 
     net_i("Features: %s=%d,%s=%d", "Status", _status, "TSO_ECN", _tso_ecn);
     net_i("Features: %s=%d,%s=%d", "Host TSO ECN", _host_tso_ecn, "CSUM", _csum);
     net_i("Features: %s=%d,%s=%d", "Guest_csum", _guest_csum, "guest tso4", _guest_tso4);
     net_i("Features: %s=%d", "host tso4", _host_tso4);
-    printf("Features: max_queue_pairs %d\n", _config.max_virtqueue_pairs);
+    if (_mq) {
+        net_i("Features: %s=%d", "max queue pairs", _config.max_virtqueue_pairs);
+    }
+}
+
+bool net::set_queue_pairs(unsigned pairs)
+{
+    struct mq_cmd {
+        net_ctrl_hdr hdr;
+        net_ctrl_mq mq;
+        net_ctrl_ack ack;
+    };
+    auto cmd = new mq_cmd;
+
+    cmd->hdr.class_t = VIRTIO_NET_CTRL_MQ;
+    cmd->hdr.cmd = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET;
+    cmd->mq.virtqueue_pairs = pairs;
+    cmd->ack = VIRTIO_NET_ERR;
+
+    vring* vq = _ctrl_vq;
+    vq->init_sg();
+    vq->add_out_sg(&cmd->hdr, sizeof(cmd->hdr));
+    vq->add_out_sg(&cmd->mq, sizeof(cmd->mq));
+    vq->add_in_sg(&cmd->ack, sizeof(cmd->ack));
+    if (!vq->add_buf(cmd)) {
+        delete cmd;
+        return false;
+    }
+    vq->kick();
+
+    // The control queue has no interrupt, and this is only done once, so
+    // just wait for the device to consume the command. Don't hang the boot
+    // on a device which never does: leave it on a single queue pair, and
+    // leak the command, which the device still owns.
+    using namespace osv::clock::literals;
+    auto deadline = osv::clock::uptime::now() + 1_s;
+    u32 len;
+    while (!vq->used_ring_not_empty()) {
+        if (osv::clock::uptime::now() > deadline) {
+            return false;
+        }
+        sched::thread::yield();
+    }
+    vq->get_buf_elem(&len);
+    vq->get_buf_finalize();
+    vq->get_buf_gc();
+
+    bool ok = cmd->ack == VIRTIO_NET_OK;
+    delete cmd;
+    return ok;
 }
 
 /**
@@ -403,17 +483,118 @@ bool net::bad_rx_csum(struct mbuf* m, struct net_hdr* hdr)
     return false;
 }
 
-void net::receiver()
+// A key of repeated 0x6d5a makes the Toeplitz hash symmetric, i.e., both
+// directions of a flow hash to the same value (Woo and Park, "Scalable TCP
+// Session Monitoring with Symmetric Receive-side Scaling"). The flowid we
+// set on received packets is cached by tcp in the inpcb and put on every
+// packet it sends, so the flow's transmit queue is the same whether the
+// first packet was sent or received.
+static const u8 rss_key[40] = {
+    0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+    0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+    0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+    0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+    0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+};
+
+// The hash is linear in its input, so we precompute the contribution of
+// every value of each input byte, and hash with one lookup per byte rather
+// than one step per bit.
+static struct toeplitz_table {
+    // the longest input: source and destination address and port
+    static constexpr unsigned max_len = 12;
+    u32 t[max_len][256];
+
+    toeplitz_table()
+    {
+        for (unsigned i = 0; i < max_len; i++) {
+            // the 32 key bits aligned with the first bit of byte i
+            u32 v = (rss_key[i] << 24) | (rss_key[i + 1] << 16) |
+                    (rss_key[i + 2] << 8) | rss_key[i + 3];
+            for (unsigned byte = 0; byte < 256; byte++) {
+                u32 hash = 0;
+                u32 w = v;
+                for (int b = 7; b >= 0; b--) {
+                    if (byte & (1 << b)) {
+                        hash ^= w;
+                    }
+                    w = (w << 1) | ((rss_key[i + 4] >> b) & 1);
+                }
+                t[i][byte] = hash;
+            }
+        }
+    }
+} toeplitz;
+
+static u32 toeplitz_hash(const u8* data, unsigned len)
+{
+    u32 hash = 0;
+
+    for (unsigned i = 0; i < len; i++) {
+        hash ^= toeplitz.t[i][data[i]];
+    }
+
+    return hash;
+}
+
+/**
+ * Compute the RSS hash of an IPv4 packet: over the addresses and ports for
+ * unfragmented TCP and UDP, over the addresses only for anything else.
+ * Packets whose headers are not in the first mbuf, and non-IPv4 packets,
+ * all hash to 0.
+ */
+static u32 flow_hash(struct mbuf* m)
+{
+    int ip_offset = sizeof(struct ether_header);
+    int len = m->m_hdr.mh_len;
+    u8* p = mtod(m, u8*);
+
+    if (len < ip_offset) {
+        return 0;
+    }
+
+    u16 eth_type = ntohs(((struct ether_header*)p)->ether_type);
+    if (eth_type == ETHERTYPE_VLAN) {
+        ip_offset = sizeof(struct ether_vlan_header);
+        if (len < ip_offset) {
+            return 0;
+        }
+        eth_type = ntohs(((struct ether_vlan_header*)p)->evl_proto);
+    }
+
+    if (eth_type != ETHERTYPE_IP || len < ip_offset + (int)sizeof(struct ip)) {
+        return 0;
+    }
+
+    struct ip* ip = (struct ip*)(p + ip_offset);
+    int l4_offset = ip_offset + (ip->ip_hl << 2);
+
+    // source address, destination address, source port, destination port
+    u8 tuple[12];
+    unsigned tuple_len = 8;
+    memcpy(tuple, &ip->ip_src, 4);
+    memcpy(tuple + 4, &ip->ip_dst, 4);
+
+    if ((ip->ip_p == IPPROTO_TCP || ip->ip_p == IPPROTO_UDP) &&
+        !(ntohs(ip->ip_off) & (IP_MF | IP_OFFMASK)) &&
+        len >= l4_offset + 4) {
+        // both tcp and udp headers start with the two ports
+        memcpy(tuple + 8, p + l4_offset, 4);
+        tuple_len = 12;
+    }
+
+    return toeplitz_hash(tuple, tuple_len);
+}
+
+void net::receiver(unsigned idx)
 {
-    unsigned idx = sched::cpu::current()->id;
-    printf("receiver idx %d\n", idx);
     struct rxq* rxq = _rxq[idx];
     vring* vq = rxq->vqueue;
     while (1) {
 
         // Wait for rx queue (used elements)
         virtio_driver::wait_for_queue(vq, &vring::used_ring_not_empty);
-        trace_virtio_net_rx_wake();
+        trace_virtio_net_rx_wake(_ifn->if_index, idx);
 
         u32 len;
         int nbufs;
@@ -426,6 +607,9 @@ void net::receiver()
         // truncating it.
         net_hdr_mrg_rxbuf* mhdr;
 
+        // net channels which got packets are woken once, after the burst
+        classifier::wake_batch wakes;
+
         while (m != nullptr) {
 
             // TODO: should get out of the loop
@@ -480,6 +664,9 @@ void net::receiver()
             // that aren't need for the above layer
             m_adj(m_head, offset);
 
+            m_head->M_dat.MH.MH_pkthdr.flowid = flow_hash(m_head);
+            m_head->m_hdr.mh_flags |= M_FLOWID;
+
             if ((_ifn->if_capenable & IFCAP_RXCSUM) &&
                 (mhdr->hdr.flags &
                  net_hdr::VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
@@ -493,7 +680,7 @@ void net::receiver()
             rx_packets++;
             rx_bytes += m_head->M_dat.MH.MH_pkthdr.len;
 
-            bool fast_path = _ifn->if_classifier.post_packet(m_head);
+            bool fast_path = _ifn->if_classifier.post_packet(m_head, wakes);
             if (!fast_path) {
                 (*_ifn->if_input)(_ifn, m_head);
             }
@@ -509,6 +696,8 @@ void net::receiver()
             m = static_cast<struct mbuf*>(vq->get_buf_elem(&len));
         }
 
+        _ifn->if_classifier.flush(wakes);
+
         if (vq->refill_ring_cond())
             fill_rx_ring(idx);
 
@@ -553,11 +742,11 @@ void net::fill_rx_ring(unsigned idx)
 // TODO: Does it really have to be "locked"?
 int net::tx_locked(unsigned idx, struct mbuf* m_head, bool flush)
 {
-    DEBUG_ASSERT(_tx_ring_lock.owned(), "_tx_ring_lock is not locked!");
+    DEBUG_ASSERT(tx_lock(idx).owned(), "tx_lock(%d) is not locked!", idx);
 
     struct mbuf* m;
-    net_req* req = new net_req;
     struct txq* txq = _txq[idx];
+    net_req* req = txq->get_req();
     vring* vq = txq->vqueue;
     auto vq_sg_vec = &vq->_sg_vec;
     int rc = 0;
@@ -569,7 +758,7 @@ int net::tx_locked(unsigned idx, struct mbuf* m_head, bool flush)
     if (m_head->M_dat.MH.MH_pkthdr.csum_flags != 0) {
         m = tx_offload(m_head, &req->mhdr.hdr);
         if ((m_head = m) == nullptr) {
-            delete req;
+            txq->put_req(req);
 
             /* The buffer is not well-formed */
             rc = EINVAL;
@@ -599,7 +788,7 @@ int net::tx_locked(unsigned idx, struct mbuf* m_head, bool flush)
             tx_gc(idx);
         } else {
             net_d("%s: no room", __FUNCTION__);
-            delete req;
+            txq->put_req(req);
 
             rc = ENOBUFS;
             goto out;
@@ -608,7 +797,7 @@ int net::tx_locked(unsigned idx, struct mbuf* m_head, bool flush)
 
     if (!vq->add_buf(req)) {
         trace_virtio_net_tx_failed_add_buf(_ifn->if_index);
-        delete req;
+        txq->put_req(req);
 
         rc = ENOBUFS;
         goto out;
@@ -724,24 +913,46 @@ net::tx_offload(struct mbuf* m, struct net_hdr* hdr)
     return m;
 }
 
-// TODO: it still need more effort
-//  1. a better way to select tx
-//  2. work together with Vlad Zolotarov's Tx softirq affinity
 unsigned net::pick_txq(mbuf* m)
 {
-//    struct ether_header* eh;
-//    u16 hash;
+    unsigned ntxq = _queue_pairs;
+
+    if (ntxq == 1) {
+        return 0;
+    }
+
+    if (!xps.empty()) {
+        return xps[sched::cpu::current()->id % xps.size()] % ntxq;
+    }
 
-//    eh = mtod(m, struct ether_header*);
-//    hash = ntohs(eh->ether_type);
+    if (!(m->m_hdr.mh_flags & M_FLOWID)) {
+        m->M_dat.MH.MH_pkthdr.flowid = flow_hash(m);
+        m->m_hdr.mh_flags |= M_FLOWID;
+    }
 
-//    return (unsigned) (((u64) hash * (_num_queues / 2)) >> 32);
+    // Scale the 32-bit hash onto [0, ntxq)
+    return ((u64)m->M_dat.MH.MH_pkthdr.flowid * ntxq) >> 32;
+}
 
-      unsigned idx = sched::cpu::current()->id;
-      if (idx >= _num_queues / 2)
-          printf("pick idx %d\n", idx);
+net::net_req* net::txq::get_req()
+{
+    if (free_reqs.empty()) {
+        return new net_req;
+    }
+    auto req = free_reqs.back();
+    free_reqs.pop_back();
+    return req;
+}
 
-      return idx;
+void net::txq::put_req(net_req* req)
+{
+    req->um.reset();
+    memset(&req->mhdr, 0, sizeof(req->mhdr));
+    if (free_reqs.size() < (size_t)vqueue->size()) {
+        free_reqs.push_back(req);
+    } else {
+        delete req;
+    }
 }
 
 void net::tx_gc(unsigned idx)
@@ -753,7 +964,7 @@ void net::tx_gc(unsigned idx)
     req = static_cast<net_req*>(vq->get_buf_elem(&len));
 
     while(req != nullptr) {
-        delete req;
+        _txq[idx]->put_req(req);
         vq->get_buf_finalize();
 
         req = static_cast<net_req*>(vq->get_buf_elem(&len));
@@ -763,7 +974,6 @@ void net::tx_gc(unsigned idx)
 
 u32 net::get_driver_features()
 {
-printf("net::get_driver_features\n");
     u32 base = virtio_driver::get_driver_features();
     return (base | (1 << VIRTIO_NET_F_MAC)        \
                  | (1 << VIRTIO_NET_F_MRG_RXBUF)  \
@@ -775,6 +985,7 @@ printf("net::get_driver_features\n");
                  | (1 << VIRTIO_NET_F_HOST_TSO4)  \
                  | (1 << VIRTIO_NET_F_GUEST_ECN)  \
                  | (1 << VIRTIO_NET_F_GUEST_UFO)  \
+                 | (1 << VIRTIO_NET_F_CTRL_VQ)    \
                  | (1 << VIRTIO_NET_F_MQ)
             );
 }
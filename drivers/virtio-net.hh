@@ -13,6 +13,8 @@
 #include <bsd/sys/net/if.h>
 #include <bsd/sys/sys/mbuf.h>
 #include <osv/sched.hh>
+#include <osv/mutex.h>
+#include <vector>
 
 #include "drivers/virtio.hh"
 #include "drivers/pci-device.hh"
@@ -212,16 +214,23 @@ public:
 
     void wait_for_queue(vring* queue);
     bool bad_rx_csum(struct mbuf* m, struct net_hdr* hdr);
-    void receiver();
+    void receiver(unsigned idx);
     void fill_rx_ring(unsigned idx);
 
-    bool ack_irq(unsigned idx);
+    bool ack_irq();
+
+    /**
+     * Tell the device how many rx/tx queue pairs to use, through the
+     * control queue.
+     * @return true if the device accepted the command
+     */
+    bool set_queue_pairs(unsigned pairs);
 
     /**
      * Transmit a single mbuf.
      * @param m_head a buffer to transmits
      * @param flush kick() if TRUE
-     * @note should be called under the _tx_ring_lock.
+     * @note should be called under tx_lock(idx).
      *
      * @return 0 in case of success and an appropriate error code
      *         otherwise
@@ -229,7 +238,18 @@ public:
     int tx_locked(unsigned idx, struct mbuf* m_head, bool flush = false);
 
     struct mbuf* tx_offload(struct mbuf* m, struct net_hdr* hdr);
+    /**
+     * Select the Tx queue for a packet.
+     *
+     * By default all packets of a flow go out on the same queue, chosen by
+     * the packet's flowid (computed and cached in the mbuf if the upper
+     * layers did not provide one), so a flow is never reordered no matter
+     * which cpu sends it. If the xps table is set, the queue is picked by
+     * the sending cpu instead.
+     */
     unsigned pick_txq(struct mbuf* m);
+    mutex& tx_lock(unsigned idx) { return _txq[idx]->lock; }
+    vring* tx_vqueue(unsigned idx) { return _txq[idx]->vqueue; }
     void kick(int queue) {_queues[queue]->kick();}
     void tx_gc(unsigned idx);
     static hw_driver* probe(hw_device* dev);
@@ -241,8 +261,16 @@ public:
      */
     void fill_stats(struct if_data* out_data) const;
 
-    // tx ring lock protects this ring for multiple access
-    mutex _tx_ring_lock;
+    // Optional XPS-style cpu to Tx queue map, set from the command line:
+    // cpu N transmits on queue xps[N % xps.size()] (modulo the number of
+    // queues). Empty means select the queue by flow hash.
+    static std::vector<unsigned> xps;
+
+    // Optional cpu of each rx queue's poll thread, set from the command
+    // line: queue N is polled on cpu rxq_cpus[N], and the number of queue
+    // pairs used is limited to the size of the list. By default, queue N is
+    // polled on cpu N, with as many queue pairs as cpus.
+    static std::vector<unsigned> rxq_cpus;
 
 private:
 
@@ -268,6 +296,12 @@ private:
     bool _guest_tso4 = false;
     bool _host_tso4 = false;
     bool _guest_ufo = false;
+    bool _ctrl_vq_cap = false;
+    bool _mq = false;
+
+    vring* _ctrl_vq = nullptr;
+    // number of rx/tx queue pairs in use
+    unsigned _queue_pairs = 1;
 
     u32 _hdr_size;
 
@@ -302,9 +336,21 @@ private:
 
     /* Single Tx queue object */
     struct txq {
-        txq(vring* vq) : vqueue(vq) {};
+        txq(vring* vq) : vqueue(vq) {
+            free_reqs.reserve(vq->size());
+            for (int i = 0; i < vq->size(); i++) {
+                free_reqs.push_back(new net_req);
+            }
+        };
         vring* vqueue;
+        // protects vqueue against concurrent transmitters
+        mutex lock;
         struct txq_stats stats = { 0 };
+        // Requests of completed packets, reused instead of allocating one
+        // per packet. Also protected by lock.
+        std::vector<net_req*> free_reqs;
+        net_req* get_req();
+        void put_req(net_req* req);
     };
 
     /**
@@ -321,7 +367,7 @@ private:
      */
     void fill_qstats(const struct txq* txq, struct if_data* out_data) const;
 
-    /* We currently support max_virtqueues_nr / 2 pairs of Rx+Tx queues */
+    /* We support up to max_virtqueues_nr / 2 pairs of Rx+Tx queues */
     struct rxq* _rxq[max_virtqueues_nr / 2];
     struct txq* _txq[max_virtqueues_nr / 2];
 
@@ -361,7 +361,7 @@ bool scsi::ack_irq()
     auto queue = get_virt_queue(VIRTIO_SCSI_QUEUE_REQ);
 
     if (isr) {
-        queue->disable_interrupts();
+        queue->interrupt();
         return true;
     } else {
         return false;
@@ -372,12 +372,10 @@ bool scsi::ack_irq()
 scsi::scsi(pci::device& dev)
     : virtio_driver(dev)
 {
-printf("scsi::scsi\n");
     _driver_name = "virtio-scsi";
     _id = _instance++;
 
-//    setup_features();
-//    read_config();
+    probe_virt_queues();
 
     //register the single irq callback for the block
     sched::thread* t = new sched::thread([this] { this->req_done(); },
@@ -389,14 +387,15 @@ printf("scsi::scsi\n");
         _msi.easy_register({
                 { VIRTIO_SCSI_QUEUE_CTRL, nullptr, nullptr },
                 { VIRTIO_SCSI_QUEUE_EVT, nullptr, nullptr },
-                { VIRTIO_SCSI_QUEUE_REQ, [=] { queue->disable_interrupts(); }, t },
+                { VIRTIO_SCSI_QUEUE_REQ, [=] { queue->interrupt(); }, t },
         });
     } else {
         _gsi.set_ack_and_handler(dev.get_interrupt_line(), [=] { return this->ack_irq(); }, [=] { t->wake(); });
     }
 
-    // Enable indirect descriptor
-    queue->set_use_indirect(true);
+    // Enable indirect descriptor: a command is a request, up to seg_max
+    // data segments and a response
+    queue->set_use_indirect(true, _config.seg_max + 2);
 
     add_dev_status(VIRTIO_CONFIG_S_DRIVER_OK);
 
@@ -0,0 +1,257 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#include "drivers/virtio-serial.hh"
+#include <osv/mempool.hh>
+#include <osv/sched.hh>
+#include <osv/clock.hh>
+#include <osv/debug.h>
+#include "processor.hh"
+
+using memory::page_size;
+
+namespace virtio {
+
+// The queues of port 0, which is the console port of a device without
+// VIRTIO_CONSOLE_F_MULTIPORT, and of the control channel, with it.
+enum {
+    RX_QUEUE = 0,
+    TX_QUEUE = 1,
+    CTRL_RX_QUEUE = 2,
+    CTRL_TX_QUEUE = 3,
+};
+
+using namespace osv::clock::literals;
+
+// How long write() waits for the host to take a page of output, with the
+// console's spinlock held
+constexpr auto tx_timeout = 100_ms;
+// How long the device gets to take a control message, at probe, and to
+// queue the replies to it
+constexpr auto control_timeout = 1_s;
+constexpr auto control_grace = 100_ms;
+// Each receive buffer of the control queue holds a message, and the name
+// which may follow it
+constexpr size_t control_buf_size = 128;
+
+serial::serial(pci::device& pci_dev)
+    : virtio_driver(pci_dev)
+    , _gsi(pci_dev.get_interrupt_line(), [&] { return ack_irq(); },
+            [&] { console::input_thread()->wake(); })
+    , _tio(console::get_termios())
+{
+    probe_virt_queues();
+    _rxq = get_virt_queue(RX_QUEUE);
+    _txq = get_virt_queue(TX_QUEUE);
+    _rxbuf = static_cast<char*>(memory::alloc_page());
+    _txbuf = static_cast<char*>(memory::alloc_page());
+    // we wait for our output to be consumed, without interrupts
+    _txq->disable_interrupts();
+
+    add_dev_status(VIRTIO_CONFIG_S_DRIVER_OK);
+
+    refill_rx();
+    if (find_console_port()) {
+        console::set_device(this);
+    } else {
+        debug("virtio-serial: no console port, not using it as the console\n");
+    }
+}
+
+serial::~serial()
+{
+}
+
+bool serial::ack_irq()
+{
+    return virtio_conf_readb(VIRTIO_PCI_ISR);
+}
+
+bool serial::reclaim_tx()
+{
+    if (!_txq->used_ring_not_empty()) {
+        return false;
+    }
+    u32 done;
+    _txq->get_buf_elem(&done);
+    _txq->get_buf_finalize();
+    _txq->get_buf_gc();
+    _tx_busy = false;
+    return true;
+}
+
+void serial::write(const char *str, size_t len)
+{
+    // The host stopped taking our output: drop it until it catches up
+    if (_tx_busy && !reclaim_tx()) {
+        return;
+    }
+    bool onlcr = (_tio->c_oflag & OPOST) && (_tio->c_oflag & ONLCR);
+    while (len > 0) {
+        size_t n = 0;
+        while (len > 0 && n < page_size - 1) {
+            if (*str == '\n' && onlcr) {
+                _txbuf[n++] = '\r';
+            }
+            _txbuf[n++] = *str++;
+            len--;
+        }
+        _txq->init_sg();
+        _txq->add_out_sg(_txbuf, n);
+        _txq->add_buf(_txbuf);
+        _txq->kick();
+        _tx_busy = true;
+        // We are called with the console's spinlock held, and reuse the
+        // buffer right away: wait for the host to be done with it, but not
+        // for long, as every cpu writing to the console waits with us.
+        auto deadline = osv::clock::uptime::now() + tx_timeout;
+        while (!reclaim_tx()) {
+            if (osv::clock::uptime::now() > deadline) {
+                return;
+            }
+            processor::pause();
+        }
+    }
+}
+
+u32 serial::get_driver_features()
+{
+    auto base = virtio_driver::get_driver_features();
+    return base | (1 << VIRTIO_CONSOLE_F_MULTIPORT);
+}
+
+// Sends a control message, and waits for the device to take it. The device
+// handles a message, queueing its replies, before completing it.
+bool serial::send_control(u32 id, u16 event, u16 value)
+{
+    console_control msg{id, event, value};
+    _c_txq->init_sg();
+    _c_txq->add_out_sg(&msg, sizeof(msg));
+    if (!_c_txq->add_buf(&msg)) {
+        return false;
+    }
+    _c_txq->kick();
+    auto deadline = osv::clock::uptime::now() + control_timeout;
+    while (!_c_txq->used_ring_not_empty()) {
+        if (osv::clock::uptime::now() > deadline) {
+            // the device only reads msg, and we won't talk to it again
+            return false;
+        }
+        sched::thread::yield();
+    }
+    u32 len;
+    _c_txq->get_buf_elem(&len);
+    _c_txq->get_buf_finalize();
+    _c_txq->get_buf_gc();
+    return true;
+}
+
+// Consumes the control messages received, until one is event for port id.
+// Devices queue the replies to a message before completing it, so we only
+// give late ones a short grace.
+bool serial::received_control(u32 id, u16 event)
+{
+    bool found = false;
+    u32 len;
+    auto deadline = osv::clock::uptime::now() + control_grace;
+    while (!found) {
+        if (!_c_rxq->used_ring_not_empty()) {
+            if (osv::clock::uptime::now() > deadline) {
+                break;
+            }
+            sched::thread::yield();
+            continue;
+        }
+        auto buf = static_cast<char*>(_c_rxq->get_buf_elem(&len));
+        _c_rxq->get_buf_finalize();
+        _c_rxq->get_buf_gc();
+        auto msg = reinterpret_cast<console_control*>(buf);
+        if (len >= sizeof(*msg) && msg->id == id && msg->event == event) {
+            found = true;
+        }
+        _c_rxq->init_sg();
+        _c_rxq->add_in_sg(buf, control_buf_size);
+        _c_rxq->add_buf(buf);
+        _c_rxq->kick();
+    }
+    return found;
+}
+
+// With VIRTIO_CONSOLE_F_MULTIPORT, port 0 (the only one we drive) exists,
+// and is a console, only if the device says so in the handshake below.
+bool serial::find_console_port()
+{
+    if (!get_guest_feature_bit(VIRTIO_CONSOLE_F_MULTIPORT)) {
+        return true;
+    }
+    _c_rxq = get_virt_queue(CTRL_RX_QUEUE);
+    _c_txq = get_virt_queue(CTRL_TX_QUEUE);
+    if (!_c_rxq || !_c_txq) {
+        return false;
+    }
+    // we don't handle control messages after probe
+    _c_rxq->disable_interrupts();
+    _c_buf = static_cast<char*>(memory::alloc_page());
+    for (size_t off = 0; off < page_size; off += control_buf_size) {
+        _c_rxq->init_sg();
+        _c_rxq->add_in_sg(_c_buf + off, control_buf_size);
+        if (!_c_rxq->add_buf(_c_buf + off)) {
+            break;
+        }
+    }
+    _c_rxq->kick();
+
+    if (!send_control(0, VIRTIO_CONSOLE_DEVICE_READY, 1) ||
+            !received_control(0, VIRTIO_CONSOLE_PORT_ADD) ||
+            !send_control(0, VIRTIO_CONSOLE_PORT_READY, 1) ||
+            !received_control(0, VIRTIO_CONSOLE_CONSOLE_PORT)) {
+        return false;
+    }
+    send_control(0, VIRTIO_CONSOLE_PORT_OPEN, 1);
+    return true;
+}
+
+void serial::refill_rx()
+{
+    _rxq->init_sg();
+    _rxq->add_in_sg(_rxbuf, page_size);
+    _rxq->add_buf(_rxbuf);
+    _rxq->kick();
+}
+
+bool serial::input_ready()
+{
+    return _rx_pos < _rx_len || _rxq->used_ring_not_empty();
+}
+
+char serial::readch()
+{
+    while (_rx_pos == _rx_len) {
+        if (!_rxq->used_ring_not_empty()) {
+            return 0;
+        }
+        _rxq->get_buf_elem(&_rx_len);
+        _rxq->get_buf_finalize();
+        _rxq->get_buf_gc();
+        _rx_pos = 0;
+        if (!_rx_len) {
+            refill_rx();
+        }
+    }
+    char c = _rxbuf[_rx_pos++];
+    if (_rx_pos == _rx_len) {
+        refill_rx();
+    }
+    return c;
+}
+
+hw_driver* serial::probe(hw_device* dev)
+{
+    return virtio::probe<serial, VIRTIO_SERIAL_DEVICE_ID>(dev);
+}
+
+}
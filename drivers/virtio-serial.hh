@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef VIRTIO_SERIAL_DRIVER_H
+#define VIRTIO_SERIAL_DRIVER_H
+
+#include "drivers/virtio.hh"
+#include "drivers/device.hh"
+#include "drivers/console.hh"
+
+#include <termios.h>
+
+namespace virtio {
+
+// The console port of a virtio-serial device (virtio-console). Output goes
+// to the host a page at a time, costing one notification rather than an
+// exit per byte, as with the ISA serial port. A device whose port 0 isn't
+// a console (say, one only carrying a guest agent's channel) is left alone.
+class serial : public virtio_driver, public Console {
+public:
+    enum {
+        VIRTIO_SERIAL_DEVICE_ID = 0x1003,
+        VIRTIO_CONSOLE_F_MULTIPORT = 1,
+    };
+
+    // Control messages, with VIRTIO_CONSOLE_F_MULTIPORT
+    enum {
+        VIRTIO_CONSOLE_DEVICE_READY = 0,
+        VIRTIO_CONSOLE_PORT_ADD = 1,
+        VIRTIO_CONSOLE_PORT_REMOVE = 2,
+        VIRTIO_CONSOLE_PORT_READY = 3,
+        VIRTIO_CONSOLE_CONSOLE_PORT = 4,
+        VIRTIO_CONSOLE_RESIZE = 5,
+        VIRTIO_CONSOLE_PORT_OPEN = 6,
+        VIRTIO_CONSOLE_PORT_NAME = 7,
+    };
+
+    struct console_control {
+        u32 id;
+        u16 event;
+        u16 value;
+    } __attribute__((packed));
+
+    explicit serial(pci::device& dev);
+    virtual ~serial();
+
+    virtual const std::string get_name() { return "virtio-serial"; }
+
+    virtual void write(const char *str, size_t len) override;
+    virtual bool input_ready() override;
+    virtual char readch() override;
+
+    virtual u32 get_driver_features();
+
+    static hw_driver* probe(hw_device* dev);
+
+private:
+    bool ack_irq();
+    void refill_rx();
+    bool reclaim_tx();
+    bool find_console_port();
+    bool send_control(u32 id, u16 event, u16 value);
+    bool received_control(u32 id, u16 event);
+
+    gsi_level_interrupt _gsi;
+    vring* _rxq;
+    vring* _txq;
+    // one page each, so they are physically contiguous
+    char* _rxbuf;
+    char* _txbuf;
+    u32 _rx_len = 0;
+    u32 _rx_pos = 0;
+    // the host still has _txbuf
+    bool _tx_busy = false;
+    vring* _c_rxq = nullptr;
+    vring* _c_txq = nullptr;
+    char* _c_buf = nullptr;
+    const termios* _tio;
+};
+
+}
+
+#endif
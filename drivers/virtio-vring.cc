@@ -6,6 +6,7 @@
  */
 
 #include <string.h>
+#include <algorithm>
 #include <osv/mempool.hh>
 #include <osv/mmu.hh>
 
@@ -23,7 +24,9 @@ using sched::thread;
 
 TRACEPOINT(trace_virtio_enable_interrupts, "vring=%p", void*);
 TRACEPOINT(trace_virtio_disable_interrupts, "vring=%p", void*);
-TRACEPOINT(trace_virtio_kick, "queue=%d", u16);
+TRACEPOINT(trace_virtio_kick, "queue=%d, bufs=%d", u16, u16);
+TRACEPOINT(trace_virtio_kick_suppressed, "queue=%d, bufs=%d", u16, u16);
+TRACEPOINT(trace_virtio_interrupt, "queue=%d", u16);
 TRACEPOINT(trace_virtio_add_buf, "queue=%d, avail=%d", u16, u16);
 
 namespace virtio {
@@ -56,21 +59,46 @@ namespace virtio {
         _used_ring_host_head = 0;
         _avail_added_since_kick = 0;
         _avail_count = num;
+        _avail_idx = 0;
+        _used_idx = 0;
 
-        _avail_event = reinterpret_cast<std::atomic<u16>*>(&_used->_used_elements[_num]);
-        _used_event = reinterpret_cast<std::atomic<u16>*>(&_avail->_ring[_num]);
+        _avail_event = _used->avail_event(_num);
+        _used_event = _avail->used_event(_num);
 
         _sg_vec.reserve(max_sgs);
 
         _use_indirect = false;
+        _indirect = nullptr;
     }
 
     vring::~vring()
     {
         memory::free_phys_contiguous_aligned(_vring_ptr);
+        if (_indirect) {
+            memory::free_phys_contiguous_aligned(_indirect);
+        }
         delete [] _cookie;
     }
 
+    void vring::set_use_indirect(bool flag, int max_desc)
+    {
+        if (flag && !_indirect) {
+            auto size = std::min(max_desc, max_sgs);
+            if (size < 2) {
+                // not worth it for a single descriptor
+                return;
+            }
+            _indirect = static_cast<vring_desc*>(alloc_phys_contiguous_aligned(
+                    _num * size * sizeof(vring_desc), 8));
+            if (!_indirect) {
+                virtio_w("No memory for the indirect descriptors of queue %d", _q_index);
+                return;
+            }
+            _indirect_size = size;
+        }
+        _use_indirect = flag;
+    }
+
     u64 vring::get_paddr()
     {
         return mmu::virt_to_phys(_vring_ptr);
@@ -89,11 +117,18 @@ namespace virtio {
         _avail->disable_interrupt();
     }
 
+    void vring::interrupt()
+    {
+        trace_virtio_interrupt(_q_index);
+        disable_interrupts();
+    }
+
     bool vring::use_indirect(int desc_needed)
     {
         return _use_indirect &&
                 _dev->get_indirect_buf_cap() &&
                 desc_needed > 1 &&	// no need to use indirect for a single descriptor
+                desc_needed <= _indirect_size &&
                 _avail_count < _num / 4;  // use indirect only when low space
     }
 
@@ -134,9 +169,7 @@ namespace virtio {
             vring_desc* descp = _desc;
 
             if (indirect) {
-                vring_desc* indirect = reinterpret_cast<vring_desc*>(alloc_phys_contiguous_aligned((_sg_vec.size())*sizeof(vring_desc), 8));
-                if (!indirect)
-                    return false;
+                vring_desc* indirect = indirect_table(idx);
                 _desc[idx]._flags = vring_desc::VRING_DESC_F_INDIRECT;
                 _desc[idx]._paddr = mmu::virt_to_phys(indirect);
                 _desc[idx]._len = (_sg_vec.size()) * sizeof(vring_desc);
@@ -162,10 +195,7 @@ namespace virtio {
             _avail_added_since_kick++;
             _avail_count -= desc_needed;
 
-            u16 avail_idx_cache = _avail->_idx.load(std::memory_order_relaxed);
-            _avail->_ring[avail_idx_cache & (_num - 1)] = _avail_head;
-            //Cheaper than the operator++ that uses seq consistency
-            _avail->_idx.store(avail_idx_cache + 1, std::memory_order_release);
+            _avail->_ring[_avail_idx++ & (_num - 1)] = _avail_head;
             _avail_head = idx;
 
             return true;
@@ -186,9 +216,8 @@ namespace virtio {
                 elem = _used->_used_elements[used_ptr];
                 int idx = elem._id;
 
-                if (_desc[idx]._flags & vring_desc::VRING_DESC_F_INDIRECT) {
-                    free_phys_contiguous_aligned(mmu::phys_to_virt(_desc[idx]._paddr));
-                } else
+                // an indirect table needs no freeing, it belongs to idx
+                if (!(_desc[idx]._flags & vring_desc::VRING_DESC_F_INDIRECT))
                     while (_desc[idx]._flags & vring_desc::VRING_DESC_F_NEXT) {
                         idx = _desc[idx]._next;
                         i++;
@@ -211,8 +240,11 @@ namespace virtio {
             // need to trim the free running counter w/ the array size
             int used_ptr = _used_ring_host_head & (_num - 1);
 
-            if (_used_ring_host_head == _used->_idx.load(std::memory_order_acquire)) {
-                return nullptr;
+            if (_used_ring_host_head == _used_idx) {
+                _used_idx = _used->_idx.load(std::memory_order_acquire);
+                if (_used_ring_host_head == _used_idx) {
+                    return nullptr;
+                }
             }
 
             elem = _used->_used_elements[used_ptr];
@@ -257,7 +289,8 @@ namespace virtio {
 
     bool vring::used_ring_not_empty() const
     {
-        return _used_ring_host_head != _used->_idx.load(std::memory_order_relaxed);
+        return _used_ring_host_head != _used_idx ||
+               _used_ring_host_head != _used->_idx.load(std::memory_order_relaxed);
     }
 
     bool vring::used_ring_is_half_empty() const
@@ -270,22 +303,45 @@ namespace virtio {
         return _used_ring_guest_head != _used_ring_host_head;
     }
 
+    // Did the index go past event, when moving from old to new_idx?
+    static inline bool need_event(u16 event, u16 new_idx, u16 old)
+    {
+        return (u16)(new_idx - event - 1) < (u16)(new_idx - old);
+    }
+
     bool
     vring::kick() {
         bool kicked = true;
 
-        if (_dev->get_event_idx_cap()) {
+        if (!_avail_added_since_kick) {
+            return false;
+        }
 
-            kicked = ((u16)(_avail->_idx.load(std::memory_order_relaxed) - _avail_event->load(std::memory_order_relaxed) - 1) < _avail_added_since_kick);
+        // Publish the buffers added since the last kick. Cheaper than the
+        // operator++ that uses seq consistency.
+        _avail->_idx.store(_avail_idx, std::memory_order_release);
 
-        } else if (_used->notifications_disabled())
-            return false;
+        // The host must see the new avail index before we look at whether
+        // it wants to be notified, or we may miss its last update of it.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (_dev->get_event_idx_cap()) {
+            u16 new_idx = _avail_idx;
+            kicked = need_event(_avail_event->load(std::memory_order_relaxed),
+                                new_idx, new_idx - _avail_added_since_kick);
+        } else {
+            kicked = !_used->notifications_disabled();
+        }
 
         if (kicked) {
-            trace_virtio_kick(_q_index);
+            trace_virtio_kick(_q_index, _avail_added_since_kick);
             _dev->kick(_q_index);
-            _avail_added_since_kick = 0;
+        } else {
+            trace_virtio_kick_suppressed(_q_index, _avail_added_since_kick);
         }
+        // Either way the host saw these: it has yet to reach avail_event,
+        // or it is polling the ring
+        _avail_added_since_kick = 0;
         return kicked;
     }
 
@@ -78,7 +78,9 @@ class virtio_driver;
         // only when the value reaches this number
         // The location of this field is places after the variable length ring array,
         // that's why we cannot fully define it within the struct and use a function accessor
-        //std::atomic<u16> used_event;
+        std::atomic<u16>* used_event(unsigned num) {
+            return reinterpret_cast<std::atomic<u16>*>(&_ring[num]);
+        }
     };
 
     class vring_used_elem {
@@ -112,7 +114,9 @@ class virtio_driver;
         // avail event index is an optimization kick the host only when the value reaches this number
         // The location of this field is places after the variable length ring array,
         // that's why we cannot fully define it within the struct and use a function accessor
-        //std::atomic<u16> avail_event;
+        std::atomic<u16>* avail_event(unsigned num) {
+            return reinterpret_cast<std::atomic<u16>*>(&_used_elements[num]);
+        }
     };
 
     class vring {
@@ -124,7 +128,8 @@ class virtio_driver;
         u64 get_paddr();
         static unsigned get_size(unsigned int num, unsigned long align);
 
-        // Ring operations
+        // Ring operations. Buffers added are only made visible to the
+        // host by the next kick().
         bool add_buf(void* cookie);
         // Get the top item from the used ring
         void* get_buf_elem(u32* len);
@@ -151,9 +156,28 @@ class virtio_driver;
         bool avail_ring_has_room(int n);
         bool refill_ring_cond();
         bool use_indirect(int desc_needed);
-        void set_use_indirect(bool flag) { _use_indirect = flag;}
+        // Turns indirect descriptors on or off. The indirect tables are
+        // sized for chains of up to max_desc descriptors (at most max_sgs),
+        // the longest the driver adds; longer ones go in the ring.
+        void set_use_indirect(bool flag, int max_desc);
         bool get_use_indirect() { return _use_indirect;}
+        // Notify the host of the buffers added since the last kick, unless
+        // it told us (with VRING_USED_F_NO_NOTIFY, or the avail event index)
+        // that it will look at them anyway. Returns true if it was notified.
         bool kick();
+
+        // "Add many, kick once": a submitter calls batch_begin() before
+        // taking the lock protecting the ring, and batch_end() instead of
+        // kick() while still holding it. Only the last submitter of a burst,
+        // the one with no other waiting to add more, kicks the host.
+        void batch_begin() { _batch_adders.fetch_add(1, std::memory_order_relaxed); }
+        bool batch_end()
+        {
+            if (_batch_adders.fetch_sub(1, std::memory_order_relaxed) == 1) {
+                return kick();
+            }
+            return false;
+        }
         // Total number of descriptors in ring
         int size() {return _num;}
 
@@ -165,6 +189,8 @@ class virtio_driver;
         // Let host know about interrupt delivery
         void disable_interrupts();
         void enable_interrupts();
+        // Called from the queue's interrupt handler, disables interrupts
+        void interrupt();
 
         const int max_sgs = 256;
         struct sg_node {
@@ -229,6 +255,12 @@ class virtio_driver;
         // The amount of avail descriptors we've added since last kick
         u16 _avail_added_since_kick;
         u16 _avail_count;
+        // Our copy of _avail->_idx, which is only written back on kick(),
+        // so adding a batch of buffers writes that shared cache line once
+        u16 _avail_idx;
+        // The host's used index as of our last look at it. We only read it
+        // again from the ring once we consumed that many elements.
+        u16 _used_idx;
 
         // Flat list of chained descriptors
         vring_desc* _desc;
@@ -245,6 +277,14 @@ class virtio_driver;
         std::atomic<u16>* _used_event;
         // A flag set by driver to turn on/off indirect descriptor
         bool _use_indirect;
+        // Indirect descriptor tables of _indirect_size entries, allocated
+        // when indirect descriptors are turned on. A chain's table is the
+        // one of its head descriptor, so it is free whenever the head is.
+        vring_desc* _indirect;
+        int _indirect_size = 0;
+        vring_desc* indirect_table(int head) { return _indirect + head * _indirect_size; }
+        // submitters between batch_begin() and batch_end()
+        std::atomic<unsigned> _batch_adders = { 0 };
     };
 
 
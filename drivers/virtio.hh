@@ -118,6 +118,10 @@ public:
 
     bool parse_pci_config();
 
+    // Negotiate features, read the device config and set up all the
+    // virtqueues the device has. Called from the derived driver's
+    // constructor, so the driver's get_driver_features() and read_config()
+    // are the ones used.
     void probe_virt_queues();
     vring* get_virt_queue(unsigned idx);
 
@@ -164,9 +168,9 @@ public:
     pci::device& pci_device() { return _dev; }
 protected:
     // Actual drivers should implement this on top of the basic ring features
-    virtual u32 get_driver_features() { printf("virtio_driver get_driver_features\n"); return 1 << VIRTIO_RING_F_INDIRECT_DESC | 1 << VIRTIO_RING_F_EVENT_IDX; }
+    virtual u32 get_driver_features() { return 1 << VIRTIO_RING_F_INDIRECT_DESC | 1 << VIRTIO_RING_F_EVENT_IDX; }
     void setup_features();
-    virtual void read_config() { printf("virtio_driver read_config\n"); }
+    virtual void read_config() {}
 protected:
     pci::device& _dev;
     interrupt_manager _msi;
@@ -256,6 +256,7 @@ struct vnops devfs_vnops = {
 	devfs_inactive,		/* inactive */
 	devfs_truncate,		/* truncate */
 	devfs_link,		/* link */
+	NULL,			/* getpage */
 };
 
 /*
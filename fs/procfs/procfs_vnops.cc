@@ -11,6 +11,9 @@
 #include <osv/prex.h>
 #include <osv/sched.hh>
 #include <osv/mmu.hh>
+#include <bsd/porting/uma_stub.h>
+#include <fs/vfs/vfs.h>
+#include <osv/pagecache.hh>
 
 #include <functional>
 #include <memory>
@@ -213,6 +216,9 @@ procfs_mount(mount* mp, char *dev, int flags, void* data)
 
     auto* root = new proc_dir_node(vp->v_ino);
     root->add("self", self);
+    root->add("uma", inode_count++, uma_procfs_stats);
+    root->add("dcache", inode_count++, dentry_procfs_stats);
+    root->add("pagecache", inode_count++, pagecache::procfs_stats);
 
     vp->v_data = static_cast<void*>(root);
 
@@ -259,6 +265,7 @@ vnops procfs_vnops = {
     (vnop_inactive_t) vop_nullop, // vop_inactive
     (vnop_truncate_t) vop_nullop, // vop_truncate
     (vnop_link_t)     vop_eperm,  // vop_link
+    nullptr,                      // vop_getpage
 };
 
 vfsops procfs_vfsops = {
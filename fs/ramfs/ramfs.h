@@ -52,13 +52,17 @@ struct ramfs_node {
 	char	*rn_name;	/* name (null-terminated) */
 	size_t	 rn_namelen;	/* length of name not including terminator */
 	size_t	 rn_size;	/* file size */
-	char	*rn_buf;	/* buffer to the file data */
-	size_t	 rn_bufsize;	/* allocated buffer size */
+	void	*rn_pages;	/* radix tree of the file data pages */
+	int	 rn_height;	/* levels of index pages above the data */
+	uint64_t rn_ino;	/* inode number, for vget() */
 };
 
+struct vnode;
+
 __BEGIN_DECLS
 struct ramfs_node *ramfs_allocate_node(char *name, int type);
 void ramfs_free_node(struct ramfs_node *node);
+int ramfs_set_file_data(struct vnode *vp, const void *data, size_t size);
 __END_DECLS
 
 #endif /* !_RAMFS_H */
@@ -70,6 +70,7 @@ ramfs_mount(struct mount *mp, char *dev, int flags, void *data)
 	if (np == NULL)
 		return ENOMEM;
 	mp->m_root->d_vnode->v_data = np;
+	mp->m_flags |= MNT_DCACHE;
 	return 0;
 }
 
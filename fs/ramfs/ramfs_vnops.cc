@@ -44,13 +44,148 @@
 #include <osv/vnode.h>
 #include <osv/file.h>
 #include <osv/mount.h>
+#include <osv/mempool.hh>
+#include <osv/pagecache.hh>
 
 #include "ramfs.h"
 
 
+extern void* elf_start;
+extern size_t elf_size;
+
 static mutex_t ramfs_lock = MUTEX_INITIALIZER;
 static uint64_t inode_count = 1; /* inode 0 is reserved to root */
 
+/*
+ * File data is kept in whole pages, indexed by a radix tree of pages of
+ * pointers, so that appending to or reading from a file touches a handful
+ * of pages regardless of its size, holes take no memory, and the data
+ * pages can be mapped as they are (see ramfs_getpage).  A tree of height
+ * 0 is a single data page.  The files of the bootfs image use the pages
+ * of the kernel image itself (see ramfs_set_file_data).
+ */
+#define RAMFS_SHIFT	9
+#define RAMFS_SLOTS	(PAGE_SIZE / sizeof(void *))
+
+static char ramfs_zero_page[PAGE_SIZE];
+
+/* Number of data pages a tree of the given height can index */
+static inline size_t
+ramfs_capacity(int height)
+{
+	return (size_t)1 << (RAMFS_SHIFT * height);
+}
+
+static void *
+ramfs_alloc_page(void)
+{
+	void *page;
+
+	page = memory::alloc_page();
+	if (page != NULL)
+		memset(page, 0, PAGE_SIZE);
+	return page;
+}
+
+static void
+ramfs_free_page(void *page)
+{
+	/* Pages of the kernel image (bootfs files) are not ours to free */
+	if (page >= elf_start && (char *)page < (char *)elf_start + elf_size)
+		return;
+	/* A page still mapped is freed by the page cache, once unmapped */
+	if (!pagecache::adopt(page))
+		memory::free_page(page);
+}
+
+/*
+ * Return the slot pointing to data page number idx of the file, or NULL
+ * if there is none.  With alloc, the tree is grown and the index pages
+ * above the slot are allocated as needed, and NULL means we ran out of
+ * memory.
+ */
+static void **
+ramfs_slot(struct ramfs_node *np, size_t idx, bool alloc)
+{
+	void **slot, **index;
+	int h;
+
+	while (idx >= ramfs_capacity(np->rn_height)) {
+		if (!alloc)
+			return NULL;
+		if (np->rn_pages != NULL) {
+			/* The current tree becomes the first slot of a new root */
+			index = (void **)ramfs_alloc_page();
+			if (index == NULL)
+				return NULL;
+			index[0] = np->rn_pages;
+			np->rn_pages = index;
+		}
+		np->rn_height++;
+	}
+	slot = &np->rn_pages;
+	for (h = np->rn_height; h > 0; h--) {
+		if (*slot == NULL) {
+			if (!alloc)
+				return NULL;
+			*slot = ramfs_alloc_page();
+			if (*slot == NULL)
+				return NULL;
+		}
+		slot = (void **)*slot +
+		    ((idx >> (RAMFS_SHIFT * (h - 1))) & (RAMFS_SLOTS - 1));
+	}
+	return slot;
+}
+
+/*
+ * Return the data page number idx of the file, or NULL for a hole.  With
+ * alloc, the page is allocated if needed, and NULL means we ran out of
+ * memory.
+ */
+static void *
+ramfs_page(struct ramfs_node *np, size_t idx, bool alloc)
+{
+	void **slot;
+
+	slot = ramfs_slot(np, idx, alloc);
+	if (slot == NULL)
+		return NULL;
+	if (*slot == NULL && alloc)
+		*slot = ramfs_alloc_page();
+	return *slot;
+}
+
+/*
+ * Free the data pages numbered first and up, in the subtree of height h
+ * at slot, whose first page is numbered base.  Index pages are freed
+ * along with the last of their pages.
+ */
+static void
+ramfs_free_pages(void **slot, int h, size_t base, size_t first)
+{
+	size_t i, span;
+
+	if (*slot == NULL)
+		return;
+	if (h > 0) {
+		span = ramfs_capacity(h - 1);
+		for (i = 0; i < RAMFS_SLOTS; i++) {
+			if (base + (i + 1) * span <= first)
+				continue;
+			ramfs_free_pages((void **)*slot + i, h - 1,
+			    base + i * span, first);
+		}
+	}
+	if (base < first)
+		return;
+	if (h > 0)
+		memory::free_page(*slot);
+	else
+		ramfs_free_page(*slot);
+	*slot = NULL;
+}
+
 struct ramfs_node *
 ramfs_allocate_node(char *name, int type)
 {
@@ -69,14 +204,19 @@ ramfs_allocate_node(char *name, int type)
 	}
 	strlcpy(np->rn_name, name, np->rn_namelen + 1);
 	np->rn_type = type;
+	/*
+	 * A node keeps its inode number, so that looking it up again finds
+	 * its vnode if it has one, rather than creating a second vnode
+	 * (which would lend the node's pages to the page cache twice).
+	 */
+	np->rn_ino = __atomic_fetch_add(&inode_count, 1, __ATOMIC_RELAXED);
 	return np;
 }
 
 void
 ramfs_free_node(struct ramfs_node *np)
 {
-	if (np->rn_buf != NULL)
-		free(np->rn_buf);
+	ramfs_free_pages(&np->rn_pages, np->rn_height, 0, 0);
 
 	free(np->rn_name);
 	free(np);
@@ -187,7 +327,7 @@ ramfs_lookup(struct vnode *dvp, char *name, struct vnode **vpp)
 		mutex_unlock(&ramfs_lock);
 		return ENOENT;
 	}
-	if (vget(dvp->v_mount, inode_count++, &vp)) {
+	if (vget(dvp->v_mount, np->rn_ino, &vp)) {
 		/* found in cache */
 		*vpp = vp;
 		mutex_unlock(&ramfs_lock);
@@ -246,30 +386,23 @@ static int
 ramfs_truncate(struct vnode *vp, off_t length)
 {
 	struct ramfs_node *np;
-	void *new_buf;
-	size_t new_size;
+	size_t off;
+	char *page;
 
 	DPRINTF(("truncate %s length=%d\n", vp->v_path, length));
 	np = (ramfs_node*)vp->v_data;
 
-	if (length == 0) {
-		if (np->rn_buf != NULL) {
-			free(np->rn_buf);
-			np->rn_buf = NULL;
-			np->rn_bufsize = 0;
-		}
-	} else if (size_t(length) > np->rn_bufsize) {
-		// XXX: this could use a page level allocator
-		new_size = round_page(length);
-		new_buf = malloc(new_size);
-		if (!new_buf)
-			return EIO;
-		if (np->rn_size != 0) {
-			memcpy(new_buf, np->rn_buf, vp->v_size);
-			free(np->rn_buf);
-		}
-		np->rn_buf = (char*)new_buf;
-		np->rn_bufsize = new_size;
+	/* Growing the file just leaves a hole */
+	if (size_t(length) < np->rn_size) {
+		ramfs_free_pages(&np->rn_pages, np->rn_height, 0,
+		    howmany(length, PAGE_SIZE));
+		if (np->rn_pages == NULL)
+			np->rn_height = 0;
+		/* Past the end of file reads as zeroes, if the file grows again */
+		off = length % PAGE_SIZE;
+		page = (char*)ramfs_page(np, length / PAGE_SIZE, false);
+		if (off != 0 && page != NULL)
+			memset(page + off, 0, PAGE_SIZE - off);
 	}
 	np->rn_size = length;
 	vp->v_size = length;
@@ -298,7 +431,9 @@ static int
 ramfs_read(struct vnode *vp, struct file *fp, struct uio *uio, int ioflag)
 {
 	struct ramfs_node *np = (ramfs_node*)vp->v_data;
-	size_t len;
+	size_t len, off, n;
+	char *page;
+	int error;
 
 	if (vp->v_type == VDIR)
 		return EISDIR;
@@ -318,13 +453,27 @@ ramfs_read(struct vnode *vp, struct file *fp, struct uio *uio, int ioflag)
 	else
 		len = uio->uio_resid;
 
-	return uiomove(np->rn_buf + uio->uio_offset, len, uio);
+	while (len > 0) {
+		off = uio->uio_offset % PAGE_SIZE;
+		n = MIN(len, PAGE_SIZE - off);
+		page = (char*)ramfs_page(np, uio->uio_offset / PAGE_SIZE, false);
+		if (page == NULL)
+			page = ramfs_zero_page;	/* a hole */
+		error = uiomove(page + off, n, uio);
+		if (error)
+			return error;
+		len -= n;
+	}
+	return 0;
 }
 
 static int
 ramfs_write(struct vnode *vp, struct uio *uio, int ioflag)
 {
 	struct ramfs_node *np = (ramfs_node*)vp->v_data;
+	size_t off, n;
+	char *page;
+	int error;
 
 	if (vp->v_type == VDIR)
 		return EISDIR;
@@ -339,26 +488,23 @@ ramfs_write(struct vnode *vp, struct uio *uio, int ioflag)
 	if (ioflag & IO_APPEND)
 		uio->uio_offset = np->rn_size;
 
-	if (size_t(uio->uio_offset + uio->uio_resid) > (size_t)vp->v_size) {
-		/* Expand the file size before writing to it */
-		off_t end_pos = uio->uio_offset + uio->uio_resid;
-		if (end_pos > (off_t)np->rn_bufsize) {
-			// XXX: this could use a page level allocator
-			size_t new_size = round_page(end_pos);
-			void *new_buf = malloc(new_size);
-			if (!new_buf)
-				return EIO;
-			if (np->rn_size != 0) {
-				memcpy(new_buf, np->rn_buf, vp->v_size);
-				free(np->rn_buf);
-			}
-			np->rn_buf = (char*)new_buf;
-			np->rn_bufsize = new_size;
+	/* The file grows by what was written, even if we fail half way */
+	while (uio->uio_resid > 0) {
+		off = uio->uio_offset % PAGE_SIZE;
+		n = MIN((size_t)uio->uio_resid, PAGE_SIZE - off);
+		page = (char*)ramfs_page(np, uio->uio_offset / PAGE_SIZE, true);
+		/* Out of memory is out of space, to a memory file system */
+		if (page == NULL)
+			return ENOSPC;
+		error = uiomove(page + off, n, uio);
+		if (error)
+			return error;
+		if ((size_t)uio->uio_offset > np->rn_size) {
+			np->rn_size = uio->uio_offset;
+			vp->v_size = uio->uio_offset;
 		}
-		np->rn_size = end_pos;
-		vp->v_size = end_pos;
 	}
-	return uiomove(np->rn_buf + uio->uio_offset, uio->uio_resid, uio);
+	return 0;
 }
 
 static int
@@ -389,10 +535,10 @@ ramfs_rename(struct vnode *dvp1, struct vnode *vp1, char *name1,
 
 		if (vp1->v_type == VREG) {
 			/* Copy file data */
-			np->rn_buf = old_np->rn_buf;
+			np->rn_pages = old_np->rn_pages;
+			np->rn_height = old_np->rn_height;
 			np->rn_size = old_np->rn_size;
-			np->rn_bufsize = old_np->rn_bufsize;
-			old_np->rn_buf = NULL;
+			old_np->rn_pages = NULL;
 		}
 		/* Remove source file */
 		ramfs_remove_node((ramfs_node*)dvp1->v_data, (ramfs_node*)vp1->v_data);
@@ -448,6 +594,55 @@ ramfs_readdir(struct vnode *vp, struct file *fp, struct dirent *dir)
 	return 0;
 }
 
+/*
+ * Lend the data page at a page aligned offset to the page cache, which
+ * maps it instead of a copy.  Holes are read into a page of its own.
+ */
+static int
+ramfs_getpage(struct vnode *vp, off_t offset, void **pagep)
+{
+	struct ramfs_node *np = (ramfs_node*)vp->v_data;
+	void *page;
+
+	if (vp->v_type != VREG)
+		return EINVAL;
+	if (offset >= (off_t)np->rn_size)
+		return ENOENT;
+	page = ramfs_page(np, offset / PAGE_SIZE, false);
+	if (page == NULL)
+		return ENOENT;
+	*pagep = page;
+	return 0;
+}
+
+/*
+ * Make the data of an empty file the given page aligned memory of the
+ * kernel image, which is used in place rather than copied: the bootfs
+ * image is unpacked this way.  The rest of the last page must be zeroes.
+ * Writes to the file change the image, whose pages are never freed.
+ */
+int
+ramfs_set_file_data(struct vnode *vp, const void *data, size_t size)
+{
+	struct ramfs_node *np = (ramfs_node*)vp->v_data;
+	void **slot;
+	size_t idx;
+
+	if (vp->v_type != VREG || np->rn_size != 0)
+		return EINVAL;
+	if ((uintptr_t)data % PAGE_SIZE != 0)
+		return EINVAL;
+	for (idx = 0; idx < howmany(size, PAGE_SIZE); idx++) {
+		slot = ramfs_slot(np, idx, true);
+		if (slot == NULL)
+			return ENOMEM;
+		*slot = (char *)data + idx * PAGE_SIZE;
+	}
+	np->rn_size = size;
+	vp->v_size = size;
+	return 0;
+}
+
 extern "C"
 int
 ramfs_init(void)
@@ -488,5 +683,6 @@ struct vnops ramfs_vnops = {
 	ramfs_inactive,		/* inactive */
 	ramfs_truncate,		/* truncate */
 	ramfs_link,		/* link */
+	ramfs_getpage,		/* getpage */
 };
 
@@ -114,7 +114,7 @@ int fdset(int fd, struct file *fp)
     return 0;
 }
 
-static bool fhold_if_positive(file* f)
+bool fhold_if_positive(file* f)
 {
     auto c = f->f_count;
     // zero or negative f_count means that the file is being closed; don't
@@ -189,11 +189,17 @@ file::~file()
     auto fp = this;
 
     poll_drain(fp);
-    if (f_epolls) {
-        for (auto ep : *f_epolls) {
-            epoll_file_closed(ep, this);
+    // epoll_file_closed() removes the entry from f_epolls, so iterate
+    // over a copy.
+    std::vector<epoll_ptr> epolls;
+    WITH_LOCK(f_lock) {
+        if (f_epolls) {
+            epolls = *f_epolls;
         }
     }
+    for (auto ep : epolls) {
+        epoll_file_closed(ep, this);
+    }
 }
 
 dentry* file_dentry(file* fp)
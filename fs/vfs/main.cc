@@ -58,6 +58,7 @@
 #include <osv/ioctl.h>
 #include <osv/trace.hh>
 #include <drivers/console.hh>
+#include <osv/boot.hh>
 
 #include "vfs.h"
 
@@ -1170,6 +1171,15 @@ int fcntl(int fd, int cmd, int arg)
     case F_GETLK:
         WARN_ONCE("fcntl(F_GETLK) stubbed\n");
         break;
+    case F_SETPIPE_SZ:
+    case F_GETPIPE_SZ:
+        /* Only pipes implement these, as ioctls */
+        tmp = arg;
+        error = fp->ioctl(cmd, &tmp);
+        if (error == ENOTTY)
+            error = EBADF;
+        ret = tmp;
+        break;
     default:
         kprintf("unsupported fcntl cmd 0x%x\n", cmd);
         error = EINVAL;
@@ -1481,6 +1491,26 @@ struct bootfs_metadata {
 };
 
 extern char bootfs_start;
+extern boot_time_chart boot_time;
+
+extern "C" int ramfs_set_file_data(struct vnode *vp, const void *data, size_t size);
+
+// Files are not copied out of the image: scripts/mkbootfs.py places their
+// data on page boundaries, and the ramfs files use those pages in place.
+// mmap() and the ELF loader map them without copying too.
+static bool set_bootfs_data(int fd, const void *data, size_t size)
+{
+    struct file *fp;
+    if (fget(fd, &fp)) {
+        return false;
+    }
+    struct vnode *vp = fp->f_dentry->d_vnode;
+    vn_lock(vp);
+    auto error = ramfs_set_file_data(vp, data, size);
+    vn_unlock(vp);
+    fdrop(fp);
+    return error == 0;
+}
 
 void unpack_bootfs(void)
 {
@@ -1508,6 +1538,11 @@ void unpack_bootfs(void)
             sys_panic("unpack_bootfs failed");
         }
 
+        // fall back to copying data which is not page aligned
+        if (set_bootfs_data(fd, &bootfs_start + md[i].offset, md[i].size)) {
+            close(fd);
+            continue;
+        }
         ret = write(fd, &bootfs_start + md[i].offset, md[i].size);
         if (ret != md[i].size) {
             kprintf("write failed, ret = %d, errno = %d\n",
@@ -1632,7 +1667,9 @@ vfs_init(void)
     }
 
     mount_rootfs();
+    boot_time.event("rootfs mounted");
     unpack_bootfs();
+    boot_time.event("bootfs unpacked");
 
     //	if (open("/dev/console", O_RDWR, 0) != 0)
     if (console::open() != 0)
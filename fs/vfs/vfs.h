@@ -140,6 +140,10 @@ int	 fs_noop(void);
 struct dentry *dentry_alloc(struct dentry *parent_dp, struct vnode *vp, const char *path);
 void	dref(struct dentry *dp);
 void	drele(struct dentry *dp);
+void	dentry_unhash(struct dentry *dp);
+void	dentry_invalidate(struct dentry *ddp, const char *name);
+void	dentry_flush_vnode(struct vnode *vp);
+void	dentry_flush_mount(struct mount *mp);
 
 #ifdef DEBUG_VFS
 void	 vnode_dump(void);
@@ -148,4 +152,10 @@ void	 mount_dump(void);
 
 __END_DECLS
 
+#ifdef __cplusplus
+#include <string>
+
+std::string dentry_procfs_stats();
+#endif
+
 #endif /* !_VFS_H */
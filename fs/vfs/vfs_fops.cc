@@ -12,6 +12,7 @@
 #include <osv/poll.h>
 #include <fs/vfs/vfs.h>
 #include <osv/vfs_file.hh>
+#include <osv/pagecache.hh>
 
 vfs_file::vfs_file(unsigned flags)
 	: file(flags, DTYPE_VNODE)
@@ -85,6 +86,8 @@ int vfs_file::write(struct uio *uio, int flags)
 	error = VOP_WRITE(vp, uio, ioflags);
 	if (!error) {
 		count = bytes - uio->uio_resid;
+		/* uio_offset is now past the data written */
+		pagecache::invalidate(vp, uio->uio_offset - count, uio->uio_offset);
 		if ((flags & FOF_OFFSET) == 0)
 			fp->f_offset += count;
 	}
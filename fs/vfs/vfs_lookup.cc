@@ -0,0 +1,613 @@
+/*
+ * Copyright (c) 2005-2007, Kohsuke Ohtani
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include <osv/dentry.h>
+#include <osv/vnode.h>
+#include <osv/mount.h>
+#include <osv/rcu-hashtable.hh>
+#include <osv/percpu.hh>
+#include <osv/sched.hh>
+#include <atomic>
+#include "vfs.h"
+
+/*
+ * The dentry cache.
+ *
+ * Dentries are found by mount point and path in an rcu hash table, so
+ * lookups which hit the cache take no lock. A hit takes a reference on
+ * the dentry, unless its reference count is -1, which marks a dentry
+ * being freed; it is only freed after an rcu grace period.
+ *
+ * On file systems with MNT_DCACHE, a dentry whose last reference is
+ * dropped stays hashed, on an LRU list of unused dentries, until the
+ * list grows too long. So do negative dentries (with no vnode), which
+ * remember that a path does not exist. Operations changing the namespace
+ * unhash the dentries they make stale.
+ */
+struct dentry_key {
+    struct mount *mp;
+    const char *path;
+};
+
+struct dentry_key_hash {
+    size_t operator()(const dentry_key& key) const {
+        size_t val = 0;
+        for (auto p = key.path; *p; p++) {
+            val = ((val << 5) + val) + *p;
+        }
+        return val ^ reinterpret_cast<uintptr_t>(key.mp);
+    }
+};
+
+struct dentry_key_equal {
+    bool operator()(const dentry_key& a, const dentry_key& b) const {
+        return a.mp == b.mp && !strcmp(a.path, b.path);
+    }
+};
+
+#define DENTRY_LRU_MAX 8192
+
+static osv::rcu_hashtable<dentry_key, struct dentry *,
+                          dentry_key_hash, dentry_key_equal> dentry_table(256);
+/* All hashed dentries, for invalidating a subtree */
+static LIST_HEAD(dentry_list_head, dentry) dentry_list = LIST_HEAD_INITIALIZER(dentry_list);
+static TAILQ_HEAD(dentry_lru_head, dentry) dentry_lru = TAILQ_HEAD_INITIALIZER(dentry_lru);
+static unsigned dentry_lru_len;
+/* Serializes changes to the above, and to d_flags */
+static mutex dentry_hash_lock;
+
+TAILQ_HEAD(dentry_victims, dentry);
+
+struct dentry_stats {
+    std::atomic<u64> hits;
+    std::atomic<u64> negative_hits;
+    std::atomic<u64> misses;
+};
+static PERCPU(dentry_stats, dentry_stats);
+
+static bool
+dentry_tryref(struct dentry *dp)
+{
+    int refcnt = __atomic_load_n(&dp->d_refcnt, __ATOMIC_RELAXED);
+    do {
+        if (refcnt < 0) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&dp->d_refcnt, &refcnt, refcnt + 1,
+            true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    return true;
+}
+
+static void
+dentry_unhash_locked(struct dentry *dp)
+{
+    if (dp->d_flags & DF_HASHED) {
+        dentry_table.erase({dp->d_mount, dp->d_path});
+        LIST_REMOVE(dp, d_link);
+        dp->d_flags &= ~DF_HASHED;
+    }
+    if (dp->d_flags & DF_LRU) {
+        TAILQ_REMOVE(&dentry_lru, dp, d_lru);
+        dentry_lru_len--;
+        dp->d_flags &= ~DF_LRU;
+    }
+}
+
+/*
+ * Unhash an unused dentry and move it to victims, to be freed with
+ * dentry_free_victims() once dentry_hash_lock is dropped. Fails if the
+ * dentry is in use.
+ */
+static bool
+dentry_kill_locked(struct dentry *dp, struct dentry_victims *victims)
+{
+    int refcnt = 0;
+    if (!__atomic_compare_exchange_n(&dp->d_refcnt, &refcnt, -1,
+            false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    dentry_unhash_locked(dp);
+    TAILQ_INSERT_TAIL(victims, dp, d_lru);
+    return true;
+}
+
+static void
+dentry_trim_locked(struct dentry_victims *victims)
+{
+    while (dentry_lru_len > DENTRY_LRU_MAX) {
+        auto dp = TAILQ_FIRST(&dentry_lru);
+        if (!dentry_kill_locked(dp, victims)) {
+            /* in use again; it will be put back when released */
+            TAILQ_REMOVE(&dentry_lru, dp, d_lru);
+            dentry_lru_len--;
+            dp->d_flags &= ~DF_LRU;
+        }
+    }
+}
+
+static void
+dentry_free_victims(struct dentry_victims *victims)
+{
+    struct dentry *dp;
+
+    while ((dp = TAILQ_FIRST(victims)) != NULL) {
+        TAILQ_REMOVE(victims, dp, d_lru);
+        if (dp->d_vnode) {
+            vn_del_name(dp->d_vnode, dp);
+            vrele(dp->d_vnode);
+        }
+        if (dp->d_parent) {
+            drele(dp->d_parent);
+        }
+        /* Lookups may still be looking at it */
+        osv::rcu_defer([=] {
+            free(dp->d_path);
+            free(dp);
+        });
+    }
+}
+
+static struct dentry *
+dentry_new(struct dentry *parent_dp, struct mount *mp, struct vnode *vp,
+           const char *path)
+{
+    struct dentry *dp = (struct dentry *)calloc(sizeof(*dp), 1);
+
+    if (!dp) {
+        return NULL;
+    }
+
+    dp->d_refcnt = 1;
+    dp->d_vnode = vp;
+    dp->d_mount = mp;
+    dp->d_path = strdup(path);
+
+    if (parent_dp) {
+        dref(parent_dp);
+    }
+    dp->d_parent = parent_dp;
+
+    if (vp) {
+        vref(vp);
+        vn_add_name(vp, dp);
+    }
+
+    /*
+     * Replace a dentry already hashed at this path: a negative one when
+     * the path was just created, or one racing with us.
+     */
+    struct dentry_victims victims = TAILQ_HEAD_INITIALIZER(victims);
+    WITH_LOCK(dentry_hash_lock) {
+        if (auto old = dentry_table.find({mp, dp->d_path})) {
+            if (!dentry_kill_locked(*old, &victims)) {
+                dentry_unhash_locked(*old);
+            }
+        }
+        dentry_table.insert({mp, dp->d_path}, dp);
+        LIST_INSERT_HEAD(&dentry_list, dp, d_link);
+        dp->d_flags |= DF_HASHED;
+    }
+    dentry_free_victims(&victims);
+    return dp;
+}
+
+struct dentry *
+dentry_alloc(struct dentry *parent_dp, struct vnode *vp, const char *path)
+{
+    return dentry_new(parent_dp, vp->v_mount, vp, path);
+}
+
+static struct dentry *
+dentry_lookup(struct mount *mp, char *path)
+{
+    WITH_LOCK(osv::rcu_read_lock) {
+        auto dpp = dentry_table.find({mp, path});
+        if (dpp && dentry_tryref(*dpp)) {
+            if ((*dpp)->d_vnode) {
+                dentry_stats->hits.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                dentry_stats->negative_hits.fetch_add(1, std::memory_order_relaxed);
+            }
+            return *dpp;
+        }
+    }
+    dentry_stats->misses.fetch_add(1, std::memory_order_relaxed);
+    return NULL;                /* not found */
+}
+
+void
+dref(struct dentry *dp)
+{
+    ASSERT(dp);
+    ASSERT(dp->d_refcnt > 0);
+
+    __atomic_fetch_add(&dp->d_refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void
+drele(struct dentry *dp)
+{
+    ASSERT(dp);
+    ASSERT(dp->d_refcnt > 0);
+
+    /*
+     * Only drop the last reference with dentry_hash_lock held, so that
+     * whoever finds and releases it again meanwhile cannot free it under us.
+     */
+    int refcnt = __atomic_load_n(&dp->d_refcnt, __ATOMIC_RELAXED);
+    while (refcnt > 1) {
+        if (__atomic_compare_exchange_n(&dp->d_refcnt, &refcnt, refcnt - 1,
+                true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+
+    struct dentry_victims victims = TAILQ_HEAD_INITIALIZER(victims);
+    WITH_LOCK(dentry_hash_lock) {
+        if (__atomic_sub_fetch(&dp->d_refcnt, 1, __ATOMIC_RELEASE)) {
+            /* found again in the meantime */
+        } else if ((dp->d_flags & DF_HASHED) && (dp->d_mount->m_flags & MNT_DCACHE)) {
+            /* Keep it cached, as the most recently used */
+            if (dp->d_flags & DF_LRU) {
+                TAILQ_REMOVE(&dentry_lru, dp, d_lru);
+                dentry_lru_len--;
+            }
+            TAILQ_INSERT_TAIL(&dentry_lru, dp, d_lru);
+            dentry_lru_len++;
+            dp->d_flags |= DF_LRU;
+            dentry_trim_locked(&victims);
+        } else {
+            dentry_kill_locked(dp, &victims);
+        }
+    }
+    dentry_free_victims(&victims);
+}
+
+/*
+ * Make a dentry, and those below it if it is a directory, impossible to
+ * find, after it was removed or renamed.
+ */
+void
+dentry_unhash(struct dentry *dp)
+{
+    struct dentry_victims victims = TAILQ_HEAD_INITIALIZER(victims);
+    size_t len = strlen(dp->d_path);
+
+    WITH_LOCK(dentry_hash_lock) {
+        dentry_unhash_locked(dp);
+        if (dp->d_vnode && dp->d_vnode->v_type == VDIR) {
+            struct dentry *child, *next;
+            LIST_FOREACH_SAFE(child, &dentry_list, d_link, next) {
+                if (child->d_mount == dp->d_mount
+                        && !strncmp(child->d_path, dp->d_path, len)
+                        && child->d_path[len] == '/') {
+                    if (!dentry_kill_locked(child, &victims)) {
+                        dentry_unhash_locked(child);
+                    }
+                }
+            }
+        }
+    }
+    dentry_free_victims(&victims);
+}
+
+/*
+ * Forget a negative dentry for a path which was just created.
+ */
+void
+dentry_invalidate(struct dentry *ddp, const char *name)
+{
+    char path[PATH_MAX];
+
+    if (!strcmp(ddp->d_path, "/")) {
+        snprintf(path, sizeof(path), "/%s", name);
+    } else {
+        snprintf(path, sizeof(path), "%s/%s", ddp->d_path, name);
+    }
+
+    struct dentry_victims victims = TAILQ_HEAD_INITIALIZER(victims);
+    WITH_LOCK(dentry_hash_lock) {
+        if (auto dpp = dentry_table.find({ddp->d_mount, path})) {
+            if (!dentry_kill_locked(*dpp, &victims)) {
+                dentry_unhash_locked(*dpp);
+            }
+        }
+    }
+    dentry_free_victims(&victims);
+}
+
+/*
+ * Free the unused dentries of a vnode, so they don't count as users of
+ * it. The vnode must be locked.
+ */
+void
+dentry_flush_vnode(struct vnode *vp)
+{
+    struct dentry_victims victims = TAILQ_HEAD_INITIALIZER(victims);
+    struct dentry *dp;
+
+    WITH_LOCK(dentry_hash_lock) {
+        LIST_FOREACH(dp, &vp->v_names, d_names_link) {
+            dentry_kill_locked(dp, &victims);
+        }
+    }
+    dentry_free_victims(&victims);
+}
+
+/*
+ * Free all the unused dentries of a mount point, before unmounting it.
+ * Freeing a dentry may leave its parent unused, so repeat until there's
+ * nothing left to free.
+ */
+void
+dentry_flush_mount(struct mount *mp)
+{
+    bool again = true;
+
+    while (again) {
+        struct dentry_victims victims = TAILQ_HEAD_INITIALIZER(victims);
+        struct dentry *dp, *next;
+
+        WITH_LOCK(dentry_hash_lock) {
+            TAILQ_FOREACH_SAFE(dp, &dentry_lru, d_lru, next) {
+                if (dp->d_mount == mp) {
+                    dentry_kill_locked(dp, &victims);
+                }
+            }
+        }
+        again = !TAILQ_EMPTY(&victims);
+        dentry_free_victims(&victims);
+    }
+}
+
+std::string
+dentry_procfs_stats()
+{
+    u64 hits = 0, negative_hits = 0, misses = 0;
+    for (auto c : sched::cpus) {
+        auto s = dentry_stats.for_cpu(c);
+        hits += s->hits.load(std::memory_order_relaxed);
+        negative_hits += s->negative_hits.load(std::memory_order_relaxed);
+        misses += s->misses.load(std::memory_order_relaxed);
+    }
+    size_t hashed, unused;
+    WITH_LOCK(dentry_hash_lock) {
+        hashed = dentry_table.size();
+        unused = dentry_lru_len;
+    }
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+            "dentries %zu\nunused %zu\nhits %lu\nnegative_hits %lu\nmisses %lu\n",
+            hashed, unused, hits, negative_hits, misses);
+    return buf;
+}
+
+/*
+ * Convert a pathname into a pointer to a dentry
+ *
+ * @path: full path name.
+ * @dpp:  dentry to be returned.
+ */
+int
+namei(char *path, struct dentry **dpp)
+{
+    char *p;
+    char node[PATH_MAX];
+    char name[PATH_MAX];
+    struct mount *mp;
+    struct dentry *dp, *ddp;
+    struct vnode *dvp, *vp;
+    int error, i;
+
+    DPRINTF(VFSDB_VNODE, ("namei: path=%s\n", path));
+
+    /*
+     * Convert a full path name to its mount point and
+     * the local node in the file system.
+     */
+    if (vfs_findroot(path, &mp, &p)) {
+        return ENOTDIR;
+    }
+    strlcpy(node, "/", sizeof(node));
+    strlcat(node, p, sizeof(node));
+    dp = dentry_lookup(mp, node);
+    if (dp) {
+        if (!dp->d_vnode) {
+            /* known not to exist */
+            drele(dp);
+            return ENOENT;
+        }
+        /* vnode is already active. */
+        *dpp = dp;
+        return 0;
+    }
+    /*
+     * Find target vnode, started from root directory.
+     * This is done to attach the fs specific data to
+     * the target vnode.
+     */
+    ddp = mp->m_root;
+    if (!ddp) {
+        sys_panic("VFS: no root");
+    }
+    dref(ddp);
+
+    node[0] = '\0';
+
+    while (*p != '\0') {
+        /*
+         * Get lower directory/file name.
+         */
+        while (*p == '/') {
+            p++;
+        }
+
+        if (*p == '\0') {
+            break;
+        }
+
+        for (i = 0; i < PATH_MAX; i++) {
+            if (*p == '\0' || *p == '/') {
+                break;
+            }
+            name[i] = *p++;
+        }
+        name[i] = '\0';
+
+        /*
+         * Get a vnode for the target.
+         */
+        strlcat(node, "/", sizeof(node));
+        strlcat(node, name, sizeof(node));
+        dvp = ddp->d_vnode;
+        vn_lock(dvp);
+        dp = dentry_lookup(mp, node);
+        if (dp && !dp->d_vnode) {
+            drele(dp);
+            vn_unlock(dvp);
+            drele(ddp);
+            return ENOENT;
+        }
+        if (dp == NULL) {
+            /* Find a vnode in this directory. */
+            error = VOP_LOOKUP(dvp, name, &vp);
+            if (error) {
+                if (error == ENOENT && (mp->m_flags & MNT_DCACHE)
+                        && strcmp(name, ".") && strcmp(name, "..")) {
+                    /* Remember that it doesn't exist */
+                    dp = dentry_new(ddp, mp, NULL, node);
+                    if (dp) {
+                        drele(dp);
+                    }
+                }
+                vn_unlock(dvp);
+                drele(ddp);
+                return error;
+            }
+
+            dp = dentry_alloc(ddp, vp, node);
+            vput(vp);
+
+            if (!dp) {
+                vn_unlock(dvp);
+                drele(ddp);
+                return ENOMEM;
+            }
+        }
+        vn_unlock(dvp);
+        drele(ddp);
+        ddp = dp;
+
+        if (*p == '/' && ddp->d_vnode->v_type != VDIR) {
+            drele(ddp);
+            return ENOTDIR;
+        }
+    }
+
+#if 0
+    /*
+     * Detemine X permission.
+     */
+    if (vp->v_type != VDIR && sec_vnode_permission(path) != 0) {
+        vp->v_mode &= ~(0111);
+    }
+#endif
+
+    *dpp = dp;
+    return 0;
+}
+
+/*
+ * Search a pathname.
+ * This is a very central but not so complicated routine. ;-P
+ *
+ * @path: full path.
+ * @dpp:  pointer to dentry for directory.
+ * @name: pointer to file name in path.
+ *
+ * This routine returns a locked directory vnode and file name.
+ */
+int
+lookup(char *path, struct dentry **dpp, char **name)
+{
+    char buf[PATH_MAX];
+    char root[] = "/";
+    char *file, *dir;
+    struct dentry *dp;
+    int error;
+
+    DPRINTF(VFSDB_VNODE, ("lookup: path=%s\n", path));
+
+    /*
+     * Get the path for directory.
+     */
+    strlcpy(buf, path, sizeof(buf));
+    file = strrchr(buf, '/');
+    if (!buf[0]) {
+        return ENOTDIR;
+    }
+    if (file == buf) {
+        dir = root;
+    } else {
+        *file = '\0';
+        dir = buf;
+    }
+    /*
+     * Get the vnode for directory
+     */
+    if ((error = namei(dir, &dp)) != 0) {
+        return error;
+    }
+    if (dp->d_vnode->v_type != VDIR) {
+        drele(dp);
+        return ENOTDIR;
+    }
+
+    *dpp = dp;
+
+    /*
+     * Get the file name
+     */
+    *name = strrchr(path, '/') + 1;
+    return 0;
+}
+
+/*
+ * lookup_init() is called once (from vfs_init)
+ * in initialization.
+ */
+void
+lookup_init(void)
+{
+}
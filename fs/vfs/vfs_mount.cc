@@ -221,6 +221,9 @@ release_mp_dentries(struct mount *mp)
 
     /* Release root dentry */
     drele(mp->m_root);
+
+    /* And whatever is left cached below it */
+    dentry_flush_mount(mp);
 }
 
 int
@@ -257,6 +260,8 @@ found:
         goto out;
     }
 
+    /* Cached dentries keep their vnodes busy */
+    dentry_flush_mount(mp);
     if ((error = VFS_UNMOUNT(mp, flags)) != 0)
         goto out;
     LIST_REMOVE(mp, m_link);
@@ -306,6 +311,7 @@ sys_pivot_root(const char *new_root, const char *put_old)
                 return EBUSY;
             }
         }
+        dentry_flush_mount(oldmp);
         if ((error = VFS_UNMOUNT(oldmp, 0)) != 0) {
             return error;
         }
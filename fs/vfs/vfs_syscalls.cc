@@ -53,6 +53,7 @@
 #include <osv/prex.h>
 #include <osv/vnode.h>
 #include <osv/vfs_file.hh>
+#include <osv/pagecache.hh>
 #include "vfs.h"
 #include <fs/fs.hh>
 
@@ -85,6 +86,8 @@ sys_open(char *path, int flags, mode_t mode, struct file **fpp)
 			mode &= ~S_IFMT;
 			mode |= S_IFREG;
 			error = VOP_CREATE(ddp->d_vnode, filename, mode);
+			if (!error)
+				dentry_invalidate(ddp, filename);
 			vn_unlock(ddp->d_vnode);
 			drele(ddp);
 
@@ -142,6 +145,7 @@ sys_open(char *path, int flags, mode_t mode, struct file **fpp)
 		error = VOP_TRUNCATE(vp, 0);
 		if (error)
 			goto out_vn_unlock;
+		pagecache::invalidate(vp, 0);
 	}
 
 	try {
@@ -489,6 +493,8 @@ sys_mkdir(char *path, mode_t mode)
 	mode |= S_IFDIR;
 
 	error = VOP_MKDIR(ddp->d_vnode, name, mode);
+	if (!error)
+		dentry_invalidate(ddp, name);
  out:
 	vn_unlock(ddp->d_vnode);
 	drele(ddp);
@@ -519,6 +525,7 @@ sys_rmdir(char *path)
 		error = ENOTDIR;
 		goto out;
 	}
+	dentry_flush_vnode(vp);
 	if (vp->v_flags & VROOT || vcount(vp) >= 2) {
 		error = EBUSY;
 		goto out;
@@ -528,6 +535,8 @@ sys_rmdir(char *path)
 
 	vn_lock(ddp->d_vnode);
 	error = VOP_RMDIR(ddp->d_vnode, vp, name);
+	if (!error)
+		dentry_unhash(dp);
 	vn_unlock(ddp->d_vnode);
 
 	vn_unlock(vp);
@@ -577,6 +586,8 @@ sys_mknod(char *path, mode_t mode)
 		error = VOP_MKDIR(ddp->d_vnode, name, mode);
 	else
 		error = VOP_CREATE(ddp->d_vnode, name, mode);
+	if (!error)
+		dentry_invalidate(ddp, name);
  out:
 	vn_unlock(ddp->d_vnode);
 	drele(ddp);
@@ -636,6 +647,7 @@ sys_rename(char *src, char *dest)
 		goto err1;
 
 	/* Is the source busy ? */
+	dentry_flush_vnode(vp1);
 	if (vcount(vp1) >= 2) {
 		error = EBUSY;
 		goto err1;
@@ -661,6 +673,7 @@ sys_rename(char *src, char *dest)
 			goto err2;
 		}
 
+		dentry_flush_vnode(vp2);
 		if (vcount(vp2) >= 2) {
 			error = EBUSY;
 			goto err2;
@@ -720,6 +733,12 @@ sys_rename(char *src, char *dest)
 	}
 
 	error = VOP_RENAME(dvp1, vp1, sname, dvp2, vp2, dname);
+	if (!error) {
+		dentry_unhash(dp1);
+		if (dp2)
+			dentry_unhash(dp2);
+		dentry_invalidate(ddp2, dname);
+	}
  err4:
 	vn_unlock(dvp2);
 	drele(ddp2);
@@ -789,6 +808,8 @@ sys_link(char *oldpath, char *newpath)
 	}
 
 	error = VOP_LINK(newdirdp->d_vnode, vp, name);
+	if (error)
+		dentry_unhash(newdp);
  out1:
 	vn_unlock(newdirdp->d_vnode);
 	drele(newdirdp);
@@ -831,6 +852,8 @@ sys_unlink(char *path)
 
 	vn_lock(ddp->d_vnode);
 	error = VOP_REMOVE(ddp->d_vnode, vp, name);
+	if (!error)
+		dentry_unhash(dp);
 	vn_unlock(ddp->d_vnode);
 
 	vn_unlock(vp);
@@ -935,6 +958,8 @@ sys_truncate(char *path, off_t length)
 
 	vn_lock(dp->d_vnode);
 	error = VOP_TRUNCATE(dp->d_vnode, length);
+	if (!error)
+		pagecache::invalidate(dp->d_vnode, length);
 	vn_unlock(dp->d_vnode);
 
 	drele(dp);
@@ -953,6 +978,8 @@ sys_ftruncate(struct file *fp, off_t length)
 	vp = fp->f_dentry->d_vnode;
 	vn_lock(vp);
 	error = VOP_TRUNCATE(vp, length);
+	if (!error)
+		pagecache::invalidate(vp, length);
 	vn_unlock(vp);
 
 	return error;
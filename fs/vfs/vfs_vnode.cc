@@ -41,6 +41,8 @@
 
 #include <osv/prex.h>
 #include <osv/vnode.h>
+#include <osv/rcu-hashtable.hh>
+#include <osv/pagecache.hh>
 #include "vfs.h"
 
 enum vtype iftovt_tab[16] = {
@@ -65,56 +67,96 @@ int vttoif_tab[10] = {
  * vrele      -1        *
  */
 
-#define VNODE_BUCKETS 32		/* size of vnode hash table */
+struct vnode_key {
+	struct mount *mp;
+	uint64_t ino;
+};
+
+struct vnode_key_hash {
+	size_t operator()(const vnode_key& key) const {
+		return key.ino ^ reinterpret_cast<uintptr_t>(key.mp);
+	}
+};
+
+struct vnode_key_equal {
+	bool operator()(const vnode_key& a, const vnode_key& b) const {
+		return a.mp == b.mp && a.ino == b.ino;
+	}
+};
 
 /*
  * vnode table.
  * All active (opened) vnodes are stored on this hash table.
- * They can be accessed by its path name.
+ * They can be accessed by their mount point and inode number without
+ * taking any lock; a vnode is only freed an rcu grace period after it
+ * is removed from the table.
  */
-static LIST_HEAD(vnode_hash_head, vnode) vnode_table[VNODE_BUCKETS];
+static osv::rcu_hashtable<vnode_key, struct vnode *,
+			  vnode_key_hash, vnode_key_equal> vnode_table(256);
 
 /*
- * Global lock to access all vnodes and vnode table.
- * If a vnode is already locked, there is no need to
- * lock this global lock to access internal data.
+ * Global lock to change the vnode table.
+ * Reference counts are atomic, and a vnode whose count dropped to 0 can
+ * no longer be referenced.
  */
 static mutex_t vnode_lock = MUTEX_INITIALIZER;
 #define VNODE_LOCK()	mutex_lock(&vnode_lock)
 #define VNODE_UNLOCK()	mutex_unlock(&vnode_lock)
-#define VNODE_OWNED()	mutex_owned(&vnode_lock)
+
+static bool
+vn_tryref(struct vnode *vp)
+{
+	int refcnt = __atomic_load_n(&vp->v_refcnt, __ATOMIC_RELAXED);
+	do {
+		if (refcnt == 0)
+			return false;
+	} while (!__atomic_compare_exchange_n(&vp->v_refcnt, &refcnt,
+			refcnt + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	return true;
+}
 
 /*
- * Get the hash value from the mount point and path name.
- * XXX(hch): replace with a better hash for 64-bit pointers.
+ * Remove a vnode whose reference count dropped to 0 from the table,
+ * unless vget() already replaced it.
+ *
+ * Locking: VNODE_LOCK must be held.
  */
-static u_int
-vn_hash(struct mount *mp, uint64_t ino)
+static void
+vn_unhash(struct vnode *vp)
+{
+	auto vpp = vnode_table.find({vp->v_mount, vp->v_ino});
+	if (vpp && *vpp == vp)
+		vnode_table.erase({vp->v_mount, vp->v_ino});
+}
+
+static void
+vn_free(struct vnode *vp)
 {
-	return (ino ^ (unsigned long)mp) & (VNODE_BUCKETS - 1);
+	pagecache::invalidate(vp, 0);
+	mutex_destroy(&vp->v_lock);
+	/* vn_lookup() may still be looking at it */
+	osv::rcu_defer([=] { free(vp); });
 }
 
 /*
  * Returns locked vnode for specified mount point and path.
  * vn_lock() will increment the reference count of vnode.
- *
- * Locking: VNODE_LOCK must be held.
  */
 struct vnode *
 vn_lookup(struct mount *mp, uint64_t ino)
 {
-	struct vnode *vp;
+	struct vnode *vp = NULL;
 
-	assert(VNODE_OWNED());
-	LIST_FOREACH(vp, &vnode_table[vn_hash(mp, ino)], v_link) {
-		if (vp->v_mount == mp && vp->v_ino == ino) {
-			vp->v_refcnt++;
-			mutex_lock(&vp->v_lock);
-			vp->v_nrlocks++;
-			return vp;
-		}
+	WITH_LOCK(osv::rcu_read_lock) {
+		auto vpp = vnode_table.find({mp, ino});
+		if (vpp && vn_tryref(*vpp))
+			vp = *vpp;
+	}
+	if (vp) {
+		mutex_lock(&vp->v_lock);
+		vp->v_nrlocks++;
 	}
-	return NULL;		/* not found */
+	return vp;
 }
 
 /*
@@ -161,6 +203,12 @@ vget(struct mount *mp, uint64_t ino, struct vnode **vpp)
 
 	DPRINTF(VFSDB_VNODE, ("vget %LLu\n", ino));
 
+	vp = vn_lookup(mp, ino);
+	if (vp) {
+		*vpp = vp;
+		return 1;
+	}
+
 	VNODE_LOCK();
 
 	vp = vn_lookup(mp, ino);
@@ -170,7 +218,7 @@ vget(struct mount *mp, uint64_t ino, struct vnode **vpp)
 		return 1;
 	}
 
-	if (!(vp = malloc(sizeof(struct vnode)))) {
+	if (!(vp = (struct vnode *)malloc(sizeof(struct vnode)))) {
 		VNODE_UNLOCK();
 		return 0;
 	}
@@ -192,13 +240,15 @@ vget(struct mount *mp, uint64_t ino, struct vnode **vpp)
 		VNODE_UNLOCK();
 		mutex_destroy(&vp->v_lock);
 		free(vp);
-		return NULL;
+		return 0;
 	}
 	vfs_busy(vp->v_mount);
 	mutex_lock(&vp->v_lock);
 	vp->v_nrlocks++;
 
-	LIST_INSERT_HEAD(&vnode_table[vn_hash(mp, ino)], vp, v_link);
+	/* A vnode of this inode may be dying, but still in the table */
+	vnode_table.erase({mp, ino});
+	vnode_table.insert({mp, ino}, vp);
 	VNODE_UNLOCK();
 
 	*vpp = vp;
@@ -218,14 +268,12 @@ vput(struct vnode *vp)
 	DPRINTF(VFSDB_VNODE, ("vput: ref=%d %s\n", vp->v_refcnt,
 			      vp->v_path));
 
-	VNODE_LOCK();
-	vp->v_refcnt--;
-	if (vp->v_refcnt > 0) {
-	    VNODE_UNLOCK();
+	if (__atomic_sub_fetch(&vp->v_refcnt, 1, __ATOMIC_RELEASE) > 0) {
 		vn_unlock(vp);
 		return;
 	}
-	LIST_REMOVE(vp, v_link);
+	VNODE_LOCK();
+	vn_unhash(vp);
 	VNODE_UNLOCK();
 
 	/*
@@ -237,8 +285,7 @@ vput(struct vnode *vp)
 	vp->v_nrlocks--;
 	ASSERT(vp->v_nrlocks == 0);
 	mutex_unlock(&vp->v_lock);
-	mutex_destroy(&vp->v_lock);
-	free(vp);
+	vn_free(vp);
 }
 
 /*
@@ -250,10 +297,8 @@ vref(struct vnode *vp)
 	ASSERT(vp);
 	ASSERT(vp->v_refcnt > 0);	/* Need vget */
 
-	VNODE_LOCK();
 	DPRINTF(VFSDB_VNODE, ("vref: ref=%d\n", vp->v_refcnt));
-	vp->v_refcnt++;
-	VNODE_UNLOCK();
+	__atomic_fetch_add(&vp->v_refcnt, 1, __ATOMIC_RELAXED);
 }
 
 /*
@@ -278,17 +323,15 @@ vrele(struct vnode *vp)
 	 * deallocate the data.
 	 */
 	VOP_INACTIVE(vp);
-	vp->v_refcnt--;
-	if (vp->v_refcnt > 0) {
+	if (__atomic_sub_fetch(&vp->v_refcnt, 1, __ATOMIC_RELEASE) > 0) {
 		VNODE_UNLOCK();
 		return;
 	}
-	LIST_REMOVE(vp, v_link);
+	vn_unhash(vp);
 	VNODE_UNLOCK();
 
 	vfs_unbusy(vp->v_mount);
-	mutex_destroy(&vp->v_lock);
-	free(vp);
+	vn_free(vp);
 }
 
 /*
@@ -436,29 +479,9 @@ vn_access(struct vnode *vp, int flags)
 void
 vnode_dump(void)
 {
-	int i;
-	struct vnode *vp;
-	struct mount *mp;
-	char type[][6] = { "VNON ", "VREG ", "VDIR ", "VBLK ", "VCHR ",
-			   "VLNK ", "VSOCK", "VFIFO" };
-
-	VNODE_LOCK();
 	dprintf("Dump vnode\n");
-	dprintf(" vnode    mount    type  refcnt blkno    path\n");
-	dprintf(" -------- -------- ----- ------ -------- ------------------------------\n");
-
-	for (i = 0; i < VNODE_BUCKETS; i++) {
-	        LIST_FOREACH(vp, &vnode_table[i], v_link) {
-			mp = vp->v_mount;
-
-			dprintf(" %08x %08x %s %6d %8d %s%s\n", (u_int)vp,
-				(u_int)mp, type[vp->v_type], vp->v_refcnt,
-				(strlen(mp->m_path) == 1) ? "\0" : mp->m_path,
-				vp->v_path);
-		}
-	}
+	dprintf(" %zu active vnodes\n", vnode_table.size());
 	dprintf("\n");
-	VNODE_UNLOCK();
 }
 #endif
 
@@ -490,10 +513,6 @@ vop_eperm(void)
 void
 vnode_init(void)
 {
-	int i;
-
-	for (i = 0; i < VNODE_BUCKETS; i++)
-		LIST_INIT(&vnode_table[i]);
 }
 
 void vn_add_name(struct vnode *vp, struct dentry *dp)
@@ -94,6 +94,8 @@ public:
     void send_lock(wait_record *wr);
     bool send_lock_unless_already_waiting(wait_record *wr);
     void receive_lock();
+private:
+    bool spin(sched::thread *current);
 };
 
 }
@@ -14,13 +14,19 @@
 struct vnode;
 
 struct dentry {
-	LIST_ENTRY(dentry) d_link;	/* link for hash list */
-	int		d_refcnt;	/* reference count */
+	LIST_ENTRY(dentry) d_link;	/* link for list of hashed dentries */
+	TAILQ_ENTRY(dentry) d_lru;	/* link for list of unused dentries */
+	int		d_refcnt;	/* reference count, -1 when dying */
+	int		d_flags;
 	char		*d_path;	/* pointer to path in fs */
-	struct vnode	*d_vnode;
+	struct vnode	*d_vnode;	/* NULL for a negative dentry */
 	struct mount	*d_mount;
 	struct dentry   *d_parent; /* pointer to parent */
 	LIST_ENTRY(dentry) d_names_link; /* link fo vnode::d_names */
 };
 
+/* flags for dentry */
+#define DF_HASHED	0x0001		/* can be found by lookups */
+#define DF_LRU		0x0002		/* on the list of unused dentries */
+
 #endif /* _OSV_DENTRY_H */
@@ -12,6 +12,9 @@
 // frame pointers instead of DWARF debug information, so it works in interrupt
 // contexts, but requires -fno-omit-frame-pointer
 int backtrace_safe(void** pc, int nr);
+// Likewise, for the context whose program counter and frame pointer are
+// given, e.g. one which was interrupted
+int backtrace_safe(void** pc, int nr, void* start_pc, void* start_fp);
 
 
 #endif /* EXECINFO_HH_ */
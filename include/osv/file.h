@@ -69,6 +69,19 @@ struct pollreq;
 
 #ifdef __cplusplus
 
+class epoll_file;
+struct epoll_registration;
+
+/*
+ * Reference to a file's registration in an epoll set (see core/epoll.cc).
+ * Anything that can wake the file (poll_wake(), the socket's net channel)
+ * passes it to epoll_wake() to put the file on the epoll's ready list.
+ */
+struct epoll_ptr {
+	epoll_file* epoll;
+	epoll_registration* reg;
+	bool operator==(const epoll_ptr& x) const { return reg == x.reg; }
+};
 
 /*
  * File structure
@@ -88,6 +101,8 @@ struct file {
 	virtual int chmod(mode_t mode) = 0;
 	virtual void poll_install(pollreq& pr) {}
 	virtual void poll_uninstall(pollreq& pr) {}
+	virtual void epoll_add(epoll_ptr ep) {}
+	virtual void epoll_del(epoll_ptr ep) {}
 
 	int		f_flags;	/* open flags */
 	int		f_count;	/* reference count, see below */
@@ -97,10 +112,7 @@ struct file {
 	filetype_t	f_type;		/* descriptor type */
 	TAILQ_HEAD(, poll_link) f_poll_list; /* poll request list */
 	mutex_t		f_lock;		/* lock */
-	std::unique_ptr<std::vector<file*>> f_epolls;
-	// poll_wake_count used for implementing epoll()'s EPOLLET using poll().
-	// Once we have a real epoll() implementation, it won't be needed.
-	int poll_wake_count = 0;
+	std::unique_ptr<std::vector<epoll_ptr>> f_epolls; /* protected by f_lock */
 };
 
 // struct file above is an abstract class; subclasses need to implement 8
@@ -154,6 +166,8 @@ void file_setoffset(struct file *fp, off_t off);
  */
 void fhold(struct file* fp);
 int fdrop(struct file* fp);
+/* Like fhold(), but fails if the file is already being closed */
+bool fhold_if_positive(struct file* fp);
 
 /* Get fp from fd and increment refcount */
 int fget(int fd, struct file** fp);
@@ -11,6 +11,7 @@
 #include <functional>
 #include <map>
 #include <list>
+#include <vector>
 
 #include <osv/sched.hh>
 #include "drivers/pci.hh"
@@ -70,7 +71,9 @@ public:
     // 2. Allocate vectors and assign ISRs
     // 3. Setup entries
     // 4. Unmask interrupts
-    bool easy_register(std::initializer_list<msix_binding> bindings);
+    // All the device's vectors must be registered in one call, as each call
+    // masks the ones registered before it.
+    bool easy_register(const std::vector<msix_binding>& bindings);
     void easy_unregister();
 
     /////////////////////
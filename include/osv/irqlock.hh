@@ -10,9 +10,16 @@
 
 #include "arch.hh"
 
+namespace sched {
+void ensure_stack_reserve();
+}
+
 class irq_lock_type {
 public:
-    static void lock() { arch::irq_disable(); }
+    static void lock() {
+        sched::ensure_stack_reserve();
+        arch::irq_disable();
+    }
     static void unlock() { arch::irq_enable(); }
 };
 
@@ -27,6 +34,7 @@ private:
 
 inline void irq_save_lock_type::lock()
 {
+    sched::ensure_stack_reserve();
     _flags.save();
     arch::irq_disable();
 }
@@ -101,7 +101,10 @@ private:
 struct page_range {
     explicit page_range(size_t size);
     size_t size;
+    // in free_page_ranges, ordered by address
     boost::intrusive::set_member_hook<> member_hook;
+    // in free_page_ranges_by_size
+    boost::intrusive::set_member_hook<> size_hook;
 };
 
 void free_initial_memory_range(void* addr, size_t size);
@@ -96,6 +96,8 @@ public:
     virtual error sync(uintptr_t start, uintptr_t end) = 0;
     virtual int validate_perm(unsigned perm) { return 0; }
     virtual map_page_ops* page_ops();
+    // permissions of the pages mapped on a fault, may lack some of perm()
+    virtual unsigned populate_perm();
     void update_flags(unsigned flag);
     bool has_flags(unsigned flag);
     template<typename T> ulong operate_range(T mapper, void *start, size_t size);
@@ -135,14 +137,18 @@ class file_vma : public vma {
 public:
     file_vma(addr_range range, unsigned perm, fileref file, f_offset offset, bool shared);
     ~file_vma();
+    virtual void fault(uintptr_t addr, exception_frame *ef) override;
     virtual void split(uintptr_t edge) override;
     virtual error sync(uintptr_t start, uintptr_t end) override;
     virtual int validate_perm(unsigned perm);
+    virtual unsigned populate_perm() override;
 private:
     f_offset offset(uintptr_t addr);
     fileref _file;
     f_offset _offset;
     bool _shared;
+    // private mapping of the page cache
+    bool _cached;
 };
 
 class jvm_balloon_vma : public vma {
@@ -91,6 +91,12 @@ struct mount {
 #define	MNT_QUOTA	0x00002000	/* quotas are enabled on filesystem */
 #define	MNT_ROOTFS	0x00004000	/* identifies the root filesystem */
 
+/*
+ * Set by file systems whose namespace only changes through the vfs, so
+ * that unused and negative dentries can be kept cached.
+ */
+#define	MNT_DCACHE	0x00010000
+
 /*
  * Mask of flags that are visible to statfs()
  */
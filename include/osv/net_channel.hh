@@ -12,14 +12,18 @@
 #include <osv/sched.hh>
 #include <lockfree/ring.hh>
 #include <functional>
+#include <array>
+#include <atomic>
 #include <unordered_map>
 #include <osv/rcu.hh>
+#include <osv/rcu-hashtable.hh>
 #include <bsd/porting/netport.h>
 #include <bsd/sys/netinet/in.h>
 #include <bsd/sys/netinet/ip.h>
 
 struct mbuf;
 struct pollreq;
+struct epoll_ptr;
 
 // Lock-free queue for moving packets to a single consumer
 // Supports waiting via sched::thread::wait_for()
@@ -30,16 +34,31 @@ private:
     sched::thread_handle _waiting_thread CACHELINE_ALIGNED;
     // extra list of threads to wake
     osv::rcu_ptr<std::vector<pollreq*>> _pollers;
+    // epoll sets to put on their ready list
+    osv::rcu_ptr<std::vector<epoll_ptr>> _epollers;
     mutex _pollers_mutex;
+    // the owner's reference, and one per wake_batch the channel is in
+    std::atomic<unsigned> _refs = { 1 };
 public:
     explicit net_channel(std::function<void (mbuf*)> process_packet)
         : _process_packet(std::move(process_packet)) {}
+    // consumer: free the channel, once it was removed from its classifier.
+    // Lookups may still find it until an rcu grace period ends, and a
+    // classifier::wake_batch may hold it until its flush().
+    void dispose() { osv::rcu_defer([=] { release(); }); }
+    // producer: keep the channel from being freed until release()
+    void hold() { _refs.fetch_add(1, std::memory_order_relaxed); }
+    void release() {
+        if (_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete this;
+        }
+    }
     // producer: try to push a packet
     bool push(mbuf* m) { return _queue.push(m); }
     // consumer: wake the consumer (best used after multiple push()s)
     void wake() {
         _waiting_thread.wake();
-        if (_pollers) {
+        if (_pollers || _epollers) {
             wake_pollers();
         }
     }
@@ -48,6 +67,9 @@ public:
     // add/remove current thread from poller list
     void add_poller(pollreq& pr);
     void del_poller(pollreq& pr);
+    // add/remove an epoll registration of the channel's file
+    void add_epoll(const epoll_ptr& ep);
+    void del_epoll(const epoll_ptr& ep);
 private:
     void wake_pollers();
 private:
@@ -70,6 +92,7 @@ public:
 }
 
 struct ipv4_tcp_conn_id {
+    ipv4_tcp_conn_id() {}
     ipv4_tcp_conn_id(in_addr src_addr, in_addr dst_addr, in_port_t src_port, in_port_t dst_port)
         : src_addr(src_addr), dst_addr(dst_addr), src_port(src_port), dst_port(dst_port) {}
 
@@ -101,19 +124,38 @@ struct hash<ipv4_tcp_conn_id> {
 
 class classifier {
 public:
+    // Channels which received packets during a receive burst, and still
+    // need to be woken by flush(). A driver keeps one per receive loop.
+    // The receive loop may sleep, so rcu can't keep the channels alive
+    // until the end of the burst; the batch holds them instead (see
+    // net_channel::hold()).
+    class wake_batch {
+    public:
+        static constexpr unsigned max_channels = 32;
+    private:
+        std::array<net_channel*, max_channels> _channels;
+        unsigned _nr = 0;
+        unsigned _packets = 0;
+        unsigned _wakes = 0;
+        friend class classifier;
+    };
     classifier();
     // consumer side operations
     void add(ipv4_tcp_conn_id id, net_channel* channel);
     void remove(ipv4_tcp_conn_id id);
     // producer side operations
     bool post_packet(mbuf* m);
+    // Like post_packet(), but the channel is only woken by flush(), once
+    // per burst no matter how many packets it received.
+    bool post_packet(mbuf* m, wake_batch& wakes);
+    void flush(wake_batch& wakes);
 private:
-    net_channel* classify_ipv4_tcp(mbuf* m);
+    net_channel* classify_ipv4_tcp(mbuf* m, ipv4_tcp_conn_id& id);
 private:
-    using ipv4_tcp_channels = std::unordered_map<ipv4_tcp_conn_id, net_channel*>;
+    using ipv4_tcp_channels = osv::rcu_hashtable<ipv4_tcp_conn_id, net_channel*>;
+    // serializes writers to the tables
     mutex _mtx;
-    // FIXME: use a fine-grained rcu hash table
-    osv::rcu_ptr<ipv4_tcp_channels, osv::rcu_deleter<ipv4_tcp_channels>> _ipv4_tcp_channels;
+    ipv4_tcp_channels _ipv4_tcp_channels;
 };
 
 #endif /* NETCHANNEL_HH_ */
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef OSV_PAGECACHE_HH_
+#define OSV_PAGECACHE_HH_
+
+#include <sys/types.h>
+#include <limits>
+#include <string>
+
+struct vnode;
+
+// Cache of file pages, keyed by vnode and offset, shared by all the private
+// mappings of a file. Faults map the cached page read-only, and a write
+// fault replaces it with a private copy. Pages no longer mapped stay cached
+// until the file changes, or the memory is needed.
+namespace pagecache {
+
+// Returns the page of vp at offset (page aligned), with a reference held
+// for the caller, or nullptr if out of memory. If must_fill is set, the
+// page was just added: the caller must read it in and call filled(), and
+// others asking for it wait until then. A file system implementing
+// vop_getpage() provides the page itself, already filled.
+void* get(struct vnode* vp, off_t offset, bool& must_fill);
+void filled(void* page);
+// Drops a reference taken by get(). Returns false if page is not part of
+// the cache.
+bool release(void* page);
+bool is_cached(void* page);
+// For file systems implementing vop_getpage(), before they free a page
+// they lent us: returns true if the page is still mapped, in which case
+// the cache now owns it, and frees it once unmapped.
+bool adopt(void* page);
+// Forgets the pages overlapping [offset, end) after the file was written
+// to or truncated, or all of them when the vnode goes away. Pages still
+// mapped are freed when unmapped.
+void invalidate(struct vnode* vp, off_t offset,
+                off_t end = std::numeric_limits<off_t>::max());
+
+std::string procfs_stats();
+
+}
+
+#endif /* OSV_PAGECACHE_HH_ */
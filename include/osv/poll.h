@@ -125,13 +125,11 @@ struct poll_file;
 
 struct poll_file {
     poll_file() = default;
-    // Note that events is int, not short, for EPOLLET support.
-    poll_file(fileref fp, int events, short revents, int c = 0)
-        : fp(fp), events(events), revents(revents), last_poll_wake_count(c) {}
+    poll_file(fileref fp, int events, short revents)
+        : fp(fp), events(events), revents(revents) {}
     fileref fp;
     int events;
     short revents;
-    int last_poll_wake_count;   // For implementing EPOLLET
 };
 
 /*
@@ -172,7 +170,10 @@ __END_DECLS
 #ifdef __cplusplus
 
 int do_poll(std::vector<poll_file>& pfd, int _timeout);
-void epoll_file_closed(file* epoller, file* client);
+void epoll_file_closed(epoll_ptr ep, file* client);
+// Put the registered file on the epoll's ready list. Does not sleep, so
+// may be called with preemption disabled (e.g., under rcu_read_lock).
+void epoll_wake(const epoll_ptr& ep);
 
 #endif
 
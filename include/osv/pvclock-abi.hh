@@ -26,6 +26,9 @@ struct pvclock_vcpu_time_info {
          u8    pad[2];
 } __attribute__((__packed__)); /* 32 bytes */
 
+/* the host keeps the TSC based clock of all vcpus in sync */
+#define PVCLOCK_TSC_STABLE_BIT	(1 << 0)
+
 namespace pvclock {
 
 inline u64 processor_to_nano(pvclock_vcpu_time_info *sys, u64 time)
@@ -0,0 +1,278 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef INCLUDED_OSV_RCU_HASHTABLE_HH
+#define INCLUDED_OSV_RCU_HASHTABLE_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <osv/rcu.hh>
+
+namespace osv {
+
+// A resizable hash table for read-mostly data, with lock-free readers.
+//
+// Each bucket is a singly-linked rcu list, so insert() and erase() only
+// touch one bucket, and find() never blocks or writes shared memory.
+//
+// Readers must hold rcu_read_lock, and may only use the pointer returned
+// by find() until they release it. Writers (insert(), erase()) must be
+// serialized by the caller, e.g. with a mutex.
+//
+// When the table gets too full, a table with twice the buckets is
+// allocated, and each subsequent write moves a few buckets of the old table
+// into it, so no single write pays for rehashing the whole table. A bucket
+// is moved by inserting copies of its nodes into the new table and only
+// then unlinking them from the old one; find() looks in the old table
+// before the new one, so a reader of a given pair of tables sees the entry
+// in at least one of them. The pair is published as one object, and a
+// reader whose pair was replaced while it looked (a resize started or
+// finished, so it may have missed a bucket moving to a table it wasn't
+// looking at) looks again in the new pair before reporting a miss.
+template <typename Key, typename Value,
+          typename Hash = std::hash<Key>,
+          typename KeyEqual = std::equal_to<Key>>
+class rcu_hashtable {
+public:
+    explicit rcu_hashtable(size_t initial_buckets = 16);
+    ~rcu_hashtable();
+    rcu_hashtable(const rcu_hashtable&) = delete;
+    rcu_hashtable& operator=(const rcu_hashtable&) = delete;
+    // reader side (under rcu_read_lock)
+    const Value* find(const Key& key) const;
+    // writer side (serialized by the caller)
+    bool insert(const Key& key, const Value& value);
+    bool erase(const Key& key);
+    size_t size() const { return _size; }
+    size_t bucket_count() const { return _tables.read_by_owner()->cur->nr_buckets(); }
+private:
+    struct node {
+        node(const Key& key, const Value& value) : key(key), value(value) {}
+        Key key;
+        Value value;
+        rcu_ptr<node> next;
+    };
+    struct table {
+        explicit table(size_t n) : mask(n - 1), buckets(new rcu_ptr<node>[n]) {}
+        size_t nr_buckets() const { return mask + 1; }
+        rcu_ptr<node>& bucket(size_t hash) { return buckets[hash & mask]; }
+        const size_t mask;
+        std::unique_ptr<rcu_ptr<node>[]> buckets;
+    };
+    struct tables {
+        table* cur;
+        // table being migrated into cur, or nullptr
+        table* old;
+    };
+    // Number of old buckets moved by each write while resizing. Since we
+    // grow by a factor of 2, anything >= 1 finishes the move before the new
+    // table needs to grow again.
+    static constexpr size_t migrate_batch = 2;
+    size_t hash(const Key& key) const;
+    static node* find_in(table* t, const Key& key, size_t h);
+    static bool erase_from(table* t, const Key& key, size_t h);
+    void migrate_some();
+    void migrate_bucket(rcu_ptr<node>& b);
+    static void free_table(table* t);
+    void publish(table* cur, table* old);
+private:
+    Hash _hash;
+    rcu_ptr<tables> _tables;
+    size_t _migrated = 0;
+    size_t _size = 0;
+};
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual>
+rcu_hashtable<Key, Value, Hash, KeyEqual>::rcu_hashtable(size_t initial_buckets)
+{
+    size_t n = 1;
+    while (n < initial_buckets) {
+        n <<= 1;
+    }
+    publish(new table(n), nullptr);
+}
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual>
+rcu_hashtable<Key, Value, Hash, KeyEqual>::~rcu_hashtable()
+{
+    // there can no longer be any readers
+    auto ts = _tables.read_by_owner();
+    free_table(ts->old);
+    free_table(ts->cur);
+    delete ts;
+}
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual>
+void rcu_hashtable<Key, Value, Hash, KeyEqual>::publish(table* cur, table* old)
+{
+    auto prev = _tables.read_by_owner();
+    _tables.assign(new tables{cur, old});
+    rcu_dispose(prev);
+}
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual>
+void rcu_hashtable<Key, Value, Hash, KeyEqual>::free_table(table* t)
+{
+    if (!t) {
+        return;
+    }
+    for (size_t i = 0; i < t->nr_buckets(); i++) {
+        auto n = t->buckets[i].read_by_owner();
+        while (n) {
+            auto next = n->next.read_by_owner();
+            delete n;
+            n = next;
+        }
+    }
+    delete t;
+}
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual>
+inline
+size_t rcu_hashtable<Key, Value, Hash, KeyEqual>::hash(const Key& key) const
+{
+    // Buckets are selected by the low bits, so mix in the high bits of
+    // weak hash functions.
+    uint64_t h = _hash(key);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual>
+inline
+auto rcu_hashtable<Key, Value, Hash, KeyEqual>::find_in(table* t,
+        const Key& key, size_t h) -> node*
+{
+    for (auto n = t->bucket(h).read(); n; n = n->next.read()) {
+        if (KeyEqual()(n->key, key)) {
+            return n;
+        }
+    }
+    return nullptr;
+}
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual>
+inline
+const Value* rcu_hashtable<Key, Value, Hash, KeyEqual>::find(const Key& key) const
+{
+    auto h = hash(key);
+    auto ts = _tables.read();
+    while (true) {
+        // The old table must be searched first, see the comment at the top.
+        if (ts->old) {
+            if (auto n = find_in(ts->old, key, h)) {
+                return &n->value;
+            }
+        }
+        if (auto n = find_in(ts->cur, key, h)) {
+            return &n->value;
+        }
+        auto now = _tables.read();
+        if (now == ts) {
+            return nullptr;
+        }
+        ts = now;
+    }
+}
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual>
+bool rcu_hashtable<Key, Value, Hash, KeyEqual>::insert(const Key& key, const Value& value)
+{
+    auto h = hash(key);
+    auto ts = _tables.read_by_owner();
+    auto old = ts->old;
+    auto t = ts->cur;
+    if ((old && find_in(old, key, h)) || find_in(t, key, h)) {
+        return false;
+    }
+    auto& b = t->bucket(h);
+    auto n = new node(key, value);
+    n->next.assign(b.read_by_owner());
+    b.assign(n);
+    ++_size;
+    if (!old && _size > t->nr_buckets()) {
+        publish(new table(t->nr_buckets() * 2), t);
+        _migrated = 0;
+    }
+    migrate_some();
+    return true;
+}
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual>
+bool rcu_hashtable<Key, Value, Hash, KeyEqual>::erase_from(table* t,
+        const Key& key, size_t h)
+{
+    auto* link = &t->bucket(h);
+    for (auto n = link->read_by_owner(); n; n = n->next.read_by_owner()) {
+        if (KeyEqual()(n->key, key)) {
+            link->assign(n->next.read_by_owner());
+            rcu_dispose(n);
+            return true;
+        }
+        link = &n->next;
+    }
+    return false;
+}
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual>
+bool rcu_hashtable<Key, Value, Hash, KeyEqual>::erase(const Key& key)
+{
+    auto h = hash(key);
+    auto ts = _tables.read_by_owner();
+    bool erased = (ts->old && erase_from(ts->old, key, h))
+            || erase_from(ts->cur, key, h);
+    if (erased) {
+        --_size;
+    }
+    migrate_some();
+    return erased;
+}
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual>
+void rcu_hashtable<Key, Value, Hash, KeyEqual>::migrate_bucket(rcu_ptr<node>& b)
+{
+    auto t = _tables.read_by_owner()->cur;
+    auto first = b.read_by_owner();
+    for (auto n = first; n; n = n->next.read_by_owner()) {
+        auto& nb = t->bucket(hash(n->key));
+        auto copy = new node(n->key, n->value);
+        copy->next.assign(nb.read_by_owner());
+        nb.assign(copy);
+    }
+    b.assign(nullptr);
+    while (first) {
+        auto next = first->next.read_by_owner();
+        rcu_dispose(first);
+        first = next;
+    }
+}
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual>
+void rcu_hashtable<Key, Value, Hash, KeyEqual>::migrate_some()
+{
+    auto ts = _tables.read_by_owner();
+    auto old = ts->old;
+    if (!old) {
+        return;
+    }
+    for (size_t i = 0; i < migrate_batch && _migrated < old->nr_buckets(); i++) {
+        migrate_bucket(old->buckets[_migrated++]);
+    }
+    if (_migrated == old->nr_buckets()) {
+        // old is now empty; readers may still be walking it
+        publish(ts->cur, nullptr);
+        rcu_dispose(old);
+    }
+}
+
+}
+
+#endif /* INCLUDED_OSV_RCU_HASHTABLE_HH */
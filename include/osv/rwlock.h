@@ -14,6 +14,12 @@
 
 #define RWLOCK_INITIALIZER {}
 
+// Readers count themselves in one of several shards, each in its own cache
+// line, so that read-locking from different cpus doesn't contend. A shard's
+// count may go negative, when a reader unlocks on another cpu than it
+// locked on; only the sum matters.
+#define RWLOCK_READER_SHARDS 8
+
 typedef struct rwlock {
 
 #ifdef __cplusplus
@@ -43,13 +49,27 @@ private:
     bool read_lockable();
     bool write_lockable();
 
+    int* reader_count();
+    bool reader_enter(int* count);
+    void reader_exit(int* count);
+    int readers();
+    void update_writer();
+
 #endif // __cplusplus
 
+    struct {
+        int count;
+        char pad[64 - sizeof(int)];
+    } _readers[RWLOCK_READER_SHARDS];
+
+    // Set while a writer owns the lock or waits for it; readers check it
+    // without taking _mtx, and take the slow path if it is set.
+    bool _writer;
+
     mutex_t _mtx;
     condvar_t _cond_readers;
     condvar_t _cond_writers;
 
-    unsigned _readers;
     unsigned _read_waiters;
     unsigned _write_waiters;
 
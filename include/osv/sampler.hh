@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef OSV_SAMPLER_HH_
+#define OSV_SAMPLER_HH_
+
+#include <chrono>
+
+// Statistical CPU profiler: a timer on every cpu records, once per period,
+// the backtrace of whatever the cpu was running when it fired, as a
+// "sampler_tick" trace record. "trace.py prof" renders them as a profile.
+namespace prof {
+
+struct config {
+    std::chrono::nanoseconds period;
+};
+
+// Periods shorter than this (above 10kHz) are lengthened to it: the samples
+// would cost more than the code being sampled.
+constexpr std::chrono::nanoseconds min_period{100000};
+
+// Starts sampling on all cpus, or changes the period if already started.
+// Returns false, and does nothing, if the period is not positive.
+bool start_sampler(config cfg);
+void stop_sampler();
+
+}
+
+#endif /* OSV_SAMPLER_HH_ */
@@ -308,6 +308,10 @@ public:
         void* begin;
         size_t size;
         void (*deleter)(stack_info si);  // null: don't delete
+        // not populated in advance: see ensure_stack_reserve()
+        bool lazy;
+        // bytes of guard pages at begin
+        size_t guard;
         static void default_deleter(stack_info si);
     };
     struct attr {
@@ -631,6 +635,8 @@ struct cpu : private timer_base::client {
     thread* idle_thread;
     // if true, cpu is now polling incoming_wakeups_mask
     std::atomic<bool> idle_poll = { false };
+    // the thread now running on this cpu, for is_running()
+    std::atomic<thread*> running_thread = { nullptr };
     // for each cpu, a list of threads that are migrating into this cpu:
     typedef lockless_queue<thread, &thread::_wakeup_link> incoming_wakeup_queue;
     cpu_set incoming_wakeups_mask;
@@ -674,7 +680,17 @@ private:
 };
 
 void preempt();
+// Whether t is running on some cpu right now (and may be gone the next
+// moment). Only t's address is compared, so t may have been destroyed.
+bool is_running(const thread* t);
 void preempt_disable() __attribute__((no_instrument_function));
+// The most stack code running with preemption or interrupts disabled may
+// use, on a lazily populated stack
+constexpr size_t lazy_stack_reserve = 16384;
+void ensure_stack_reserve() __attribute__((no_instrument_function));
+void init_lazy_stack(const thread::stack_info& si);
+// Called on a page fault with preemption or interrupts disabled
+void check_lazy_stack_fault(uintptr_t addr);
 void preempt_enable() __attribute__((no_instrument_function));
 bool preemptable() __attribute__((no_instrument_function));
 
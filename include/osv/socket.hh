@@ -36,6 +36,8 @@ public:
     virtual int chmod(mode_t mode) override;
     virtual void poll_install(pollreq& pr) override;
     virtual void poll_uninstall(pollreq& pr) override;
+    virtual void epoll_add(epoll_ptr ep) override;
+    virtual void epoll_del(epoll_ptr ep) override;
     int bsd_ioctl(u_long cmd, void* data);
     socket* so;
 };
@@ -41,7 +41,13 @@ struct trace_record {
     };
 };
 
-trace_record* allocate_trace_record(size_t size);
+// Reserves a record in the trace ring of the given cpu, or returns nullptr
+// (and counts the record as dropped) if that cpu has no ring. Must be
+// called on that cpu, with interrupts disabled.
+trace_record* allocate_trace_record(size_t size, unsigned cpu);
+// Counts a record dropped because it was logged before there was a current
+// thread, and so a cpu to log it to
+void trace_record_no_cpu();
 
 template <size_t idx, size_t N, typename... args>
 struct tuple_formatter
@@ -238,6 +244,11 @@ public:
     static void log_backtraces();
     void add_probe(probe* p);
     void del_probe(probe* p);
+    // Logs a record with the given backtrace (of an interrupted context,
+    // say) instead of the caller's, and no arguments. Called with
+    // interrupts disabled.
+    void log_sample(void** bt, int nr);
+    static const size_t backtrace_len = 10;
     tracepoint_id id;
     const char* name;
     const char* format;
@@ -272,7 +283,6 @@ private:
     void update();
     static std::unordered_set<tracepoint_id>& known_ids();
     static bool _log_backtrace;
-    static const size_t backtrace_len = 10;
 };
 
 namespace {
@@ -307,6 +317,7 @@ public:
     }
     void trace_slow_path(std::tuple<s_args...> as) __attribute__((cold)) {
         if (active) {
+            sched::ensure_stack_reserve();
             arch::irq_flag_notrace irq;
             irq.save();
             arch::irq_disable_notrace();
@@ -319,17 +330,22 @@ public:
         if (!logging) {
             return;
         }
-        auto tr = allocate_trace_record(size());
+        auto thread = sched::thread::current();
+        if (!thread) {
+            trace_record_no_cpu();
+            return;
+        }
+        auto cpu = thread->tcpu()->id;
+        auto tr = allocate_trace_record(size(), cpu);
+        if (!tr) {
+            return;
+        }
         tr->tp = this;
-        tr->thread = sched::thread::current();
-        tr->thread_name = tr->thread->name_raw();
-        tr->time = 0;
-        tr->cpu = -1;
+        tr->thread = thread;
+        tr->thread_name = thread->name_raw();
+        tr->time = clock::get()->time();
+        tr->cpu = cpu;
         auto buffer = tr->buffer;
-        if (tr->thread) {
-            tr->time = clock::get()->time();
-            tr->cpu = tr->thread->tcpu()->id;
-        }
         tr->backtrace = false;
         log_backtrace(tr, buffer);
         serialize(buffer, as);
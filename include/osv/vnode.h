@@ -68,10 +68,9 @@ enum vtype {
  */
 struct vnode {
 	uint64_t	v_ino;		/* inode number */
-	LIST_ENTRY(vnode) v_link;	/* link for hash list */
 	struct mount	*v_mount;	/* mounted vfs pointer */
 	struct vnops	*v_op;		/* vnode operations */
-	int		v_refcnt;	/* reference count */
+	int		v_refcnt;	/* reference count, 0 when dying */
 	int		v_type;		/* vnode type */
 	int		v_flags;	/* vnode flag */
 	mode_t		v_mode;		/* file mode */
@@ -79,6 +78,7 @@ struct vnode {
 	mutex_t		v_lock;		/* lock for this vnode */
 	LIST_HEAD(, dentry) v_names;	/* directory entries pointing at this */
 	int		v_nrlocks;	/* lock count (for debug) */
+	int		v_npages;	/* pages in the page cache */
 	void		*v_data;	/* private data for fs */
 };
 
@@ -138,6 +138,7 @@ typedef	int (*vnop_setattr_t)	(struct vnode *, struct vattr *);
 typedef	int (*vnop_inactive_t)	(struct vnode *);
 typedef	int (*vnop_truncate_t)	(struct vnode *, off_t);
 typedef	int (*vnop_link_t)      (struct vnode *, struct vnode *, char *);
+typedef	int (*vnop_getpage_t)	(struct vnode *, off_t, void **);
 
 /*
  * vnode operations
@@ -162,6 +163,9 @@ struct vnops {
 	vnop_inactive_t		vop_inactive;
 	vnop_truncate_t		vop_truncate;
 	vnop_link_t		vop_link;
+	/* optional: the page holding the data at a page aligned offset, for
+	   file systems keeping whole pages, so it can be mapped as is */
+	vnop_getpage_t		vop_getpage;
 };
 
 /*
@@ -187,6 +191,7 @@ struct vnops {
 #define VOP_INACTIVE(VP)	   ((VP)->v_op->vop_inactive)(VP)
 #define VOP_TRUNCATE(VP, N)	   ((VP)->v_op->vop_truncate)(VP, N)
 #define VOP_LINK(DVP, SVP, N) 	   ((DVP)->v_op->vop_link)(DVP, SVP, N)
+#define VOP_GETPAGE(VP, O, P)	   ((VP)->v_op->vop_getpage)(VP, O, P)
 
 int	 vop_nullop(void);
 int	 vop_einval(void);
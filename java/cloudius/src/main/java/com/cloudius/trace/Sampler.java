@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+package com.cloudius.trace;
+
+import com.cloudius.Config;
+
+/**
+ * Controls the sampling profiler, which records the backtrace of what each
+ * cpu is running, frequency times a second, in the trace buffer.
+ */
+public class Sampler {
+
+    static {
+        Config.loadJNI("tracepoint.so");
+    }
+
+    public static void start(int frequency) {
+        if (frequency <= 0) {
+            throw new IllegalArgumentException("frequency must be positive");
+        }
+        // the kernel lowers frequencies above its maximum
+        if (!doStart(Math.max(1000000000L / frequency, 1))) {
+            throw new IllegalArgumentException("bad sampling frequency " + frequency);
+        }
+    }
+
+    public static void stop() {
+        doStop();
+    }
+
+    native static boolean doStart(long periodNanos);
+
+    native static void doStop();
+}
@@ -3,6 +3,7 @@
 #include <osv/per-cpu-counter.hh>
 #include <osv/callstack.hh>
 #include <osv/debug.hh>
+#include <osv/sampler.hh>
 
 static std::string get_string(JNIEnv* jni, jstring s)
 {
@@ -122,3 +123,15 @@ JNIEXPORT jobjectArray JNICALL Java_com_cloudius_trace_Callstack_collect
     });
     return array;
 }
+
+JNIEXPORT jboolean JNICALL Java_com_cloudius_trace_Sampler_doStart
+  (JNIEnv *jni, jclass klass, jlong period)
+{
+    return prof::start_sampler({std::chrono::nanoseconds(period)});
+}
+
+JNIEXPORT void JNICALL Java_com_cloudius_trace_Sampler_doStop
+  (JNIEnv *jni, jclass klass)
+{
+    prof::stop_sampler();
+}
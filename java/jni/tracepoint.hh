@@ -71,6 +71,22 @@ JNIEXPORT jlong JNICALL Java_com_cloudius_trace_Tracepoint_readCounter
 JNIEXPORT jobjectArray JNICALL Java_com_cloudius_trace_Callstack_collect
   (JNIEnv *, jclass, jobject, jint, jint, jlong);
 
+/*
+ * Class:     com_cloudius_trace_Sampler
+ * Method:    doStart
+ * Signature: (J)Z
+ */
+JNIEXPORT jboolean JNICALL Java_com_cloudius_trace_Sampler_doStart
+  (JNIEnv *, jclass, jlong);
+
+/*
+ * Class:     com_cloudius_trace_Sampler
+ * Method:    doStop
+ * Signature: ()V
+ */
+JNIEXPORT void JNICALL Java_com_cloudius_trace_Sampler_doStop
+  (JNIEnv *, jclass);
+
 #ifdef __cplusplus
 }
 #endif
@@ -34,7 +34,9 @@ public:
     virtual int read(uio* data, int flags) override;
     virtual int write(uio* data, int flags) override;
     virtual int poll(int events) override;
+    virtual int ioctl(u_long com, void *data) override;
     virtual int close() override;
+    pipe_buffer* buf() { return (f_flags & FWRITE) ? writer->buf.get() : reader->buf.get(); }
 private:
     pipe_writer* writer = nullptr;
     pipe_reader* reader = nullptr;
@@ -80,6 +82,30 @@ int pipe_file::poll(int events)
     return revents;
 }
 
+// F_SETPIPE_SZ and F_GETPIPE_SZ are passed on by fcntl()
+int pipe_file::ioctl(u_long com, void *data)
+{
+    auto arg = static_cast<int*>(data);
+    switch (com) {
+    case F_SETPIPE_SZ: {
+        if (*arg < 0) {
+            return EINVAL;
+        }
+        auto error = buf()->resize(*arg);
+        if (error) {
+            return error;
+        }
+        *arg = buf()->size();
+        return 0;
+    }
+    case F_GETPIPE_SZ:
+        *arg = buf()->size();
+        return 0;
+    default:
+        return special_file::ioctl(com, data);
+    }
+}
+
 int pipe_file::close()
 {
     if (f_flags & FWRITE) {
@@ -109,3 +135,84 @@ int pipe(int pipefd[2]) {
         return libc_error(error);
     }
 }
+
+ssize_t splice(int fd_in, off_t *off_in, int fd_out, off_t *off_out,
+        size_t len, unsigned flags)
+{
+    fileref in(fileref_from_fd(fd_in));
+    fileref out(fileref_from_fd(fd_out));
+    if (!in || !out) {
+        return libc_error(EBADF);
+    }
+    auto pin = dynamic_cast<pipe_file*>(in.get());
+    auto pout = dynamic_cast<pipe_file*>(out.get());
+    if ((pin && !(pin->f_flags & FREAD)) || (pout && !(pout->f_flags & FWRITE))) {
+        return libc_error(EBADF);
+    }
+    if ((pin && off_in) || (pout && off_out)) {
+        return libc_error(ESPIPE);
+    }
+    bool nonblock = (flags & SPLICE_F_NONBLOCK)
+            || (pin && is_nonblock(pin)) || (pout && is_nonblock(pout));
+    size_t count;
+    int error;
+    if (pin && pout) {
+        if (pin->buf() == pout->buf()) {
+            return libc_error(EINVAL);
+        }
+        error = pin->buf()->splice(pout->buf(), len, nonblock, &count);
+    } else if (pin) {
+        error = pin->buf()->splice_to(out.get(), off_out ? *off_out : -1,
+                len, nonblock, &count);
+        if (!error && off_out) {
+            *off_out += count;
+        }
+    } else if (pout) {
+        error = pout->buf()->splice_from(in.get(), off_in ? *off_in : -1,
+                len, nonblock, &count);
+        if (!error && off_in) {
+            *off_in += count;
+        }
+    } else {
+        return libc_error(EINVAL);
+    }
+    if (error) {
+        return libc_error(error);
+    }
+    return count;
+}
+
+// User memory cannot be gifted to the pipe, so unlike Linux, this copies
+ssize_t vmsplice(int fd, const struct iovec *iov, size_t nr, unsigned flags)
+{
+    fileref f(fileref_from_fd(fd));
+    if (!f) {
+        return libc_error(EBADF);
+    }
+    auto p = dynamic_cast<pipe_file*>(f.get());
+    if (!p) {
+        return libc_error(EBADF);
+    }
+    uio data;
+    data.uio_iov = const_cast<iovec*>(iov);
+    data.uio_iovcnt = nr;
+    data.uio_offset = -1;
+    data.uio_resid = 0;
+    for (size_t i = 0; i < nr; i++) {
+        data.uio_resid += iov[i].iov_len;
+    }
+    auto total = data.uio_resid;
+    bool nonblock = (flags & SPLICE_F_NONBLOCK) || is_nonblock(p);
+    int error;
+    if (p->f_flags & FWRITE) {
+        data.uio_rw = UIO_WRITE;
+        error = p->buf()->write(&data, nonblock);
+    } else {
+        data.uio_rw = UIO_READ;
+        error = p->buf()->read(&data, nonblock);
+    }
+    if (error) {
+        return libc_error(error);
+    }
+    return total - data.uio_resid;
+}
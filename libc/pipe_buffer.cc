@@ -11,6 +11,28 @@
 #include "pipe_buffer.hh"
 
 #include <osv/poll.h>
+#include <osv/mempool.hh>
+#include <fs/vfs/vfs.h>
+#include <algorithm>
+#include <string.h>
+
+using memory::page_size;
+
+pipe_buffer::pipe_buffer()
+    : pages(default_size / page_size)
+    , capacity(default_size)
+{
+    for (auto& p : pages) {
+        p = memory::alloc_page();
+    }
+}
+
+pipe_buffer::~pipe_buffer()
+{
+    for (auto p : pages) {
+        memory::free_page(p);
+    }
+}
 
 void pipe_buffer::detach_sender()
 {
@@ -49,7 +71,7 @@ void pipe_buffer::attach_receiver(struct file *f)
 int pipe_buffer::read_events_unlocked()
 {
     int ret = 0;
-    ret |= !q.empty() ? POLLIN : 0;
+    ret |= len ? POLLIN : 0;
     ret |= !sender ? POLLHUP : 0;
     return ret;
 }
@@ -60,7 +82,7 @@ int pipe_buffer::write_events_unlocked()
         return POLLERR|POLLOUT;
     }
     int ret = 0;
-    ret |= q.size() < max_buf ? POLLOUT : 0;
+    ret |= room() ? POLLOUT : 0;
     return ret;
 }
 
@@ -78,67 +100,143 @@ int pipe_buffer::write_events()
     }
 }
 
-// Copy from the pipe into the given iovec array, until the array is full
-// or the queue is empty. Decrements uio->uio_resid.
-static void copy_to_uio(std::deque<char> &q, uio *uio)
+void pipe_buffer::wake_reader()
 {
-    for (int i = 0; i < uio->uio_iovcnt && !q.empty(); i++) {
-        auto &iov = uio->uio_iov[i];
-        auto n = std::min(q.size(), iov.iov_len);
-        char* p = static_cast<char*>(iov.iov_base);
-        std::copy(q.begin(), q.begin() + n, p);
-        q.erase(q.begin(), q.begin() + n);
-        uio->uio_resid -= n;
+    if (receiver && (read_events_unlocked() & POLLIN)) {
+        poll_wake(receiver, (POLLIN | POLLRDNORM));
     }
+    may_read.wake_all();
 }
 
-int pipe_buffer::read(uio* data, bool nonblock)
+void pipe_buffer::wake_writer()
 {
-    if (!data->uio_resid) {
-        return 0;
+    if (sender && (write_events_unlocked() & POLLOUT)) {
+        poll_wake(sender, (POLLOUT | POLLWRNORM));
     }
-    std::unique_lock<mutex> lock(mtx);
-    if (nonblock && q.empty()) {
-        return sender ? EAGAIN : 0;
+    may_write.wake_all();
+}
+
+void pipe_buffer::consumed(size_t n)
+{
+    rd = (rd + n) % capacity;
+    len -= n;
+}
+
+void pipe_buffer::produced(size_t n)
+{
+    len += n;
+}
+
+// Copy n bytes (no more than len) out of the ring, in page-sized chunks
+void pipe_buffer::copy_out(void* dst, size_t n)
+{
+    while (n) {
+        auto off = rd % page_size;
+        auto c = std::min(n, page_size - off);
+        memcpy(dst, static_cast<char*>(pages[rd / page_size]) + off, c);
+        consumed(c);
+        dst += c;
+        n -= c;
     }
-    while (sender && q.empty()) {
-        may_read.wait(&mtx);
+}
+
+// Copy n bytes (no more than room()) into the ring, in page-sized chunks
+void pipe_buffer::copy_in(const void* src, size_t n)
+{
+    while (n) {
+        auto wr = write_pos();
+        auto off = wr % page_size;
+        auto c = std::min(n, page_size - off);
+        memcpy(static_cast<char*>(pages[wr / page_size]) + off, src, c);
+        produced(c);
+        src += c;
+        n -= c;
     }
-    if (q.empty()) {
-        return 0;
+}
+
+// Describe the first n bytes of data (or less, if there isn't as much)
+// as an iovec array pointing into the ring
+std::vector<iovec> pipe_buffer::data_iov(size_t n)
+{
+    std::vector<iovec> ret;
+    n = std::min(n, len);
+    for (auto pos = rd; n; pos = (pos + page_size) % capacity) {
+        pos -= pos % page_size;
+        auto off = ret.empty() ? rd % page_size : 0;
+        auto c = std::min(n, page_size - off);
+        ret.push_back({static_cast<char*>(pages[pos / page_size]) + off, c});
+        n -= c;
     }
-    copy_to_uio(q, data);
-    if (write_events_unlocked() & POLLOUT)
-        poll_wake(sender, (POLLOUT | POLLWRNORM));
-    lock.unlock();
-    may_write.wake_all();
-    return 0;
+    return ret;
 }
 
-// Copy from a certain iovec array into a pipe, starting at a given index
-// and offset, until the buffer or the array ends. Decrements uio->uio_resid,
-// and modifies ind and offset to where the copy stopped.
-static void copy_from_uio(uio *uio, size_t *ind, size_t *offset,
-        std::deque<char> &buf, size_t bufsize)
+// Likewise for the first n bytes of free space
+std::vector<iovec> pipe_buffer::room_iov(size_t n)
 {
-    int i = *ind;
-    size_t off = *offset;
+    std::vector<iovec> ret;
+    n = std::min(n, room());
+    auto wr = write_pos();
+    for (auto pos = wr; n; pos = (pos + page_size) % capacity) {
+        pos -= pos % page_size;
+        auto off = ret.empty() ? wr % page_size : 0;
+        auto c = std::min(n, page_size - off);
+        ret.push_back({static_cast<char*>(pages[pos / page_size]) + off, c});
+        n -= c;
+    }
+    return ret;
+}
 
-    while (i < uio->uio_iovcnt && buf.size() < bufsize) {
-        auto &iov = uio->uio_iov[i];
-        auto n = std::min(bufsize - buf.size(), iov.iov_len - off);
-        char* p = static_cast<char*>(iov.iov_base) + off;
-        std::copy(p, p + n, std::back_inserter(buf));
-        uio->uio_resid -= n;
-        off += n;
-        if (off == iov.iov_len) {
-            ++i;
-            off = 0;
+// Wait until there's data for us to read, or no writer is left (in which
+// case len is 0 on return). Called with mtx held.
+int pipe_buffer::wait_for_data(bool nonblock)
+{
+    while ((sender && !len) || reading) {
+        if (nonblock) {
+            return EAGAIN;
         }
+        may_read.wait(&mtx);
     }
+    return 0;
+}
 
-    *offset = off;
-    *ind = i;
+// Wait until there's room for n bytes. Called with mtx held.
+int pipe_buffer::wait_for_room(size_t n, bool nonblock)
+{
+    while (receiver && (room() < n || writing)) {
+        if (nonblock) {
+            return EAGAIN;
+        }
+        may_write.wait(&mtx);
+    }
+    if (!receiver) {
+        // FIXME: If we don't generate a SIGPIPE here, at least assert
+        // that the user did not install a SIGPIPE handler.
+        return EPIPE;
+    }
+    return 0;
+}
+
+int pipe_buffer::read(uio* data, bool nonblock)
+{
+    if (!data->uio_resid) {
+        return 0;
+    }
+    WITH_LOCK(mtx) {
+        auto error = wait_for_data(nonblock);
+        if (error || !len) {
+            return error;
+        }
+        // Copy from the pipe into the given iovec array, until the array
+        // is full or the pipe is empty.
+        for (int i = 0; i < data->uio_iovcnt && len; i++) {
+            auto &iov = data->uio_iov[i];
+            auto n = std::min(len, iov.iov_len);
+            copy_out(iov.iov_base, n);
+            data->uio_resid -= n;
+        }
+        wake_writer();
+    }
+    return 0;
 }
 
 int pipe_buffer::write(uio* data, bool nonblock)
@@ -150,47 +248,217 @@ int pipe_buffer::write(uio* data, bool nonblock)
         // A write() smaller than PIPE_BUF (=4096 in Linux) will not be split
         // (i.e., will be "atomic"): For such a small write, we need to wait
         // until there's enough room for all it in the buffer.
-        int needroom = data->uio_resid <= 4096 ? data->uio_resid : 1;
-        if (nonblock) {
-            if (!receiver) {
-                // FIXME: If we don't generate a SIGPIPE here, at least assert
-                // that the user did not install a SIGPIPE handler.
-                return EPIPE;
-            } else if (q.size() + needroom > max_buf) {
-                return EAGAIN;
-            }
-        } else {
-            while (receiver && q.size() + needroom > max_buf) {
-                may_write.wait(&mtx);
-            }
-            if (!receiver) {
-                return EPIPE;
-            }
+        size_t needroom = data->uio_resid <= 4096 ? data->uio_resid : 1;
+        auto error = wait_for_room(needroom, nonblock);
+        if (error) {
+            return error;
         }
 
         // A blocking write() to a pipe never returns with partial success -
         // it waits, possibly writing its output in parts and waiting multiple
         // times, until the whole given buffer is written.
-        size_t ind = 0, offset = 0;
+        int i = 0;
+        size_t off = 0;
         while (data->uio_resid && receiver) {
-            copy_from_uio(data, &ind, &offset, q, max_buf);
+            while (i < data->uio_iovcnt && room()) {
+                auto &iov = data->uio_iov[i];
+                auto n = std::min(room(), iov.iov_len - off);
+                copy_in(static_cast<char*>(iov.iov_base) + off, n);
+                data->uio_resid -= n;
+                off += n;
+                if (off == iov.iov_len) {
+                    ++i;
+                    off = 0;
+                }
+            }
             if (data->uio_resid) {
                 // The buffer is full but we still have more to send. Wake up
                 // readers, and go to sleep ourselves.
-                assert(q.size() == max_buf);
-                poll_wake(receiver, (POLLIN | POLLRDNORM));
-                may_read.wake_all();
+                wake_reader();
                 if (nonblock) {
                     return 0;
                 }
-                while (receiver && q.size() == max_buf) {
+                while (receiver && (!room() || writing)) {
                     may_write.wait(&mtx);
                 }
             }
         }
-        if (read_events_unlocked() & POLLIN)
-            poll_wake(receiver, (POLLIN | POLLRDNORM));
+        wake_reader();
+    }
+    return 0;
+}
+
+// Move up to n bytes to another pipe, both locked. Whole pages are moved by
+// exchanging them for free pages of the other pipe, the rest is copied.
+size_t pipe_buffer::move_to(pipe_buffer* out, size_t n)
+{
+    size_t moved = 0;
+    while (moved < n && len && out->room()) {
+        auto wr = out->write_pos();
+        if (rd % page_size == 0 && wr % page_size == 0 && len >= page_size
+                && out->room() >= page_size && n - moved >= page_size) {
+            std::swap(pages[rd / page_size], out->pages[wr / page_size]);
+            consumed(page_size);
+            out->produced(page_size);
+            moved += page_size;
+            continue;
+        }
+        auto c = std::min({n - moved, len, out->room(),
+                page_size - rd % page_size, page_size - wr % page_size});
+        memcpy(static_cast<char*>(out->pages[wr / page_size]) + wr % page_size,
+                static_cast<char*>(pages[rd / page_size]) + rd % page_size, c);
+        consumed(c);
+        out->produced(c);
+        moved += c;
+    }
+    return moved;
+}
+
+int pipe_buffer::splice(pipe_buffer* out, size_t n, bool nonblock, size_t* count)
+{
+    *count = 0;
+    if (!n) {
+        return 0;
+    }
+    while (true) {
+        WITH_LOCK(mtx) {
+            auto error = wait_for_data(nonblock);
+            if (error || !len) {
+                return error;
+            }
+        }
+        WITH_LOCK(out->mtx) {
+            auto error = out->wait_for_room(1, nonblock);
+            if (error) {
+                return error;
+            }
+        }
+        // A splice in the other direction may be running concurrently, so
+        // take both locks in address order.
+        auto first = std::min(this, out);
+        auto second = std::max(this, out);
+        WITH_LOCK(first->mtx) {
+            WITH_LOCK(second->mtx) {
+                if (!out->receiver) {
+                    return EPIPE;
+                }
+                if (reading || out->writing) {
+                    continue;
+                }
+                auto moved = move_to(out, n);
+                if (moved) {
+                    wake_writer();
+                    out->wake_reader();
+                    *count = moved;
+                    return 0;
+                }
+            }
+        }
+    }
+}
+
+int pipe_buffer::splice_to(struct file* out, off_t offset, size_t n,
+        bool nonblock, size_t* count)
+{
+    *count = 0;
+    if (!n) {
+        return 0;
+    }
+    std::vector<iovec> iov;
+    WITH_LOCK(mtx) {
+        auto error = wait_for_data(nonblock);
+        if (error || !len) {
+            return error;
+        }
+        iov = data_iov(n);
+        reading = true;
+    }
+    // Writers only touch the free part of the ring, so we can write the
+    // data to the file without holding the lock.
+    size_t written = 0;
+    auto error = sys_write(out, iov.data(), iov.size(), offset, &written);
+    WITH_LOCK(mtx) {
+        reading = false;
+        consumed(written);
+        wake_writer();
+        may_read.wake_all();
+    }
+    *count = written;
+    return written ? 0 : error;
+}
+
+int pipe_buffer::splice_from(struct file* in, off_t offset, size_t n,
+        bool nonblock, size_t* count)
+{
+    *count = 0;
+    if (!n) {
+        return 0;
+    }
+    std::vector<iovec> iov;
+    WITH_LOCK(mtx) {
+        auto error = wait_for_room(1, nonblock);
+        if (error) {
+            return error;
+        }
+        iov = room_iov(n);
+        writing = true;
+    }
+    // Readers only touch the data part of the ring, and don't move its end,
+    // so we can read into the free part without holding the lock.
+    size_t nread = 0;
+    auto error = sys_read(in, iov.data(), iov.size(), offset, &nread);
+    WITH_LOCK(mtx) {
+        writing = false;
+        produced(nread);
+        wake_reader();
+        may_write.wake_all();
+    }
+    *count = nread;
+    return nread ? 0 : error;
+}
+
+int pipe_buffer::resize(size_t size)
+{
+    if (size > max_size) {
+        return EPERM;
+    }
+    // Like Linux, round up to a power of two number of pages
+    size_t npages = 1;
+    while (npages * page_size < size) {
+        npages <<= 1;
+    }
+    WITH_LOCK(mtx) {
+        while (reading || writing) {
+            if (reading) {
+                may_read.wait(&mtx);
+            } else {
+                may_write.wait(&mtx);
+            }
+        }
+        if (len > npages * page_size) {
+            return EBUSY;
+        }
+        std::vector<void*> new_pages(npages);
+        auto n = len;
+        for (auto& p : new_pages) {
+            p = memory::alloc_page();
+            copy_out(p, std::min(len, page_size));
+        }
+        for (auto p : pages) {
+            memory::free_page(p);
+        }
+        pages = std::move(new_pages);
+        capacity = npages * page_size;
+        rd = 0;
+        len = n;
+        wake_writer();
     }
-    may_read.wake_all();
     return 0;
 }
+
+size_t pipe_buffer::size()
+{
+    WITH_LOCK(mtx) {
+        return capacity;
+    }
+}
@@ -8,7 +8,7 @@
 #ifndef PIPE_BUFFER_HH_
 #define PIPE_BUFFER_HH_
 
-#include <deque>
+#include <vector>
 #include <atomic>
 #include <boost/intrusive_ptr.hpp>
 
@@ -16,14 +16,32 @@
 #include <osv/condvar.h>
 #include <osv/file.h>
 
+// The buffer is a ring of pages. Besides read() and write(), data can be
+// spliced between two pipes by exchanging whole pages (no copy at all), or
+// between a pipe and a file, with the file's read() or write() operating
+// directly on the pipe's pages.
 struct pipe_buffer {
-private:
-    static constexpr size_t max_buf = 8192;
 public:
-    pipe_buffer() = default;
+    static constexpr size_t default_size = 8192;
+    // like Linux's /proc/sys/fs/pipe-max-size
+    static constexpr size_t max_size = 1 << 20;
+    pipe_buffer();
+    ~pipe_buffer();
     pipe_buffer(const pipe_buffer&) = delete;
     int read(uio* data, bool nonblock);
     int write(uio* data, bool nonblock);
+    // Move up to len bytes into another pipe
+    int splice(pipe_buffer* out, size_t len, bool nonblock, size_t* count);
+    // Write up to len bytes to a file, at the given offset (-1 for the
+    // file's current offset)
+    int splice_to(struct file* out, off_t offset, size_t len, bool nonblock,
+            size_t* count);
+    // Read up to len bytes from a file into the pipe
+    int splice_from(struct file* in, off_t offset, size_t len, bool nonblock,
+            size_t* count);
+    // F_SETPIPE_SZ, F_GETPIPE_SZ
+    int resize(size_t size);
+    size_t size();
     int read_events();
     int write_events();
     void detach_sender();
@@ -33,9 +51,30 @@ public:
 private:
     int read_events_unlocked();
     int write_events_unlocked();
+    size_t room() const { return capacity - len; }
+    size_t write_pos() const { return (rd + len) % capacity; }
+    void copy_out(void* dst, size_t n);
+    void copy_in(const void* src, size_t n);
+    void consumed(size_t n);
+    void produced(size_t n);
+    std::vector<iovec> data_iov(size_t n);
+    std::vector<iovec> room_iov(size_t n);
+    int wait_for_data(bool nonblock);
+    int wait_for_room(size_t n, bool nonblock);
+    size_t move_to(pipe_buffer* out, size_t n);
+    void wake_reader();
+    void wake_writer();
 private:
     mutex mtx;
-    std::deque<char> q;
+    std::vector<void*> pages;
+    size_t capacity;
+    // offset of the first byte in the ring, and the number of bytes
+    size_t rd = 0;
+    size_t len = 0;
+    // A splice to or from a file works on the ring without holding mtx,
+    // and excludes other readers (or writers, respectively) meanwhile.
+    bool reading = false;
+    bool writing = false;
     struct file *receiver = nullptr;
     struct file *sender = nullptr;
     std::atomic<unsigned> refs = {};
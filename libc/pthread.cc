@@ -22,6 +22,9 @@
 #include <osv/condvar.h>
 #include <osv/stubbing.hh>
 #include <osv/lazy_indirect.hh>
+#include <osv/percpu.hh>
+#include <osv/preempt-lock.hh>
+#include <osv/align.hh>
 
 #include <api/time.h>
 
@@ -53,6 +56,8 @@ namespace pthread_private {
     private:
         sched::thread::stack_info allocate_stack(thread_attr attr);
         static void free_stack(sched::thread::stack_info si);
+        static void* get_cached_stack(size_t size);
+        static void put_cached_stack(sched::thread::stack_info si);
         sched::thread::attr attributes(thread_attr attr);
     };
 
@@ -84,16 +89,72 @@ namespace pthread_private {
         return a;
     }
 
+    // Stacks with the default one-page guard which were recently freed, so
+    // that threads coming and going don't map and unmap a stack each time.
+    // Their pages stay populated as far as the previous thread used them.
+    struct stack_cache {
+        static constexpr unsigned max = 16;
+        unsigned nr = 0;
+        struct {
+            void* begin;
+            size_t size;
+        } stacks[max];
+    };
+
+    PERCPU(stack_cache, percpu_stack_cache);
+
+    void* pthread::get_cached_stack(size_t size)
+    {
+        WITH_LOCK(preempt_lock) {
+            auto& cache = *percpu_stack_cache;
+            for (unsigned i = cache.nr; i-- > 0; ) {
+                if (cache.stacks[i].size == size) {
+                    auto addr = cache.stacks[i].begin;
+                    cache.stacks[i] = cache.stacks[--cache.nr];
+                    return addr;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    void pthread::put_cached_stack(sched::thread::stack_info si)
+    {
+        WITH_LOCK(preempt_lock) {
+            auto& cache = *percpu_stack_cache;
+            if (cache.nr < cache.max) {
+                cache.stacks[cache.nr++] = {si.begin, si.size};
+                return;
+            }
+        }
+        free_stack(si);
+    }
+
+    // Stacks are not populated in advance, so a thread only uses as much
+    // memory as its stack grows to, and the guard pages none at all. Only
+    // the top page is faulted in here, as the new thread starts running on
+    // it with interrupts disabled; see sched::ensure_stack_reserve() for
+    // the rest.
     sched::thread::stack_info pthread::allocate_stack(thread_attr attr)
     {
         if (attr.stack_begin) {
             return {attr.stack_begin, attr.stack_size};
         }
-        size_t size = attr.stack_size;
-        void *addr = mmu::map_anon(nullptr, size, mmu::mmap_populate, mmu::perm_rw);
-        mmu::mprotect(addr, attr.guard_size, 0);
+        size_t size = align_up(attr.stack_size, mmu::page_size);
+        size_t guard = align_up(attr.guard_size, mmu::page_size);
+        bool cacheable = guard == mmu::page_size;
+        void *addr = cacheable ? get_cached_stack(size) : nullptr;
+        if (!addr) {
+            addr = mmu::map_anon(nullptr, size, 0, mmu::perm_rw);
+            if (guard) {
+                mmu::mprotect(addr, guard, 0);
+            }
+            *static_cast<volatile char*>(addr + size - 1) = 0;
+        }
         sched::thread::stack_info si{addr, size};
-        si.deleter = free_stack;
+        si.deleter = cacheable ? put_cached_stack : free_stack;
+        si.lazy = true;
+        si.guard = guard;
         return si;
     }
 
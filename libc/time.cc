@@ -13,6 +13,7 @@
 #include "libc.hh"
 #include <osv/clock.hh>
 #include <osv/sched.hh>
+#include <atomic>
 
 u64 convert(const timespec& ts)
 {
@@ -54,6 +55,61 @@ static inline void fill_ts(std::chrono::duration<Rep, Period> d, timespec *ts)
     ts->tv_nsec = duration_cast<nanoseconds>(d).count() % 1000000000;
 }
 
+// CLOCK_*_COARSE return the uptime cached by a thread ticking every
+// coarse_tick, which is only started by the first such call, so that guests
+// not using them aren't woken up for nothing. The thread also stops ticking
+// after a tick with no reader, so a guest which stopped using them can go
+// idle again; the next reader brings the cached uptime up to date itself,
+// and restarts the ticks.
+static constexpr std::chrono::milliseconds coarse_tick(4);
+static std::atomic<s64> coarse_uptime;
+// read since the last tick
+static std::atomic<bool> coarse_used;
+// the ticker is waiting for a reader
+static std::atomic<bool> coarse_parked;
+
+// Both the ticker and a reader restarting it update the cached uptime, so
+// never move it backwards.
+static void update_coarse_uptime()
+{
+    auto now = osv::clock::uptime::now().time_since_epoch().count();
+    auto old = coarse_uptime.load(std::memory_order_relaxed);
+    while (old < now && !coarse_uptime.compare_exchange_weak(old, now,
+                std::memory_order_relaxed)) {
+    }
+}
+
+static std::chrono::nanoseconds coarse_now()
+{
+    static sched::thread* ticker = [] {
+        update_coarse_uptime();
+        auto t = new sched::thread([] {
+            while (true) {
+                sched::thread::sleep(coarse_tick);
+                if (!coarse_used.exchange(false, std::memory_order_relaxed)) {
+                    coarse_parked.store(true);
+                    sched::thread::wait_until([] { return !coarse_parked.load(); });
+                }
+                update_coarse_uptime();
+            }
+        }, sched::thread::attr().name("coarse-clock"));
+        t->start();
+        return t;
+    }();
+    // Only write the shared flag when the ticker cleared it
+    if (!coarse_used.load(std::memory_order_relaxed)) {
+        coarse_used.store(true, std::memory_order_relaxed);
+    }
+    if (coarse_parked.load()) {
+        // the cached uptime may be from long ago
+        update_coarse_uptime();
+        if (coarse_parked.exchange(false)) {
+            ticker->wake();
+        }
+    }
+    return std::chrono::nanoseconds(coarse_uptime.load(std::memory_order_relaxed));
+}
+
 int clock_gettime(clockid_t clk_id, struct timespec* ts)
 {
     switch (clk_id) {
@@ -61,9 +117,14 @@ int clock_gettime(clockid_t clk_id, struct timespec* ts)
         fill_ts(osv::clock::uptime::now().time_since_epoch(), ts);
         break;
     case CLOCK_REALTIME:
-    case CLOCK_REALTIME_COARSE:
         fill_ts(osv::clock::wall::now().time_since_epoch(), ts);
         break;
+    case CLOCK_MONOTONIC_COARSE:
+        fill_ts(coarse_now(), ts);
+        break;
+    case CLOCK_REALTIME_COARSE:
+        fill_ts(osv::clock::wall::boot_time().time_since_epoch() + coarse_now(), ts);
+        break;
     case CLOCK_PROCESS_CPUTIME_ID:
         // FIXME: discount idle time
         fill_ts(osv::clock::uptime::now().time_since_epoch() * sched::cpus.size(), ts);
@@ -90,8 +151,13 @@ int __clock_gettime(clockid_t clk_id, struct timespec* ts) __attribute__((alias(
 int clock_getres(clockid_t clk_id, struct timespec* ts)
 {
     switch (clk_id) {
-    case CLOCK_REALTIME:
     case CLOCK_REALTIME_COARSE:
+    case CLOCK_MONOTONIC_COARSE:
+        if (ts) {
+            fill_ts(std::chrono::nanoseconds(coarse_tick), ts);
+        }
+        return 0;
+    case CLOCK_REALTIME:
     case CLOCK_PROCESS_CPUTIME_ID:
     case CLOCK_THREAD_CPUTIME_ID:
     case CLOCK_MONOTONIC:
@@ -26,6 +26,7 @@
 #include "drivers/virtio-blk.hh"
 #include "drivers/virtio-scsi.hh"
 #include "drivers/virtio-rng.hh"
+#include "drivers/virtio-serial.hh"
 #include "drivers/xenfront-xenbus.hh"
 #include "drivers/ahci.hh"
 #include "drivers/ide.hh"
@@ -48,6 +49,7 @@
 #include <osv/shutdown.hh>
 #include <osv/commands.hh>
 #include <osv/boot.hh>
+#include <osv/sampler.hh>
 
 using namespace osv;
 
@@ -113,6 +115,7 @@ static bool opt_vga = false;
 static bool opt_verbose = false;
 static std::string opt_chdir;
 static bool opt_bootchart = false;
+static unsigned opt_sampler = 0;
 
 std::tuple<int, char**> parse_options(int ac, char** av)
 {
@@ -134,6 +137,7 @@ std::tuple<int, char**> parse_options(int ac, char** av)
         ("help", "show help text")
         ("trace", bpo::value<std::vector<std::string>>(), "tracepoints to enable")
         ("trace-backtrace", "log backtraces in the tracepoint log")
+        ("sampler", bpo::value<unsigned>(), "start the sampling profiler, taking N samples per second on each cpu")
         ("leak", "start leak detector after boot")
         ("nomount", "don't mount the file system")
         ("noshutdown", "continue running after main() returns")
@@ -141,6 +145,8 @@ std::tuple<int, char**> parse_options(int ac, char** av)
         ("verbose", "be verbose, print debug messages")
         ("env", bpo::value<std::vector<std::string>>(), "set Unix-like environment variable (putenv())")
         ("cwd", bpo::value<std::vector<std::string>>(), "set current working directory")
+        ("xps", bpo::value<std::string>(), "virtio-net transmit queue of each cpu, e.g. 0,0,1,1 (default: select by flow hash)")
+        ("rxq-cpus", bpo::value<std::string>(), "virtio-net cpu polling each receive queue, e.g. 0,2,4,6 (default: queue N on cpu N)")
         ("bootchart", "perform a test boot measuring a time distribution of the various operations\n")
     ;
     bpo::variables_map vars;
@@ -172,6 +178,10 @@ std::tuple<int, char**> parse_options(int ac, char** av)
         opt_log_backtrace = true;
     }
 
+    if (vars.count("sampler")) {
+        opt_sampler = vars["sampler"].as<unsigned>();
+    }
+
     if (vars.count("verbose")) {
         opt_verbose = true;
         enable_verbose();
@@ -209,6 +219,22 @@ std::tuple<int, char**> parse_options(int ac, char** av)
         opt_chdir = v.front();
     }
 
+    if (vars.count("xps")) {
+        std::vector<std::string> tmp;
+        boost::split(tmp, vars["xps"].as<std::string>(), boost::is_any_of(" ,"), boost::token_compress_on);
+        for (auto t : tmp) {
+            virtio::net::xps.push_back(std::stoul(t));
+        }
+    }
+
+    if (vars.count("rxq-cpus")) {
+        std::vector<std::string> tmp;
+        boost::split(tmp, vars["rxq-cpus"].as<std::string>(), boost::is_any_of(" ,"), boost::token_compress_on);
+        for (auto t : tmp) {
+            virtio::net::rxq_cpus.push_back(std::stoul(t));
+        }
+    }
+
     av += nr_options;
     ac -= nr_options;
     return std::make_tuple(ac, av);
@@ -299,6 +325,7 @@ void* do_main_thread(void *_commands)
     drvman->register_driver(virtio::scsi::probe);
     drvman->register_driver(virtio::net::probe);
     drvman->register_driver(virtio::rng::probe);
+    drvman->register_driver(virtio::serial::probe);
     drvman->register_driver(xenfront::xenbus::probe);
     drvman->register_driver(ahci::hba::probe);
     drvman->register_driver(ide::ide_drive::probe);
@@ -395,6 +422,11 @@ void main_cont(int ac, char** av)
     rcu_init();
     boot_time.event("RCU initialized");
 
+    if (opt_sampler &&
+            !prof::start_sampler({std::chrono::nanoseconds(1000000000 / opt_sampler)})) {
+        printf("sampler: invalid frequency %u\n", opt_sampler);
+    }
+
     vfs_init();
     boot_time.event("VFS initialized");
     ramdisk_init();
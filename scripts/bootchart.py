@@ -0,0 +1,47 @@
+#!/usr/bin/env python2
+#
+# Boots the image several times with --bootchart and prints, for each boot
+# event, the mean and the minimum time since the previous event. Arguments
+# after "--" are passed on to scripts/run.py, e.g. to pick the image:
+#
+#   scripts/bootchart.py -n 10 -- -i build/release/usr.img
+#
+import subprocess
+import argparse
+import re
+import os
+
+event_re = re.compile(r'^\s*(.+): ([0-9.]+)ms, \(\+([0-9.]+)ms\)')
+
+def boot(run_args):
+    out = subprocess.check_output([os.path.join(os.path.dirname(__file__), 'run.py'),
+                                   '-e', '--bootchart'] + run_args)
+    events = []
+    for line in out.splitlines():
+        m = event_re.match(line)
+        if m:
+            events.append((m.group(1), float(m.group(2)), float(m.group(3))))
+    if not events:
+        raise Exception('no bootchart in the output:\n' + out)
+    return events
+
+def main(options):
+    runs = [boot(options.run_args) for i in range(options.count)]
+    names = [e[0] for e in runs[0]]
+    print '%-32s %10s %10s' % ('event', 'mean (ms)', 'min (ms)')
+    for i, name in enumerate(names):
+        deltas = [r[i][2] for r in runs if len(r) > i and r[i][0] == name]
+        print '%-32s %10.2f %10.2f' % (name, sum(deltas) / len(deltas), min(deltas))
+    totals = [r[-1][1] for r in runs]
+    print '%-32s %10.2f %10.2f' % ('total', sum(totals) / len(totals), min(totals))
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(prog='bootchart')
+    parser.add_argument("-n", "--count", action="store", type=int, default=5,
+                        help="number of boots")
+    parser.add_argument("run_args", nargs=argparse.REMAINDER,
+                        help="arguments for scripts/run.py, after --")
+    options = parser.parse_args()
+    if options.run_args[:1] == ['--']:
+        options.run_args = options.run_args[1:]
+    main(options)
@@ -821,18 +821,13 @@ def align_down(v, pagesize):
 def align_up(v, pagesize):
     return align_down(v + pagesize - 1, pagesize)
 
-def all_traces():
-    # XXX: needed for GDB to see 'trace_page_size'
-    gdb.lookup_global_symbol('gdb_trace_function_entry')
-
+def cpu_traces(cpu_id, tb, tracepoints):
+    '''Traces in one cpu's ring, oldest first'''
     inf = gdb.selected_inferior()
-    trace_log = gdb.lookup_global_symbol('trace_log').value()
-    if not trace_log:
-    	return
     max_trace = ulong(gdb.parse_and_eval('max_trace'))
-    trace_log = inf.read_memory(trace_log, max_trace)
+    trace_log = inf.read_memory(tb['log'], max_trace)
     trace_page_size = ulong(gdb.parse_and_eval('trace_page_size'))
-    last = ulong(gdb.lookup_global_symbol('trace_record_last').value()['_M_i'])
+    last = ulong(tb['last'])
     last %= max_trace
     pivot = align_up(last, trace_page_size)
     trace_log = trace_log[pivot:] + trace_log[:pivot]
@@ -840,8 +835,8 @@ def all_traces():
 
     tp_ptr = gdb.lookup_type('tracepoint_base').pointer()
     backtrace_len = ulong(gdb.parse_and_eval('tracepoint_base::backtrace_len'))
-    tracepoints = {}
 
+    found = 0
     i = 0
     while i < last:
         tp_key, thread, thread_name, time, cpu, flags = struct.unpack('QQ16sQII', trace_log[i:i+48])
@@ -868,8 +863,34 @@ def all_traces():
         data = struct.unpack(tp.signature, trace_log[i:i+size])
         i += size
         i = align_up(i, 8)
+        found += 1
         yield Trace(tp, thread, thread_name, time, cpu, data, backtrace=backtrace)
 
+    records = ulong(tb['records'])
+    dropped = ulong(tb['dropped'])
+    if records > found or dropped:
+        gdb.write('cpu %d: %d records overwritten, %d dropped\n'
+                  % (cpu_id, records - found, dropped))
+
+def all_traces():
+    '''Traces of all cpus, merged by time'''
+    # XXX: needed for GDB to see 'trace_page_size'
+    gdb.lookup_global_symbol('gdb_trace_function_entry')
+
+    trace_bufs = gdb.lookup_global_symbol('trace_bufs').value()
+    tracepoints = {}
+    streams = []
+    for cpu in range(trace_bufs.type.range()[1] + 1):
+        tb = trace_bufs[cpu]
+        if tb['log']:
+            streams.append(cpu_traces(cpu, tb, tracepoints))
+
+    no_cpu = ulong(gdb.lookup_global_symbol('trace_records_no_cpu').value()['_M_i'])
+    if no_cpu:
+        gdb.write('%d records dropped before threads were running\n' % no_cpu)
+
+    return trace.merge(streams)
+
 def save_traces_to_file(filename):
     trace.write_to_file(filename, list(all_traces()))
 
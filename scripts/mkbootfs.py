@@ -82,19 +82,32 @@ def unsymlink(f):
 files = list(expand(files.items()))
 files = [(x, unsymlink(y)) for (x, y) in files]
 
-pos = (len(files) + 1) * metadata_size
+# File data starts on a page boundary, and the rest of its last page is
+# zeroes, so that the kernel can use the pages in place instead of copying
+# the files out.
+page_size = 4096
+
+def align_up(pos):
+    return (pos + page_size - 1) & ~(page_size - 1)
+
+pos = align_up((len(files) + 1) * metadata_size)
 
 for name, hostname in files:
     size = os.stat(hostname).st_size
     metadata = struct.pack('QQ112s', size, pos, name)
     out.write(metadata)
-    pos += size
+    pos = align_up(pos + size)
     depends.write('\t%s \\\n' % (hostname,))
 
+def pad():
+    out.write('\0' * (align_up(out.tell()) - out.tell()))
+
 out.write(struct.pack('128s', ''))
+pad()
 
 for name, hostname in files:
     out.write(file(hostname).read())
+    pad()
 
 depends.write('\n\n')
 
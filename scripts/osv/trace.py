@@ -2,6 +2,7 @@ import os
 import mmap
 import struct
 import sys
+import heapq
 
 # version 2 introduced thread_name
 _format_version = 2
@@ -167,6 +168,15 @@ class WritingPacker:
             self.writer(struct.pack('H', count))
             self.writer(struct.pack('c' * count, *arg))
 
+def merge(streams):
+    '''Merge streams of traces, each sorted by time (such as the traces of
+    each cpu), into one stream sorted by time'''
+    def keyed(stream, idx):
+        for seq, t in enumerate(stream):
+            yield (t.time, idx, seq, t)
+    for _, _, _, t in heapq.merge(*[keyed(s, i) for i, s in enumerate(streams)]):
+        yield t
+
 def read(buffer_view):
     unpacker = SlidingUnpacker(buffer_view)
     version, = unpacker.unpack('i')
@@ -370,12 +370,13 @@ if __name__ == "__main__":
 
     cmd_prof_hit = subparsers.add_parser("prof", help="show trace hit profile", description="""
         Prints profile showing number of times given tracepoint was reached.
-        Requires trace samples with backtrace.
+        Requires trace samples with backtrace. By default shows the samples
+        of the sampling profiler (started with --sampler=<frequency>).
         """)
     add_symbol_resolution_options(cmd_prof_hit)
     add_trace_source_options(cmd_prof_hit)
     add_profile_options(cmd_prof_hit)
-    cmd_prof_hit.add_argument("-t", "--tracepoint", action="store", required=True, help="name of the tracepint to count")
+    cmd_prof_hit.add_argument("-t", "--tracepoint", action="store", default="sampler_tick", help="name of the tracepint to count")
     cmd_prof_hit.set_defaults(func=prof_hit)
 
     cmd_extract = subparsers.add_parser("extract", help="extract trace from running instance", description="""
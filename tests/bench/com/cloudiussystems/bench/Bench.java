@@ -29,6 +29,7 @@ public class Bench {
 	
 	public static void main(String[] args) throws Exception {
 		test(new NanoTimeBench());
+		test(new NanoTimeBench(4));
 		test(new ContextSwitchBench());
 		// large test requiring more memory:
 		//SieveBench small = new SieveBench(10000);
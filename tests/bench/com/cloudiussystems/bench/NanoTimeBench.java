@@ -10,14 +10,47 @@ package com.cloudiussystems.bench;
 class NanoTimeBench implements Benchmark {
 	
 	static long total;
+
+	// number of threads calling nanoTime() at once, each doing all the
+	// iterations: the time per iteration stays flat if the clock scales
+	private final int threads;
+
+	NanoTimeBench() {
+		this(1);
+	}
+
+	NanoTimeBench(int threads) {
+		this.threads = threads;
+	}
 	
 	public String getName() {
-		return "NanoTime";
+		return threads == 1 ? "NanoTime" : "NanoTime (" + threads + " threads)";
 	}
-	
-	public void run(int iterations) {
-		for (int i = 0; i < iterations; ++i) {
-			total += System.nanoTime();
+
+	public void run(final int iterations) throws Exception {
+		if (threads == 1) {
+			for (int i = 0; i < iterations; ++i) {
+				total += System.nanoTime();
+			}
+			return;
+		}
+		Thread[] t = new Thread[threads];
+		for (int i = 0; i < threads; ++i) {
+			t[i] = new Thread() {
+				public void run() {
+					// not into the shared total, which would bounce
+					// between the cpus
+					long sum = 0;
+					for (int j = 0; j < iterations; ++j) {
+						sum += System.nanoTime();
+					}
+					total += sum;
+				}
+			};
+			t[i].start();
+		}
+		for (int i = 0; i < threads; ++i) {
+			t[i].join();
 		}
 	}
 }
@@ -3,6 +3,9 @@
 #include <thread>
 #include <vector>
 #include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <random>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -15,6 +18,7 @@
 #include <osv/bio.h>
 #include <osv/prex.h>
 #include <osv/mempool.hh>
+#include <osv/sched.hh>
 
 #define MB (1024*1024)
 #define KB (1024)
@@ -36,11 +40,102 @@ static void bio_done(struct bio* bio)
     }
 }
 
+// Random 4K reads, fio style: each reader thread, pinned to its own cpu,
+// keeps qdepth reads in flight at random offsets below max_offset.
+struct reader {
+    std::mutex lock;
+    std::condition_variable done;
+    int inflight = 0;
+    long completed = 0;
+};
+
+static void read_done(struct bio* bio)
+{
+    auto* r = static_cast<reader*>(bio->bio_caller1);
+    if (bio->bio_flags & BIO_ERROR) {
+        printf("bio err!\n");
+    }
+    destroy_bio(bio);
+    std::lock_guard<std::mutex> guard(r->lock);
+    r->inflight--;
+    r->completed++;
+    r->done.notify_one();
+}
+
+static void randread(struct device* dev, long max_offset, reader* r,
+        std::chrono::high_resolution_clock::time_point end_at)
+{
+    const int qdepth = 32;
+    const long buf_size = 4*KB;
+    std::vector<void*> bufs(qdepth);
+    for (auto& b : bufs) {
+        b = memory::alloc_page();
+    }
+    std::default_random_engine rand(sched::cpu::current()->id);
+    std::uniform_int_distribution<long> block(0, max_offset / buf_size - 1);
+    unsigned next = 0;
+    std::unique_lock<std::mutex> guard(r->lock);
+    while (s_clock.now() < end_at) {
+        while (r->inflight == qdepth) {
+            r->done.wait(guard);
+        }
+        r->inflight++;
+        guard.unlock();
+        auto bio = alloc_bio();
+        bio->bio_cmd = BIO_READ;
+        bio->bio_dev = dev;
+        // reads into the same buffer may overlap, we don't look at the data
+        bio->bio_data = bufs[next++ % qdepth];
+        bio->bio_offset = block(rand) * buf_size;
+        bio->bio_bcount = buf_size;
+        bio->bio_caller1 = r;
+        bio->bio_done = read_done;
+        dev->driver->devops->strategy(bio);
+        guard.lock();
+    }
+    while (r->inflight) {
+        r->done.wait(guard);
+    }
+    guard.unlock();
+    for (auto b : bufs) {
+        memory::free_page(b);
+    }
+}
+
+static void randread_bench(struct device* dev, long max_offset, unsigned nthreads)
+{
+    if (max_offset == 0) {
+        max_offset = dev->size;
+    }
+    printf("threads       IOPS\n");
+    // 1, 2, 4, ... threads, and finally nthreads
+    for (unsigned n = 1; n <= nthreads; n = n == nthreads ? n + 1 : std::min(n * 2, nthreads)) {
+        std::vector<reader> readers(n);
+        std::vector<sched::thread*> threads;
+        auto start = s_clock.now();
+        auto end_at = start + std::chrono::seconds(5);
+        for (unsigned i = 0; i < n; i++) {
+            auto* r = &readers[i];
+            threads.push_back(new sched::thread([=] { randread(dev, max_offset, r, end_at); },
+                    sched::thread::attr().pin(sched::cpus[i % sched::cpus.size()])));
+            threads.back()->start();
+        }
+        long total = 0;
+        for (unsigned i = 0; i < n; i++) {
+            threads[i]->join();
+            delete threads[i];
+            total += readers[i].completed;
+        }
+        auto duration = to_seconds(s_clock.now() - start);
+        printf("%7u %10.0f\n", n, total / duration);
+    }
+}
+
 int main(int argc, char const *argv[])
 {
     struct device *dev;
     if (argc < 2) {
-        printf("Usage: %s <dev-name>\n", argv[0]);
+        printf("Usage: %s <dev-name> [max-offset] [randread-threads]\n", argv[0]);
         return 1;
     }
 
@@ -54,6 +149,11 @@ int main(int argc, char const *argv[])
         max_offset = atol(argv[2]);
     }
 
+    if (argc > 3) {
+        randread_bench(dev, max_offset, atoi(argv[3]));
+        return 0;
+    }
+
     printf("bdev-write test offset limit: %ld byte(s)\n", max_offset);
 
     const std::chrono::seconds test_duration(10);
@@ -12,6 +12,8 @@
 #include <bsd/porting/callout.h>
 #include <bsd/porting/netport.h>
 #include <bsd/porting/sync_stub.h>
+#include <chrono>
+#include <vector>
 
 #define tdbg(...) tprintf_d("tst-bsd-callout", __VA_ARGS__)
 
@@ -160,9 +162,57 @@ void test2(void)
     tdbg("BSD Callout Test2 - END\n");
 }
 
+/********************** Test 3 **********************/
+
+/*
+ * Cost of re-arming and stopping callouts with many of them armed, as with
+ * the retransmit and delayed ack timers of many tcp connections.
+ */
+void t3_never(void *unused)
+{
+}
+
+void test3(void)
+{
+    constexpr int nr_callouts = 50000;
+    constexpr int rounds = 20;
+    std::vector<struct callout> c(nr_callouts);
+
+    tdbg("BSD Callout Test3 - BEGIN\n");
+
+    for (auto& co : c) {
+        callout_init(&co, 1);
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < nr_callouts; i++) {
+            callout_reset(&c[i], 100 * hz + i % 1000, t3_never, NULL);
+        }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> sec = end - start;
+    printf("callout_reset with %d armed: %.0f ns\n", nr_callouts,
+            sec.count() / (rounds * nr_callouts) * 1e9);
+
+    // Stopping a pending callout must not wait for it to expire
+    start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < nr_callouts; i++) {
+        if (!callout_drain(&c[i])) {
+            printf("callout_drain didn't find callout %d pending\n", i);
+        }
+    }
+    end = std::chrono::high_resolution_clock::now();
+    sec = end - start;
+    printf("callout_drain: %.0f ns\n", sec.count() / nr_callouts * 1e9);
+
+    tdbg("BSD Callout Test3 - END\n");
+}
+
 int main(int argc, char **argv)
 {
     test1();
     test2();
+    test3();
     return 0;
 }
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// clock_gettime() benchmark: the time per call of each clock, with one
+// thread and with several reading it at once. Also checks that the
+// monotonic clocks don't go backwards as the threads move between cpus.
+
+#include <time.h>
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#ifndef CLOCK_MONOTONIC_COARSE
+#define CLOCK_MONOTONIC_COARSE 6
+#endif
+
+static constexpr int iterations = 10000000;
+
+static long long ns(const timespec& ts)
+{
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Returns the number of times the clock went backwards
+static int reader(clockid_t clock, bool monotonic)
+{
+    timespec ts;
+    long long last = 0;
+    int backwards = 0;
+    for (int i = 0; i < iterations; i++) {
+        clock_gettime(clock, &ts);
+        auto now = ns(ts);
+        backwards += monotonic && now < last;
+        last = now;
+    }
+    return backwards;
+}
+
+static bool bench(const char* name, clockid_t clock, bool monotonic, int nthreads)
+{
+    std::vector<std::thread> threads;
+    std::vector<int> backwards(nthreads);
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < nthreads; i++) {
+        threads.emplace_back([&, i] { backwards[i] = reader(clock, monotonic); });
+    }
+    int total = 0;
+    for (int i = 0; i < nthreads; i++) {
+        threads[i].join();
+        total += backwards[i];
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::nano> t = end - start;
+    printf("%-24s %d threads: %6.1f ns/call", name, nthreads, t.count() / iterations);
+    if (total) {
+        printf(", went backwards %d times", total);
+    }
+    printf("\n");
+    return total == 0;
+}
+
+int main(int ac, char** av)
+{
+    bool ok = true;
+    for (int nthreads : {1, 4}) {
+        ok &= bench("CLOCK_MONOTONIC", CLOCK_MONOTONIC, true, nthreads);
+        ok &= bench("CLOCK_REALTIME", CLOCK_REALTIME, false, nthreads);
+        ok &= bench("CLOCK_MONOTONIC_COARSE", CLOCK_MONOTONIC_COARSE, true, nthreads);
+        ok &= bench("CLOCK_REALTIME_COARSE", CLOCK_REALTIME_COARSE, false, nthreads);
+    }
+    return ok ? 0 : 1;
+}
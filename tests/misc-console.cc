@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Console write latency: threads log lines to stdout as fast as they can,
+// and we report the average and worst time a write() took, with one
+// writer and with several competing for the console.
+
+#include <unistd.h>
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+typedef std::chrono::high_resolution_clock clk;
+
+struct result {
+    clk::duration total {};
+    clk::duration max {};
+};
+
+static result logger(int id, int lines)
+{
+    char line[100];
+    result r;
+    for (int i = 0; i < lines; i++) {
+        auto len = snprintf(line, sizeof(line),
+                "logger %d: line %d of some chatty log output\n", id, i);
+        auto start = clk::now();
+        write(1, line, len);
+        auto t = clk::now() - start;
+        r.total += t;
+        r.max = std::max(r.max, t);
+    }
+    return r;
+}
+
+static void bench(int nthreads, int lines)
+{
+    std::vector<std::thread> threads;
+    std::vector<result> results(nthreads);
+    for (int i = 0; i < nthreads; i++) {
+        threads.emplace_back([&, i] { results[i] = logger(i, lines); });
+    }
+    result r;
+    for (int i = 0; i < nthreads; i++) {
+        threads[i].join();
+        r.total += results[i].total;
+        r.max = std::max(r.max, results[i].max);
+    }
+    std::chrono::duration<double, std::micro> avg = r.total / (nthreads * lines);
+    std::chrono::duration<double, std::micro> max = r.max;
+    fprintf(stderr, "%d threads: write() avg %.2f us, max %.2f us\n",
+            nthreads, avg.count(), max.count());
+}
+
+int main(int ac, char** av)
+{
+    for (int nthreads : {1, 4}) {
+        bench(nthreads, 5000);
+    }
+    return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measure the cost of an epoll_wait() which finds one ready fd, as a
+// function of the number of idle fds registered in the same epoll set.
+// With a ready-list based epoll, the cost should stay flat.
+//
+// The idle fds are unarmed timerfds, so the number we can test is limited
+// by the size of the file descriptor table.
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <cstdio>
+#include <chrono>
+#include <vector>
+
+constexpr int iterations = 100000;
+
+bool bench(int ep, int rfd, int wfd, unsigned nidle)
+{
+    std::vector<int> idle;
+    for (unsigned i = 0; i < nidle; i++) {
+        int fd = timerfd_create(CLOCK_MONOTONIC, 0);
+        if (fd < 0) {
+            printf("%8u: could not create idle fd: %s\n", nidle, strerror(errno));
+            for (auto fd : idle) {
+                close(fd);
+            }
+            return false;
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+        idle.push_back(fd);
+    }
+
+    struct epoll_event events[16];
+    char c = 'x';
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        if (write(wfd, &c, 1) != 1) {
+            perror("write");
+            return false;
+        }
+        int r = epoll_wait(ep, events, 16, -1);
+        if (r != 1 || events[0].data.fd != rfd) {
+            printf("epoll_wait returned %d\n", r);
+            return false;
+        }
+        if (read(rfd, &c, 1) != 1) {
+            perror("read");
+            return false;
+        }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> sec = end - start;
+    printf("%8u %10.0f\n", nidle, sec.count() / iterations * 1e9);
+
+    for (auto fd : idle) {
+        close(fd);
+    }
+    return true;
+}
+
+int main(int ac, char** av)
+{
+    int ep = epoll_create1(0);
+    int s[2];
+    if (ep < 0 || pipe(s) < 0) {
+        perror("setup");
+        return 1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = s[0];
+    epoll_ctl(ep, EPOLL_CTL_ADD, s[0], &ev);
+
+    printf("    idle  ns/wakeup\n");
+    for (unsigned nidle = 10; nidle <= 100000; nidle *= 10) {
+        if (!bench(ep, s[0], s[1], nidle)) {
+            break;
+        }
+    }
+
+    close(ep);
+    close(s[0]);
+    close(s[1]);
+    return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Fragmentation stress benchmark for the large allocation path: fill memory
+// with large objects of random sizes, free every other one, and measure the
+// cost of large malloc()/free() and of huge page allocation while the free
+// page ranges are split into thousands of small holes.
+
+#include <osv/pagealloc.hh>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <random>
+#include <vector>
+
+constexpr unsigned objects = 8000;
+constexpr unsigned iterations = 100000;
+constexpr unsigned huge_iterations = 1000;
+constexpr size_t huge_page_size = 2 << 20;
+
+template <typename Func>
+static void measure(const char* what, unsigned n, Func func)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    func();
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> sec = end - start;
+    printf("%-40s %8.1f ns/op\n", what, sec.count() / n * 1e9);
+}
+
+static void bench(const char* state, std::mt19937& rand)
+{
+    std::uniform_int_distribution<size_t> large(8 << 10, 64 << 10);
+    char what[100];
+
+    snprintf(what, sizeof(what), "malloc+free 8K-64K (%s)", state);
+    measure(what, iterations, [&] {
+        for (unsigned i = 0; i < iterations; i++) {
+            free(malloc(large(rand)));
+        }
+    });
+
+    // keep objects alive, so each allocation has to find a new hole
+    std::vector<void*> live;
+    live.reserve(objects / 4);
+    snprintf(what, sizeof(what), "fill holes 8K-64K (%s)", state);
+    measure(what, objects / 4, [&] {
+        for (unsigned i = 0; i < objects / 4; i++) {
+            live.push_back(malloc(large(rand)));
+        }
+    });
+    for (auto p : live) {
+        free(p);
+    }
+
+    snprintf(what, sizeof(what), "huge page alloc+free (%s)", state);
+    unsigned failed = 0;
+    measure(what, huge_iterations, [&] {
+        for (unsigned i = 0; i < huge_iterations; i++) {
+            auto p = memory::alloc_huge_page(huge_page_size);
+            if (p) {
+                memory::free_huge_page(p, huge_page_size);
+            } else {
+                failed++;
+            }
+        }
+    });
+    if (failed) {
+        printf("%u huge page allocations failed\n", failed);
+    }
+}
+
+int main(int ac, char** av)
+{
+    std::mt19937 rand(12345);
+    std::uniform_int_distribution<size_t> size(8 << 10, 32 << 10);
+
+    bench("unfragmented", rand);
+
+    std::vector<void*> objs(objects);
+    for (auto& p : objs) {
+        p = malloc(size(rand));
+    }
+    for (unsigned i = 0; i < objects; i += 2) {
+        free(objs[i]);
+        objs[i] = nullptr;
+    }
+
+    bench("fragmented", rand);
+
+    for (auto p : objs) {
+        free(p);
+    }
+    return 0;
+}
@@ -13,6 +13,8 @@
 #include "drivers/clock.hh"
 
 #include <string.h>
+#include <algorithm>
+#include <vector>
 
 // increment_thread loops() non-atomically incrementing a shared value.
 // If N threads like this run concurrently, at the end the sum will
@@ -126,6 +128,57 @@ static void measure_uncontended(long len)
     debug ("%d ns\n", (t2-t1)/len);
 }
 
+// Contended lock throughput and latency: N threads, each pinned to a
+// different cpu, repeatedly hold the lock for a short critical section of
+// cs increments, and do as much work between locks. Short critical
+// sections like these should rarely need to put a waiter to sleep.
+template <typename T>
+static void measure_contended(int N, long len, int cs)
+{
+    assert((unsigned int)N <= sched::cpus.size());
+    T m;
+    volatile long shared = 0;
+    std::vector<s64> total_latency(N), max_latency(N);
+    std::vector<sched::thread*> threads;
+    for (int i = 0; i < N; i++) {
+        threads.push_back(new sched::thread([&, i] {
+            for (long k = 0; k < len; k++) {
+                auto t1 = clock::get()->time();
+                m.lock();
+                auto latency = clock::get()->time() - t1;
+                for (int j = 0; j < cs; j++) {
+                    shared = shared + 1;
+                }
+                m.unlock();
+                total_latency[i] += latency;
+                max_latency[i] = std::max(max_latency[i], latency);
+                volatile long local = 0;
+                for (int j = 0; j < cs; j++) {
+                    local = local + 1;
+                }
+            }
+        }, sched::thread::attr().pin(sched::cpus[i])));
+    }
+    auto t1 = clock::get()->time();
+    for (auto t : threads) {
+        t->start();
+    }
+    for (auto t : threads) {
+        t->join();
+        delete t;
+    }
+    auto t2 = clock::get()->time();
+    assert(shared == len * N * cs);
+    s64 total = 0, max = 0;
+    for (int i = 0; i < N; i++) {
+        total += total_latency[i];
+        max = std::max(max, max_latency[i]);
+    }
+    debug("Contended %s, %d threads, critical section %d: %d locks/ms, "
+            "lock latency avg %d ns, max %d ns\n", typeinfo<T>::name(), N, cs,
+            len * N * 1000000 / (t2 - t1), total / (len * N), max);
+}
+
 template <typename T>
 static void show_size()
 {
@@ -211,6 +264,10 @@ int main(int argc, char **argv)
 //    test<spinlock>(2, 1000000, true);
 //    test<spinlock>(20, 1000000, false);
 
+    for (int cs : {10, 100, 1000}) {
+        measure_contended<lockfree::mutex>(2, 1000000, cs);
+        measure_contended<lockfree::mutex>((int)sched::cpus.size(), 1000000, cs);
+    }
 
     debug("mutex tests succeeded\n");
 }
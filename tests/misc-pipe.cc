@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Pipe throughput benchmark: a writer thread pushes data through a pipe in
+// writes of 64 bytes to 1 MB, with the default and the maximum pipe size,
+// and the reader reads it back in large chunks. Also measures splice()
+// between two pipes, which moves whole pages without copying.
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <cstdio>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+constexpr size_t max_chunk = 1 << 20;
+
+static bool writer(int fd, size_t chunk, size_t total)
+{
+    std::vector<char> buf(chunk, 'x');
+    for (size_t done = 0; done < total; done += chunk) {
+        if (write(fd, buf.data(), chunk) != ssize_t(chunk)) {
+            perror("write");
+            return false;
+        }
+    }
+    return true;
+}
+
+static void report(const char* what, size_t chunk, size_t total,
+        std::chrono::high_resolution_clock::time_point start)
+{
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> sec = end - start;
+    printf("%-8s %8zu %10.1f\n", what, chunk, total / sec.count() / (1 << 20));
+}
+
+static bool bench(size_t chunk, int pipe_size, const char* name)
+{
+    // keep the number of writes reasonable for small chunks
+    size_t total = std::min(size_t(256) << 20, chunk << 20);
+    int s[2];
+    if (pipe(s) < 0) {
+        perror("pipe");
+        return false;
+    }
+    if (pipe_size && fcntl(s[1], F_SETPIPE_SZ, pipe_size) < 0) {
+        perror("F_SETPIPE_SZ");
+        return false;
+    }
+    std::vector<char> buf(max_chunk);
+    auto start = std::chrono::high_resolution_clock::now();
+    std::thread t([&] { writer(s[1], chunk, total); });
+    size_t received = 0;
+    while (received < total) {
+        auto r = read(s[0], buf.data(), buf.size());
+        if (r <= 0) {
+            perror("read");
+            break;
+        }
+        received += r;
+    }
+    t.join();
+    report(name, chunk, total, start);
+    close(s[0]);
+    close(s[1]);
+    return received == total;
+}
+
+static bool bench_splice(size_t chunk)
+{
+    size_t total = size_t(256) << 20;
+    int s1[2], s2[2];
+    if (pipe(s1) < 0 || pipe(s2) < 0) {
+        perror("pipe");
+        return false;
+    }
+    for (int fd : {s1[1], s2[1]}) {
+        fcntl(fd, F_SETPIPE_SZ, max_chunk);
+    }
+    std::vector<char> buf(max_chunk);
+    auto start = std::chrono::high_resolution_clock::now();
+    std::thread t([&] { writer(s1[1], chunk, total); });
+    std::thread t2([&] {
+        for (size_t done = 0; done < total; ) {
+            auto r = splice(s1[0], NULL, s2[1], NULL, max_chunk, 0);
+            if (r <= 0) {
+                perror("splice");
+                return;
+            }
+            done += r;
+        }
+    });
+    size_t received = 0;
+    while (received < total) {
+        auto r = read(s2[0], buf.data(), buf.size());
+        if (r <= 0) {
+            perror("read");
+            break;
+        }
+        received += r;
+    }
+    t.join();
+    t2.join();
+    report("splice", chunk, total, start);
+    for (int fd : {s1[0], s1[1], s2[0], s2[1]}) {
+        close(fd);
+    }
+    return received == total;
+}
+
+int main(int ac, char** av)
+{
+    bool ok = true;
+    printf("pipe       write       MB/s\n");
+    for (size_t chunk = 64; chunk <= max_chunk; chunk *= 4) {
+        ok &= bench(chunk, 0, "default");
+    }
+    for (size_t chunk = 64; chunk <= max_chunk; chunk *= 4) {
+        ok &= bench(chunk, max_chunk, "1M");
+    }
+    for (size_t chunk = 4096; chunk <= max_chunk; chunk *= 16) {
+        ok &= bench_splice(chunk);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// ramfs benchmark: appends to a file in 4K writes (1 GB by default, or the
+// number of MB given), reporting the throughput of every 128 MB so that any
+// slowdown as the file grows shows, then reads it back, and maps it.
+
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstdio>
+#include <chrono>
+#include <string>
+
+int sys_mount(char *dev, char *dir, char *fsname, int flags, void *data);
+int sys_umount(const char *path);
+
+constexpr size_t chunk = 4096;
+constexpr size_t step = size_t(128) << 20;
+
+static double mbps(size_t bytes,
+        std::chrono::high_resolution_clock::time_point start)
+{
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> sec = end - start;
+    return bytes / sec.count() / (1 << 20);
+}
+
+int main(int ac, char** av)
+{
+    size_t total = (ac > 1 ? atol(av[1]) : 1024) << 20;
+    char tmp[64] = "/tmp/misc-ramfsXXXXXX";
+    std::string dir = mkdtemp(tmp);
+    int error = sys_mount(const_cast<char*>(""), &dir[0],
+            const_cast<char*>("ramfs"), 0, nullptr);
+    if (error) {
+        printf("mount: %s\n", strerror(error));
+        return 1;
+    }
+    auto path = dir + "/file";
+    int fd = open(path.c_str(), O_CREAT|O_TRUNC|O_RDWR|O_APPEND, 0666);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+
+    char buf[chunk];
+    memset(buf, 'x', sizeof(buf));
+    printf("append   size (MB)     MB/s\n");
+    auto start = std::chrono::high_resolution_clock::now();
+    auto step_start = start;
+    for (size_t done = 0; done < total; ) {
+        if (write(fd, buf, chunk) != ssize_t(chunk)) {
+            perror("write");
+            return 1;
+        }
+        done += chunk;
+        if (done % step == 0 || done == total) {
+            printf("         %9zu %8.1f\n", done >> 20,
+                    mbps(done % step ? done % step : step, step_start));
+            step_start = std::chrono::high_resolution_clock::now();
+        }
+    }
+    printf("total              %8.1f\n", mbps(total, start));
+
+    start = std::chrono::high_resolution_clock::now();
+    for (size_t done = 0; done < total; done += chunk) {
+        if (pread(fd, buf, chunk, done) != ssize_t(chunk) || buf[0] != 'x') {
+            perror("pread");
+            return 1;
+        }
+    }
+    printf("read               %8.1f\n", mbps(total, start));
+
+    start = std::chrono::high_resolution_clock::now();
+    auto p = static_cast<char*>(mmap(nullptr, total, PROT_READ, MAP_PRIVATE, fd, 0));
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    size_t sum = 0;
+    for (size_t done = 0; done < total; done += chunk) {
+        sum += p[done];
+    }
+    printf("mmap               %8.1f\n", mbps(total, start));
+    munmap(p, total);
+
+    close(fd);
+    unlink(path.c_str());
+    sys_umount(dir.c_str());
+    rmdir(dir.c_str());
+    return sum == total / chunk * 'x' ? 0 : 1;
+}
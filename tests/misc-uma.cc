@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// UMA zone allocation benchmark: the cost of uma_zalloc()+uma_zfree() from
+// the per-cpu magazines, compared with the malloc()+free() zones used to
+// fall through to, with one thread and with several, and in bursts large
+// enough to exchange magazines with the depot.
+
+#include <bsd/porting/netport.h>
+#include <bsd/porting/uma_stub.h>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+constexpr size_t item_size = 256;
+constexpr unsigned iterations = 10000000;
+constexpr unsigned burst = 1000;
+
+template <typename Func>
+static void measure(const char* what, unsigned nthreads, Func func)
+{
+    std::vector<std::thread> threads;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (unsigned i = 0; i < nthreads; i++) {
+        threads.emplace_back(func);
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> sec = end - start;
+    printf("%-36s %u threads: %8.1f ns/op\n", what, nthreads,
+            sec.count() / iterations * 1e9);
+}
+
+int main(int ac, char** av)
+{
+    auto zone = uma_zcreate("misc-uma", item_size, nullptr, nullptr,
+            nullptr, nullptr, 0, 0);
+    for (unsigned nthreads : {1, 4}) {
+        measure("malloc+free", nthreads, [] {
+            for (unsigned i = 0; i < iterations; i++) {
+                free(malloc(item_size));
+            }
+        });
+        measure("uma_zalloc+uma_zfree", nthreads, [=] {
+            for (unsigned i = 0; i < iterations; i++) {
+                uma_zfree(zone, uma_zalloc(zone, M_WAITOK));
+            }
+        });
+        measure("malloc+free, bursts", nthreads, [] {
+            std::vector<void*> items(burst);
+            for (unsigned i = 0; i < iterations / burst; i++) {
+                for (auto& p : items) {
+                    p = malloc(item_size);
+                }
+                for (auto p : items) {
+                    free(p);
+                }
+            }
+        });
+        measure("uma_zalloc+uma_zfree, bursts", nthreads, [=] {
+            std::vector<void*> items(burst);
+            for (unsigned i = 0; i < iterations / burst; i++) {
+                for (auto& p : items) {
+                    p = uma_zalloc(zone, M_WAITOK);
+                }
+                for (auto p : items) {
+                    uma_zfree(zone, p);
+                }
+            }
+        });
+    }
+    uma_zdestroy(zone);
+    return 0;
+}
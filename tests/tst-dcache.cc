@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Check that cached (and negative) dentries don't outlive the names they
+// describe: lookups after create, unlink, rename and rmdir must see the
+// current namespace.
+
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string>
+
+static int tests = 0, fails = 0;
+
+static void report(bool ok, const char* msg)
+{
+    ++tests;
+    fails += !ok;
+    printf("%s: %s\n", (ok ? "PASS" : "FAIL"), msg);
+}
+
+static bool exists(const std::string& path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+static bool missing(const std::string& path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) < 0 && errno == ENOENT;
+}
+
+static bool create(const std::string& path)
+{
+    auto fd = open(path.c_str(), O_CREAT|O_EXCL|O_RDWR, 0666);
+    if (fd < 0) {
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    char tmp[64] = "/tmp/tst-dcacheXXXXXX";
+    std::string dir = mkdtemp(tmp);
+    auto a = dir + "/a", b = dir + "/b";
+
+    // cache a negative entry, twice, then create the file
+    report(missing(a) && missing(a), "stat of a missing file");
+    report(create(a), "create after negative lookup");
+    report(exists(a), "created file is found");
+
+    report(unlink(a.c_str()) == 0, "unlink");
+    report(missing(a), "unlinked file is gone");
+    report(create(a), "create again");
+
+    report(missing(b), "rename target is missing");
+    report(rename(a.c_str(), b.c_str()) == 0, "rename");
+    report(missing(a) && exists(b), "rename source gone, target found");
+
+    report(link(b.c_str(), a.c_str()) == 0, "link to a negative name");
+    report(exists(a) && exists(b), "both links found");
+    report(unlink(a.c_str()) == 0 && unlink(b.c_str()) == 0, "unlink both");
+    report(missing(a) && missing(b), "both links gone");
+
+    // a directory tree with cached entries below it
+    auto sub = dir + "/sub", subfile = sub + "/f", moved = dir + "/moved";
+    report(missing(subfile), "stat in a missing directory");
+    report(mkdir(sub.c_str(), 0777) == 0, "mkdir");
+    report(create(subfile) && exists(subfile), "create in new directory");
+    report(rename(sub.c_str(), moved.c_str()) == 0, "rename directory");
+    report(missing(subfile) && exists(moved + "/f"),
+            "entries below a renamed directory move with it");
+    report(unlink((moved + "/f").c_str()) == 0, "unlink in renamed directory");
+    report(rmdir(moved.c_str()) == 0, "rmdir with cached entries");
+    report(missing(moved) && missing(moved + "/f"), "removed directory is gone");
+    report(mkdir(moved.c_str(), 0777) == 0 && missing(moved + "/f"),
+            "recreated directory is empty");
+    rmdir(moved.c_str());
+    rmdir(dir.c_str());
+
+    printf("SUMMARY: %d tests, %d failures\n", tests, fails);
+    return fails == 0 ? 0 : 1;
+}
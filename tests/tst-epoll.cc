@@ -7,6 +7,9 @@
 
 #include <sys/epoll.h>
 #include <sys/poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 #include <errno.h>
 
@@ -143,6 +146,106 @@ int main(int ac, char** av)
     r = read(s[0], &c, 1);
     report(r == 1, "read the last byte on the pipe");
 
+    ////////////////////////////////////////////////////////////////////////////
+    // Test EPOLLONESHOT: after one event is reported, the fd is disabled
+    // until it is re-armed with EPOLL_CTL_MOD.
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.u32 = 789;
+    r = epoll_ctl(ep, EPOLL_CTL_MOD, s[0], &event);
+    report(r == 0, "epoll_ctl_mod");
+    r = write(s[1], &c, 1);
+    report(r == 1, "write single character");
+    r = epoll_wait(ep, events, MAXEVENTS, 0);
+    report(r == 1 && (events[0].events & EPOLLIN) &&
+            (events[0].data.u32 == 789), "epoll_wait finds fd");
+    r = epoll_wait(ep, events, MAXEVENTS, 0);
+    report(r == 0, "epoll_wait doesn't find again (because of EPOLLONESHOT)");
+    r = write(s[1], &c, 1);
+    report(r == 1, "write single character");
+    r = epoll_wait(ep, events, MAXEVENTS, 0);
+    report(r == 0, "new data doesn't re-arm EPOLLONESHOT");
+    r = epoll_ctl(ep, EPOLL_CTL_MOD, s[0], &event);
+    report(r == 0, "epoll_ctl_mod re-arms");
+    r = epoll_wait(ep, events, MAXEVENTS, 0);
+    report(r == 1 && (events[0].events & EPOLLIN) &&
+            (events[0].data.u32 == 789), "epoll_wait finds fd after re-arm");
+    char buf[2];
+    r = read(s[0], buf, 2);
+    report(r == 2, "read the two bytes on the pipe");
+
+    r = epoll_ctl(ep, EPOLL_CTL_DEL, s[0], &event);
+    report(r == 0, "epoll_ctl_del");
+    r = write(s[1], &c, 1);
+    report(r == 1, "write single character");
+    r = epoll_wait(ep, events, MAXEVENTS, 0);
+    report(r == 0, "epoll_wait doesn't find deleted fd");
+
+    ////////////////////////////////////////////////////////////////////////////
+    // EPOLLET on sockets: each new connection or datagram is reported once,
+    // and a later one is reported again, even while the earlier ones are
+    // still queued.
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(5558);
+
+    int ls = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    r = bind(ls, (struct sockaddr*)&addr, sizeof(addr));
+    report(r == 0 && listen(ls, 5) == 0, "listen");
+    event.events = EPOLLIN | EPOLLET;
+    event.data.u32 = 1001;
+    r = epoll_ctl(ep, EPOLL_CTL_ADD, ls, &event);
+    report(r == 0, "epoll_ctl_add listening socket (EPOLLET)");
+    r = epoll_wait(ep, events, MAXEVENTS, 0);
+    report(r == 0, "epoll_wait finds no connection yet");
+    int c1 = socket(AF_INET, SOCK_STREAM, 0);
+    r = connect(c1, (struct sockaddr*)&addr, sizeof(addr));
+    report(r == 0, "connect");
+    r = epoll_wait(ep, events, MAXEVENTS, 5000);
+    report(r == 1 && (events[0].events & EPOLLIN) &&
+            events[0].data.u32 == 1001, "epoll_wait finds connection");
+    r = epoll_wait(ep, events, MAXEVENTS, 0);
+    report(r == 0, "epoll_wait doesn't find it again (EPOLLET)");
+    int c2 = socket(AF_INET, SOCK_STREAM, 0);
+    r = connect(c2, (struct sockaddr*)&addr, sizeof(addr));
+    report(r == 0, "connect again, first connection not accepted");
+    r = epoll_wait(ep, events, MAXEVENTS, 5000);
+    report(r == 1 && (events[0].events & EPOLLIN) &&
+            events[0].data.u32 == 1001, "epoll_wait finds second connection");
+    int a1 = accept(ls, nullptr, nullptr);
+    int a2 = accept(ls, nullptr, nullptr);
+    report(a1 >= 0 && a2 >= 0, "accept both");
+    close(a1);
+    close(a2);
+    close(c1);
+    close(c2);
+    close(ls);
+
+    int us = socket(AF_INET, SOCK_DGRAM, 0);
+    r = bind(us, (struct sockaddr*)&addr, sizeof(addr));
+    report(r == 0, "bind udp socket");
+    event.events = EPOLLIN | EPOLLET;
+    event.data.u32 = 1002;
+    r = epoll_ctl(ep, EPOLL_CTL_ADD, us, &event);
+    report(r == 0, "epoll_ctl_add udp socket (EPOLLET)");
+    int uc = socket(AF_INET, SOCK_DGRAM, 0);
+    r = sendto(uc, &c, 1, 0, (struct sockaddr*)&addr, sizeof(addr));
+    report(r == 1, "send datagram");
+    r = epoll_wait(ep, events, MAXEVENTS, 5000);
+    report(r == 1 && (events[0].events & EPOLLIN) &&
+            events[0].data.u32 == 1002, "epoll_wait finds datagram");
+    r = epoll_wait(ep, events, MAXEVENTS, 0);
+    report(r == 0, "epoll_wait doesn't find it again (EPOLLET)");
+    r = sendto(uc, &c, 1, 0, (struct sockaddr*)&addr, sizeof(addr));
+    report(r == 1, "send another datagram, first one not read");
+    r = epoll_wait(ep, events, MAXEVENTS, 5000);
+    report(r == 1 && (events[0].events & EPOLLIN) &&
+            events[0].data.u32 == 1002, "epoll_wait finds second datagram");
+    close(uc);
+    close(us);
+
 
     std::cout << "SUMMARY: " << tests << ", " << fails << " failures\n";
 }
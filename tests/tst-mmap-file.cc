@@ -143,6 +143,29 @@ int main(int argc, char *argv[])
     report(munmap(b, 4096) == 0, "munmap temporary mapping");
     report(close(fd) == 0, "close again");
 
+    // Private mappings share the pages of the page cache until written to
+    fd = open("/tmp/mmap-file-test", O_RDWR);
+    report(fd > 0, "open file again: O_RDWR");
+    auto* ro = static_cast<unsigned char*>(mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0));
+    auto* rw = static_cast<unsigned char*>(mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0));
+    report(ro != MAP_FAILED && rw != MAP_FAILED, "map the file privately twice");
+    report(ro[0] == 0xfe && rw[0] == 0xfe, "both mappings read the file");
+    rw[0] = 0x11;
+    report(rw[0] == 0x11 && ro[0] == 0xfe, "write to a private mapping is not seen by the other");
+    unsigned char c = 0;
+    report(pread(fd, &c, 1, 0) == 1 && c == 0xfe, "write to a private mapping doesn't change the file");
+    report(mprotect(ro, size, PROT_READ|PROT_WRITE) == 0, "mprotect: make private mapping writable");
+    ro[1] = 0x22;
+    report(ro[1] == 0x22 && rw[1] == 0xfe, "write after mprotect is private too");
+    report(rw[size - 1] == 0x0f, "read the last page into the cache");
+    c = 0x33;
+    report(pwrite(fd, &c, 1, size - 1) == 1, "write to the file");
+    auto* fresh = static_cast<unsigned char*>(mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0));
+    report(fresh != MAP_FAILED && fresh[size - 1] == 0x33, "new mapping sees the write");
+    report(munmap(ro, size) == 0 && munmap(rw, size) == 0 && munmap(fresh, size) == 0,
+            "munmap private mappings");
+    report(close(fd) == 0, "close again");
+
     // TODO: map an append-only file with prot asking for PROT_WRITE, mmap should return EACCES.
     // TODO: map a file under a fs mounted with the flag NO_EXEC and prot asked for PROT_EXEC (expect EPERM).
 
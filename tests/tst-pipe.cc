@@ -10,6 +10,7 @@
 #include <sys/uio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <osv/sched.hh>
 #include <osv/debug.hh>
@@ -364,6 +365,39 @@ int main(int ac, char** av)
     r = close(s[1]);
     report(r == 0, "close also write side");
 
+    // Test F_SETPIPE_SZ, and splice() between two pipes
+    int s2[2];
+    r = pipe(s);
+    report(r == 0, "pipe call");
+    r = pipe(s2);
+    report(r == 0, "pipe call");
+    r = fcntl(s[1], F_GETPIPE_SZ);
+    report(r == 8192, "default pipe size");
+    r = fcntl(s[1], F_SETPIPE_SZ, 100000);
+    report(r == 131072, "pipe size rounded up");
+    r = fcntl(s2[0], F_SETPIPE_SZ, 131072);
+    report(r == 131072, "set size of read side");
+    buf1 = (char*) malloc(100000);
+    for (int i = 0; i < 100000; i++) {
+        buf1[i] = i;
+    }
+    r = write(s[1], buf1, 100000);
+    report(r == 100000, "write more than the default size");
+    r = fcntl(s[1], F_SETPIPE_SZ, 4096);
+    report(r == -1 && errno == EBUSY, "cannot shrink below contents");
+    r = splice(s[0], NULL, s2[1], NULL, 100000, 0);
+    report(r == 100000, "splice between pipes");
+    buf2 = (char*) malloc(100000);
+    r = read(s2[0], buf2, 100000);
+    report(r == 100000 && memcmp(buf1, buf2, 100000) == 0, "read spliced data");
+    r = splice(s[0], NULL, s2[1], NULL, 100, SPLICE_F_NONBLOCK);
+    report(r == -1 && errno == EAGAIN, "splice from empty pipe");
+    free(buf1);
+    free(buf2);
+    close(s[0]);
+    close(s[1]);
+    close(s2[0]);
+    close(s2[1]);
 
     debug("SUMMARY: %d tests, %d failures\n", tests, fails);
     return fails == 0 ? 0 : 1;
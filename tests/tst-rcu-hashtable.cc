@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// osv::rcu_hashtable: readers must find every key which is in the table
+// while a writer inserts keys of its own, making the table grow and
+// migrate its buckets again and again under the readers.
+
+#include <osv/rcu-hashtable.hh>
+#include <osv/mutex.h>
+#include <atomic>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+static int tests = 0, fails = 0;
+
+static void report(bool ok, std::string msg)
+{
+    ++tests;
+    fails += !ok;
+    std::cout << (ok ? "PASS" : "FAIL") << ": " << msg << "\n";
+}
+
+constexpr unsigned stable_keys = 64;
+constexpr unsigned churn_keys = 16384;
+constexpr unsigned rounds = 200;
+constexpr unsigned nreaders = 4;
+
+int main(int ac, char** av)
+{
+    unsigned long lookups = 0, misses = 0, wrong = 0;
+    unsigned resizes = 0;
+    for (unsigned round = 0; round < rounds; round++) {
+        // start small, so the churn resizes the table many times
+        osv::rcu_hashtable<unsigned, unsigned> table(16);
+        mutex mtx;
+        for (unsigned i = 0; i < stable_keys; i++) {
+            WITH_LOCK(mtx) {
+                table.insert(i, i);
+            }
+        }
+        std::atomic<bool> done(false);
+        std::atomic<unsigned long> n(0), miss(0), bad(0);
+        std::vector<std::thread> readers;
+        for (unsigned r = 0; r < nreaders; r++) {
+            readers.emplace_back([&] {
+                unsigned long my_n = 0, my_miss = 0, my_bad = 0;
+                while (!done.load(std::memory_order_relaxed)) {
+                    for (unsigned i = 0; i < stable_keys; i++) {
+                        WITH_LOCK(osv::rcu_read_lock) {
+                            auto v = table.find(i);
+                            my_miss += !v;
+                            my_bad += v && *v != i;
+                        }
+                        ++my_n;
+                    }
+                }
+                n += my_n;
+                miss += my_miss;
+                bad += my_bad;
+            });
+        }
+        auto buckets = table.bucket_count();
+        for (unsigned i = 0; i < churn_keys; i++) {
+            WITH_LOCK(mtx) {
+                table.insert(stable_keys + i, 0);
+            }
+            if (table.bucket_count() != buckets) {
+                buckets = table.bucket_count();
+                ++resizes;
+            }
+        }
+        done = true;
+        for (auto& t : readers) {
+            t.join();
+        }
+        lookups += n;
+        misses += miss;
+        wrong += bad;
+    }
+
+    std::cout << resizes << " resizes, " << lookups << " lookups, "
+              << misses << " misses\n";
+    report(resizes >= rounds, "table resized");
+    report(lookups > 0, "readers ran during the resizes");
+    report(misses == 0, "readers never missed a key in the table");
+    report(wrong == 0, "readers always found the right value");
+    std::cout << "SUMMARY: " << tests << " tests, " << fails << " failures\n";
+    return fails == 0 ? 0 : 1;
+}
@@ -11,6 +11,9 @@
 #include <osv/debug.h>
 #include <osv/sched.hh>
 #include "tst-hub.hh"
+#include <chrono>
+#include <vector>
+#include <algorithm>
 
 using namespace sched;
 
@@ -21,6 +24,9 @@ using namespace sched;
 // Test 2 - test sleep of rwlock from 2 threads, read/write equivalence
 //          The key is in the call to thread::current()->yield() before
 //          releasing the lock
+// Test 3 - try_rlock while read locked
+// Test 4 - read throughput with 1, 2, 4, ... cpus read locking the same
+//          lock at once; it should scale with the number of cpus
 //
 
 
@@ -40,6 +46,42 @@ public:
 
     bool _test3_finished;
 
+    rwlock _test4_rwlock;
+    static constexpr long _test4_iterations = 10000000;
+
+    void rwlock_test4_reader(void)
+    {
+        for (long i = 0; i < _test4_iterations; i++) {
+            rw_rlock(&_test4_rwlock);
+            rw_runlock(&_test4_rwlock);
+        }
+    }
+
+    void rwlock_test4(void)
+    {
+        unsigned ncpus = sched::cpus.size();
+        rw_init(&_test4_rwlock, "tst4");
+        debugf("rwlock read contention: cpus Mlocks/s\n");
+        // 1, 2, 4, ... cpus, and finally all of them
+        for (unsigned n = 1; n <= ncpus; n = n == ncpus ? n + 1 : std::min(n * 2, ncpus)) {
+            std::vector<thread*> threads;
+            auto start = std::chrono::high_resolution_clock::now();
+            for (unsigned i = 0; i < n; i++) {
+                threads.push_back(new thread([&] { rwlock_test4_reader(); },
+                        thread::attr().pin(sched::cpus[i])));
+                threads.back()->start();
+            }
+            for (auto t : threads) {
+                t->join();
+                delete t;
+            }
+            std::chrono::duration<double> sec =
+                    std::chrono::high_resolution_clock::now() - start;
+            debugf("rwlock read contention: %4u %10.1f\n", n,
+                    n * _test4_iterations / sec.count() / 1e6);
+        }
+    }
+
     void rwlock_test3(void)
     {
         rw_d("rwlock_test3... ");
@@ -156,6 +198,9 @@ public:
         t3->start();
         _main->wait_until([&] { return (_test3_finished); });
         delete t3;
+
+        // Test 4
+        rwlock_test4();
     }
 };
 
@@ -11,6 +11,10 @@
 #include "tst-hub.hh"
 #include <osv/sched.hh>
 #include <osv/debug.hh>
+#include <osv/mempool.hh>
+#include "drivers/clock.hh"
+#include <pthread.h>
+#include <vector>
 
 class test_threads : public unit_tests::vtest {
 
@@ -50,6 +54,64 @@ public:
         tt.main->wake();
     }
 
+    struct waiting_data {
+        pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+        pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+        int waiting = 0;
+        bool done = false;
+    };
+
+    static void* waiting_pthread(void* arg)
+    {
+        auto wd = static_cast<waiting_data*>(arg);
+        pthread_mutex_lock(&wd->mtx);
+        ++wd->waiting;
+        pthread_cond_broadcast(&wd->cond);
+        while (!wd->done) {
+            pthread_cond_wait(&wd->cond, &wd->mtx);
+        }
+        pthread_mutex_unlock(&wd->mtx);
+        return nullptr;
+    }
+
+    // Measure pthread create+join latency, and the memory cost of many
+    // pthreads sitting idle, which is mostly that of their stacks.
+    void bench_pthreads()
+    {
+        const int n = 10000;
+        auto t1 = clock::get()->time();
+        for (int i = 0; i < n; i++) {
+            pthread_t t;
+            pthread_create(&t, nullptr, [](void*) -> void* { return nullptr; }, nullptr);
+            pthread_join(t, nullptr);
+        }
+        auto t2 = clock::get()->time();
+        debug("pthread create+join: %d ns\n", (t2 - t1) / n);
+
+        const int nwait = 1000;
+        waiting_data wd;
+        std::vector<pthread_t> threads(nwait);
+        auto before = memory::stats::free();
+        for (auto& t : threads) {
+            pthread_create(&t, nullptr, waiting_pthread, &wd);
+        }
+        pthread_mutex_lock(&wd.mtx);
+        while (wd.waiting < nwait) {
+            pthread_cond_wait(&wd.cond, &wd.mtx);
+        }
+        pthread_mutex_unlock(&wd.mtx);
+        auto after = memory::stats::free();
+        debug("%d idle pthreads: %d KB each\n", nwait,
+                (ssize_t(before) - ssize_t(after)) / nwait / 1024);
+        pthread_mutex_lock(&wd.mtx);
+        wd.done = true;
+        pthread_cond_broadcast(&wd.cond);
+        pthread_mutex_unlock(&wd.mtx);
+        for (auto t : threads) {
+            pthread_join(t, nullptr);
+        }
+    }
+
     void run()
     {
         test_threads_data tt;
@@ -66,6 +128,7 @@ public:
         delete tt.t1;
         delete tt.t2;
         debug("threading test succeeded\n");
+        bench_pthreads();
     }
 };
 